@@ -0,0 +1,144 @@
+/*
+ * AttrIter.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Walks the attributes of an MFT record in place, for every parser of records.
+ * A record may come from a hostile guest, so each attribute is checked before
+ * it is handed out: its header and its whole length must lie within the used
+ * part of the record (dwRecLength, itself within dwAllLength and the buffer),
+ * and so must its name and its resident content or the start of its run list.
+ * The walk stops at the end marker, or at the first attribute which fails a
+ * check, setting bad. A zero or overlong length can no longer loop forever or
+ * read past the record, and nothing is copied or allocated.
+ *
+ * A record read from disk must first have its update sequence fixups applied,
+ * with recordFixup, or its attributes are wrong wherever they cross the end of
+ * a 512 byte stride, as most do in a 4096 byte record.
+ */
+#ifndef ATTRITER_H_
+#define ATTRITER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "NTFSStruct.h"
+
+#define ATTR_END_MARKER		0xFFFFFFFF	/*Type of the marker after the last attribute */
+#define ATTR_HDR_LEN		16			/*Header common to all attributes */
+#define ATTR_RES_HDR_LEN	24			/*Header of a resident attribute */
+#define ATTR_NONRES_HDR_LEN	64			/*Header of a non-resident attribute */
+#define MFT_FIXUP_STRIDE	512			/*Bytes each update sequence entry ends, whatever the sector size */
+
+typedef struct _ATTR_ITER {
+	char		*record;
+	uint32_t	end;		/*Attributes lie before this, the record's used length */
+	uint32_t	next;		/*Offset of the next attribute */
+	uint16_t	offs;		/*Offset of the attribute last returned */
+	bool		bad;		/*Stopped at a malformed record or attribute */
+} ATTR_ITER;
+
+void     attrIterInit(ATTR_ITER *it, char *record, uint32_t bufLen);
+NTFS_ATTRIBUTE *attrNext(ATTR_ITER *it);
+uint32_t attrResidentCopy(NTFS_ATTRIBUTE *attr, void *out, uint32_t outLen);
+
+/**
+ * Applies the update sequence fixups of the record in record, recLen bytes. On
+ * disk the last two bytes of each stride hold the update sequence number, the
+ * first entry of the update sequence array, and the array holds what they hid.
+ * A stride not ending in the number was torn, only partly written.
+ *
+ * Inline, so that callers with a constant recLen get a copy of their own.
+ *
+ * Returns false, with the record left as it was, if the array does not fit the
+ * record or a stride was torn. A record with no array is left as it is.
+ */
+static inline bool recordFixup(char *record, const uint32_t recLen) {
+	NTFS_MFT_FILE_ENTRY_HEADER *hdr = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	uint16_t usn, entry;
+	uint32_t s;
+	if(hdr->wFixupSize == 0) {
+		return true;
+	}
+	if((uint32_t)hdr->wFixupSize != recLen/MFT_FIXUP_STRIDE + 1 ||
+	   (uint32_t)hdr->wFixupOffset + 2u*hdr->wFixupSize > recLen) {
+		return false;
+	}
+	memcpy(&usn, record + hdr->wFixupOffset, sizeof(usn));
+	for(s = 1; s <= recLen/MFT_FIXUP_STRIDE; s++) {
+		if(memcmp(record + s*MFT_FIXUP_STRIDE - 2, &usn, sizeof(usn)) != 0) {
+			return false;
+		}
+	}
+	for(s = 1; s <= recLen/MFT_FIXUP_STRIDE; s++) {
+		memcpy(&entry, record + hdr->wFixupOffset + 2*s, sizeof(entry));
+		memcpy(record + s*MFT_FIXUP_STRIDE - 2, &entry, sizeof(entry));
+	}
+	return true;
+}
+
+/**
+ * Starts a walk of the attributes of the record in record, bufLen bytes of it.
+ * A record whose lengths or first attribute offset do not fit is bad, and has
+ * no attributes.
+ */
+void attrIterInit(ATTR_ITER *it, char *record, uint32_t bufLen) {
+	NTFS_MFT_FILE_ENTRY_HEADER *hdr = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	memset(it, 0, sizeof(ATTR_ITER));
+	it->record = record;
+	if(bufLen < sizeof(NTFS_MFT_FILE_ENTRY_HEADER) || hdr->dwRecLength > hdr->dwAllLength ||
+	   hdr->dwAllLength > bufLen || hdr->wAttribOffset < sizeof(NTFS_MFT_FILE_ENTRY_HEADER) ||
+	   hdr->wAttribOffset >= hdr->dwRecLength) {
+		it->bad = true;
+		return;
+	}
+	it->end = hdr->dwRecLength;
+	it->next = hdr->wAttribOffset;
+}
+
+/**
+ * Returns the next attribute, pointing into the record, or NULL at the end of
+ * the attributes or at a malformed one. it->offs is its offset in the record.
+ */
+NTFS_ATTRIBUTE *attrNext(ATTR_ITER *it) {
+	if(it->bad || it->next + sizeof(uint32_t) > it->end) {
+		return NULL;
+	}
+	NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(it->record + it->next);
+	uint32_t room = it->end - it->next;
+	if(attr->dwType == ATTR_END_MARKER) {
+		return NULL;
+	}
+	if(room < ATTR_HDR_LEN || attr->dwFullLength < ATTR_HDR_LEN || attr->dwFullLength > room ||
+	   (attr->uchNameLength && (uint32_t)attr->wNameOffset + 2*attr->uchNameLength > attr->dwFullLength)) {
+		it->bad = true;
+		return NULL;
+	}
+	if(attr->uchNonResFlag ? attr->dwFullLength < ATTR_NONRES_HDR_LEN ||
+							 (attr->Attr).NonResident.wDatarunOffset >= attr->dwFullLength
+						   : attr->dwFullLength < ATTR_RES_HDR_LEN ||
+							 (uint64_t)(attr->Attr).Resident.wAttrOffset + (attr->Attr).Resident.dwLength > attr->dwFullLength) {
+		it->bad = true;
+		return NULL;
+	}
+	it->offs = (uint16_t)it->next;
+	it->next += attr->dwFullLength;
+	return attr;
+}
+
+/**
+ * Copies the content of a resident attribute returned by attrNext to out, up to
+ * outLen bytes, and zeroes the rest of out, such as the fields an older, shorter
+ * $STANDARD_INFORMATION does not have.
+ *
+ * Returns the number of bytes copied.
+ */
+uint32_t attrResidentCopy(NTFS_ATTRIBUTE *attr, void *out, uint32_t outLen) {
+	uint32_t len = attr->uchNonResFlag ? 0 : (attr->Attr).Resident.dwLength;
+	if(len > outLen) len = outLen;
+	memcpy(out, (char *)attr + (attr->Attr).Resident.wAttrOffset, len);
+	memset((char *)out + len, 0, outLen - len);
+	return len;
+}
+
+#endif /* ATTRITER_H_ */
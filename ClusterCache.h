@@ -0,0 +1,443 @@
+/*
+ * ClusterCache.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Fixed size cache of device blocks under the reads of MFT records: those the
+ * consumer makes for a write, and again for each change journal record naming a
+ * file, and those of the extract commands. A burst of journal records names the
+ * files of one directory, whose records share a few clusters, so most re-reads
+ * find their cluster already read.
+ *
+ * Only blocks in the regions given by clusterCacheRegion, the $MFT runs of each
+ * volume as it is opened, are cached. Everything else, file content and writes
+ * to other clusters, is read around the cache, so a large extraction, recovery
+ * or burst of data writes cannot flush it.
+ *
+ * Blocks of CCACHE_BLOCK bytes, on CCACHE_BLOCK boundaries of the device, are
+ * keyed by volume and block number and spread over CCACHE_SHARDS shards by a
+ * hash of the key. Each shard has its own lock, hash table and slots, evicted
+ * by CLOCK: a hit sets the slot's reference bit, and the hand clears set bits
+ * as it passes, taking the first slot it finds clear.
+ *
+ * Guest writes are applied as the consumer takes them: the bytes written, from
+ * the write's payload or read from the device around the cache, are copied into
+ * the blocks cached, and a block written whole is cached. The other records of
+ * a block written stay cached, and the journal re-reads and extract commands
+ * that follow find those written. Until a write is consumed its blocks may be
+ * served as they were before it, which misses nothing, as the consumer reads
+ * the write itself. A write that is never consumed, dropped when the queue is
+ * full or not shaped as MFT records, is applied by clusterCacheWrites as it is
+ * dropped, from its payload or else by dropping the blocks it wrote. A read
+ * which missed while a write to its shard was applied does not insert what it
+ * read, as the shard's generation has moved, so it cannot put back what the
+ * write replaced.
+ */
+#ifndef CLUSTERCACHE_H_
+#define CLUSTERCACHE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "NTFSStruct.h"
+#include "Hash.h"
+#include "Metrics.h"
+#include "UDSProtocol.h"
+
+#define CCACHE_BLOCK		4096		/*Bytes per block, one cluster of most volumes */
+#define CCACHE_SHARDS		16
+#define CCACHE_RUN			16			/*Missing blocks read at once */
+#define CCACHE_NONE			UINT32_MAX	/*No slot */
+#define CCACHE_KEY(volume, block)	((uint64_t)(volume) << 48 | (uint64_t)(block))
+
+typedef struct _CCACHE_SLOT {
+	uint64_t	key;
+	uint32_t	next;			/*Next slot in the same hash bucket */
+	bool		used;
+	bool		referenced;		/*Hit since the hand last passed */
+} CCACHE_SLOT;
+
+typedef struct _CCACHE_SHARD {
+	pthread_mutex_t	lock;
+	CCACHE_SLOT		*slots;
+	BYTE			*blocks;		/*CCACHE_BLOCK bytes per slot */
+	uint32_t		*buckets;		/*First slot of each hash bucket */
+	uint32_t		nSlots;
+	uint32_t		bucketMask;
+	uint32_t		hand;			/*CLOCK hand */
+	uint64_t		generation;		/*Moved by every write notification to the shard */
+	uint64_t		countHits;
+	uint64_t		countMisses;
+	uint64_t		countInvalidated;	/*Blocks dropped by writes */
+} __attribute__((aligned(64))) CCACHE_SHARD;
+
+typedef struct _CCACHE_REGION {
+	uint64_t	first;			/*First block */
+	uint64_t	end;			/*Block after the last */
+	uint16_t	volume;
+} CCACHE_REGION;
+
+typedef struct _CLUSTER_CACHE {
+	CCACHE_SHARD	shards[CCACHE_SHARDS];
+	uint64_t		size;			/*Bytes of blocks, 0 if reads go straight to the device */
+	CCACHE_REGION	*regions;		/*Device ranges cached, set before reads start */
+	uint32_t		nRegions;
+} CLUSTER_CACHE;
+
+CLUSTER_CACHE clusterCache;			/*Blocks of the volumes served */
+
+int     clusterCacheInit(CLUSTER_CACHE *cache, uint64_t size);
+int     clusterCacheRegion(CLUSTER_CACHE *cache, uint16_t volume, uint64_t offs, uint64_t len);
+ssize_t clusterCacheRead(CLUSTER_CACHE *cache, uint16_t volume, int fd, void *buff, size_t len, off_t offs);
+ssize_t clusterCacheReload(CLUSTER_CACHE *cache, uint16_t volume, int fd, void *buff, size_t len, off_t offs);
+void    clusterCacheInvalidate(CLUSTER_CACHE *cache, uint16_t volume, uint64_t offs, uint64_t len);
+void    clusterCacheUpdate(CLUSTER_CACHE *cache, uint16_t volume, uint64_t offs, const BYTE *data, uint64_t len);
+void    clusterCacheWrites(CLUSTER_CACHE *cache, const WRITE_EVENT *writes, int nWrites);
+uint64_t clusterCacheHits(void);
+uint64_t clusterCacheMisses(void);
+uint64_t clusterCacheInvalidated(void);
+void    clusterCacheFree(CLUSTER_CACHE *cache);
+
+static inline uint64_t ccacheHash(uint64_t key) {
+	return key*XXH_PRIME64_1;
+}
+
+static inline CCACHE_SHARD *ccacheShard(CLUSTER_CACHE *cache, uint64_t key) {
+	return &cache->shards[ccacheHash(key) >> 60 & (CCACHE_SHARDS - 1)];
+}
+
+/**
+ * Sets up a cache of size bytes, shared evenly by the shards. A size too small
+ * for a block in each shard gives no cache: every read goes to the device.
+ */
+int clusterCacheInit(CLUSTER_CACHE *cache, uint64_t size) {
+	uint32_t s, nSlots = size/CCACHE_BLOCK/CCACHE_SHARDS, nBuckets = 1;
+	memset(cache, 0, sizeof(CLUSTER_CACHE));
+	while(nBuckets < nSlots) nBuckets *= 2;
+	for(s = 0; s < CCACHE_SHARDS; s++) {
+		CCACHE_SHARD *shard = &cache->shards[s];
+		pthread_mutex_init(&shard->lock, NULL);
+		if(nSlots == 0) continue;
+		shard->slots = calloc(nSlots, sizeof(CCACHE_SLOT));
+		shard->blocks = malloc( (size_t)nSlots*CCACHE_BLOCK );
+		shard->buckets = malloc( nBuckets*sizeof(uint32_t) );
+		if(shard->slots == NULL || shard->blocks == NULL || shard->buckets == NULL) {
+			clusterCacheFree(cache);
+			return EXIT_FAILURE;
+		}
+		memset(shard->buckets, 0xFF, nBuckets*sizeof(uint32_t));	/*CCACHE_NONE */
+		shard->nSlots = nSlots;
+		shard->bucketMask = nBuckets - 1;
+	}
+	cache->size = (uint64_t)nSlots*CCACHE_BLOCK*CCACHE_SHARDS;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Has the blocks holding the len bytes at device offset offs of the volume
+ * cached, as they are read. Regions are added as volumes are opened, before
+ * anything is read through the cache.
+ */
+int clusterCacheRegion(CLUSTER_CACHE *cache, uint16_t volume, uint64_t offs, uint64_t len) {
+	if(cache->size == 0 || len == 0) return EXIT_SUCCESS;
+	CCACHE_REGION *regions = realloc(cache->regions, (cache->nRegions + 1)*sizeof(CCACHE_REGION));
+	if(regions == NULL) return EXIT_FAILURE;
+	regions[cache->nRegions].first = offs/CCACHE_BLOCK;
+	regions[cache->nRegions].end = (offs + len + CCACHE_BLOCK - 1)/CCACHE_BLOCK;
+	regions[cache->nRegions].volume = volume;
+	cache->regions = regions;
+	cache->nRegions++;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Whether any of blocks [first, last] of the volume is in a region cached.
+ */
+static bool ccacheCovers(CLUSTER_CACHE *cache, uint16_t volume, uint64_t first, uint64_t last) {
+	uint32_t i;
+	for(i = 0; i < cache->nRegions; i++) {
+		CCACHE_REGION *region = &cache->regions[i];
+		if(region->volume == volume && first < region->end && last >= region->first) return true;
+	}
+	return false;
+}
+
+/**
+ * Returns the slot holding key, with the shard locked, or CCACHE_NONE. If prev
+ * is given it is set to the slot before it in its bucket, or CCACHE_NONE.
+ */
+static uint32_t ccacheFind(CCACHE_SHARD *shard, uint64_t key, uint32_t *prev) {
+	uint32_t slot = shard->buckets[ccacheHash(key) & shard->bucketMask], before = CCACHE_NONE;
+	while(slot != CCACHE_NONE && shard->slots[slot].key != key) {
+		before = slot;
+		slot = shard->slots[slot].next;
+	}
+	if(prev) *prev = before;
+	return slot;
+}
+
+/**
+ * Unlinks a slot in use from its bucket and frees it, with the shard locked.
+ */
+static void ccacheDrop(CCACHE_SHARD *shard, uint32_t slot) {
+	uint32_t prev;
+	ccacheFind(shard, shard->slots[slot].key, &prev);
+	if(prev == CCACHE_NONE) {
+		shard->buckets[ccacheHash(shard->slots[slot].key) & shard->bucketMask] = shard->slots[slot].next;
+	} else {
+		shard->slots[prev].next = shard->slots[slot].next;
+	}
+	shard->slots[slot].used = false;
+}
+
+/**
+ * Copies n bytes from offset from in the block key to out, if it is cached.
+ * On a miss *generation is set to the shard's, for ccachePut.
+ */
+static bool ccacheGet(CLUSTER_CACHE *cache, uint64_t key, BYTE *out, uint32_t from, uint32_t n,
+					  uint64_t *generation) {
+	CCACHE_SHARD *shard = ccacheShard(cache, key);
+	pthread_mutex_lock(&shard->lock);
+	uint32_t slot = ccacheFind(shard, key, NULL);
+	if(slot != CCACHE_NONE) {
+		memcpy(out, shard->blocks + (size_t)slot*CCACHE_BLOCK + from, n);
+		shard->slots[slot].referenced = true;
+		shard->countHits++;
+	} else {
+		*generation = shard->generation;
+		shard->countMisses++;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return slot != CCACHE_NONE;
+}
+
+/**
+ * Takes the slot the CLOCK hand stops at for the block key, which is not cached,
+ * and copies the block into it, with the shard locked.
+ */
+static void ccacheInsert(CCACHE_SHARD *shard, uint64_t key, const BYTE *block) {
+	while(shard->slots[shard->hand].used && shard->slots[shard->hand].referenced) {
+		shard->slots[shard->hand].referenced = false;	/*A second chance */
+		shard->hand = (shard->hand + 1) % shard->nSlots;
+	}
+	uint32_t slot = shard->hand, bucket = ccacheHash(key) & shard->bucketMask;
+	shard->hand = (shard->hand + 1) % shard->nSlots;
+	if(shard->slots[slot].used) {
+		ccacheDrop(shard, slot);
+	}
+	memcpy(shard->blocks + (size_t)slot*CCACHE_BLOCK, block, CCACHE_BLOCK);
+	shard->slots[slot].key = key;
+	shard->slots[slot].next = shard->buckets[bucket];
+	shard->slots[slot].used = true;
+	shard->slots[slot].referenced = false;
+	shard->buckets[bucket] = slot;
+}
+
+/**
+ * Caches the block key read from the device, unless a write to the shard was
+ * applied since the read missed, or another reader has cached it meanwhile.
+ */
+static void ccachePut(CLUSTER_CACHE *cache, uint64_t key, const BYTE *block, uint64_t generation) {
+	CCACHE_SHARD *shard = ccacheShard(cache, key);
+	pthread_mutex_lock(&shard->lock);
+	if(shard->generation == generation && ccacheFind(shard, key, NULL) == CCACHE_NONE) {
+		ccacheInsert(shard, key, block);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Where block x of a read of len bytes at offs, whose first block is first,
+ * goes: *at bytes into the output, from *from bytes into the block, *n bytes.
+ */
+static inline void ccacheSpan(int64_t x, int64_t first, off_t offs, size_t len,
+							  size_t *at, uint32_t *from, uint32_t *n) {
+	*from = x == first ? offs%CCACHE_BLOCK : 0;
+	*at = x == first ? 0 : (x - first)*CCACHE_BLOCK - offs%CCACHE_BLOCK;
+	*n = len - *at < CCACHE_BLOCK - *from ? len - *at : CCACHE_BLOCK - *from;
+}
+
+/**
+ * Reads len bytes at device offset offs of the volume's device fd to buff, as
+ * pread does, taking the blocks cached and reading the rest from the device,
+ * each run of missing blocks at once. Blocks outside the regions cached are
+ * read but neither cached nor counted.
+ *
+ * Returns the number of bytes read, short at the end of the device, or -1 with
+ * errno set.
+ */
+ssize_t clusterCacheRead(CLUSTER_CACHE *cache, uint16_t volume, int fd, void *buff, size_t len, off_t offs) {
+	BYTE *out = buff;
+	int64_t first = offs/CCACHE_BLOCK, last = (offs + (off_t)len - 1)/CCACHE_BLOCK, b = first;
+	uint64_t generations[CCACHE_RUN];
+	bool cached[CCACHE_RUN];				/*Whether each block of the run is in a region */
+	BYTE run[CCACHE_RUN*CCACHE_BLOCK];		/*64KiB, read into before caching */
+	size_t at;
+	uint32_t from, n, nRun, r;
+
+	if(cache->size == 0 || len == 0 || !ccacheCovers(cache, volume, first, last)) {
+		ssize_t nRead = pread(fd, buff, len, offs);
+		if(nRead > 0) metricsAdd(MET_DEV_BYTES_READ, nRead);
+		return nRead;
+	}
+	while(b <= last) {
+		/*Blocks missing from b on, up to the next one cached, which is copied */
+		bool hit = false;
+		for(nRun = 0; b + nRun <= last && nRun < CCACHE_RUN; nRun++) {
+			if(!(cached[nRun] = ccacheCovers(cache, volume, b + nRun, b + nRun))) continue;
+			ccacheSpan(b + nRun, first, offs, len, &at, &from, &n);
+			if((hit = ccacheGet(cache, CCACHE_KEY(volume, b + nRun), out + at, from, n, &generations[nRun]))) {
+				break;
+			}
+		}
+		if(nRun > 0) {
+			ssize_t nRead;
+			if((nRead = pread(fd, run, (size_t)nRun*CCACHE_BLOCK, b*CCACHE_BLOCK)) == -1) {
+				return -1;
+			}
+			metricsAdd(MET_DEV_BYTES_READ, nRead);
+			for(r = 0; r < nRun; r++) {
+				ccacheSpan(b + r, first, offs, len, &at, &from, &n);
+				int64_t avail = nRead - (int64_t)r*CCACHE_BLOCK - from;
+				if(avail < n) {		/*The end of the device */
+					if(avail > 0) memcpy(out + at, run + (size_t)r*CCACHE_BLOCK + from, avail);
+					return at + (avail > 0 ? avail : 0);
+				}
+				memcpy(out + at, run + (size_t)r*CCACHE_BLOCK + from, n);
+				if(cached[r] && nRead >= (ssize_t)(r + 1)*CCACHE_BLOCK) {
+					ccachePut(cache, CCACHE_KEY(volume, b + r), run + (size_t)r*CCACHE_BLOCK, generations[r]);
+				}
+			}
+		}
+		b += nRun + hit;
+	}
+	return len;
+}
+
+/**
+ * Reads len bytes written at device offset offs of the volume's device fd to
+ * buff, as pread does, past the blocks cached, which are then brought up to
+ * date with what was read.
+ *
+ * Returns the number of bytes read, short at the end of the device, or -1 with
+ * errno set.
+ */
+ssize_t clusterCacheReload(CLUSTER_CACHE *cache, uint16_t volume, int fd, void *buff, size_t len, off_t offs) {
+	ssize_t nRead = pread(fd, buff, len, offs);
+	if(nRead > 0) {
+		metricsAdd(MET_DEV_BYTES_READ, nRead);
+		clusterCacheUpdate(cache, volume, offs, buff, nRead);
+	}
+	return nRead;
+}
+
+/**
+ * Drops the cached blocks of the volume holding any of the len bytes written at
+ * device offset offs.
+ */
+void clusterCacheInvalidate(CLUSTER_CACHE *cache, uint16_t volume, uint64_t offs, uint64_t len) {
+	uint64_t b;
+	if(cache->size == 0 || (int64_t)len <= 0 || offs + len < offs) return;	/*Nor a length gone negative */
+	for(b = offs/CCACHE_BLOCK; b <= (offs + len - 1)/CCACHE_BLOCK; b++) {
+		if(!ccacheCovers(cache, volume, b, b)) continue;
+		uint64_t key = CCACHE_KEY(volume, b);
+		CCACHE_SHARD *shard = ccacheShard(cache, key);
+		pthread_mutex_lock(&shard->lock);
+		uint32_t slot = ccacheFind(shard, key, NULL);
+		if(slot != CCACHE_NONE) {
+			ccacheDrop(shard, slot);
+			shard->countInvalidated++;
+		}
+		shard->generation++;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/**
+ * Copies the len bytes of data written at device offset offs of the volume into
+ * the blocks cached, and caches the blocks it writes whole.
+ */
+void clusterCacheUpdate(CLUSTER_CACHE *cache, uint16_t volume, uint64_t offs, const BYTE *data, uint64_t len) {
+	int64_t b, first = offs/CCACHE_BLOCK;
+	size_t at;
+	uint32_t from, n;
+	if(cache->size == 0 || (int64_t)len <= 0 || offs + len < offs) return;	/*Nor a length gone negative */
+	for(b = first; b <= (int64_t)((offs + len - 1)/CCACHE_BLOCK); b++) {
+		if(!ccacheCovers(cache, volume, b, b)) continue;
+		uint64_t key = CCACHE_KEY(volume, b);
+		CCACHE_SHARD *shard = ccacheShard(cache, key);
+		ccacheSpan(b, first, offs, len, &at, &from, &n);
+		pthread_mutex_lock(&shard->lock);
+		uint32_t slot = ccacheFind(shard, key, NULL);
+		if(slot != CCACHE_NONE) {
+			memcpy(shard->blocks + (size_t)slot*CCACHE_BLOCK + from, data + at, n);
+		} else if(n == CCACHE_BLOCK) {
+			ccacheInsert(shard, key, data + at);
+		}
+		shard->generation++;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/**
+ * Applies guest writes which the consumer will never read: from their payloads,
+ * or else by dropping the blocks they wrote.
+ */
+void clusterCacheWrites(CLUSTER_CACHE *cache, const WRITE_EVENT *writes, int nWrites) {
+	int i;
+	for(i = 0; i < nWrites; i++) {
+		if(writes[i].nSectors <= 0 || writes[i].sectorN < 0) continue;	/*Malformed, nothing was written */
+		uint64_t offs = (uint64_t)writes[i].sectorN*UDS_SECTOR_SIZE, len = (uint64_t)writes[i].nSectors*UDS_SECTOR_SIZE;
+		if(writes[i].payload) {
+			clusterCacheUpdate(cache, writes[i].volume, offs, writes[i].payload, len);
+		} else {
+			clusterCacheInvalidate(cache, writes[i].volume, offs, len);
+		}
+	}
+}
+
+/**
+ * Sums a counter over the shards of clusterCache, as a metrics gauge.
+ */
+static uint64_t ccacheSum(size_t counter) {
+	uint64_t sum = 0;
+	uint32_t s;
+	for(s = 0; s < CCACHE_SHARDS; s++) {
+		CCACHE_SHARD *shard = &clusterCache.shards[s];
+		pthread_mutex_lock(&shard->lock);
+		sum += *(uint64_t *)((char *)shard + counter);
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return sum;
+}
+
+uint64_t clusterCacheHits(void) {
+	return ccacheSum(offsetof(CCACHE_SHARD, countHits));
+}
+
+uint64_t clusterCacheMisses(void) {
+	return ccacheSum(offsetof(CCACHE_SHARD, countMisses));
+}
+
+uint64_t clusterCacheInvalidated(void) {
+	return ccacheSum(offsetof(CCACHE_SHARD, countInvalidated));
+}
+
+void clusterCacheFree(CLUSTER_CACHE *cache) {
+	uint32_t s;
+	for(s = 0; s < CCACHE_SHARDS; s++) {
+		free(cache->shards[s].slots);
+		free(cache->shards[s].blocks);
+		free(cache->shards[s].buckets);
+		pthread_mutex_destroy(&cache->shards[s].lock);
+	}
+	free(cache->regions);
+	memset(cache, 0, sizeof(CLUSTER_CACHE));
+}
+
+#endif /* CLUSTERCACHE_H_ */
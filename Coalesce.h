@@ -0,0 +1,231 @@
+/*
+ * Coalesce.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Write coalescing between the UDS producer and the extraction consumer.
+ *
+ * Guest metadata flushes write the same few MFT clusters many times a second.
+ * Writes are held in a small window for up to coalesceWindowMs; repeats and
+ * overlapping or adjacent sector ranges are merged into one pending range, so
+ * each range is read from the device once. Ranges are released in the order
+ * they were last written, which keeps the order of the final state.
+ *
+ * Only writes to MFT records are held: the consumer hands those to the change
+ * journal and $Bitmap straight to their handlers, so a range merged from them
+ * holds no clusters of either, and their length is never capped.
+ *
+ * Pending ranges never overlap. A write is merged with every range it overlaps
+ * or abuts at once, so one which bridges two ranges joins them. A write which
+ * overlaps a range it cannot be merged with, the union being too long, is not
+ * taken until the window has been released, so older bytes never follow newer.
+ *
+ * Writes that carry their payload are merged by laying the newer bytes over the
+ * older ones. Merging a payload with a write that has none drops the payload,
+ * since only the device then holds every byte of the union.
+ */
+#ifndef COALESCE_H_
+#define COALESCE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "UDSServer.h"
+
+#define COALESCE_WINDOW_MS	100		/*Default time a write is held for merging */
+#define COALESCE_SLOTS		256		/*Maximum number of distinct pending ranges */
+#define COALESCE_MAX_RECORDS 16		/*Merged ranges never exceed 16 MFT records, or a cluster of them */
+
+typedef struct _PENDING_WRITE {
+	WRITE_EVENT		write;			/*Union of the merged sector ranges */
+	uint64_t		firstSeenNs;	/*When the range entered the window */
+	uint64_t		lastSeenNs;		/*When the range was last written, orders release */
+} PENDING_WRITE;
+
+typedef struct _COALESCER {
+	PENDING_WRITE	pending[COALESCE_SLOTS];
+	uint32_t		nPending;
+	uint64_t		windowNs;
+	uint64_t		countIn;		/*Writes accepted into the window */
+	uint64_t		countOut;		/*Ranges released to the consumer */
+} COALESCER;
+
+uint32_t coalesceWindowMs = COALESCE_WINDOW_MS;
+
+void coalesceInit(COALESCER *c, uint32_t windowMs);
+bool coalesceAdd(COALESCER *c, WRITE_EVENT item, uint64_t nowNs, int recSectors, int maxSectors);
+uint32_t coalesceRelease(COALESCER *c, uint64_t nowNs, bool all, WRITE_EVENT *out, uint32_t maxOut);
+double coalesceRatio(COALESCER *c);
+
+void coalesceInit(COALESCER *c, uint32_t windowMs) {
+	memset(c, 0, sizeof(COALESCER));
+	c->windowNs = (uint64_t)windowMs*1000000ULL;
+}
+
+/**
+ * Sets the payload of p, which will cover [uStart, uEnd), from its old payload
+ * and item's newer one laid over it. That is the final state of each sector as
+ * no other pending range overlaps p. Sectors of the union in neither are left
+ * for a later merge to fill, as coalesceAdd's bridging write does.
+ */
+static void coalescePayload(WRITE_EVENT *p, WRITE_EVENT *item, int64_t uStart, int64_t uEnd) {
+	if(p->payload == NULL || item->payload == NULL) {
+		free(p->payload);
+		free(item->payload);
+		p->payload = NULL;
+		return;
+	}
+	BYTE *merged = malloc((uEnd - uStart)*UDS_SECTOR_SIZE);
+	if(merged == NULL) {
+		free(p->payload);
+		free(item->payload);
+		p->payload = NULL;
+		return;
+	}
+	memcpy(merged + (p->sectorN - uStart)*UDS_SECTOR_SIZE, p->payload, (size_t)p->nSectors*UDS_SECTOR_SIZE);
+	memcpy(merged + (item->sectorN - uStart)*UDS_SECTOR_SIZE, item->payload, (size_t)item->nSectors*UDS_SECTOR_SIZE);
+	free(p->payload);
+	free(item->payload);
+	p->payload = merged;
+}
+
+/**
+ * Whether a merged range of len sectors stays a whole number of MFT records of
+ * recSectors, and no longer than maxSectors.
+ */
+static inline bool coalesceFits(int64_t len, int recSectors, int maxSectors) {
+	return len <= maxSectors && len % recSectors == 0;
+}
+
+/**
+ * Merges item into p, item's bytes over p's.
+ */
+static void coalesceMerge(WRITE_EVENT *p, WRITE_EVENT *item) {
+	int64_t uStart = item->sectorN < p->sectorN ? item->sectorN : p->sectorN;
+	int64_t uEnd = item->sectorN + item->nSectors > p->sectorN + p->nSectors ?
+				   item->sectorN + item->nSectors : p->sectorN + p->nSectors;
+	coalescePayload(p, item, uStart, uEnd);
+	p->sectorN = uStart;
+	p->nSectors = (int)(uEnd - uStart);
+}
+
+/**
+ * Adds a write to the window, merging it with the pending ranges of the same
+ * volume it repeats, overlaps or abuts when the union stays a whole number of
+ * MFT records, recSectors each, and at most maxSectors, as the volume's record
+ * and cluster sizes allow. If the union of them all is too long, a range the
+ * write only abuts may still take it alone.
+ *
+ * Returns false if the write was not taken, as the window is full or the write
+ * overlaps a range it cannot be merged with: the window is to be released and
+ * the write added again. Otherwise the window owns the write's payload.
+ */
+bool coalesceAdd(COALESCER *c, WRITE_EVENT item, uint64_t nowNs, int recSectors, int maxSectors) {
+
+	int64_t start = item.sectorN;
+	int64_t end = item.sectorN + item.nSectors;
+	int64_t uStart = start, uEnd = end;
+	uint32_t touched[COALESCE_SLOTS], nTouched = 0, i;
+	bool overlaps = false;
+
+	/*The ranges the write overlaps or abuts, which are disjoint from each other */
+	for(i = 0; i < c->nPending; i++) {
+		PENDING_WRITE *p = &c->pending[i];
+		int64_t pStart = p->write.sectorN;
+		int64_t pEnd = pStart + p->write.nSectors;
+		if(p->write.volume != item.volume || start > pEnd || pStart > end) continue;
+		touched[nTouched++] = i;
+		overlaps |= start < pEnd && pStart < end;
+		if(pStart < uStart) uStart = pStart;
+		if(pEnd > uEnd) uEnd = pEnd;
+	}
+	if(nTouched > 0 && !coalesceFits(uEnd - uStart, recSectors, maxSectors)) {
+		if(overlaps) {
+			return false;
+		}
+		for(i = 0; i < nTouched; i++) {		/*Only abuts them, one on its own will do */
+			WRITE_EVENT *w = &c->pending[touched[i]].write;
+			int64_t len = (end > w->sectorN + w->nSectors ? end : w->sectorN + w->nSectors) -
+						  (start < w->sectorN ? start : w->sectorN);
+			if(coalesceFits(len, recSectors, maxSectors)) break;
+		}
+		if(i < nTouched) {
+			touched[0] = touched[i];
+			nTouched = 1;
+		} else {
+			nTouched = 0;
+		}
+	}
+
+	if(nTouched > 0) {
+		PENDING_WRITE *p = &c->pending[touched[0]];
+		for(i = 1; i < nTouched; i++) {		/*Disjoint, so in any order, then the write over them */
+			coalesceMerge(&p->write, &c->pending[touched[i]].write);
+			if(c->pending[touched[i]].firstSeenNs < p->firstSeenNs) {
+				p->firstSeenNs = c->pending[touched[i]].firstSeenNs;
+			}
+		}
+		coalesceMerge(&p->write, &item);
+		p->lastSeenNs = nowNs;
+		for(i = nTouched; i-- > 1; ) {		/*Highest first, so the slots moved are never ones merged */
+			c->pending[touched[i]] = c->pending[--c->nPending];
+		}
+		c->countIn++;
+		return true;
+	}
+
+	if(c->nPending == COALESCE_SLOTS) {
+		return false;
+	}
+	c->pending[c->nPending].write = item;
+	c->pending[c->nPending].firstSeenNs = nowNs;
+	c->pending[c->nPending].lastSeenNs = nowNs;
+	c->nPending++;
+	c->countIn++;
+	return true;
+}
+
+/**
+ * Removes ranges whose window has expired (or every range, if all) and copies
+ * up to maxOut of them into out, ordered by when they were last written.
+ *
+ * Returns the number of ranges released.
+ */
+uint32_t coalesceRelease(COALESCER *c, uint64_t nowNs, bool all, WRITE_EVENT *out, uint32_t maxOut) {
+
+	PENDING_WRITE ready[COALESCE_SLOTS];
+	uint32_t nReady = 0, nKept = 0, i, j;
+
+	for(i = 0; i < c->nPending; i++) {
+		if((all || nowNs - c->pending[i].firstSeenNs >= c->windowNs) && nReady < maxOut) {
+			ready[nReady++] = c->pending[i];
+		} else {
+			c->pending[nKept++] = c->pending[i];
+		}
+	}
+	c->nPending = nKept;
+
+	/*Insertion sort on last write time, the window is small */
+	for(i = 1; i < nReady; i++) {
+		PENDING_WRITE key = ready[i];
+		for(j = i; j > 0 && ready[j-1].lastSeenNs > key.lastSeenNs; j--) {
+			ready[j] = ready[j-1];
+		}
+		ready[j] = key;
+	}
+	for(i = 0; i < nReady; i++) {
+		out[i] = ready[i].write;
+	}
+	c->countOut += nReady;
+	return nReady;
+}
+
+/**
+ * Writes accepted per range released, 1.0 means nothing was merged.
+ */
+double coalesceRatio(COALESCER *c) {
+	return c->countOut ? (double)c->countIn/c->countOut : 1.0;
+}
+
+#endif /* COALESCE_H_ */
@@ -0,0 +1,349 @@
+/*
+ * Config.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Runtime configuration: built-in defaults, overridden by a key = value config
+ * file, overridden in turn by command line options. Each device option adds a
+ * volume; guests bind to a volume by its index in the order given.
+ *
+ * Socket names beginning with '@' are abstract, anything else is a path.
+ */
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/un.h>
+#include "Debug.h"
+
+#define CFG_MAX_VOLUMES		64
+#define CFG_VOLNAME_LEN		32
+#define CFG_LINE_LEN		1024
+#define CFG_SOCKNAME_LEN	sizeof(((struct sockaddr_un *)0)->sun_path)
+
+#define CFG_DEFAULT_DEVICE		"/dev/mechastriessand/windows7"
+#define CFG_DEFAULT_EXTRACT		2097152			/*Max file size extracted, bytes */
+#define CFG_DEFAULT_AGE			600				/*Max time since a file was modified, seconds */
+#define CFG_DEFAULT_RECOVER		4				/*Threads reading deleted files in a bulk recovery */
+#define CFG_MAX_RECOVER			64
+#define CFG_DEFAULT_CACHE		64				/*MFT cluster read cache, MiB */
+#define CFG_DEFAULT_WINDOW		100				/*Time a guest write is held for merging, ms */
+#define CFG_MAX_WINDOW			1000
+#define CFG_QUEUE_FILE			"pending.queue"	/*In the store directory unless --queue-file is given */
+
+/* One guest volume: a block device, loop device or image file */
+typedef struct _VOLUME_CFG {
+	char	name[CFG_VOLNAME_LEN];		/*Used in file names and messages */
+	char	device[FILENAME_MAX];
+} VOLUME_CFG;
+
+typedef struct _CONFIG {
+	VOLUME_CFG	volumes[CFG_MAX_VOLUMES];
+	uint16_t	nVolumes;
+	char		mftCopyDir[FILENAME_MAX];		/*Where the local $MFT copies are written */
+	char		storeDir[FILENAME_MAX];			/*Extraction store, per volume subdirectory if several */
+	char		socketName[CFG_SOCKNAME_LEN];	/*UDS server, "\0name" if abstract */
+	char		metricsSocketName[CFG_SOCKNAME_LEN];
+	char		controlSocketName[CFG_SOCKNAME_LEN];
+	bool		daemon;							/*No terminal interface, consume from the start */
+	char		traceFile[FILENAME_MAX];		/*Record received writes here if set */
+	char		queueFile[FILENAME_MAX];		/*Writes left at shutdown, reloaded at start */
+	char		logFile[FILENAME_MAX];			/*Log to stderr if not set */
+	uint8_t		logLevel;
+	uint64_t	maxExtractSize;					/*Bytes */
+	uint64_t	maxModifyAge;					/*Seconds */
+	uint64_t	recoverThreads;
+	uint64_t	cacheSize;						/*MiB, 0 for no cluster cache */
+	uint64_t	coalesceWindow;					/*ms, 0 to release writes at once */
+} CONFIG;
+
+CONFIG config;
+
+void configDefaults(CONFIG *cfg, const char *udsSocket, const char *metricsSocket,
+					const char *controlSocket, const char *storeDir);
+int  configLoadFile(CONFIG *cfg, const char *path);
+int  configParseArgs(CONFIG *cfg, int argc, char *argv[]);
+int  configAddVolume(CONFIG *cfg, const char *spec);
+void configUsage(CONFIG *cfg, const char *prog);
+
+static const struct option configOptions[] = {
+	{ "config",				required_argument,	NULL, 'c' },
+	{ "device",				required_argument,	NULL, 'd' },
+	{ "mft-copy-dir",		required_argument,	NULL, 'm' },
+	{ "store-dir",			required_argument,	NULL, 'o' },
+	{ "socket",				required_argument,	NULL, 's' },
+	{ "metrics-socket",		required_argument,	NULL, 'M' },
+	{ "control-socket",		required_argument,	NULL, 'C' },
+	{ "daemon",				no_argument,		NULL, 'D' },
+	{ "trace",				required_argument,	NULL, 't' },
+	{ "queue-file",			required_argument,	NULL, 'q' },
+	{ "log-level",			required_argument,	NULL, 'l' },
+	{ "log-file",			required_argument,	NULL, 'L' },
+	{ "max-extract-size",	required_argument,	NULL, 'x' },
+	{ "max-modify-age",		required_argument,	NULL, 'a' },
+	{ "recover-threads",	required_argument,	NULL, 'r' },
+	{ "cache-size",			required_argument,	NULL, 'K' },
+	{ "coalesce-window",	required_argument,	NULL, 'w' },
+	{ "help",				no_argument,		NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+#define CONFIG_SHORTOPTS	"c:d:m:o:s:M:C:Dt:q:l:L:x:a:r:K:w:h"
+
+/**
+ * Copies a socket name, turning a leading '@' into the NUL of an abstract name.
+ * Names passed in already abstract ("\0name") are copied as they are.
+ */
+static void configSocketName(char *dst, const char *src, bool fromUser) {
+	memset(dst, 0, CFG_SOCKNAME_LEN);
+	if(src[0] == '\0') {
+		strncpy(dst + 1, src + 1, CFG_SOCKNAME_LEN - 2);
+	} else if(fromUser && src[0] == '@') {
+		strncpy(dst + 1, src + 1, CFG_SOCKNAME_LEN - 2);
+	} else {
+		strncpy(dst, src, CFG_SOCKNAME_LEN - 1);
+	}
+}
+
+/**
+ * Parses a size or age, rejecting anything that is not a whole number.
+ */
+static int configNumber(const char *key, const char *val, uint64_t *out) {
+	char *end = NULL;
+	errno = 0;
+	uint64_t n = strtoull(val, &end, 10);
+	if(errno || end == val || *end != '\0') {
+		printf("Invalid value for %s: %s.\n", key, val);
+		return EXIT_FAILURE;
+	}
+	*out = n;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Sets one option by its long name. Shared by the config file and command line.
+ */
+static int configSet(CONFIG *cfg, const char *key, const char *val) {
+	if(strcmp(key, "device") == 0) return configAddVolume(cfg, val);
+	if(strcmp(key, "mft-copy-dir") == 0) {
+		snprintf(cfg->mftCopyDir, sizeof(cfg->mftCopyDir), "%s", val);
+	} else if(strcmp(key, "store-dir") == 0) {
+		/*The store appends its own names directly */
+		size_t len = strlen(val);
+		snprintf(cfg->storeDir, sizeof(cfg->storeDir), "%s%s", val, len && val[len-1] == '/' ? "" : "/");
+	} else if(strcmp(key, "socket") == 0) {
+		configSocketName(cfg->socketName, val, true);
+	} else if(strcmp(key, "metrics-socket") == 0) {
+		configSocketName(cfg->metricsSocketName, val, true);
+	} else if(strcmp(key, "control-socket") == 0) {
+		configSocketName(cfg->controlSocketName, val, true);
+	} else if(strcmp(key, "daemon") == 0) {		/*No value on the command line */
+		cfg->daemon = val == NULL || strcasecmp(val, "yes") == 0 || strcasecmp(val, "true") == 0 ||
+					  strcmp(val, "1") == 0;
+	} else if(strcmp(key, "trace") == 0) {
+		snprintf(cfg->traceFile, sizeof(cfg->traceFile), "%s", val);
+	} else if(strcmp(key, "queue-file") == 0) {
+		snprintf(cfg->queueFile, sizeof(cfg->queueFile), "%s", val);
+	} else if(strcmp(key, "log-level") == 0) {
+		cfg->logLevel = logLevelFromName(val, cfg->logLevel);
+	} else if(strcmp(key, "log-file") == 0) {
+		snprintf(cfg->logFile, sizeof(cfg->logFile), "%s", val);
+	} else if(strcmp(key, "max-extract-size") == 0) {
+		return configNumber(key, val, &cfg->maxExtractSize);
+	} else if(strcmp(key, "max-modify-age") == 0) {
+		return configNumber(key, val, &cfg->maxModifyAge);
+	} else if(strcmp(key, "recover-threads") == 0) {
+		if(configNumber(key, val, &cfg->recoverThreads) == EXIT_FAILURE) return EXIT_FAILURE;
+		if(cfg->recoverThreads == 0 || cfg->recoverThreads > CFG_MAX_RECOVER) {
+			printf("recover-threads must be from 1 to %d.\n", CFG_MAX_RECOVER);
+			return EXIT_FAILURE;
+		}
+	} else if(strcmp(key, "cache-size") == 0) {
+		return configNumber(key, val, &cfg->cacheSize);
+	} else if(strcmp(key, "coalesce-window") == 0) {
+		if(configNumber(key, val, &cfg->coalesceWindow) == EXIT_FAILURE) return EXIT_FAILURE;
+		if(cfg->coalesceWindow > CFG_MAX_WINDOW) {
+			printf("coalesce-window must be at most %d ms.\n", CFG_MAX_WINDOW);
+			return EXIT_FAILURE;
+		}
+	} else {
+		printf("Unknown configuration option %s.\n", key);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Fills cfg with the built-in defaults. The socket and store names are passed in
+ * so the modules that own them keep their constants. NTFS_LOG_LEVEL,
+ * NTFS_LOG_FILE and NTFS_TRACE_FILE, if set, are taken as defaults too.
+ */
+void configDefaults(CONFIG *cfg, const char *udsSocket, const char *metricsSocket,
+					const char *controlSocket, const char *storeDir) {
+	memset(cfg, 0, sizeof(CONFIG));
+	snprintf(cfg->mftCopyDir, sizeof(cfg->mftCopyDir), ".");
+	snprintf(cfg->storeDir, sizeof(cfg->storeDir), "%s", storeDir);
+	configSocketName(cfg->socketName, udsSocket, false);
+	configSocketName(cfg->metricsSocketName, metricsSocket, false);
+	configSocketName(cfg->controlSocketName, controlSocket, false);
+	cfg->logLevel = logLevelFromName(getenv("NTFS_LOG_LEVEL"), LOG_LVL_INFO);
+	if(getenv("NTFS_LOG_FILE")) snprintf(cfg->logFile, sizeof(cfg->logFile), "%s", getenv("NTFS_LOG_FILE"));
+	if(getenv("NTFS_TRACE_FILE")) snprintf(cfg->traceFile, sizeof(cfg->traceFile), "%s", getenv("NTFS_TRACE_FILE"));
+	cfg->maxExtractSize = CFG_DEFAULT_EXTRACT;
+	cfg->maxModifyAge = CFG_DEFAULT_AGE;
+	cfg->recoverThreads = CFG_DEFAULT_RECOVER;
+	cfg->cacheSize = CFG_DEFAULT_CACHE;
+	cfg->coalesceWindow = CFG_DEFAULT_WINDOW;
+}
+
+/**
+ * Adds a volume from "path" or "name=path". Unnamed volumes are called volN.
+ */
+int configAddVolume(CONFIG *cfg, const char *spec) {
+	if(cfg->nVolumes == CFG_MAX_VOLUMES) {
+		printf("Too many volumes, at most %d are supported.\n", CFG_MAX_VOLUMES);
+		return EXIT_FAILURE;
+	}
+	VOLUME_CFG *vol = &cfg->volumes[cfg->nVolumes];
+	const char *eq = strchr(spec, '=');
+	const char *slash = strchr(spec, '/');
+	if(eq && (slash == NULL || eq < slash) && eq != spec) {
+		snprintf(vol->name, sizeof(vol->name), "%.*s", (int)(eq - spec), spec);
+		snprintf(vol->device, sizeof(vol->device), "%s", eq + 1);
+	} else {
+		snprintf(vol->name, sizeof(vol->name), "vol%u", cfg->nVolumes);
+		snprintf(vol->device, sizeof(vol->device), "%s", spec);
+	}
+	cfg->nVolumes++;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Reads "key = value" lines, keys being the long option names. Blank lines and
+ * lines starting with '#' are ignored; device may be given more than once.
+ */
+int configLoadFile(CONFIG *cfg, const char *path) {
+	char line[CFG_LINE_LEN];
+	int lineN = 0, ret = EXIT_SUCCESS;
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL) {
+		int errsv = errno;
+		printf("Failed to open config file %s: %s.\n", path, strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	while(fgets(line, sizeof(line), fp)) {
+		char *key = line, *val, *end;
+		lineN++;
+		while(isspace((unsigned char)*key)) key++;
+		if(*key == '\0' || *key == '#') continue;
+		if((val = strchr(key, '=')) == NULL) {
+			printf("%s:%d: expected key = value.\n", path, lineN);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		for(end = val; end > key && isspace((unsigned char)end[-1]); end--);
+		*end = '\0';
+		for(val++; isspace((unsigned char)*val); val++);
+		for(end = val + strlen(val); end > val && isspace((unsigned char)end[-1]); end--);
+		*end = '\0';
+		if(configSet(cfg, key, val) == EXIT_FAILURE) {
+			printf("%s:%d: in config file.\n", path, lineN);
+			ret = EXIT_FAILURE;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+/**
+ * Applies the config file named by --config, then the other options, then any
+ * further arguments as devices. The built-in device is used if none are given,
+ * and the queue file is kept in the store directory unless one is named.
+ *
+ * Returns EXIT_FAILURE on a bad option or if --help was asked for.
+ */
+int configParseArgs(CONFIG *cfg, int argc, char *argv[]) {
+	int opt, idx, ret = EXIT_SUCCESS;
+
+	/*The config file first, so the command line overrides it */
+	opterr = 0;
+	while((opt = getopt_long(argc, argv, CONFIG_SHORTOPTS, configOptions, NULL)) != -1) {
+		if(opt == 'c' && configLoadFile(cfg, optarg) == EXIT_FAILURE) ret = EXIT_FAILURE;
+	}
+	uint16_t fileVolumes = cfg->nVolumes;
+
+	optind = 1;
+	opterr = 1;
+	while((opt = getopt_long(argc, argv, CONFIG_SHORTOPTS, configOptions, &idx)) != -1) {
+		const struct option *o;
+		switch(opt) {
+		case 'c':
+			break;
+		case 'h':
+		case '?':
+			configUsage(cfg, argv[0]);
+			return EXIT_FAILURE;
+		default:
+			if(opt == 'd' && fileVolumes) {	/*Devices on the command line replace the file's */
+				cfg->nVolumes = fileVolumes = 0;
+			}
+			for(o = configOptions; o->name && o->val != opt; o++);
+			if(o->name && configSet(cfg, o->name, optarg) == EXIT_FAILURE) ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	for(; optind < argc; optind++) {
+		if(fileVolumes) cfg->nVolumes = fileVolumes = 0;
+		if(configAddVolume(cfg, argv[optind]) == EXIT_FAILURE) ret = EXIT_FAILURE;
+	}
+	if(cfg->nVolumes == 0) {
+		configAddVolume(cfg, CFG_DEFAULT_DEVICE);
+	}
+	if(cfg->queueFile[0] == '\0' &&
+	   snprintf(cfg->queueFile, sizeof(cfg->queueFile), "%s%s", cfg->storeDir, CFG_QUEUE_FILE) >= (int)sizeof(cfg->queueFile)) {
+		printf("Store directory %s is too long to hold the queue file.\n", cfg->storeDir);
+		ret = EXIT_FAILURE;
+	}
+	return ret;
+}
+
+/**
+ * Prints the options, with the defaults currently in cfg.
+ */
+void configUsage(CONFIG *cfg, const char *prog) {
+	printf("Usage: %s [options] [[name=]device ...]\n"
+		   "  -c, --config FILE            read key = value options from FILE\n"
+		   "  -d, --device [NAME=]PATH     block device, loop device or image file, repeatable\n"
+		   "  -m, --mft-copy-dir DIR       where local $MFT copies are written (.)\n"
+		   "  -o, --store-dir DIR          extraction store (%s)\n"
+		   "  -s, --socket NAME            UDS server socket, @name for abstract (%s%s)\n"
+		   "  -M, --metrics-socket NAME    metrics endpoint socket (%s%s)\n"
+		   "  -C, --control-socket NAME    control socket (%s%s)\n"
+		   "  -D, --daemon                 no terminal interface, start consuming writes at once\n"
+		   "  -t, --trace FILE             record received writes to FILE\n"
+		   "  -q, --queue-file FILE        save unconsumed writes at shutdown, reload at start (%s%s)\n"
+		   "  -l, --log-level LEVEL        error, warn, info, debug or trace (info)\n"
+		   "  -L, --log-file FILE          log to FILE instead of stderr\n"
+		   "  -x, --max-extract-size BYTES largest file extracted (%d)\n"
+		   "  -a, --max-modify-age SECS    only extract files modified this recently (%d)\n"
+		   "  -r, --recover-threads N      threads reading deleted files when recovering (%d)\n"
+		   "  -K, --cache-size MIB         cache of MFT clusters read from the device, 0 for none (%d)\n"
+		   "  -w, --coalesce-window MS     time a guest write is held to merge repeats, 0 for none (%d)\n",
+		   prog, cfg->storeDir,
+		   cfg->socketName[0] ? "" : "@", cfg->socketName[0] ? cfg->socketName : cfg->socketName + 1,
+		   cfg->metricsSocketName[0] ? "" : "@",
+		   cfg->metricsSocketName[0] ? cfg->metricsSocketName : cfg->metricsSocketName + 1,
+		   cfg->controlSocketName[0] ? "" : "@",
+		   cfg->controlSocketName[0] ? cfg->controlSocketName : cfg->controlSocketName + 1,
+		   cfg->storeDir, CFG_QUEUE_FILE, CFG_DEFAULT_EXTRACT, CFG_DEFAULT_AGE, CFG_DEFAULT_RECOVER,
+		   CFG_DEFAULT_CACHE, CFG_DEFAULT_WINDOW);
+}
+
+#endif /* CONFIG_H_ */
@@ -0,0 +1,192 @@
+/*
+ * Control.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Control socket for running the engine without a terminal. Each connection is
+ * a session of request lines, the user interface commands with their search
+ * term on the same line, e.g. "search using record number 42". Batch searches
+ * read their terms from the lines that follow, up to a blank line. The output
+ * of each command is sent back followed by a line reading CTL_OK or CTL_ERROR.
+ * Each session has its own selected volume and "exit" ends it.
+ *
+ * controlServerStop closes the listening socket and ends every session once the
+ * command it is running returns, so nothing reaches the volumes after it.
+ */
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "UDSProtocol.h"
+#include "UserInterface.h"
+
+#define CONTROL_SOCKET_NAME	"\0diskTapControl"
+#define CTL_OK				"OK"
+#define CTL_ERROR			"ERROR"
+#define CTL_CLOSE			2		/*Handler return code ending the session */
+#define CTL_BACKLOG			4
+
+/* Runs one request line, writing its output to out. Further input is read from in */
+typedef int (*CONTROL_HANDLER)(FILE *in, FILE *out, char *line, uint16_t *volume);
+
+/* An open control connection */
+typedef struct _CTL_SESSION {
+	int					fd;
+	struct _CTL_SESSION	*next;
+} CTL_SESSION;
+
+char *control_socket_path = CONTROL_SOCKET_NAME;
+CONTROL_HANDLER controlHandler = NULL;
+
+static pthread_mutex_t controlLock = PTHREAD_MUTEX_INITIALIZER;	/*Guards the fields below */
+static pthread_cond_t controlIdle = PTHREAD_COND_INITIALIZER;	/*Signalled as each session ends */
+static CTL_SESSION *controlSessions = NULL;
+static int controlListenFD = -1;
+static bool controlStopping = false;
+
+void *controlServerThreadFn(void *socket_path);
+void controlServerStop(void);
+
+/**
+ * Serves one control connection until the client closes it, sends "exit" or
+ * the server is stopped.
+ */
+static void *controlSessionThreadFn(void *param) {
+	CTL_SESSION *session = param, **s;
+	int clientFD = session->fd;
+	char line[CMD_BUFF];
+	uint16_t volume = 0;
+	FILE *in = fdopen(clientFD, "r");
+	FILE *out = fdopen(dup(clientFD), "w");
+
+	if(in == NULL || out == NULL) {
+		int errsv = errno;
+		printf("Failed to open control connection: %s.\n", strerror(errsv));
+	}
+	while(in && out && fgets(line, sizeof(line), in)) {
+		if(__atomic_load_n(&controlStopping, __ATOMIC_ACQUIRE)) {	/*Lines already read */
+			fprintf(out, "Shutting down.\n%s\n", CTL_ERROR);
+			break;
+		}
+		int ret = controlHandler(in, out, line, &volume);
+		if(ret == CTL_CLOSE) break;
+		fprintf(out, "%s\n", ret == EXIT_SUCCESS ? CTL_OK : CTL_ERROR);
+		if(fflush(out) == EOF) break;	/*Client gone */
+	}
+
+	/*Unlisted before its descriptor is closed and can be reused */
+	pthread_mutex_lock(&controlLock);
+	for(s = &controlSessions; *s != session; s = &(*s)->next);
+	*s = session->next;
+	free(session);
+	pthread_cond_broadcast(&controlIdle);
+	pthread_mutex_unlock(&controlLock);
+	if(in) fclose(in); else close(clientFD);
+	if(out) fclose(out);
+	return NULL;
+}
+
+/**
+ * Control socket worker thread, starts a session thread for each connection.
+ */
+void *controlServerThreadFn(void *socket_path) {
+
+	struct sockaddr_un addr;
+	socklen_t addrLen = udsAddress(&addr, (char *)socket_path);
+	pthread_attr_t attr;
+	pthread_t tid;
+	int listenFD, clientFD;
+
+	if((listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		perror("control socket error");
+		pthread_exit(NULL);
+	}
+	if(addr.sun_path[0] != '\0') {
+		unlink((char *)socket_path);
+	}
+	if(bind(listenFD, (struct sockaddr*)&addr, addrLen) == -1) {
+		perror("control bind error");
+		close(listenFD);
+		pthread_exit(NULL);
+	}
+	if(listen(listenFD, CTL_BACKLOG) == -1) {
+		perror("control listen error");
+		close(listenFD);
+		pthread_exit(NULL);
+	}
+
+	pthread_mutex_lock(&controlLock);
+	if(controlStopping) {		/*Stopped before it was listening */
+		pthread_mutex_unlock(&controlLock);
+		close(listenFD);
+		pthread_exit(NULL);
+	}
+	controlListenFD = listenFD;
+	pthread_mutex_unlock(&controlLock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while(true) {
+		if((clientFD = accept4(listenFD, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+			if(errno == EINTR) continue;
+			if(!__atomic_load_n(&controlStopping, __ATOMIC_ACQUIRE)) perror("control accept error");
+			break;
+		}
+		/*Registered before it starts, so controlServerStop waits for it */
+		pthread_mutex_lock(&controlLock);
+		if(controlStopping) {
+			pthread_mutex_unlock(&controlLock);
+			close(clientFD);
+			break;
+		}
+		CTL_SESSION *session = malloc( sizeof(CTL_SESSION) );
+		session->fd = clientFD;
+		session->next = controlSessions;
+		controlSessions = session;
+		if(pthread_create(&tid, &attr, controlSessionThreadFn, session) != 0) {
+			controlSessions = session->next;
+			free(session);
+			close(clientFD);
+		}
+		pthread_mutex_unlock(&controlLock);
+	}
+	pthread_attr_destroy(&attr);
+	pthread_mutex_lock(&controlLock);
+	controlListenFD = -1;
+	pthread_mutex_unlock(&controlLock);
+	close(listenFD);
+	pthread_exit(NULL);
+}
+
+/**
+ * Stops taking connections and commands, and waits for each session to finish
+ * the command it is running and end. Call before the consumer and volumes are
+ * torn down.
+ */
+void controlServerStop() {
+	CTL_SESSION *session;
+
+	pthread_mutex_lock(&controlLock);
+	__atomic_store_n(&controlStopping, true, __ATOMIC_RELEASE);
+	if(controlListenFD != -1) {
+		shutdown(controlListenFD, SHUT_RDWR);	/*Wakes accept */
+	}
+	for(session = controlSessions; session; session = session->next) {
+		shutdown(session->fd, SHUT_RD);		/*Ends the session at its next read */
+	}
+	while(controlSessions) {
+		pthread_cond_wait(&controlIdle, &controlLock);
+	}
+	pthread_mutex_unlock(&controlLock);
+}
+
+#endif /* CONTROL_H_ */
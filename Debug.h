@@ -2,9 +2,261 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
 
-	static uint8_t DEBUG = false;
-	static uint8_t VERBOSE = false;
+/*
+ * Leveled logging. Messages above LOG_BUILD_LEVEL compile out entirely, those
+ * at or below it are filtered at runtime against logLevel. Messages are
+ * formatted by the caller and handed to a ring buffer that a writer thread
+ * empties to the log sink, so the hot path never waits on the terminal or disk.
+ * If the ring is full the message is dropped and counted.
+ *
+ * DEBUG and VERBOSE are kept to guard the debug blocks that format through the
+ * structure dump helpers, which logText then logs; they are the debug and trace
+ * levels.
+ */
+#define LOG_LVL_ERROR	1
+#define LOG_LVL_WARN	2
+#define LOG_LVL_INFO	3
+#define LOG_LVL_DEBUG	4
+#define LOG_LVL_TRACE	5
+
+#ifndef LOG_BUILD_LEVEL
+#define LOG_BUILD_LEVEL	LOG_LVL_DEBUG
+#endif
+
+#define LOG_MSG_LEN		240			/*Longer messages are truncated */
+#define LOG_RING_SIZE	1024		/*Messages buffered for the writer thread */
+#define LOG_HEX_LINE	32			/*Bytes per line of a hex dump */
+
+#define LOG_ENABLED(lvl)	((lvl) <= LOG_BUILD_LEVEL && (lvl) <= logLevel)
+#define LOG_AT(lvl, ...)	do { if(LOG_ENABLED(lvl)) logWrite((lvl), __VA_ARGS__); } while(0)
+#define LOG_ERROR(...)		LOG_AT(LOG_LVL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)		LOG_AT(LOG_LVL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)		LOG_AT(LOG_LVL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)		LOG_AT(LOG_LVL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...)		LOG_AT(LOG_LVL_TRACE, __VA_ARGS__)
+
+#define DEBUG		LOG_ENABLED(LOG_LVL_DEBUG)
+#define VERBOSE		LOG_ENABLED(LOG_LVL_TRACE)
+
+typedef struct _LOG_ENTRY {
+	uint64_t	timeNs;		/*CLOCK_REALTIME when logged */
+	uint16_t	thread;		/*Small per-thread id */
+	uint8_t		level;
+	char		msg[LOG_MSG_LEN];
+} LOG_ENTRY;
+
+typedef struct _LOG_SINK {
+	LOG_ENTRY		ring[LOG_RING_SIZE];
+	uint32_t		head, tail;		/*Free running, head - tail entries are pending */
+	uint64_t		dropped;		/*Messages lost because the ring was full */
+	FILE			*out;
+	bool			running;		/*Writer thread started */
+	bool			stopping;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	pthread_t		writer;
+} LOG_SINK;
+
+static const char *logLevelNames[] = { "NONE", "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+
+uint8_t logLevel = LOG_LVL_INFO;
+LOG_SINK logSink = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+static __thread uint16_t logThreadId = 0;
+static uint16_t logNThreads = 0;
+
+int  logInit(uint8_t level, const char *path);
+void logWrite(uint8_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logHex(uint8_t level, const void *data, size_t len);
+void logText(uint8_t level, const char *text);
+uint8_t logLevelFromName(const char *name, uint8_t fallback);
+void logClose(void);
+
+/**
+ * Writes one entry to the sink as "time level [thread] message".
+ */
+static void logEmit(FILE *out, LOG_ENTRY *entry) {
+	time_t secs = entry->timeNs/1000000000ULL;
+	struct tm tmNow;
+	char stamp[32];
+	localtime_r(&secs, &tmNow);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tmNow);
+	fprintf(out, "%s.%06u %-5s [%u] %s\n", stamp, (unsigned)((entry->timeNs/1000)%1000000),
+			logLevelNames[entry->level], entry->thread, entry->msg);
+}
+
+/**
+ * Log writer thread, empties the ring to the sink.
+ */
+static void *logWriterThreadFn(void *param) {
+
+	(void)param;
+	LOG_ENTRY batch[64];
+	uint32_t n, i;
+	pthread_mutex_lock(&logSink.lock);
+	while(true) {
+		while(logSink.head == logSink.tail && !logSink.stopping) {
+			pthread_cond_wait(&logSink.wake, &logSink.lock);
+		}
+		if(logSink.head == logSink.tail) break;		/*Stopping and drained */
+		for(n = 0; n < 64 && logSink.tail != logSink.head; n++, logSink.tail++) {
+			batch[n] = logSink.ring[logSink.tail % LOG_RING_SIZE];
+		}
+		pthread_mutex_unlock(&logSink.lock);
+		for(i = 0; i < n; i++) {
+			logEmit(logSink.out, &batch[i]);
+		}
+		fflush(logSink.out);
+		pthread_mutex_lock(&logSink.lock);
+	}
+	pthread_mutex_unlock(&logSink.lock);
+	return NULL;
+}
+
+/**
+ * Sets the runtime level and starts the writer thread. Messages go to the file
+ * at path (appended to), or to stderr if path is NULL.
+ */
+int logInit(uint8_t level, const char *path) {
+	logLevel = level;
+	logSink.out = stderr;
+	if(path && (logSink.out = fopen(path, "a")) == NULL) {
+		int errsv = errno;
+		printf("Failed to open log file %s: %s.\n", path, strerror(errsv));
+		logSink.out = stderr;
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_lock(&logSink.lock);
+	if(pthread_create(&logSink.writer, NULL, logWriterThreadFn, NULL) == 0) {
+		logSink.running = true;
+	}
+	pthread_mutex_unlock(&logSink.lock);
+	return logSink.running ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Formats a message and queues it for the writer thread. Before logInit (or
+ * after logClose) messages are written to stderr directly.
+ */
+void logWrite(uint8_t level, const char *fmt, ...) {
+	LOG_ENTRY entry;
+	struct timespec ts;
+	va_list args;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	entry.timeNs = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+	entry.level = level;
+	if(logThreadId == 0) {
+		logThreadId = __atomic_add_fetch(&logNThreads, 1, __ATOMIC_RELAXED);
+	}
+	entry.thread = logThreadId;
+	va_start(args, fmt);
+	int len = vsnprintf(entry.msg, LOG_MSG_LEN, fmt, args);
+	va_end(args);
+	if(len > 0 && len < LOG_MSG_LEN && entry.msg[len-1] == '\n') {
+		entry.msg[len-1] = '\0';	/*The sink ends every entry with a newline */
+	}
+
+	pthread_mutex_lock(&logSink.lock);
+	if(!logSink.running) {
+		pthread_mutex_unlock(&logSink.lock);
+		logEmit(stderr, &entry);
+		return;
+	}
+	if(logSink.head - logSink.tail == LOG_RING_SIZE) {
+		logSink.dropped++;
+	} else {
+		logSink.ring[logSink.head++ % LOG_RING_SIZE] = entry;
+		pthread_cond_signal(&logSink.wake);
+	}
+	pthread_mutex_unlock(&logSink.lock);
+}
+
+/**
+ * Logs len bytes as lines of hex followed by their printable characters.
+ */
+void logHex(uint8_t level, const void *data, size_t len) {
+	const uint8_t *bytes = (const uint8_t *)data;
+	char line[LOG_HEX_LINE*3 + LOG_HEX_LINE + 2];
+	size_t offs, k;
+	for(offs = 0; offs < len; offs += LOG_HEX_LINE) {
+		size_t n = len - offs < LOG_HEX_LINE ? len - offs : LOG_HEX_LINE;
+		char *p = line;
+		for(k = 0; k < n; k++) {
+			p += sprintf(p, "%02x ", bytes[offs+k]);
+		}
+		*p++ = ' ';
+		for(k = 0; k < n; k++) {
+			uint8_t c = bytes[offs+k];
+			*p++ = (c >= 0x20 && c < 0x7f) ? c : '.';
+		}
+		*p = '\0';
+		logWrite(level, "%06zx  %s", offs, line);
+	}
+}
+
+/**
+ * Logs each line of text, such as a structure dump helper's, as an entry.
+ */
+void logText(uint8_t level, const char *text) {
+	while(*text) {
+		const char *end = strchr(text, '\n');
+		int n = end ? (int)(end - text) : (int)strlen(text);
+		if(n > 0) logWrite(level, "%.*s", n, text);
+		text += n + (end ? 1 : 0);
+	}
+}
+
+/**
+ * Returns the level named (error, warn, info, debug, trace, or a digit), or
+ * fallback if name is NULL or not a level.
+ */
+uint8_t logLevelFromName(const char *name, uint8_t fallback) {
+	uint8_t level;
+	if(name == NULL) return fallback;
+	if(name[0] >= '0' && name[0] <= '5' && name[1] == '\0') return name[0] - '0';
+	for(level = LOG_LVL_ERROR; level <= LOG_LVL_TRACE; level++) {
+		if(strcasecmp(name, logLevelNames[level]) == 0) return level;
+	}
+	return fallback;
+}
+
+/**
+ * Writes out everything still in the ring and stops the writer thread.
+ */
+void logClose() {
+	pthread_mutex_lock(&logSink.lock);
+	if(!logSink.running) {
+		pthread_mutex_unlock(&logSink.lock);
+		return;
+	}
+	logSink.stopping = true;
+	pthread_cond_signal(&logSink.wake);
+	pthread_mutex_unlock(&logSink.lock);
+	pthread_join(logSink.writer, NULL);
+
+	pthread_mutex_lock(&logSink.lock);
+	logSink.running = false;
+	logSink.stopping = false;
+	pthread_mutex_unlock(&logSink.lock);
+	if(logSink.dropped) {
+		fprintf(logSink.out, "%" PRIu64 " log messages dropped.\n", logSink.dropped);
+	}
+	if(logSink.out != stderr) {
+		fclose(logSink.out);
+		logSink.out = stderr;
+	}
+}
 
 #endif
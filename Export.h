@@ -0,0 +1,529 @@
+/*
+ * Export.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Streaming export of rows to CSV, newline delimited JSON (NDJSON) or an Arrow
+ * IPC stream, for loading listings of the index into analytics tools. Rows are
+ * written as they are given, through a large stdio buffer; Arrow output holds at
+ * most EXPORT_BATCH_ROWS rows before writing them as one record batch, so memory
+ * use does not grow with the size of the volume.
+ *
+ * The Arrow stream is the IPC streaming format: a Schema message, RecordBatch
+ * messages and the end of stream marker, each message a flatbuffer written by
+ * the small builder below. pyarrow.ipc.open_stream and most Arrow readers take
+ * it directly, and it converts to Parquet without a schema of its own.
+ */
+#ifndef EXPORT_H_
+#define EXPORT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#define EXPORT_CSV			0
+#define EXPORT_NDJSON		1
+#define EXPORT_ARROW		2
+
+#define EXPORT_U64			0			/*Column types */
+#define EXPORT_I64			1
+#define EXPORT_STR			2
+#define EXPORT_TIME			3			/*Microseconds since 01/01/1970 UTC, in i */
+
+#define EXPORT_BATCH_ROWS	65536		/*Rows in one Arrow record batch at most */
+#define EXPORT_BUFF			(1 << 20)	/*stdio buffer of an export file */
+#define EXPORT_MAX_COLS		32
+
+#define ARROW_CONTINUATION	0xFFFFFFFFU	/*Starts every IPC message */
+#define ARROW_V5			4			/*MetadataVersion */
+#define ARROW_HDR_SCHEMA	1			/*MessageHeader union types */
+#define ARROW_HDR_BATCH		3
+#define ARROW_TYPE_INT		2			/*Type union types */
+#define ARROW_TYPE_UTF8		5
+#define ARROW_TYPE_TIMESTAMP	10
+#define ARROW_MICROSECOND	2			/*TimeUnit */
+
+typedef struct _EXPORT_COLUMN {
+	const char	*name;
+	uint8_t		type;
+} EXPORT_COLUMN;
+
+/* Value of one column of a row, by the column's type */
+typedef union _EXPORT_VALUE {
+	uint64_t	u;
+	int64_t		i;
+	const char	*s;
+} EXPORT_VALUE;
+
+/* Arrow record batch being filled, one per column */
+typedef struct _EXPORT_ARRAY {
+	int64_t		*values;		/*Integer columns */
+	int32_t		*offsets;		/*String columns, EXPORT_BATCH_ROWS + 1 */
+	char		*data;
+	uint32_t	dataLen;
+	uint32_t	dataSize;
+} EXPORT_ARRAY;
+
+typedef struct _EXPORTER {
+	FILE				*out;
+	bool				ownsOut;		/*Opened by exportOpen */
+	char				*vbuf;
+	int					format;
+	const EXPORT_COLUMN	*cols;
+	uint32_t			nCols;
+	EXPORT_ARRAY		*arrays;		/*Arrow only */
+	uint32_t			nBatch;			/*Rows in the arrays */
+	uint64_t			nRows;			/*Rows exported */
+} EXPORTER;
+
+int  exportFormat(const char *name);
+int  exportOpen(EXPORTER *exp, const char *path, FILE *out, int format, const EXPORT_COLUMN *cols, uint32_t nCols);
+int  exportRow(EXPORTER *exp, const EXPORT_VALUE *row);
+int  exportClose(EXPORTER *exp);
+
+/*---------------------------------- Flatbuffer builder ---------------------------------*/
+
+/*
+ * Flatbuffers are written front to back here: a table is written before what
+ * its offset fields point to, and those fields are patched once it is written,
+ * which keeps every offset pointing forward as the format requires. The buffer
+ * starts 8 byte aligned in the stream, so alignment within it is alignment.
+ */
+typedef struct _FB_BUILDER {
+	uint8_t		*buf;
+	uint32_t	len;
+	uint32_t	size;
+} FB_BUILDER;
+
+/* Field of a table: its size in bytes, 0 if absent, and value. Offset fields are 4 bytes */
+typedef struct _FB_FIELD {
+	uint8_t		size;
+	uint64_t	value;
+} FB_FIELD;
+
+#define FB_MAX_FIELDS 8
+
+static uint32_t fbReserve(FB_BUILDER *fb, uint32_t n) {
+	if(fb->len + n > fb->size) {
+		while(fb->len + n > fb->size) fb->size = fb->size ? fb->size*2 : 1024;
+		fb->buf = realloc(fb->buf, fb->size);
+	}
+	memset(fb->buf + fb->len, 0, n);
+	fb->len += n;
+	return fb->len - n;
+}
+
+/* Pads so that the position extra bytes on is a multiple of align */
+static void fbAlign(FB_BUILDER *fb, uint32_t align, uint32_t extra) {
+	while((fb->len + extra) % align) fbReserve(fb, 1);
+}
+
+/* Points the offset at pos to target, written after it */
+static void fbPatch(FB_BUILDER *fb, uint32_t pos, uint32_t target) {
+	uint32_t rel = target - pos;
+	memcpy(fb->buf + pos, &rel, sizeof(rel));
+}
+
+/**
+ * Writes a table and its vtable, placing each field at its natural alignment.
+ * The positions of the fields are returned in fieldPos, for patching offsets.
+ *
+ * Returns the position of the table.
+ */
+static uint32_t fbTable(FB_BUILDER *fb, const FB_FIELD *fields, uint16_t n, uint32_t *fieldPos) {
+	uint16_t vtable[2 + FB_MAX_FIELDS], tableLen = 4, i;	/*After the offset to the vtable */
+	for(i = 0; i < n; i++) {
+		if(fields[i].size == 0) {
+			vtable[2 + i] = 0;
+			continue;
+		}
+		tableLen = (tableLen + fields[i].size - 1)/fields[i].size*fields[i].size;
+		vtable[2 + i] = tableLen;
+		tableLen += fields[i].size;
+	}
+	vtable[0] = 4 + 2*n;
+	vtable[1] = tableLen;
+
+	fbAlign(fb, 2, 0);
+	uint32_t vtablePos = fbReserve(fb, vtable[0]);
+	memcpy(fb->buf + vtablePos, vtable, vtable[0]);
+	fbAlign(fb, 8, 0);
+	uint32_t tablePos = fbReserve(fb, tableLen);
+	int32_t toVtable = tablePos - vtablePos;
+	memcpy(fb->buf + tablePos, &toVtable, sizeof(toVtable));
+	for(i = 0; i < n; i++) {
+		if(fields[i].size == 0) continue;
+		memcpy(fb->buf + tablePos + vtable[2 + i], &fields[i].value, fields[i].size);	/*Little endian */
+		if(fieldPos) fieldPos[i] = tablePos + vtable[2 + i];
+	}
+	return tablePos;
+}
+
+/**
+ * Writes a vector of count elements, aligning the elements to align. Elements
+ * are zero if elems is NULL, for vectors of offsets patched later.
+ */
+static uint32_t fbVector(FB_BUILDER *fb, const void *elems, uint32_t count, uint32_t elemSize, uint32_t align) {
+	fbAlign(fb, align < 4 ? 4 : align, 4);
+	uint32_t pos = fbReserve(fb, 4 + count*elemSize);
+	memcpy(fb->buf + pos, &count, sizeof(count));
+	if(elems) memcpy(fb->buf + pos + 4, elems, count*elemSize);
+	return pos;
+}
+
+static uint32_t fbString(FB_BUILDER *fb, const char *s) {
+	uint32_t len = strlen(s);
+	fbAlign(fb, 4, 0);
+	uint32_t pos = fbReserve(fb, 4 + len + 1);
+	memcpy(fb->buf + pos, &len, sizeof(len));
+	memcpy(fb->buf + pos + 4, s, len);
+	return pos;
+}
+
+/**
+ * Starts an IPC message: the root offset and the Message table, with the
+ * position of its header offset returned for the header to be patched to.
+ */
+static void arrowMessage(FB_BUILDER *fb, uint8_t headerType, int64_t bodyLength, uint32_t *headerPos) {
+	FB_FIELD msg[4] = { { 2, ARROW_V5 }, { 1, headerType }, { 4, 0 }, { 8, bodyLength } };
+	uint32_t fieldPos[4];
+	fb->len = 0;
+	fbReserve(fb, 4);
+	fbPatch(fb, 0, fbTable(fb, msg, 4, fieldPos));
+	*headerPos = fieldPos[2];
+}
+
+/**
+ * Writes a message, framed by the continuation marker and its padded length.
+ */
+static void arrowWriteMessage(FILE *out, FB_BUILDER *fb) {
+	static const uint8_t zeros[8];
+	uint32_t prefix[2] = { ARROW_CONTINUATION, (fb->len + 7) & ~7U };
+	fwrite(prefix, sizeof(prefix), 1, out);
+	fwrite(fb->buf, fb->len, 1, out);
+	fwrite(zeros, prefix[1] - fb->len, 1, out);
+}
+
+static void arrowWriteSchema(EXPORTER *exp) {
+	FB_BUILDER fb = { NULL, 0, 0 };
+	uint32_t headerPos, schemaPos[2], i;
+
+	arrowMessage(&fb, ARROW_HDR_SCHEMA, 0, &headerPos);
+	FB_FIELD schema[2] = { { 0, 0 }, { 4, 0 } };	/*Little endian, fields */
+	fbPatch(&fb, headerPos, fbTable(&fb, schema, 2, schemaPos));
+	uint32_t fieldsPos = fbVector(&fb, NULL, exp->nCols, 4, 4);
+	fbPatch(&fb, schemaPos[1], fieldsPos);
+
+	for(i = 0; i < exp->nCols; i++) {
+		uint8_t type = exp->cols[i].type;
+		/*name, nullable, type_type, type, dictionary, children */
+		FB_FIELD field[6] = { { 4, 0 }, { 1, 0 }, { 1, type == EXPORT_STR ? ARROW_TYPE_UTF8 :
+													   type == EXPORT_TIME ? ARROW_TYPE_TIMESTAMP : ARROW_TYPE_INT },
+							  { 4, 0 }, { 0, 0 }, { 4, 0 } };
+		uint32_t fieldPos[6], timePos[2];
+		fbPatch(&fb, fieldsPos + 4 + 4*i, fbTable(&fb, field, 6, fieldPos));
+		fbPatch(&fb, fieldPos[0], fbString(&fb, exp->cols[i].name));
+		if(type == EXPORT_STR) {
+			fbPatch(&fb, fieldPos[3], fbTable(&fb, NULL, 0, NULL));
+		} else if(type == EXPORT_TIME) {
+			FB_FIELD timeType[2] = { { 2, ARROW_MICROSECOND }, { 4, 0 } };	/*unit, timezone */
+			fbPatch(&fb, fieldPos[3], fbTable(&fb, timeType, 2, timePos));
+			fbPatch(&fb, timePos[1], fbString(&fb, "UTC"));
+		} else {
+			FB_FIELD intType[2] = { { 4, 64 }, { 1, exp->cols[i].type == EXPORT_I64 } };	/*bitWidth, is_signed */
+			fbPatch(&fb, fieldPos[3], fbTable(&fb, intType, 2, NULL));
+		}
+		fbPatch(&fb, fieldPos[5], fbVector(&fb, NULL, 0, 4, 4));
+	}
+	arrowWriteMessage(exp->out, &fb);
+	free(fb.buf);
+}
+
+/**
+ * Writes the rows in the arrays as a record batch and empties them. Every
+ * column has an empty validity buffer, as none has nulls, then its values, or
+ * for strings its offsets and data.
+ */
+static void arrowWriteBatch(EXPORTER *exp) {
+	static const uint8_t zeros[8];
+	FB_BUILDER fb = { NULL, 0, 0 };
+	int64_t nodes[EXPORT_MAX_COLS][2], buffers[3*EXPORT_MAX_COLS][2], bodyLen = 0;
+	const void *bufData[3*EXPORT_MAX_COLS];
+	uint32_t nBuffers = 0, headerPos, batchPos[3], i, b;
+
+	for(i = 0; i < exp->nCols; i++) {
+		EXPORT_ARRAY *arr = &exp->arrays[i];
+		int64_t lens[3] = { 0, 0, 0 };
+		const void *data[3] = { NULL, NULL, NULL };
+		uint32_t n = 2;
+		nodes[i][0] = exp->nBatch;
+		nodes[i][1] = 0;			/*Nulls */
+		if(exp->cols[i].type == EXPORT_STR) {
+			lens[1] = (exp->nBatch + 1)*sizeof(int32_t);
+			data[1] = arr->offsets;
+			lens[2] = arr->dataLen;
+			data[2] = arr->data;
+			n = 3;
+		} else {
+			lens[1] = exp->nBatch*sizeof(int64_t);
+			data[1] = arr->values;
+		}
+		for(b = 0; b < n; b++) {
+			buffers[nBuffers][0] = bodyLen;
+			buffers[nBuffers][1] = lens[b];
+			bufData[nBuffers++] = data[b];
+			bodyLen += (lens[b] + 7) & ~7;
+		}
+	}
+
+	arrowMessage(&fb, ARROW_HDR_BATCH, bodyLen, &headerPos);
+	FB_FIELD batch[3] = { { 8, exp->nBatch }, { 4, 0 }, { 4, 0 } };	/*length, nodes, buffers */
+	fbPatch(&fb, headerPos, fbTable(&fb, batch, 3, batchPos));
+	fbPatch(&fb, batchPos[1], fbVector(&fb, nodes, exp->nCols, sizeof(nodes[0]), 8));
+	fbPatch(&fb, batchPos[2], fbVector(&fb, buffers, nBuffers, sizeof(buffers[0]), 8));
+	arrowWriteMessage(exp->out, &fb);
+	free(fb.buf);
+
+	for(b = 0; b < nBuffers; b++) {
+		if(buffers[b][1] == 0) continue;
+		fwrite(bufData[b], buffers[b][1], 1, exp->out);
+		fwrite(zeros, ((buffers[b][1] + 7) & ~7) - buffers[b][1], 1, exp->out);
+	}
+	for(i = 0; i < exp->nCols; i++) {
+		exp->arrays[i].dataLen = 0;
+	}
+	exp->nBatch = 0;
+}
+
+/*---------------------------------- Text formats ---------------------------------------*/
+
+/* Writes the n low decimal digits of v to out, zero padded */
+static inline void putDigits(char *out, int64_t v, int n) {
+	while(n-- > 0) {
+		out[n] = '0' + v % 10;
+		v /= 10;
+	}
+}
+
+/**
+ * Writes a time as ISO 8601 UTC, "2015-03-10T14:30:00.000000Z". The date is
+ * worked out from the day number (proleptic Gregorian, years 0 to 9999), as
+ * gmtime and strftime are slow for millions of values.
+ */
+static void isoTime(FILE *out, int64_t us) {
+	char buff[27] = "0000-00-00T00:00:00.000000Z";
+	int64_t days = us/86400000000LL, rem = us % 86400000000LL;
+	if(rem < 0) {
+		rem += 86400000000LL;
+		days--;
+	}
+	/*Civil date from days since 1970-01-01, in 400 year eras starting 0000-03-01 */
+	int64_t z = days + 719468;
+	int64_t era = (z >= 0 ? z : z - 146096)/146097;
+	int64_t doe = z - era*146097;
+	int64_t yoe = (doe - doe/1460 + doe/36524 - doe/146096)/365;
+	int64_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+	int64_t mp = (5*doy + 2)/153;
+	int64_t day = doy - (153*mp + 2)/5 + 1;
+	int64_t month = mp < 10 ? mp + 3 : mp - 9;
+	int64_t year = yoe + era*400 + (month <= 2);
+
+	putDigits(buff, year, 4);
+	putDigits(buff + 5, month, 2);
+	putDigits(buff + 8, day, 2);
+	putDigits(buff + 11, rem/3600000000LL, 2);
+	putDigits(buff + 14, rem/60000000 % 60, 2);
+	putDigits(buff + 17, rem/1000000 % 60, 2);
+	putDigits(buff + 20, rem % 1000000, 6);
+	fwrite(buff, sizeof(buff), 1, out);
+}
+
+/* Writes s as a CSV field, quoted if it holds a separator, quote or line break */
+static void csvString(FILE *out, const char *s) {
+	if(s[strcspn(s, ",\"\r\n")] == '\0') {
+		fputs(s, out);
+		return;
+	}
+	putc('"', out);
+	for(; *s; s++) {
+		if(*s == '"') putc('"', out);
+		putc(*s, out);
+	}
+	putc('"', out);
+}
+
+/* Writes s as a JSON string, escaping quotes, backslashes and control characters */
+static void jsonString(FILE *out, const char *s) {
+	const char *run = s;
+	putc('"', out);
+	for(; *s; s++) {
+		unsigned char c = *s;
+		if(c != '"' && c != '\\' && c >= 0x20) continue;
+		fwrite(run, s - run, 1, out);		/*Unescaped run before c */
+		if(c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			putc('\\', out);
+			putc(c, out);
+		}
+		run = s + 1;
+	}
+	fwrite(run, s - run, 1, out);
+	putc('"', out);
+}
+
+/*---------------------------------- Exporter -------------------------------------------*/
+
+/**
+ * Returns the format called name, csv, ndjson or arrow, or -1 if unknown.
+ */
+int exportFormat(const char *name) {
+	if(strcmp(name, "csv") == 0) return EXPORT_CSV;
+	if(strcmp(name, "ndjson") == 0) return EXPORT_NDJSON;
+	if(strcmp(name, "arrow") == 0) return EXPORT_ARROW;
+	return -1;
+}
+
+/**
+ * Starts an export of rows of the columns given to the file at path, or to out
+ * if path is "-". CSV starts with a header line, Arrow with the schema.
+ */
+int exportOpen(EXPORTER *exp, const char *path, FILE *out, int format, const EXPORT_COLUMN *cols, uint32_t nCols) {
+	uint32_t i;
+	memset(exp, 0, sizeof(EXPORTER));
+	if(nCols > EXPORT_MAX_COLS) {
+		printf("Too many columns to export.\n");
+		return EXIT_FAILURE;
+	}
+	if(strcmp(path, "-") == 0) {
+		exp->out = out;
+	} else {
+		if((exp->out = fopen(path, "w")) == NULL) {
+			int errsv = errno;
+			printf("Failed to open export file %s: %s.\n", path, strerror(errsv));
+			return EXIT_FAILURE;
+		}
+		exp->ownsOut = true;
+		exp->vbuf = malloc( EXPORT_BUFF );
+		setvbuf(exp->out, exp->vbuf, _IOFBF, EXPORT_BUFF);
+	}
+	exp->format = format;
+	exp->cols = cols;
+	exp->nCols = nCols;
+
+	if(format == EXPORT_CSV) {
+		for(i = 0; i < nCols; i++) {
+			if(i) putc(',', exp->out);
+			csvString(exp->out, cols[i].name);
+		}
+		putc('\n', exp->out);
+	} else if(format == EXPORT_ARROW) {
+		exp->arrays = calloc(nCols, sizeof(EXPORT_ARRAY));
+		for(i = 0; i < nCols; i++) {
+			if(cols[i].type == EXPORT_STR) {
+				exp->arrays[i].offsets = malloc( (EXPORT_BATCH_ROWS + 1)*sizeof(int32_t) );
+				exp->arrays[i].offsets[0] = 0;
+			} else {
+				exp->arrays[i].values = malloc( EXPORT_BATCH_ROWS*sizeof(int64_t) );
+			}
+		}
+		arrowWriteSchema(exp);
+	}
+	return ferror(exp->out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Exports one row, its values in column order.
+ */
+int exportRow(EXPORTER *exp, const EXPORT_VALUE *row) {
+	uint32_t i;
+	switch(exp->format) {
+	case EXPORT_CSV:
+		for(i = 0; i < exp->nCols; i++) {
+			if(i) putc(',', exp->out);
+			switch(exp->cols[i].type) {
+			case EXPORT_U64: fprintf(exp->out, "%" PRIu64, row[i].u); break;
+			case EXPORT_I64: fprintf(exp->out, "%" PRId64, row[i].i); break;
+			case EXPORT_STR: csvString(exp->out, row[i].s); break;
+			case EXPORT_TIME: isoTime(exp->out, row[i].i); break;
+			}
+		}
+		putc('\n', exp->out);
+		break;
+	case EXPORT_NDJSON:
+		for(i = 0; i < exp->nCols; i++) {
+			fputs(i ? "," : "{", exp->out);
+			jsonString(exp->out, exp->cols[i].name);
+			putc(':', exp->out);
+			switch(exp->cols[i].type) {
+			case EXPORT_U64: fprintf(exp->out, "%" PRIu64, row[i].u); break;
+			case EXPORT_I64: fprintf(exp->out, "%" PRId64, row[i].i); break;
+			case EXPORT_STR: jsonString(exp->out, row[i].s); break;
+			case EXPORT_TIME:
+				putc('"', exp->out);
+				isoTime(exp->out, row[i].i);
+				putc('"', exp->out);
+				break;
+			}
+		}
+		fputs("}\n", exp->out);
+		break;
+	case EXPORT_ARROW:
+		for(i = 0; i < exp->nCols; i++) {
+			EXPORT_ARRAY *arr = &exp->arrays[i];
+			if(exp->cols[i].type != EXPORT_STR) {
+				arr->values[exp->nBatch] = row[i].i;
+				continue;
+			}
+			uint32_t len = strlen(row[i].s);
+			if(arr->dataLen + len > arr->dataSize) {
+				while(arr->dataLen + len > arr->dataSize) arr->dataSize = arr->dataSize ? arr->dataSize*2 : 65536;
+				arr->data = realloc(arr->data, arr->dataSize);
+			}
+			memcpy(arr->data + arr->dataLen, row[i].s, len);
+			arr->dataLen += len;
+			arr->offsets[exp->nBatch + 1] = arr->dataLen;
+		}
+		if(++exp->nBatch == EXPORT_BATCH_ROWS) {
+			arrowWriteBatch(exp);
+		}
+		break;
+	}
+	exp->nRows++;
+	return ferror(exp->out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Finishes the export, writing any rows held and the Arrow end of stream, and
+ * closes the file.
+ *
+ * Returns EXIT_FAILURE if any of the output failed to be written.
+ */
+int exportClose(EXPORTER *exp) {
+	int retVal;
+	uint32_t i;
+	if(exp->format == EXPORT_ARROW) {
+		uint32_t eos[2] = { ARROW_CONTINUATION, 0 };
+		if(exp->nBatch > 0) arrowWriteBatch(exp);
+		fwrite(eos, sizeof(eos), 1, exp->out);
+		for(i = 0; i < exp->nCols; i++) {
+			free(exp->arrays[i].values);
+			free(exp->arrays[i].offsets);
+			free(exp->arrays[i].data);
+		}
+		free(exp->arrays);
+	}
+	retVal = fflush(exp->out) == EOF || ferror(exp->out) ? EXIT_FAILURE : EXIT_SUCCESS;
+	if(exp->ownsOut && fclose(exp->out) == EOF) {
+		retVal = EXIT_FAILURE;
+	}
+	free(exp->vbuf);
+	memset(exp, 0, sizeof(EXPORTER));
+	return retVal;
+}
+
+#endif /* EXPORT_H_ */
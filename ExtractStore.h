@@ -0,0 +1,332 @@
+/*
+ * ExtractStore.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Content-addressed store for extracted file data. Each distinct file content
+ * is written once, as a blob named by its XXH64 digest, and a manifest records
+ * which (record number, sequence number, LSN, time) produced which blob.
+ *
+ * Re-extracting an unchanged file costs one hash: if the last digest stored for
+ * the record's stream matches, neither the blob nor the manifest is touched.
+ */
+#ifndef EXTRACTSTORE_H_
+#define EXTRACTSTORE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "NTFSStruct.h"
+#include "Hash.h"
+
+#define EXTFILESDIR		"EXTRACTED_FILES/"
+#define STOREBLOBDIR	"Store/"
+#define STOREMANIFEST	"manifest"
+#define STORE_SET_INIT	4096	/*Initial blob and stream set capacity, power of two */
+
+/* storePut return codes */
+#define STORE_UNCHANGED	0		/*Record content identical to its last extraction */
+#define STORE_NEWREF	1		/*Content already held, only the manifest was appended */
+#define STORE_NEWBLOB	2		/*Content was new and written as a blob */
+
+/* Last digest stored for one stream of one record */
+typedef struct _STORE_LAST {
+	uint64_t	key;			/*Record number above the stream name's hash */
+	uint64_t	hash;			/*0 = empty slot */
+	uint16_t	wSequence;		/*Sequence number of the record stored */
+} STORE_LAST;
+
+typedef struct _EXTRACT_STORE {
+	char		*rootDir;		/*Directory holding the blobs and manifest */
+	FILE		*manifest;		/*Append-only manifest */
+	uint64_t	*blobSet;		/*Open addressed set of digests held on disk, 0 = empty */
+	uint32_t	nBlobSlots;
+	uint32_t	nBlobs;
+	STORE_LAST	*lastSet;		/*Open addressed, by record number and stream */
+	uint32_t	nLastSlots;
+	uint32_t	nLast;
+	uint64_t	countUnchanged;	/*storePut outcome counters */
+	uint64_t	countNewRef;
+	uint64_t	countNewBlob;
+	pthread_mutex_t lock;
+} EXTRACT_STORE;
+
+int  storeInit(EXTRACT_STORE *store, const char *rootDir);
+int  storePut(EXTRACT_STORE *store, uint32_t recordNumber, uint16_t wSequence, int64_t n64LSN,
+			  const char *fileName, const void *data, uint64_t len);
+int  storeRecovered(EXTRACT_STORE *store, uint32_t recordNumber, uint16_t wSequence, int64_t n64LSN,
+					const char *fileName, const void *data, uint64_t len);
+void storeClose(EXTRACT_STORE *store);
+
+/**
+ * Returns true if the digest is in the blob set.
+ */
+static bool storeHasBlob(EXTRACT_STORE *store, uint64_t hash) {
+	uint32_t mask = store->nBlobSlots - 1;
+	uint32_t i = (uint32_t)hash & mask;
+	while(store->blobSet[i] != 0) {
+		if(store->blobSet[i] == hash) return true;
+		i = (i + 1) & mask;
+	}
+	return false;
+}
+
+/**
+ * Adds a digest to the blob set, growing the table when over half full.
+ */
+static void storeAddBlob(EXTRACT_STORE *store, uint64_t hash) {
+	if(hash == 0) hash = 1;	/*0 marks an empty slot */
+	if((store->nBlobs+1)*2 > store->nBlobSlots) {
+		uint64_t *oldSet = store->blobSet;
+		uint32_t oldSlots = store->nBlobSlots, j;
+		store->nBlobSlots *= 2;
+		store->blobSet = calloc(store->nBlobSlots, sizeof(uint64_t));
+		store->nBlobs = 0;
+		for(j = 0; j < oldSlots; j++) {
+			if(oldSet[j]) storeAddBlob(store, oldSet[j]);
+		}
+		free(oldSet);
+	}
+	uint32_t mask = store->nBlobSlots - 1;
+	uint32_t i = (uint32_t)hash & mask;
+	while(store->blobSet[i] != 0) {
+		if(store->blobSet[i] == hash) return;
+		i = (i + 1) & mask;
+	}
+	store->blobSet[i] = hash;
+	store->nBlobs++;
+}
+
+/**
+ * Returns the slot of key in the stream set, or the empty slot it would take.
+ */
+static STORE_LAST *storeFindLast(EXTRACT_STORE *store, uint64_t key) {
+	uint32_t mask = store->nLastSlots - 1;
+	uint32_t i = (uint32_t)(key ^ key >> 32) & mask;
+	while(store->lastSet[i].hash != 0 && store->lastSet[i].key != key) {
+		i = (i + 1) & mask;
+	}
+	return &store->lastSet[i];
+}
+
+/**
+ * Records hash as the last digest stored for key, growing the set when over
+ * half full.
+ */
+static void storeSetLast(EXTRACT_STORE *store, uint64_t key, uint64_t hash, uint16_t wSequence) {
+	STORE_LAST *slot = storeFindLast(store, key);
+	if(slot->hash == 0) {
+		if((store->nLast+1)*2 > store->nLastSlots) {
+			STORE_LAST *oldSet = store->lastSet;
+			uint32_t oldSlots = store->nLastSlots, j;
+			store->nLastSlots *= 2;
+			store->lastSet = calloc(store->nLastSlots, sizeof(STORE_LAST));
+			for(j = 0; j < oldSlots; j++) {
+				if(oldSet[j].hash) *storeFindLast(store, oldSet[j].key) = oldSet[j];
+			}
+			free(oldSet);
+			slot = storeFindLast(store, key);
+		}
+		store->nLast++;
+	}
+	slot->key = key;
+	slot->hash = hash;
+	slot->wSequence = wSequence;
+}
+
+/**
+ * Key of a stream in the stream set. A named stream's file name is given as
+ * "file:stream", which is unambiguous as NTFS names cannot hold a ':'.
+ */
+static uint64_t storeStreamKey(uint32_t recordNumber, const char *fileName) {
+	const char *stream = fileName ? strrchr(fileName, ':') : NULL;
+	uint32_t streamHash = stream ? (uint32_t)xxh64(stream + 1, strlen(stream + 1), 0) | 1 : 0;
+	return (uint64_t)recordNumber << 32 | streamHash;
+}
+
+/**
+ * Creates dir if it does not already exist.
+ */
+static int storeMkdir(const char *dir) {
+	if(mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		int errsv = errno;
+		printf("Failed to create directory %s with error: %s.\n", dir, strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Prepares the store under rootDir, creating it if necessary, and loads the
+ * digests of blobs left by previous runs so they are not written again. With
+ * no rootDir the store keeps only digests and counts and writes nothing, for
+ * the fuzzer.
+ */
+int storeInit(EXTRACT_STORE *store, const char *rootDir) {
+
+	char path[FILENAME_MAX];
+	memset(store, 0, sizeof(EXTRACT_STORE));
+	store->nBlobSlots = STORE_SET_INIT;
+	store->blobSet = calloc(store->nBlobSlots, sizeof(uint64_t));
+	store->nLastSlots = STORE_SET_INIT;
+	store->lastSet = calloc(store->nLastSlots, sizeof(STORE_LAST));
+	pthread_mutex_init(&store->lock, NULL);
+	if(rootDir == NULL) {
+		return EXIT_SUCCESS;
+	}
+	store->rootDir = strdup(rootDir);
+
+	snprintf(path, sizeof(path), "%s%s", rootDir, STOREBLOBDIR);
+	if(storeMkdir(rootDir) == EXIT_FAILURE || storeMkdir(path) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+
+	DIR *blobDir = opendir(path);
+	if(blobDir) {
+		struct dirent *entry;
+		while((entry = readdir(blobDir)) != NULL) {
+			char *end = NULL;
+			uint64_t hash = strtoull(entry->d_name, &end, 16);
+			if(end && *end == '\0' && end - entry->d_name == 16) {
+				storeAddBlob(store, hash);
+			}
+		}
+		closedir(blobDir);
+	}
+
+	snprintf(path, sizeof(path), "%s%s", rootDir, STOREMANIFEST);
+	if((store->manifest = fopen(path, "a")) == NULL) {
+		int errsv = errno;
+		printf("Failed to open extraction manifest %s: %s.\n", path, strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Writes a blob atomically, via a temporary file renamed into place.
+ */
+static int storeWriteBlob(EXTRACT_STORE *store, uint64_t hash, const void *data, uint64_t len) {
+
+	char blobPath[FILENAME_MAX], tmpPath[FILENAME_MAX+8];
+	snprintf(blobPath, sizeof(blobPath), "%s%s%016" PRIx64, store->rootDir, STOREBLOBDIR, hash);
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", blobPath);
+
+	FILE *blob;
+	if((blob = fopen(tmpPath, "w")) == NULL) {
+		int errsv = errno;
+		printf("Failed to create blob %s: %s.\n", tmpPath, strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	if(len > 0 && fwrite(data, len, 1, blob) != 1) {
+		int errsv = errno;
+		printf("Failed to write blob %s: %s.\n", tmpPath, strerror(errsv));
+		fclose(blob);
+		unlink(tmpPath);
+		return EXIT_FAILURE;
+	}
+	if(fclose(blob) != 0 || rename(tmpPath, blobPath) != 0) {
+		int errsv = errno;
+		printf("Failed to commit blob %s: %s.\n", blobPath, strerror(errsv));
+		unlink(tmpPath);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Adds content to the store and the manifest. A live extraction is skipped if
+ * its stream's last content, of the same sequence number, was the same, and
+ * becomes that stream's last content.
+ */
+static int storeAdd(EXTRACT_STORE *store, bool live, uint32_t recordNumber, uint16_t wSequence,
+					int64_t n64LSN, const char *fileName, const void *data, uint64_t len) {
+
+	uint64_t hash = xxh64(data, len, 0);
+	if(hash == 0) hash = 1;	/*0 is reserved for 'never stored' */
+	uint64_t key = storeStreamKey(recordNumber, fileName);
+	int retVal;
+
+	pthread_mutex_lock(&store->lock);
+	STORE_LAST *last = storeFindLast(store, key);
+	if(live && last->hash == hash && last->wSequence == wSequence) {
+		store->countUnchanged++;
+		pthread_mutex_unlock(&store->lock);
+		return STORE_UNCHANGED;
+	}
+
+	if(storeHasBlob(store, hash)) {
+		retVal = STORE_NEWREF;
+		store->countNewRef++;
+	} else {
+		if(store->rootDir && storeWriteBlob(store, hash, data, len) == EXIT_FAILURE) {
+			pthread_mutex_unlock(&store->lock);
+			return -1;
+		}
+		storeAddBlob(store, hash);
+		retVal = STORE_NEWBLOB;
+		store->countNewBlob++;
+	}
+
+	/*time  record  sequence  LSN  digest  length  name */
+	if(store->manifest) {
+		fprintf(store->manifest, "%" PRId64 "\t%" PRIu32 "\t%u\t%" PRId64 "\t%016" PRIx64 "\t%" PRIu64 "\t%s\n",
+				(int64_t)time(NULL), recordNumber, wSequence, n64LSN, hash, len,
+				fileName ? fileName : "");
+		fflush(store->manifest);
+	}
+
+	if(live) {
+		storeSetLast(store, key, hash, wSequence);
+	}
+	pthread_mutex_unlock(&store->lock);
+	return retVal;
+}
+
+/**
+ * Stores len bytes of file content extracted from MFT record recordNumber, of
+ * its stream named in fileName if that is "file:stream". A record reused for
+ * another file has a new sequence number, so its first content is stored even
+ * if it matches the last file's.
+ *
+ * Returns STORE_UNCHANGED, STORE_NEWREF or STORE_NEWBLOB, or -1 on error.
+ */
+int storePut(EXTRACT_STORE *store, uint32_t recordNumber, uint16_t wSequence, int64_t n64LSN,
+			 const char *fileName, const void *data, uint64_t len) {
+	return storeAdd(store, true, recordNumber, wSequence, n64LSN, fileName, data, len);
+}
+
+/**
+ * Stores the content of a deleted file read back by recovery. It is always
+ * stored, and is not taken as the last content of the record, which a live
+ * file may reuse with the deleted one's sequence number.
+ *
+ * Returns STORE_NEWREF or STORE_NEWBLOB, or -1 on error.
+ */
+int storeRecovered(EXTRACT_STORE *store, uint32_t recordNumber, uint16_t wSequence, int64_t n64LSN,
+				   const char *fileName, const void *data, uint64_t len) {
+	return storeAdd(store, false, recordNumber, wSequence, n64LSN, fileName, data, len);
+}
+
+/**
+ * Closes the manifest and frees the store's tables.
+ */
+void storeClose(EXTRACT_STORE *store) {
+	if(store->manifest) fclose(store->manifest);
+	free(store->blobSet);
+	free(store->lastSet);
+	free(store->rootDir);
+	pthread_mutex_destroy(&store->lock);
+	memset(store, 0, sizeof(EXTRACT_STORE));
+}
+
+#endif /* EXTRACTSTORE_H_ */
@@ -12,62 +12,107 @@
 
 #include "UserInterface.h"
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <inttypes.h>
 
+#define FTIME_CREATED	0		/* Times of FILE_META, in the order NTFS keeps them */
+#define FTIME_MODIFIED	1
+#define FTIME_CHANGED	2		/* MFT record changed */
+#define FTIME_READ		3
+#define FTIME_FIELDS	4
+
+/* Times (NTFS, 100ns since 1601), flags and version of a file's MFT record */
+typedef struct _FILE_META {
+	int64_t siTime[FTIME_FIELDS];	/* From $STANDARD_INFORMATION, updated by Windows on use */
+	int64_t fnTime[FTIME_FIELDS];	/* From $FILE_NAME, updated on rename and move only */
+	int64_t lsn;					/* $LogFile sequence number of the record */
+	uint32_t flags;					/* $STANDARD_INFORMATION file permissions, e.g. HIDDEN */
+	uint16_t sequence;				/* Record reuse count */
+} FILE_META;
+
 /* Represents the information necessary to link file writes with file names on disk */
 typedef struct _File {
 	char *fileName;			/* File name defined in $FILE_NAME */
+	char *streamName;		/* Named $DATA stream this entry is for, NULL for the file's own data */
 	int64_t sec_offset;		/* Offset in sectors to the file record */
 	int64_t cl_offset;		/* Offset to the cluster which contains this record(amongst others) */
 	uint32_t length;		/* Length of the file in bytes */
 	uint32_t recordNumber;	/* MFT record number from which this originates */
+	uint32_t parentRecord;	/* MFT record number of the directory named in $FILE_NAME */
+	FILE_META meta;
 	struct _File *p_next;	/* Pointer to next file record */
 } File;
 
+/* One term of a batch lookup and the files it matched */
+typedef struct _FILE_QUERY {
+	const char *term;		/* As given, not copied */
+	int64_t value;			/* Record number or offset, if valid */
+	bool valid;				/* Numeric terms which did not parse never match */
+	File *found;			/* Copies of the matching files, free with freeFilesList */
+	uint32_t nFound;
+} FILE_QUERY;
+
 /*
- * Adds a new file to the start of the list and returns it.
+ * Adds a new file to the start of the list and returns it. meta may be NULL.
  */
 File* addFile(File *p_head, char *fileName,
 		 	  int64_t sec_offs, int64_t cl_offs,
-			  uint32_t length, uint32_t recordNumber) {
+			  uint32_t length, uint32_t recordNumber, uint32_t parentRecord,
+			  const FILE_META *meta) {
 
 	File *p_new_run = malloc( sizeof(File) );
 
 	p_new_run->p_next = p_head;		/*This item is now the head. */
 	p_new_run->fileName = fileName;
+	p_new_run->streamName = NULL;
 	p_new_run->sec_offset = sec_offs;
 	p_new_run->cl_offset = cl_offs;
 	p_new_run->length = length;
 	p_new_run->recordNumber = recordNumber;
+	p_new_run->parentRecord = parentRecord;
+	if(meta) {
+		p_new_run->meta = *meta;
+	} else {
+		memset(&p_new_run->meta, 0, sizeof(FILE_META));
+	}
 
 	return p_new_run;	/*Return the new head of the list */
 }
 
 /**
- * Adds a copy of an existing file (source) to the head of the list at *dest
+ * Adds a copy of an existing file (source) to the head of the list at *dest.
+ * The name is copied too, so either list may be freed on its own.
  *
  * Returns the new pointer to the head of the list (dest)
  */
 File* addFileCopy(File *source, File *dest) {
-	return addFile(dest, source->fileName,
+	dest = addFile(dest, source->fileName ? strdup(source->fileName) : NULL,
 						 source->sec_offset,
 						 source->cl_offset ,
 						 source->length,
-						 source->recordNumber);
+						 source->recordNumber,
+						 source->parentRecord,
+						 &source->meta);
+	dest->streamName = source->streamName ? strdup(source->streamName) : NULL;
+	return dest;
 }
 
 /**
- * Prints the members of the file record to stdout.
+ * Prints the members of the file record to out.
  */
-void printFile(File *fileP) {
+void printFile(FILE *out, File *fileP) {
 	if(fileP != NULL && fileP->fileName != NULL) {
-		printf("%8d | %12" PRId64 " | %12" PRId64 " | %10" PRIu32 " | %s\n",
+		fprintf(out, "%8d | %12" PRId64 " | %12" PRId64 " | %10" PRIu32 " | %s%s%s\n",
 														fileP->recordNumber,
 														  fileP->sec_offset,
 														   fileP->cl_offset,
 															  fileP->length,
-														   fileP->fileName);
+														   fileP->fileName,
+										   fileP->streamName ? ":" : "",
+							fileP->streamName ? fileP->streamName : "");
 	}
 }
 
@@ -76,28 +121,29 @@ void printFile(File *fileP) {
  *
  * Returns the number of named files in the list.
  */
-uint32_t printAllFiles(File *p_head) {
+uint32_t printAllFiles(FILE *out, File *p_head) {
 
 	uint32_t countFiles = 0;
 	File *p_current_item = p_head;
 	while (p_current_item) {    // Loop while the current pointer is not NULL.
 		if (p_current_item->fileName != NULL) {
-			printFile(p_current_item);
+			printFile(out, p_current_item);
 			countFiles++;
 		}
 		// Advance the current pointer to the next item in the list.
 		p_current_item = p_current_item->p_next;
 	}
-	printf("%" PRIu32 " files on record.\n", countFiles);
+	fprintf(out, "%" PRIu32 " files on record.\n", countFiles);
 	return countFiles;
 }
 
 /**
- * Search for the specified parameter, in the specified list
+ * Search for the specified parameter, in the specified list, printing the
+ * matches to out.
  *
- * Returns the number of hits.
+ * Returns a copy of the matching files.
  */
-File *searchFiles(File *p_head, uint8_t srchType, char * searchTerm) {
+File *searchFiles(FILE *out, File *p_head, uint8_t srchType, char * searchTerm) {
 
 	int64_t d64SearchTerm = strtoull(searchTerm, NULL, 10);
 	File *foundFiles = NULL;
@@ -109,33 +155,33 @@ File *searchFiles(File *p_head, uint8_t srchType, char * searchTerm) {
 			if(SRCH_NUM == srchType) { /*Search for the record number given in searchTerm */
 				if( p_current_item->recordNumber == d64SearchTerm ) {
 					if(d64SearchTerm != 0) {
-						printFile(p_current_item);
+						printFile(out, p_current_item);
 						foundFiles = addFileCopy(p_current_item, foundFiles);
 					} else {
-						printf("Please enter a valid search query.\n");
+						fprintf(out, "Please enter a valid search query.\n");
 					}
 				}
 			} else if (SRCH_OFFS == srchType) {
 				if( p_current_item->sec_offset == d64SearchTerm ) { /*use cluster offset not sector */
 				if(d64SearchTerm != 0) {
-					printFile(p_current_item);
+					printFile(out, p_current_item);
 					foundFiles = addFileCopy(p_current_item, foundFiles);
 				} else {
-					printf("Please enter a valid search query.\n");
+					fprintf(out, "Please enter a valid search query.\n");
 				}
 			}
 			} else if (SRCH_CROFFS == srchType) { /*Search for records using disk offset to content */
 				if( p_current_item->cl_offset == d64SearchTerm ) { /*use cluster offset not sector */
 					if(d64SearchTerm != 0) {
-						printFile(p_current_item);
+						printFile(out, p_current_item);
 						foundFiles = addFileCopy(p_current_item, foundFiles);
 					} else {
-						printf("Please enter a valid search query.\n");
+						fprintf(out, "Please enter a valid search query.\n");
 					}
 				}
 			} else if (SRCH_NAME == srchType) { /*Search for records using file name */
 				if( strcmp(searchTerm, p_current_item->fileName) == 0 ) {
-					printFile(p_current_item);
+					printFile(out, p_current_item);
 					foundFiles = addFileCopy(p_current_item, foundFiles);
 				}
 			}
@@ -147,6 +193,73 @@ File *searchFiles(File *p_head, uint8_t srchType, char * searchTerm) {
 	return foundFiles;
 }
 
+/**
+ * Prepares a batch lookup term for searchFilesBatch, or nameIndexBatch if srchType
+ * is SRCH_NAME.
+ */
+void fileQueryInit(FILE_QUERY *query, uint8_t srchType, const char *term) {
+	char *end = NULL;
+	query->term = term;
+	query->found = NULL;
+	query->nFound = 0;
+	errno = 0;
+	query->value = strtoll(term, &end, 0);
+	query->valid = srchType == SRCH_NAME || (errno == 0 && end != term && *end == '\0');
+}
+
+/* Orders batch terms by the key they are looked up with */
+static int fileQueryCmpValue(const void *a, const void *b) {
+	int64_t va = (*(FILE_QUERY * const *)a)->value, vb = (*(FILE_QUERY * const *)b)->value;
+	return (va > vb) - (va < vb);
+}
+
+/**
+ * Looks up many record numbers or offsets (srchType) in one pass over the list. The terms are sorted once and each file is binary searched among them,
+ * so a batch costs about one scan rather than one scan per term. Each query
+ * collects copies of its matches, the same as searchFiles returns. Names are
+ * looked up in the name index instead, by nameIndexBatch.
+ *
+ * Returns the number of queries that matched at least one file.
+ */
+uint32_t searchFilesBatch(File *p_head, uint8_t srchType, FILE_QUERY *queries, uint32_t nQueries) {
+
+	FILE_QUERY **sorted = malloc( (nQueries + 1)*sizeof(FILE_QUERY *) );
+	uint32_t i, nSorted = 0, nMatched = 0;
+
+	for(i = 0; i < nQueries; i++) {
+		if(queries[i].valid) sorted[nSorted++] = &queries[i];
+	}
+	qsort(sorted, nSorted, sizeof(FILE_QUERY *), fileQueryCmpValue);
+
+	File *p_current_item;
+	for(p_current_item = p_head; p_current_item && nSorted; p_current_item = p_current_item->p_next) {
+		if(p_current_item->fileName == NULL) continue;
+		int64_t key = srchType == SRCH_NUM ? p_current_item->recordNumber :
+					  srchType == SRCH_OFFS ? p_current_item->sec_offset : p_current_item->cl_offset;
+
+		/* First term not below this file's key */
+		uint32_t lo = 0, hi = nSorted, mid;
+		while(lo < hi) {
+			mid = lo + (hi - lo)/2;
+			if(sorted[mid]->value < key) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		for(; lo < nSorted && sorted[lo]->value == key; lo++) {
+			sorted[lo]->found = addFileCopy(p_current_item, sorted[lo]->found);
+			sorted[lo]->nFound++;
+		}
+	}
+
+	for(i = 0; i < nQueries; i++) {
+		if(queries[i].nFound) nMatched++;
+	}
+	free(sorted);
+	return nMatched;
+}
+
 /* Not working yet - why not?*/
 int freeFilesList(File *p_head)	{
 
@@ -158,6 +271,7 @@ int freeFilesList(File *p_head)	{
 	    if (p_current_item->fileName != NULL) {		   /*Free fileName */
 	    	free(p_current_item->fileName);
 	    }
+	    free(p_current_item->streamName);
 
 	    free(p_current_item);		//	Free data run structure
 	    p_current_item = p_next;	// Move to the next item
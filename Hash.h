@@ -0,0 +1,109 @@
+/*
+ * Hash.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * 64-bit xxHash (XXH64), used to key extracted content and to fingerprint
+ * MFT record state cheaply. Matches the reference implementation's output.
+ */
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "NTFSStruct.h"
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+static inline uint64_t xxhRotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxhRead64(const BYTE *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));	/*Unaligned little-endian read */
+	return v;
+}
+
+static inline uint32_t xxhRead32(const BYTE *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+	acc += input * XXH_PRIME64_2;
+	acc  = xxhRotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMergeRound(uint64_t acc, uint64_t val) {
+	acc ^= xxhRound(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * Returns the XXH64 digest of len bytes at data.
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+
+	const BYTE *p = (const BYTE *)data;
+	const BYTE *end = p + len;
+	uint64_t h64;
+
+	if(len >= 32) {	/*Consume 32 byte stripes using four accumulators */
+		const BYTE *limit = end - 32;
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+		do {
+			v1 = xxhRound(v1, xxhRead64(p)); p += 8;
+			v2 = xxhRound(v2, xxhRead64(p)); p += 8;
+			v3 = xxhRound(v3, xxhRead64(p)); p += 8;
+			v4 = xxhRound(v4, xxhRead64(p)); p += 8;
+		} while(p <= limit);
+
+		h64 = xxhRotl64(v1, 1) + xxhRotl64(v2, 7) + xxhRotl64(v3, 12) + xxhRotl64(v4, 18);
+		h64 = xxhMergeRound(h64, v1);
+		h64 = xxhMergeRound(h64, v2);
+		h64 = xxhMergeRound(h64, v3);
+		h64 = xxhMergeRound(h64, v4);
+	} else {
+		h64 = seed + XXH_PRIME64_5;
+	}
+
+	h64 += (uint64_t)len;
+
+	while(p + 8 <= end) {
+		h64 ^= xxhRound(0, xxhRead64(p));
+		h64  = xxhRotl64(h64, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+	if(p + 4 <= end) {
+		h64 ^= (uint64_t)xxhRead32(p) * XXH_PRIME64_1;
+		h64  = xxhRotl64(h64, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	while(p < end) {
+		h64 ^= (*p) * XXH_PRIME64_5;
+		h64  = xxhRotl64(h64, 11) * XXH_PRIME64_1;
+		p++;
+	}
+
+	/*Final avalanche */
+	h64 ^= h64 >> 33;
+	h64 *= XXH_PRIME64_2;
+	h64 ^= h64 >> 29;
+	h64 *= XXH_PRIME64_3;
+	h64 ^= h64 >> 32;
+	return h64;
+}
+
+#endif /* HASH_H_ */
@@ -0,0 +1,154 @@
+/*
+ * LinkTable.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Every (parent directory, name) link of the records in use, kept from the
+ * offline pass. A record has one link per $FILE_NAME outside the DOS namespace;
+ * a file with hard links, such as almost every file in WinSxS, has several, and
+ * the header's wHardLinks counts them. The DOS 8.3 names are not links of their
+ * own, only short forms of a Win32 name, and are not kept.
+ *
+ * Links are held in record number order, as the $MFT is read, so the links of a
+ * record are found with a binary search, and once sorted also in order of their
+ * parent, so the entries of a directory are a run found the same way. Names are
+ * packed into one arena rather than allocated one by one.
+ */
+#ifndef LINKTABLE_H_
+#define LINKTABLE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LINK_NONE		UINT32_MAX		/*No link, or no record */
+
+typedef struct _HARD_LINK {
+	uint32_t	record;
+	uint32_t	parent;			/*Directory the link is in */
+	uint32_t	nameOffs;		/*Name in the table's arena */
+} HARD_LINK;
+
+typedef struct _LINK_TABLE {
+	HARD_LINK	*links;			/*In record number order */
+	uint32_t	count;
+	uint32_t	size;			/*Entries allocated */
+	uint32_t	*byParent;		/*Link ids in parent then name order, once sorted */
+	char		*arena;
+	size_t		arenaLen;
+	size_t		arenaMax;
+	uint32_t	nLinked;		/*Records with more than one link */
+} LINK_TABLE;
+
+int      linkTableAdd(LINK_TABLE *table, uint32_t record, uint32_t parent, const char *name);
+int      linkTableSort(LINK_TABLE *table);
+uint32_t linkRecordLinks(LINK_TABLE *table, uint32_t record, HARD_LINK **first);
+uint32_t linkChildren(LINK_TABLE *table, uint32_t parent, uint32_t **first);
+void     linkTableFree(LINK_TABLE *table);
+
+static inline const char *linkName(LINK_TABLE *table, const HARD_LINK *link) {
+	return table->arena + link->nameOffs;
+}
+
+/**
+ * Adds a link of record, copying name. Records must be added in ascending order,
+ * all the links of one record together.
+ */
+int linkTableAdd(LINK_TABLE *table, uint32_t record, uint32_t parent, const char *name) {
+	size_t len = strlen(name);
+	if(table->count == table->size) {
+		uint32_t newSize = table->size ? table->size*2 : 1024;
+		HARD_LINK *links = realloc(table->links, newSize*sizeof(HARD_LINK));
+		if(links == NULL) return EXIT_FAILURE;
+		table->links = links;
+		table->size = newSize;
+	}
+	if(table->arenaLen + len + 1 > table->arenaMax) {
+		size_t newMax = table->arenaMax ? table->arenaMax : 1 << 16;
+		while(table->arenaLen + len + 1 > newMax) newMax *= 2;
+		char *arena = realloc(table->arena, newMax);
+		if(arena == NULL) return EXIT_FAILURE;
+		table->arena = arena;
+		table->arenaMax = newMax;
+	}
+	memcpy(table->arena + table->arenaLen, name, len + 1);
+	if(table->count && table->links[table->count - 1].record == record &&
+	   (table->count == 1 || table->links[table->count - 2].record != record)) {
+		table->nLinked++;	/*Its second link */
+	}
+	table->links[table->count].record = record;
+	table->links[table->count].parent = parent;
+	table->links[table->count++].nameOffs = (uint32_t)table->arenaLen;
+	table->arenaLen += len + 1;
+	return EXIT_SUCCESS;
+}
+
+static LINK_TABLE *sortTable;		/*qsort has no context argument */
+
+static int linkParentCmp(const void *a, const void *b) {
+	const HARD_LINK *la = &sortTable->links[*(const uint32_t *)a], *lb = &sortTable->links[*(const uint32_t *)b];
+	if(la->parent != lb->parent) return la->parent < lb->parent ? -1 : 1;
+	return strcmp(linkName(sortTable, la), linkName(sortTable, lb));
+}
+
+/**
+ * Orders the links by parent, once they have all been added.
+ */
+int linkTableSort(LINK_TABLE *table) {
+	uint32_t i;
+	free(table->byParent);
+	if((table->byParent = malloc( (table->count + 1)*sizeof(uint32_t) )) == NULL) {
+		return EXIT_FAILURE;
+	}
+	for(i = 0; i < table->count; i++) {
+		table->byParent[i] = i;
+	}
+	sortTable = table;
+	qsort(table->byParent, table->count, sizeof(uint32_t), linkParentCmp);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Finds the links of record. *first is set to the first of them, the rest
+ * follow it.
+ *
+ * Returns the number of links, 0 if the record has none.
+ */
+uint32_t linkRecordLinks(LINK_TABLE *table, uint32_t record, HARD_LINK **first) {
+	uint32_t lo = 0, hi = table->count, end;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo)/2;
+		if(table->links[mid].record < record) lo = mid + 1; else hi = mid;
+	}
+	for(end = lo; end < table->count && table->links[end].record == record; end++);
+	*first = table->links + lo;
+	return end - lo;
+}
+
+/**
+ * Finds the links in directory parent, in name order. *first is set to the id
+ * of the first of them, the rest follow it.
+ *
+ * Returns the number of links in the directory.
+ */
+uint32_t linkChildren(LINK_TABLE *table, uint32_t parent, uint32_t **first) {
+	uint32_t lo = 0, hi = table->count, end;
+	*first = table->byParent;
+	if(table->byParent == NULL) return 0;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo)/2;
+		if(table->links[table->byParent[mid]].parent < parent) lo = mid + 1; else hi = mid;
+	}
+	for(end = lo; end < table->count && table->links[table->byParent[end]].parent == parent; end++);
+	*first = table->byParent + lo;
+	return end - lo;
+}
+
+void linkTableFree(LINK_TABLE *table) {
+	free(table->links);
+	free(table->byParent);
+	free(table->arena);
+	memset(table, 0, sizeof(LINK_TABLE));
+}
+
+#endif /* LINKTABLE_H_ */
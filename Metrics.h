@@ -0,0 +1,274 @@
+/*
+ * Metrics.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Counters and latency histograms for the extraction pipeline.
+ *
+ * Every thread that records a metric claims its own cache line aligned shard on
+ * first use, so updates are plain relaxed stores with no lock or shared cache
+ * line. A scrape sums the shards. Latencies are kept in log2 nanosecond buckets.
+ *
+ * Connecting to METRICS_SOCKET_NAME returns the current values in the
+ * Prometheus text format and closes the connection, e.g.
+ *   socat - ABSTRACT-CONNECT:diskTapMetrics
+ */
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "UDSProtocol.h"
+
+#define METRICS_SOCKET_NAME	"\0diskTapMetrics"	/*Abstract socket the metrics are served on */
+#define METRICS_MAX_SHARDS	16			/*Threads that may record metrics */
+#define METRICS_MAX_GAUGES	8
+#define METRICS_BUCKETS		64			/*log2 of latency in ns */
+#define METRICS_OUT_MIN		10			/*Buckets reported from 1us ... */
+#define METRICS_OUT_MAX		36			/*... to 68s */
+
+/* Counters */
+typedef enum _METRIC_COUNTER {
+	MET_WRITES_RECEIVED,		/*Write notifications from producers */
+	MET_WRITES_HELD,			/*Writes taken into the coalescing window */
+	MET_WRITES_COALESCED,		/*Ranges released to the consumer */
+	MET_DEV_BYTES_READ,			/*Bytes read from the block device */
+	MET_PAYLOAD_BYTES,			/*Bytes passed through by producers instead */
+	MET_RECORDS_PARSED,			/*MFT records walked */
+	MET_RECORDS_SKIPPED,		/*MFT records skipped by the record cache */
+	MET_FILES_EXTRACTED,		/*Files stored with new content */
+	MET_USN_RECORDS,			/*New change journal records read */
+	MET_USN_REREADS,			/*MFT records re-read for them */
+	MET_WRITES_UNALLOCATED,		/*Writes to free clusters dropped */
+	MET_FILES_RECOVERED,		/*Deleted files read back */
+	MET_COUNTERS
+} METRIC_COUNTER;
+
+/* Pipeline stages timed */
+typedef enum _METRIC_STAGE {
+	MET_STAGE_RECEIVE,			/*Socket or ring to queue */
+	MET_STAGE_COALESCE,			/*Queue to coalescing window */
+	MET_STAGE_READ,				/*Device read of a write */
+	MET_STAGE_PARSE,			/*MFT record walk of a write */
+	MET_STAGE_WRITE,			/*Store of an extracted file */
+	MET_STAGES
+} METRIC_STAGE;
+
+typedef struct _METRICS_HIST {
+	uint64_t	buckets[METRICS_BUCKETS];
+	uint64_t	sumNs;
+	uint64_t	count;
+} METRICS_HIST;
+
+typedef struct _METRICS_SHARD {
+	uint64_t		counters[MET_COUNTERS];
+	METRICS_HIST	stages[MET_STAGES];
+} __attribute__((aligned(64))) METRICS_SHARD;
+
+typedef struct _METRICS_GAUGE {
+	const char	*name;
+	const char	*help;
+	uint64_t	(*read)(void);		/*Sampled at scrape time */
+} METRICS_GAUGE;
+
+static const char *metricCounterNames[MET_COUNTERS][2] = {
+	{ "ntfs_writes_received_total",	"Write notifications received from producers" },
+	{ "ntfs_writes_held_total",		"Writes taken into the coalescing window, over ranges released the coalescing ratio" },
+	{ "ntfs_writes_coalesced_total","Coalesced ranges released to the consumer" },
+	{ "ntfs_device_read_bytes_total","Bytes read from the block device" },
+	{ "ntfs_payload_bytes_total",	"Bytes passed through by producers" },
+	{ "ntfs_records_parsed_total",	"MFT records parsed" },
+	{ "ntfs_records_skipped_total",	"MFT records skipped as unchanged" },
+	{ "ntfs_files_extracted_total",	"Files extracted with new content" },
+	{ "ntfs_usn_records_total",		"Change journal records read" },
+	{ "ntfs_usn_rereads_total",		"MFT records re-read for change journal records" },
+	{ "ntfs_writes_unallocated_total","Writes to free clusters dropped" },
+	{ "ntfs_files_recovered_total",	"Deleted files recovered" }
+};
+
+static const char *metricStageNames[MET_STAGES] = {
+	"receive", "coalesce", "read", "parse", "write"
+};
+
+METRICS_SHARD metricsShards[METRICS_MAX_SHARDS];
+uint32_t metricsNShards = 0;
+METRICS_GAUGE metricsGauges[METRICS_MAX_GAUGES];
+uint32_t metricsNGauges = 0;
+static __thread METRICS_SHARD *metricsShard = NULL;
+static __thread bool metricsShared = false;		/*metricsShard is the last, shared by the threads past the rest */
+
+char *metrics_socket_path = METRICS_SOCKET_NAME;
+
+void metricsAdd(METRIC_COUNTER counter, uint64_t n);
+void metricsTime(METRIC_STAGE stage, uint64_t elapsedNs);
+uint64_t monotonicNs(void);
+void metricsGauge(const char *name, const char *help, uint64_t (*read)(void));
+void metricsWrite(FILE *out);
+void *metricsServerThreadFn(void *socket_path);
+
+/**
+ * Returns the calling thread's shard, claiming one on first use. Threads beyond
+ * METRICS_MAX_SHARDS - 1 share the last shard, which is added to atomically.
+ */
+static METRICS_SHARD *metricsLocal(void) {
+	if(metricsShard == NULL) {
+		uint32_t n = __atomic_fetch_add(&metricsNShards, 1, __ATOMIC_RELAXED);
+		metricsShared = n >= METRICS_MAX_SHARDS-1;
+		metricsShard = &metricsShards[metricsShared ? METRICS_MAX_SHARDS-1 : n];
+	}
+	return metricsShard;
+}
+
+/* A single writer per shard but the last, so a relaxed load and store is enough */
+static inline void metricsBump(uint64_t *val, uint64_t n) {
+	if(metricsShared) {
+		__atomic_fetch_add(val, n, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(val, __atomic_load_n(val, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+	}
+}
+
+void metricsAdd(METRIC_COUNTER counter, uint64_t n) {
+	metricsBump(&metricsLocal()->counters[counter], n);
+}
+
+void metricsTime(METRIC_STAGE stage, uint64_t elapsedNs) {
+	METRICS_HIST *hist = &metricsLocal()->stages[stage];
+	int bucket = elapsedNs ? 64 - __builtin_clzll(elapsedNs) : 0;	/*elapsedNs < 2^bucket */
+	metricsBump(&hist->buckets[bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS-1], 1);
+	metricsBump(&hist->sumNs, elapsedNs);
+	metricsBump(&hist->count, 1);
+}
+
+/**
+ * Returns the monotonic clock in nanoseconds.
+ */
+uint64_t monotonicNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Registers a value sampled at scrape time, e.g. the queue depth.
+ */
+void metricsGauge(const char *name, const char *help, uint64_t (*read)(void)) {
+	if(metricsNGauges < METRICS_MAX_GAUGES) {
+		metricsGauges[metricsNGauges].name = name;
+		metricsGauges[metricsNGauges].help = help;
+		metricsGauges[metricsNGauges].read = read;
+		metricsNGauges++;
+	}
+}
+
+/**
+ * Writes the sum of all shards in the Prometheus text format.
+ */
+void metricsWrite(FILE *out) {
+	uint32_t nShards = __atomic_load_n(&metricsNShards, __ATOMIC_RELAXED);
+	uint32_t i, s, b;
+	if(nShards > METRICS_MAX_SHARDS) nShards = METRICS_MAX_SHARDS;
+
+	for(i = 0; i < MET_COUNTERS; i++) {
+		uint64_t total = 0;
+		for(s = 0; s < nShards; s++) {
+			total += __atomic_load_n(&metricsShards[s].counters[i], __ATOMIC_RELAXED);
+		}
+		fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+				metricCounterNames[i][0], metricCounterNames[i][1],
+				metricCounterNames[i][0], metricCounterNames[i][0], total);
+	}
+	for(i = 0; i < metricsNGauges; i++) {
+		fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %" PRIu64 "\n",
+				metricsGauges[i].name, metricsGauges[i].help,
+				metricsGauges[i].name, metricsGauges[i].name, metricsGauges[i].read());
+	}
+
+	fprintf(out, "# HELP ntfs_stage_seconds Time spent in each pipeline stage\n"
+				 "# TYPE ntfs_stage_seconds histogram\n");
+	for(i = 0; i < MET_STAGES; i++) {
+		METRICS_HIST total;
+		memset(&total, 0, sizeof(total));
+		for(s = 0; s < nShards; s++) {
+			METRICS_HIST *hist = &metricsShards[s].stages[i];
+			for(b = 0; b < METRICS_BUCKETS; b++) {
+				total.buckets[b] += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+			}
+			total.sumNs += __atomic_load_n(&hist->sumNs, __ATOMIC_RELAXED);
+			total.count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+		}
+		uint64_t cumulative = 0;
+		for(b = 0; b <= METRICS_OUT_MAX; b++) {
+			cumulative += total.buckets[b];
+			if(b >= METRICS_OUT_MIN) {
+				fprintf(out, "ntfs_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %" PRIu64 "\n",
+						metricStageNames[i], (double)(1ULL << b)/1e9, cumulative);
+			}
+		}
+		fprintf(out, "ntfs_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+					 "ntfs_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+					 "ntfs_stage_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+				metricStageNames[i], total.count,
+				metricStageNames[i], (double)total.sumNs/1e9,
+				metricStageNames[i], total.count);
+	}
+}
+
+/**
+ * Metrics endpoint worker thread, answers each connection with one scrape.
+ */
+void *metricsServerThreadFn(void *socket_path) {
+
+	struct sockaddr_un addr;
+	socklen_t addrLen = udsAddress(&addr, (char *)socket_path);
+	int listenFD, clientFD;
+
+	if((listenFD = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("metrics socket error");
+		pthread_exit(NULL);
+	}
+	if(addr.sun_path[0] != '\0') {
+		unlink((char *)socket_path);
+	}
+
+	if(bind(listenFD, (struct sockaddr*)&addr, addrLen) == -1) {
+		perror("metrics bind error");
+		close(listenFD);
+		pthread_exit(NULL);
+	}
+	if(listen(listenFD, 4) == -1) {
+		perror("metrics listen error");
+		close(listenFD);
+		pthread_exit(NULL);
+	}
+
+	while(true) {
+		if((clientFD = accept(listenFD, NULL, NULL)) == -1) {
+			if(errno == EINTR) continue;
+			perror("metrics accept error");
+			break;
+		}
+		FILE *out = fdopen(clientFD, "w");
+		if(out) {
+			metricsWrite(out);
+			fclose(out);
+		} else {
+			close(clientFD);
+		}
+	}
+	close(listenFD);
+	pthread_exit(0);
+}
+
+#endif /* METRICS_H_ */
@@ -1,8 +1,9 @@
 /* Christopher Hicks */
-#ifndef NTFSATT2H_
+#ifndef NTFSATTRH_
 #define NTFSATTRH_
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <time.h>
 #include <iconv.h>
@@ -28,7 +29,7 @@
 
 /*Linux and NTFS time constants */
 #define TIME_NTFSPERLINUX 10000000 			  /*NTFS uses 100ns intervals, Linux uses 1s intervals */
-#define TIME_NTFSTOLINUXOFFSET 1.16444916e+17 /*Number of 100ns intervals between 01/01/1601 and 01/01/1970 */
+#define TIME_NTFSTOLINUXOFFSET 116444736000000000LL /*Number of 100ns intervals between 01/01/1601 and 01/01/1970 */
 
 /*File permissions */
 #define RDONLY		0x0001
@@ -45,6 +46,12 @@
 #define	NOTINDEXED 	0x2000
 #define ENCRYPTED	0X4000
 
+/*$FILE_NAME namespaces */
+#define FILE_NAME_POSIX		0
+#define FILE_NAME_WIN32		1
+#define FILE_NAME_DOS		2		/*8.3 short form of a Win32 name, not a link of its own */
+#define FILE_NAME_WIN32_DOS	3		/*Win32 name which is also a valid 8.3 name */
+
 #pragma pack(push, 1) /*Pack structures to a one byte alignment */
 
 	typedef struct _STD_INFORMATION {
@@ -86,7 +93,68 @@
 
 uint32_t getFilePermissions(STD_INFORMATION *stdInfo);
 char *getFileName(NTFS_ATTRIBUTE *mftRecAttr, char *mftBuffer, uint16_t offs );
+BYTE getFileNameSpace(NTFS_ATTRIBUTE *mftRecAttr, char *mftBuffer, uint16_t offs);
+char *getAttrName(NTFS_ATTRIBUTE *attr, const char *attrBase);
 uint64_t linuxTimetoNTFStime();
+size_t utf16ToUtf8(char *out, const uint16_t *in, size_t len);
+
+/**
+ * Returns an NTFS time as microseconds since 01/01/1970.
+ */
+static inline int64_t ntfsTimeToUnixUs(int64_t ntfsTime) {
+	int64_t ticks = ntfsTime - TIME_NTFSTOLINUXOFFSET;
+	return ticks/10 - (ticks % 10 < 0);		/*Rounded down */
+}
+
+/**
+ * Writes code point cp as UTF-8 to out, which has room for 4 bytes.
+ *
+ * Returns the number of bytes written.
+ */
+static inline size_t utf8Encode(char *out, uint32_t cp) {
+	if(cp < 0x80) {
+		out[0] = (char)cp;
+		return 1;
+	} else if(cp < 0x800) {
+		out[0] = (char)(0xC0 | (cp >> 6));
+		out[1] = (char)(0x80 | (cp & 0x3F));
+		return 2;
+	} else if(cp < 0x10000) {
+		out[0] = (char)(0xE0 | (cp >> 12));
+		out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		out[2] = (char)(0x80 | (cp & 0x3F));
+		return 3;
+	}
+	out[0] = (char)(0xF0 | (cp >> 18));
+	out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+	out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+	out[3] = (char)(0x80 | (cp & 0x3F));
+	return 4;
+}
+
+/**
+ * Converts len UTF-16 units at in to NUL terminated UTF-8 in out, which has
+ * room for 3*len+1 bytes. Surrogate pairs are joined, control characters are
+ * dropped.
+ *
+ * Returns the length of the UTF-8 string.
+ */
+size_t utf16ToUtf8(char *out, const uint16_t *in, size_t len) {
+	size_t k, outLen = 0;
+	for(k = 0; k < len; k++) {
+		uint32_t cp = in[k];
+		if(cp >= 0xD800 && cp < 0xDC00 && k+1 < len &&
+		   in[k+1] >= 0xDC00 && in[k+1] < 0xE000) {
+			cp = 0x10000 + ((cp - 0xD800) << 10) + (in[k+1] - 0xDC00);
+			k++;
+		}
+		if(cp >= 0x20) {
+			outLen += utf8Encode(out + outLen, cp);
+		}
+	}
+	out[outLen] = '\0';
+	return outLen;
+}
 
 /**
 *	Returns the file permissions member for a given $STANDARD_INFORMATION attribute.
@@ -97,55 +165,70 @@ uint32_t getFilePermissions(STD_INFORMATION *stdInfo) {
 
 /**
  * 	Given an NTFS_ATTRIBUTE of type FILE_NAME (0x30)
- * 	and the mftBuffer record (1024 bytes)
+ * 	and the mftBuffer record
  * 	and the offs into the record which the attribute is located at.
  *
- * 	returns the fileName in 8-bit character width.
+ * 	returns the fileName in UTF-8. Surrogate pairs are joined, control characters
+ * 	are dropped. A name longer than the attribute is cut short, and an attribute
+ * 	too short to hold one has no name: NULL is returned.
  *
  * 	WARNING: Memory is allocated for utf8FileName, need to free the returned pointer.
  */
 char *getFileName(NTFS_ATTRIBUTE *mftRecAttr, char *mftBuffer, uint16_t offs ) {
 
 	char *utf8fileName = NULL;
-	if(!mftRecAttr->dwType == FILE_NAME) { /*Make sure this is a FILE_NAME attribute */
+	uint32_t attrLen = (mftRecAttr->Attr).Resident.dwLength;
+	if(mftRecAttr->dwType != FILE_NAME || mftRecAttr->uchNonResFlag ||
+	   attrLen < offsetof(FILE_NAME_ATTR, arrUnicodeFileName)) { /*Make sure this is a FILE_NAME attribute */
 		return NULL;
 	}
 
-	FILE_NAME_ATTR *fileNameAttr = malloc( mftRecAttr->Attr.Resident.dwLength );
-	memcpy(fileNameAttr, mftBuffer+offs+(mftRecAttr->Attr).Resident.wAttrOffset,
-										(mftRecAttr->Attr).Resident.dwLength);
+	FILE_NAME_ATTR *fileNameAttr = (FILE_NAME_ATTR *)(mftBuffer+offs+(mftRecAttr->Attr).Resident.wAttrOffset);
+	uint16_t unicodeFileName[255];
+	size_t unicodeLen = fileNameAttr->bFileNameLength;
+	if(unicodeLen > (attrLen - offsetof(FILE_NAME_ATTR, arrUnicodeFileName))/2) {	/*Never past the attribute */
+		unicodeLen = (attrLen - offsetof(FILE_NAME_ATTR, arrUnicodeFileName))/2;
+	}
+	memcpy(unicodeFileName, (char *)fileNameAttr + offsetof(FILE_NAME_ATTR, arrUnicodeFileName), 2*unicodeLen);
 
-	char *unicodeFileName = (char*)&fileNameAttr->arrUnicodeFileName;
+	utf8fileName = malloc(3*unicodeLen+1);	/*At most 3 bytes per UTF-16 unit */
+	utf16ToUtf8(utf8fileName, unicodeFileName, unicodeLen);
 
-	utf8fileName = malloc(fileNameAttr->bFileNameLength+1);
-	*utf8fileName = '\0';
+	LOG_TRACE("FILE_NAME attribute: File name length: %u\tNamespace: %u\tFile name: %s",
+			  fileNameAttr->bFileNameLength, fileNameAttr->bFilenameNamespace, utf8fileName);
 
-	size_t unicodeLen = 2*fileNameAttr->bFileNameLength;
+	return utf8fileName;
+}
 
-	int  k;
-	/* Convert UNICODE filename to UTF8 filename */
-	for(k = 0; k<unicodeLen; k++) {
-		if (unicodeFileName[k]<0x80 && unicodeFileName[k]>0x14) {
-			sprintf(utf8fileName + strlen(utf8fileName), "%c", unicodeFileName[k]);
-		}
+/**
+ * Returns the namespace of the $FILE_NAME attribute at offs, FILE_NAME_POSIX if
+ * it is too short to hold one.
+ */
+BYTE getFileNameSpace(NTFS_ATTRIBUTE *mftRecAttr, char *mftBuffer, uint16_t offs) {
+	if((mftRecAttr->Attr).Resident.dwLength <= offsetof(FILE_NAME_ATTR, bFilenameNamespace)) {
+		return FILE_NAME_POSIX;
 	}
+	return (BYTE)mftBuffer[offs + (mftRecAttr->Attr).Resident.wAttrOffset + offsetof(FILE_NAME_ATTR, bFilenameNamespace)];
+}
 
-	if(DEBUG && VERBOSE) {
-		printf("FILE_NAME attribute:\n");
-		printf("\tFile name length: %u\t", fileNameAttr->bFileNameLength);
-		printf("\tNamespace: %u\t", fileNameAttr->bFilenameNamespace);
-
-		/* Print out the file name of the record*/
-		printf("\tFile name: ");
-		int  j = 0;
-		for(; j<fileNameAttr->bFileNameLength; j++) {
-			printf("%c", unicodeFileName[k]&0xFF); /*Mask just the final 8 bits */
-		}
-		printf("\n");
+/**
+ * Gets the name of an attribute starting at attrBase, such as the stream name of
+ * a named $DATA attribute (an alternate data stream), in UTF-8.
+ *
+ * Returns NULL if the attribute is unnamed.
+ *
+ * WARNING: Memory is allocated for the name, need to free the returned pointer.
+ */
+char *getAttrName(NTFS_ATTRIBUTE *attr, const char *attrBase) {
+	size_t len = attr->uchNameLength;
+	if(len == 0 || attr->wNameOffset + 2*len > attr->dwFullLength) {
+		return NULL;
 	}
-
-	free(fileNameAttr);
-	return utf8fileName;
+	uint16_t unicodeName[255];
+	char *utf8Name = malloc(3*len+1);	/*At most 3 bytes per UTF-16 unit */
+	memcpy(unicodeName, attrBase + attr->wNameOffset, 2*len);
+	utf16ToUtf8(utf8Name, unicodeName, len);
+	return utf8Name;
 }
 
 /**
@@ -154,10 +237,7 @@ char *getFileName(NTFS_ATTRIBUTE *mftRecAttr, char *mftBuffer, uint16_t offs ) {
 uint64_t linuxTimetoNTFStime() {
 	uint64_t linuxTime = (uint64_t)time(NULL);
 	uint64_t ntfsTime = (linuxTime*TIME_NTFSPERLINUX)+TIME_NTFSTOLINUXOFFSET;
-	if(DEBUG&&VERBOSE) {
-		printf("Linux time: %" PRIu64 "\n", linuxTime);
-		printf("NTFS time:  %" PRIu64 "\n", ntfsTime);
-	}
+	LOG_TRACE("Linux time: %" PRIu64 " NTFS time: %" PRIu64, linuxTime, ntfsTime);
 	return ntfsTime;
 }
 
@@ -160,7 +160,7 @@ typedef unsigned char BYTE; /*Define byte abbreviation */
 
 	/*Actual index record structure */
 	typedef struct _NTATTR_INDEX_RECORD_ENTRY {
-		/*Multiply by MFT_RECORD_SIZE (1024 bytes) and use as offset from
+		/*Multiply by the MFT record length from the boot sector and use as offset from
 		  start of the MFT to find the record */
 		uint64_t mftReference;
 		/*Next INDX record can be located by adding sizeofIndexEntry to the
@@ -186,6 +186,10 @@ typedef unsigned char BYTE; /*Define byte abbreviation */
 	/*Unicode file name string is found directly after the end of the index record entry structure */
 #pragma pack(pop)
 
+/* Volume geometry from the boot sector */
+uint32_t getBytesPerCluster(NTFS_BOOT_SECTOR *bootSec);
+uint32_t getMFTRecordLength(NTFS_BOOT_SECTOR *bootSec);
+
 /* Verbose debug methods */
 FRAG *createFragRecord(uint64_t fragOffset);
 int getPartitionInfo(char *buff, PARTITION *part);
@@ -193,6 +197,34 @@ int getBootSectInfo(char* buff, NTFS_BOOT_SECTOR *bootSec);
 int getFILE0Attrib(char* buff, NTFS_MFT_FILE_ENTRY_HEADER *mftFileEntry);
 int getFileAttribMembers(char * buff, NTFS_ATTRIBUTE* attrib);
 
+/**
+ * Returns the bytes per cluster. Sectors per cluster above 0x80 are the negative
+ * of a power of two, as for clusters of 128KiB and more, so 0xF8 is 256 sectors.
+ */
+uint32_t getBytesPerCluster(NTFS_BOOT_SECTOR *bootSec) {
+	BYTE secPerClust = (bootSec->bpb).uchSecPerClust;
+	if(secPerClust > 0x80) {
+		return (bootSec->bpb).wBytesPerSec << (256 - secPerClust);
+	}
+	return (bootSec->bpb).wBytesPerSec*secPerClust;
+}
+
+/**
+ * Returns the bytes per MFT record. The low byte of nClustPerMFTRecord counts
+ * clusters if it is positive; records smaller than a cluster, the usual case,
+ * are given as the negative of a power of two of bytes instead, so 0xF6 (-10)
+ * is 1024 bytes and 0xF4 (-12) 4096 bytes.
+ *
+ * Returns 0 if the size cannot be encoded in 32 bits.
+ */
+uint32_t getMFTRecordLength(NTFS_BOOT_SECTOR *bootSec) {
+	int8_t clustPerRecord = (int8_t)((bootSec->bpb).nClustPerMFTRecord & 0xFF);
+	if(clustPerRecord < 0) {
+		return -clustPerRecord < 32 ? 1U << -clustPerRecord : 0;
+	}
+	return clustPerRecord*getBytesPerCluster(bootSec);
+}
+
 /**
  *	Create a Fragment record which contains the offset from which the MFT records
  *	which follow were copied. This is necessary to determine the absolute offset
@@ -323,7 +355,7 @@ int getBootSectInfo(char* buff, NTFS_BOOT_SECTOR *bootSec) {
 			"Size of volume sectors: %0.2f mb\n"
 			"\n*Cluster number for MFT: %" PRId64 "\n"
 			"Mirror of cluster number for MFT: %" PRId64 "\n"
-			"MFT record size: %d\n"
+			"MFT record size: %u bytes\n"
 			"Index block size: %d\n"
 			"\nVolume serial number: %" PRId64 "\n"
 			"Volume checksum: %d\n"
@@ -341,7 +373,7 @@ int getBootSectInfo(char* buff, NTFS_BOOT_SECTOR *bootSec) {
 					(bootSec->bpb).wBytesPerSec*(bootSec->bpb).n64TotalSec/(1024.0*1024.0),
 					(bootSec->bpb).n64MFTLogicalClustNum,	/*Cluster number for MFT! */
 					(bootSec->bpb).n64MFTMirrLoficalClustNum,
-					(bootSec->bpb).nClustPerMFTRecord,
+					getMFTRecordLength(bootSec),
 					(bootSec->bpb).nClustPerIndexRecord,
 					(bootSec->bpb).n64VolumeSerialNum,
 					(bootSec->bpb).dwCheckSum,
@@ -0,0 +1,494 @@
+/*
+ * NameIndex.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Case-insensitive file name search over the offline index. Names are folded
+ * with the volume's $UpCase table, which is how NTFS itself compares them, so
+ * "REPORT.DOCX" finds report.docx and non-ASCII names fold as Windows folds
+ * them. Without a table only ASCII letters are folded.
+ *
+ * Patterns may use '*' (any run of characters) and '?' (one character). Exact
+ * names and patterns starting with a literal prefix are binary searched in the
+ * sorted folded names. Any other pattern with a literal run of three bytes or
+ * more is answered from a trigram index built with the names: only names
+ * containing the rarest trigram of the pattern are matched against it. The
+ * rest, such as "*.c", fall back to a scan of the folded names.
+ *
+ * Every hard link of a file is indexed, so a file is found by any of its names,
+ * and is shown under the name it was found by. Paths, "\dir\file", are looked
+ * up a directory at a time through the link table. Batches of exact names are
+ * each binary searched the same way.
+ */
+#ifndef NAMEINDEX_H_
+#define NAMEINDEX_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "NTFSAttributes.h"
+#include "FileList.h"
+#include "PathTable.h"
+#include "LinkTable.h"
+
+#define UPCASE_RECORD		10			/*MFT record number of $UpCase */
+#define UPCASE_ENTRIES		65536		/*One upper case mapping per UTF-16 unit */
+#define NAME_FOLD_MAX		(4*255+1)	/*Longest folded name, 255 units of 4 bytes at most */
+#define TRI_TABLE_MIN		4096		/*Initial trigram table slots, a power of 2 */
+
+typedef struct _NAME_INDEX {
+	uint16_t	*upcase;		/*$UpCase, or NULL to fold ASCII only */
+	File		**files;		/*Named files, by id */
+	LINK_TABLE	*links;
+	uint32_t	*linkIds;		/*Link each id names, LINK_NONE for the file's own name */
+	uint32_t	*foldOffs;		/*Folded name of each id in arena */
+	char		*arena;
+	uint32_t	nFiles;
+	uint32_t	*sorted;		/*Ids in folded name order */
+	uint32_t	*triKeys;		/*Trigram of each slot, 0 if unused */
+	uint32_t	*triStart;		/*Postings of a slot are postings[triStart..triStart+triCount) */
+	uint32_t	*triCount;
+	uint32_t	triSlots;		/*Power of 2 */
+	uint32_t	nTrigrams;
+	uint32_t	*postings;		/*Ids containing each trigram, ascending */
+} NAME_INDEX;
+
+int  nameIndexBuild(NAME_INDEX *idx, File *files, uint16_t *upcase, LINK_TABLE *links);
+File *nameIndexSearch(FILE *out, NAME_INDEX *idx, const char *pattern, uint32_t *nMatched);
+File *nameIndexSearchPath(FILE *out, NAME_INDEX *idx, const char *path, uint32_t *nMatched);
+uint32_t nameIndexBatch(NAME_INDEX *idx, FILE_QUERY *queries, uint32_t nQueries);
+void nameIndexFree(NAME_INDEX *idx);
+size_t nameFold(const uint16_t *upcase, const char *name, char *out, size_t outLen);
+bool nameGlobMatch(const char *pattern, const char *name);
+
+/**
+ * Decodes one UTF-8 character at s into *cp. Bytes that are not valid UTF-8
+ * decode as themselves.
+ *
+ * Returns the number of bytes used.
+ */
+static size_t utf8Decode(const char *s, uint32_t *cp) {
+	const BYTE *u = (const BYTE *)s;
+	if(u[0] >= 0xF0 && (u[1] & 0xC0) == 0x80 && (u[2] & 0xC0) == 0x80 && (u[3] & 0xC0) == 0x80) {
+		*cp = ((uint32_t)(u[0] & 0x07) << 18) | ((uint32_t)(u[1] & 0x3F) << 12) | ((u[2] & 0x3F) << 6) | (u[3] & 0x3F);
+		return 4;
+	} else if(u[0] >= 0xE0 && (u[1] & 0xC0) == 0x80 && (u[2] & 0xC0) == 0x80) {
+		*cp = ((uint32_t)(u[0] & 0x0F) << 12) | ((u[1] & 0x3F) << 6) | (u[2] & 0x3F);
+		return 3;
+	} else if(u[0] >= 0xC0 && (u[1] & 0xC0) == 0x80) {
+		*cp = ((uint32_t)(u[0] & 0x1F) << 6) | (u[1] & 0x3F);
+		return 2;
+	}
+	*cp = u[0];
+	return 1;
+}
+
+/**
+ * Folds a UTF-8 name to upper case with the $UpCase table, as NTFS compares
+ * names. Characters outside the Basic Multilingual Plane are kept as they are.
+ *
+ * Returns the length of the folded name written to out.
+ */
+size_t nameFold(const uint16_t *upcase, const char *name, char *out, size_t outLen) {
+	size_t n = 0;
+	uint32_t cp;
+	while(*name && n + 4 < outLen) {
+		name += utf8Decode(name, &cp);
+		if(cp < UPCASE_ENTRIES) {
+			cp = upcase ? upcase[cp] : (cp >= 'a' && cp <= 'z' ? cp - 'a' + 'A' : cp);
+		}
+		n += utf8Encode(out + n, cp);
+	}
+	out[n] = '\0';
+	return n;
+}
+
+/**
+ * Matches a folded name against a folded pattern of '*', '?' and literal
+ * characters. '?' matches one UTF-8 character.
+ */
+bool nameGlobMatch(const char *pattern, const char *name) {
+	const char *star = NULL, *resume = NULL;
+	uint32_t cp;
+	while(*name) {
+		if(*pattern == '*') {
+			star = ++pattern;
+			resume = name;
+		} else if(*pattern == '?') {
+			pattern++;
+			name += utf8Decode(name, &cp);
+		} else if(*pattern == *name) {
+			pattern++;
+			name++;
+		} else if(star) {	/*Let the last '*' take one more character */
+			pattern = star;
+			resume += utf8Decode(resume, &cp);
+			name = resume;
+		} else {
+			return false;
+		}
+	}
+	while(*pattern == '*') pattern++;
+	return *pattern == '\0';
+}
+
+static inline const char *nameFolded(NAME_INDEX *idx, uint32_t id) {
+	return idx->arena + idx->foldOffs[id];
+}
+
+static inline uint32_t triKey(const char *s) {
+	return ((uint32_t)(BYTE)s[0] << 16) | ((uint32_t)(BYTE)s[1] << 8) | (BYTE)s[2];
+}
+
+/**
+ * Returns the slot of trigram key, or the empty slot it would take.
+ */
+static uint32_t triSlot(NAME_INDEX *idx, uint32_t key) {
+	uint32_t slot = (key*0x9E3779B1u) & (idx->triSlots - 1);
+	while(idx->triKeys[slot] != 0 && idx->triKeys[slot] != key) {
+		slot = (slot + 1) & (idx->triSlots - 1);
+	}
+	return slot;
+}
+
+/**
+ * Doubles the trigram table, keeping the counts.
+ */
+static void triGrow(NAME_INDEX *idx) {
+	uint32_t *oldKeys = idx->triKeys, *oldCount = idx->triCount, oldSlots = idx->triSlots, s;
+	idx->triSlots *= 2;
+	idx->triKeys = calloc(idx->triSlots, sizeof(uint32_t));
+	idx->triCount = calloc(idx->triSlots, sizeof(uint32_t));
+	for(s = 0; s < oldSlots; s++) {
+		if(oldKeys[s] == 0) continue;
+		uint32_t slot = triSlot(idx, oldKeys[s]);
+		idx->triKeys[slot] = oldKeys[s];
+		idx->triCount[slot] = oldCount[s];
+	}
+	free(oldKeys);
+	free(oldCount);
+}
+
+static int triCmp(const void *a, const void *b) {
+	uint32_t ka = *(const uint32_t *)a, kb = *(const uint32_t *)b;
+	return (ka > kb) - (ka < kb);
+}
+
+/**
+ * Puts the distinct trigrams of a folded name in keys, sorted.
+ *
+ * Returns how many there are.
+ */
+static uint32_t nameTrigrams(const char *folded, uint32_t *keys) {
+	size_t len = strlen(folded), i;
+	uint32_t n = 0, nDistinct = 0;
+	for(i = 0; i + 3 <= len; i++) {
+		keys[n++] = triKey(folded + i);
+	}
+	qsort(keys, n, sizeof(uint32_t), triCmp);
+	for(i = 0; i < n; i++) {
+		if(i == 0 || keys[i] != keys[i-1]) keys[nDistinct++] = keys[i];
+	}
+	return nDistinct;
+}
+
+static NAME_INDEX *sortIdx;		/*qsort has no context argument */
+
+static int nameSortCmp(const void *a, const void *b) {
+	return strcmp(nameFolded(sortIdx, *(const uint32_t *)a), nameFolded(sortIdx, *(const uint32_t *)b));
+}
+
+/* Returns true if link is the name the file was indexed under, not another link */
+static inline bool nameIsOwn(LINK_TABLE *links, const HARD_LINK *link, const File *f) {
+	return link->parent == f->parentRecord && strcmp(linkName(links, link), f->fileName) == 0;
+}
+
+/**
+ * Builds the folded, sorted and trigram indexes over the named files in the
+ * list and the other links of their records in links. The index refers to the
+ * list's files and the links, which must outlive it, and takes ownership of
+ * upcase.
+ */
+int nameIndexBuild(NAME_INDEX *idx, File *files, uint16_t *upcase, LINK_TABLE *links) {
+	char folded[NAME_FOLD_MAX], named[NAME_FOLD_MAX];
+	uint32_t keys[NAME_FOLD_MAX];
+	size_t arenaLen = 0, arenaMax = 1 << 16;
+	uint32_t i, k, n, nPostings = 0, nLinks, l;
+	HARD_LINK *link;
+	File *f;
+
+	memset(idx, 0, sizeof(NAME_INDEX));
+	idx->upcase = upcase;
+	idx->links = links;
+	for(f = files; f; f = f->p_next) {
+		if(f->fileName == NULL) continue;
+		idx->nFiles++;
+		nLinks = linkRecordLinks(links, f->recordNumber, &link);
+		for(l = 0; l < nLinks; l++) {
+			if(!nameIsOwn(links, &link[l], f)) idx->nFiles++;
+		}
+	}
+	idx->files = malloc( (idx->nFiles + 1)*sizeof(File *) );
+	idx->linkIds = malloc( (idx->nFiles + 1)*sizeof(uint32_t) );
+	idx->foldOffs = malloc( (idx->nFiles + 1)*sizeof(uint32_t) );
+	idx->sorted = malloc( (idx->nFiles + 1)*sizeof(uint32_t) );
+	idx->arena = malloc(arenaMax);
+
+	/*Fold every name into the arena, the file's own then its other links */
+	for(i = 0, f = files; f; f = f->p_next) {
+		if(f->fileName == NULL) continue;
+		nLinks = linkRecordLinks(links, f->recordNumber, &link);
+		for(l = 0; l <= nLinks; l++) {
+			if(l > 0 && nameIsOwn(links, &link[l - 1], f)) continue;
+			const char *name = l == 0 ? f->fileName : linkName(links, &link[l - 1]);
+			size_t len;
+			if(f->streamName) {		/*Streams are found as "name:stream" */
+				snprintf(named, sizeof(named), "%s:%s", name, f->streamName);
+				len = nameFold(upcase, named, folded, sizeof(folded));
+			} else {
+				len = nameFold(upcase, name, folded, sizeof(folded));
+			}
+			if(arenaLen + len + 1 > arenaMax) {
+				while(arenaLen + len + 1 > arenaMax) arenaMax *= 2;
+				idx->arena = realloc(idx->arena, arenaMax);
+			}
+			memcpy(idx->arena + arenaLen, folded, len + 1);
+			idx->files[i] = f;
+			idx->linkIds[i] = l == 0 ? LINK_NONE : (uint32_t)(link + l - 1 - links->links);
+			idx->foldOffs[i] = (uint32_t)arenaLen;
+			idx->sorted[i] = i;
+			arenaLen += len + 1;
+			i++;
+		}
+	}
+
+	sortIdx = idx;
+	qsort(idx->sorted, idx->nFiles, sizeof(uint32_t), nameSortCmp);
+
+	/*Count the names holding each trigram, then lay the postings out by trigram */
+	idx->triSlots = TRI_TABLE_MIN;
+	idx->triKeys = calloc(idx->triSlots, sizeof(uint32_t));
+	idx->triCount = calloc(idx->triSlots, sizeof(uint32_t));
+	for(i = 0; i < idx->nFiles; i++) {
+		n = nameTrigrams(nameFolded(idx, i), keys);
+		for(k = 0; k < n; k++) {
+			uint32_t slot = triSlot(idx, keys[k]);
+			if(idx->triKeys[slot] == 0) {
+				if(2*(idx->nTrigrams + 1) > idx->triSlots) {	/*Keep the load under a half */
+					triGrow(idx);
+					slot = triSlot(idx, keys[k]);
+				}
+				idx->triKeys[slot] = keys[k];
+				idx->nTrigrams++;
+			}
+			idx->triCount[slot]++;
+			nPostings++;
+		}
+	}
+	idx->triStart = malloc(idx->triSlots*sizeof(uint32_t));
+	idx->postings = malloc( (nPostings + 1)*sizeof(uint32_t) );
+	for(k = 0, n = 0; k < idx->triSlots; k++) {
+		idx->triStart[k] = n;
+		n += idx->triCount[k];
+		idx->triCount[k] = 0;	/*Counted again as the postings are filled */
+	}
+	for(i = 0; i < idx->nFiles; i++) {
+		n = nameTrigrams(nameFolded(idx, i), keys);
+		for(k = 0; k < n; k++) {
+			uint32_t slot = triSlot(idx, keys[k]);
+			idx->postings[idx->triStart[slot] + idx->triCount[slot]++] = i;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Returns the first position in sorted order whose folded name is not below key.
+ */
+static uint32_t nameLowerBound(NAME_INDEX *idx, const char *key) {
+	uint32_t lo = 0, hi = idx->nFiles, mid;
+	while(lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if(strcmp(nameFolded(idx, idx->sorted[mid]), key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/**
+ * Adds a copy of the file of id to found, under the name it was indexed by.
+ *
+ * Returns the new head of found.
+ */
+static File *nameIndexCopy(NAME_INDEX *idx, uint32_t id, File *found) {
+	found = addFileCopy(idx->files[id], found);
+	if(idx->linkIds[id] != LINK_NONE) {		/*Found by another of its links */
+		HARD_LINK *link = &idx->links->links[idx->linkIds[id]];
+		free(found->fileName);
+		found->fileName = strdup(linkName(idx->links, link));
+		found->parentRecord = link->parent;
+	}
+	return found;
+}
+
+/**
+ * Prints the file of id, under the name it was indexed by, and adds a copy of it
+ * to found.
+ *
+ * Returns the new head of found.
+ */
+static File *nameIndexHit(FILE *out, NAME_INDEX *idx, uint32_t id, File *found) {
+	found = nameIndexCopy(idx, id, found);
+	printFile(out, found);
+	return found;
+}
+
+/**
+ * Finds the files whose names match pattern, ignoring case, printing each to out.
+ *
+ * Returns copies of the matching files, as searchFiles does, and their number
+ * in *nMatched.
+ */
+File *nameIndexSearch(FILE *out, NAME_INDEX *idx, const char *pattern, uint32_t *nMatched) {
+	char folded[NAME_FOLD_MAX], prefix[NAME_FOLD_MAX];
+	File *found = NULL;
+	uint32_t i, *candidates = NULL, nCandidates = 0;
+	size_t len = nameFold(idx->upcase, pattern, folded, sizeof(folded));
+	size_t prefixLen = strcspn(folded, "*?");
+
+	*nMatched = 0;
+	if(prefixLen == len || prefixLen > 0) {	/*Exact name, or a literal prefix */
+		memcpy(prefix, folded, prefixLen);
+		prefix[prefixLen] = '\0';
+		for(i = nameLowerBound(idx, prefix); i < idx->nFiles; i++) {
+			const char *name = nameFolded(idx, idx->sorted[i]);
+			if(strncmp(name, prefix, prefixLen) != 0) break;
+			if(prefixLen == len ? name[prefixLen] == '\0' : nameGlobMatch(folded, name)) {
+				found = nameIndexHit(out, idx, idx->sorted[i], found);
+				(*nMatched)++;
+			}
+		}
+		return found;
+	}
+
+	/*Pick the rarest trigram in the literal runs of the pattern */
+	const char *run = folded;
+	bool haveTrigram = false;
+	while(*run) {
+		size_t runLen = strcspn(run, "*?");
+		for(i = 0; i + 3 <= runLen; i++) {
+			uint32_t slot = triSlot(idx, triKey(run + i));
+			uint32_t count = idx->triKeys[slot] ? idx->triCount[slot] : 0;
+			if(!haveTrigram || count < nCandidates) {
+				candidates = idx->postings + (idx->triKeys[slot] ? idx->triStart[slot] : 0);
+				nCandidates = count;
+				haveTrigram = true;
+			}
+		}
+		run += runLen;
+		if(*run) run++;
+	}
+
+	uint32_t n = haveTrigram ? nCandidates : idx->nFiles;
+	for(i = 0; i < n; i++) {
+		uint32_t id = haveTrigram ? candidates[i] : i;
+		if(nameGlobMatch(folded, nameFolded(idx, id))) {
+			found = nameIndexHit(out, idx, id, found);
+			(*nMatched)++;
+		}
+	}
+	return found;
+}
+
+/**
+ * Finds the file at path, "\dir\file", ignoring case, printing it to out. Each
+ * directory is looked up among the links of its parent, from the root; the file
+ * is then any indexed name in the last of them, whichever of its links that is.
+ *
+ * Returns copies of the matching files, as nameIndexSearch does, and their
+ * number in *nMatched. A stream is found as "\dir\file:stream".
+ */
+File *nameIndexSearchPath(FILE *out, NAME_INDEX *idx, const char *path, uint32_t *nMatched) {
+	char part[NAME_FOLD_MAX], folded[NAME_FOLD_MAX], linkFolded[NAME_FOLD_MAX];
+	uint32_t dir = PATH_ROOT_RECORD, *children, nChildren, i;
+	File *found = NULL;
+
+	*nMatched = 0;
+	path += strspn(path, "\\/");
+	size_t partLen = strcspn(path, "\\/");
+	while(path[partLen]) {		/*Every part but the last is a directory */
+		snprintf(part, sizeof(part), "%.*s", (int)partLen, path);
+		nameFold(idx->upcase, part, folded, sizeof(folded));
+		nChildren = linkChildren(idx->links, dir, &children);
+		for(i = 0; i < nChildren; i++) {
+			HARD_LINK *link = &idx->links->links[children[i]];
+			nameFold(idx->upcase, linkName(idx->links, link), linkFolded, sizeof(linkFolded));
+			if(strcmp(folded, linkFolded) == 0) break;
+		}
+		if(i == nChildren) return NULL;
+		dir = idx->links->links[children[i]].record;
+		path += partLen;
+		path += strspn(path, "\\/");
+		partLen = strcspn(path, "\\/");
+	}
+	if(partLen == 0) return NULL;
+
+	nameFold(idx->upcase, path, folded, sizeof(folded));
+	for(i = nameLowerBound(idx, folded); i < idx->nFiles; i++) {
+		uint32_t id = idx->sorted[i];
+		if(strcmp(nameFolded(idx, id), folded) != 0) break;
+		uint32_t parent = idx->linkIds[id] == LINK_NONE ? idx->files[id]->parentRecord :
+						  idx->links->links[idx->linkIds[id]].parent;
+		if(parent == dir) {
+			found = nameIndexHit(out, idx, id, found);
+			(*nMatched)++;
+		}
+	}
+	return found;
+}
+
+/**
+ * Looks up each term of a batch as an exact name, ignoring case, collecting
+ * copies of its files in the query as searchFilesBatch does. Wildcards are not
+ * expanded.
+ *
+ * Returns the number of queries that matched at least one file.
+ */
+uint32_t nameIndexBatch(NAME_INDEX *idx, FILE_QUERY *queries, uint32_t nQueries) {
+	char folded[NAME_FOLD_MAX];
+	uint32_t q, i, nMatched = 0;
+
+	for(q = 0; q < nQueries; q++) {
+		if(!queries[q].valid) continue;
+		nameFold(idx->upcase, queries[q].term, folded, sizeof(folded));
+		for(i = nameLowerBound(idx, folded); i < idx->nFiles; i++) {
+			uint32_t id = idx->sorted[i];
+			if(strcmp(nameFolded(idx, id), folded) != 0) break;
+			queries[q].found = nameIndexCopy(idx, id, queries[q].found);
+			queries[q].nFound++;
+		}
+		if(queries[q].nFound) nMatched++;
+	}
+	return nMatched;
+}
+
+void nameIndexFree(NAME_INDEX *idx) {
+	free(idx->upcase);
+	free(idx->files);
+	free(idx->linkIds);
+	free(idx->foldOffs);
+	free(idx->arena);
+	free(idx->sorted);
+	free(idx->triKeys);
+	free(idx->triStart);
+	free(idx->triCount);
+	free(idx->postings);
+	memset(idx, 0, sizeof(NAME_INDEX));
+}
+
+#endif /* NAMEINDEX_H_ */
@@ -0,0 +1,96 @@
+/*
+ * PathTable.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Directory names and parents by MFT record number, kept from the offline pass
+ * so a file's full path can be rebuilt from the parent directory named in its
+ * $FILE_NAME. The root directory is record 5; paths are given as Windows shows
+ * them, "\dir\file". A parent that is not a known directory, such as one
+ * deleted or outside the copy, shows as "?".
+ */
+#ifndef PATHTABLE_H_
+#define PATHTABLE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PATH_ROOT_RECORD	5			/*MFT record number of the root directory */
+#define PATH_MAX_DEPTH		256			/*Parent chains deeper than this are cut short */
+#define PATH_FULL_MAX		4096		/*Longest full path given */
+#define PATH_REF_MASK		0x0000FFFFFFFFFFFFULL	/*Record number part of a file reference */
+
+typedef struct _PATH_TABLE {
+	char		**names;		/*Directory name by record number, NULL if not a directory */
+	uint32_t	*parents;
+	uint32_t	size;			/*Entries allocated */
+	uint32_t	count;			/*Directories added */
+} PATH_TABLE;
+
+void   pathTableAdd(PATH_TABLE *table, uint32_t record, uint32_t parent, char *name);
+size_t pathResolve(PATH_TABLE *table, uint32_t parent, const char *name, char *out, size_t outLen);
+void   pathTableFree(PATH_TABLE *table);
+
+/**
+ * Adds a directory, taking ownership of name.
+ */
+void pathTableAdd(PATH_TABLE *table, uint32_t record, uint32_t parent, char *name) {
+	if(record >= table->size) {
+		uint32_t newSize = table->size ? table->size : 1024;
+		while(newSize <= record) newSize *= 2;
+		table->names = realloc(table->names, newSize*sizeof(char *));
+		table->parents = realloc(table->parents, newSize*sizeof(uint32_t));
+		memset(table->names + table->size, 0, (newSize - table->size)*sizeof(char *));
+		table->size = newSize;
+	}
+	if(table->names[record]) {
+		free(table->names[record]);
+	} else {
+		table->count++;
+	}
+	table->names[record] = name;
+	table->parents[record] = parent;
+}
+
+/**
+ * Writes the full path of the entry called name in directory parent to out.
+ *
+ * Returns the length of the path, which is cut short if out is too small.
+ */
+size_t pathResolve(PATH_TABLE *table, uint32_t parent, const char *name, char *out, size_t outLen) {
+	const char *parts[PATH_MAX_DEPTH];
+	uint32_t nParts = 0, dir = parent;
+	size_t len = 0;
+
+	while(dir != PATH_ROOT_RECORD && nParts < PATH_MAX_DEPTH - 1) {
+		if(dir >= table->size || table->names[dir] == NULL) {
+			parts[nParts++] = "?";		/*Unknown parent */
+			break;
+		}
+		parts[nParts++] = table->names[dir];
+		if(table->parents[dir] == dir) break;
+		dir = table->parents[dir];
+	}
+
+	out[0] = '\0';
+	while(nParts > 0 && len + 1 < outLen) {
+		len += snprintf(out + len, outLen - len, "\\%s", parts[--nParts]);
+	}
+	if(len + 1 < outLen) {
+		len += snprintf(out + len, outLen - len, "\\%s", name);
+	}
+	return len < outLen ? len : outLen - 1;
+}
+
+void pathTableFree(PATH_TABLE *table) {
+	uint32_t i;
+	for(i = 0; i < table->size; i++) {
+		free(table->names[i]);
+	}
+	free(table->names);
+	free(table->parents);
+	memset(table, 0, sizeof(PATH_TABLE));
+}
+
+#endif /* PATHTABLE_H_ */
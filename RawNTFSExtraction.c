@@ -8,6 +8,7 @@
  ============================================================================
  */
 
+#define _GNU_SOURCE				/*accept4, memfd_create et al */
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -25,29 +26,88 @@
 
 #include "NTFSStruct.h"
 #include "NTFSAttributes.h"
+#include "AttrIter.h"
 #include "RunList.h"
 #include "Debug.h"
 #include "FileList.h"
+#include "NameIndex.h"
+#include "PathTable.h"
+#include "LinkTable.h"
+#include "TimeIndex.h"
+#include "UsnJournal.h"
+#include "VolumeBitmap.h"
+#include "Recovery.h"
+#include "Export.h"
 #include "UserInterface.h"
 #include "UDSServer.h"
+#include "ExtractStore.h"
+#include "RecordCache.h"
+#include "ClusterCache.h"
+#include "Coalesce.h"
+#include "Config.h"
+#include "Control.h"
 
 #define BUFFSIZE 1024			/*Generic data buffer size */
 #define FNAMEBUFF 256
 #define P_PARTITIONS 4			/*Number of primary partitions */
-#define SECTOR_SIZE 512			/*Size of one sector */
+#define SECTOR_SIZE 512			/*Unit sector offsets and guest writes are given in, whatever the disk's sector size */
 #define P_OFFSET 0x1BE			/*Partition information begins at offset 0x1BE */
-#define MFT_RECORD_LENGTH 1024 	/*MFT entries are 1024 bytes long */
-#define MFT_FILE_ATTR_PAD 8
-#define RESEXTFILESDIR "EXTRACTED_FILES/Resident/"
-#define NONRESEXTFILESDIR "EXTRACTED_FILES/NonResident/"
-#define MAX_EXTRACT_FSIZE 2097152		/*Max file size which will be extracted to the VMM */
-#define MAX_FILEMODIFY_AGE 6000000000 //72000000000 /*Max diff between the time now and a guest file modify time - 2HRS */
+#define MFT_RECORD_LENGTH 1024 	/*MFT entries are 1024 bytes long, unless the boot sector says otherwise */
+#define MFT_RECORD_MAX 4096		/*Largest MFT entries, as volumes on 4K sector disks have */
+#define DISK_SECTOR_MAX 4096	/*Largest disk sector, of 4K native disks */
+#define MFT_MAX_STREAMS 32		/*Named $DATA streams indexed per record, more cannot fit in one */
+#define MFT_MAX_LINKS 32		/*Hard links indexed per record, more cannot fit in one */
+#define NTFS_TICKS_PER_SEC 10000000ULL		/*NTFS times count 100ns intervals */
+#define DRAIN_TIMEOUT_MS 5000			/*Longest the consumer drains the queue for when stopping */
+#define FREE_SPACE_RUNS 8				/*Largest free runs listed by cmdFreeSpace */
+#define RECOVER_MIN_SCORE 100			/*Least % of clusters still free of files recovered by name */
 
 
 #define IN_USE		0x01		/*MFT FILE0 record flags */
 #define DIRECTORY	0x02
 
-static const char BLOCK_DEVICE[] = "/dev/mechastriessand/windows7";
+/*
+ * State of one volume served. The device and geometry globals below describe the
+ * selected volume; volumeSelect swaps them, with the store and record cache, in
+ * and out of these.
+ */
+typedef struct _VOLUME {
+	VOLUME_CFG		*cfg;
+	bool			open;
+	int				fd;
+	off_t			offset;					/*blk_offset */
+	uint64_t		endOfDev;
+	uint32_t		dwBytesPerCluster;
+	uint32_t		dwMFTRecordLength;
+	uint64_t		relativePartSector;
+	char			mftCopyName[FILENAME_MAX];
+	File			*files;					/*Index built from the $MFT copy */
+	NAME_INDEX		names;					/*Case-insensitive name search over files */
+	PATH_TABLE		dirs;					/*Directory names, for the paths of files */
+	LINK_TABLE		links;					/*Every name of the records in use */
+	TIME_INDEX		times;					/*Files by time, for time range search */
+	USN_JOURNAL		journal;				/*usnJournal */
+	VOLUME_BITMAP	bitmap;					/*volBitmap */
+	RECOVERY_INDEX	deleted;				/*Deleted files, for recovery */
+	EXTRACT_STORE	store;
+	RECORD_CACHE	recCache;
+} VOLUME;
+
+/* Deleted files being recovered, shared by the reader threads, with the state
+ * of their volume pinned so that volumeLock is not held while they read */
+typedef struct _RECOVER_JOB {
+	int				fd;
+	uint32_t		dwBytesPerCluster;
+	uint64_t		relativePartSector;
+	VOLUME_BITMAP	*bitmap;
+	EXTRACT_STORE	*store;
+	DELETED_FILE	**files;
+	uint32_t		nFiles;
+	uint32_t		next;					/*Next file to take */
+	uint32_t		countRecovered;
+	uint32_t		countFailed;
+	uint64_t		bytes;
+} RECOVER_JOB;
 
 /*Information methods which print to the buffer pointer given */
 int getPartitionInfo(char *buff, PARTITION *part);
@@ -59,59 +119,972 @@ int getFileAttribMembers(char * buff, NTFS_ATTRIBUTE* attrib);
 int lseekAbs(int fileDescriptor, off_t offset);
 int lseekRel(int fileDescriptor, off_t offset);
 
+/*Volume setup */
+int mountVolume(const char *device);
+int buildFileIndex(const char *mftCopyPath, File **files);
+int volumeOpen(VOLUME *vol, VOLUME_CFG *cfg);
+void volumeSelect(VOLUME *vol);
+void volumeClose(VOLUME *vol);
+
 /*Utility methods */
 int64_t roundToNearestCluster(int64_t sec_offs, int32_t secPerClus);
-int extractResFile(char * fileName, void * dataAttr, uint32_t len);
+int extractResFile(NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader, char *fileName, void *dataAttr, uint32_t len);
+int extractNonResFile(NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader, char *fileName, DataRun *runList, uint64_t realSize);
+int extractDataAttr(NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader, NTFS_ATTRIBUTE *mftRecAttr, char *fName);
+uint64_t runListSize(DataRun *runList);
+int loadUpcase(DataRun *runList);
+int loadBitmap(DataRun *runList, uint64_t realSize);
+int readRunList(DataRun *runList, BYTE *data, const char *fileName, uint64_t *filled);
+int readJournal(int64_t offs, BYTE *data, uint32_t len);
+void tailJournal(void);
+int recoverFile(RECOVER_JOB *job, DELETED_FILE *file);
+void *recoverThreadFn(void *param);
+
+/*Commands, from the terminal or the control socket, with their output to out */
+void cmdPrintFiles(FILE *out, uint16_t volume);
+int cmdSearch(FILE *out, uint16_t volume, uint8_t srchType, char *searchTerm);
+int cmdSearchTime(FILE *out, uint16_t volume, char *searchTerm);
+int cmdBatchSearch(FILE *in, FILE *out, uint16_t volume, uint8_t srchType);
+int cmdExport(FILE *out, uint16_t volume, char *searchTerm);
+int cmdFreeSpace(FILE *out, uint16_t volume);
+int cmdSearchDeleted(FILE *out, uint16_t volume, char *searchTerm);
+int cmdRecover(FILE *out, uint16_t volume, char *searchTerm);
+int cmdExtractRecord(FILE *out, uint16_t volume, char *searchTerm);
+int cmdExtractOffset(FILE *out, uint16_t volume, char *searchTerm);
+int cmdUseVolume(FILE *out, char *searchTerm, uint16_t *volume);
+int cmdServerStart(FILE *out);
+int cmdServerStop(FILE *out);
+int runTermCommand(FILE *out, int8_t cmd, char *searchTerm, uint16_t *volume);
+int runCommand(FILE *in, FILE *out, char *line, uint16_t *volume);
 
 /* Consumer thread worker function */
 void *consumerThreadFn(void *param);
+void consumeWrite(WRITE_EVENT newQItem);
+bool consumeJournalWrite(WRITE_EVENT newQItem);
+bool consumeBitmapWrite(WRITE_EVENT newQItem);
 
 uint16_t blkDevDescriptor = 0;		/*File descriptor for block device */
 off_t blk_offset = 0;
 uint64_t endOfDev = -1;
 uint32_t dwBytesPerCluster = -1;  	/*Bytes per cluster on the disk */
+uint32_t dwMFTRecordLength = MFT_RECORD_LENGTH;	/*Bytes per MFT record, from the boot sector */
 uint64_t relativePartSector = -1; 	/*Relative offset in bytes of the NTFS partition table */
 
 FILE * MFT_offline_copy;
+char mftCopyName[FILENAME_MAX] = "$MFT1";	/*Local copy of the $MFT of the volume in use */
+char mftCopyPrefix[FILENAME_MAX] = "";		/*Directory and volume name the copy is named with */
+int countBadAttr = 0;						/*Attributes with impossible lengths */
+uint16_t *upcaseTable = NULL;				/*$UpCase of the volume last indexed, if read */
+PATH_TABLE dirTable;						/*Directories of the volume last indexed */
+LINK_TABLE linkTable;						/*Links of the volume last indexed */
+RECOVERY_INDEX delIndex;					/*Deleted files of the volume last indexed */
+uint64_t maxExtractSize = CFG_DEFAULT_EXTRACT;						/*Max file size which will be extracted to the VMM */
+uint64_t maxFileModifyAge = CFG_DEFAULT_AGE*NTFS_TICKS_PER_SEC;	/*Max diff between the time now and a guest file modify time */
+
+VOLUME volumes[CFG_MAX_VOLUMES];	/*Volumes served, guests bind to them by index */
+uint16_t nVolumes = 0;
+VOLUME *curVolume = NULL;			/*Volume the globals above describe */
+EXTRACT_STORE *extStore = &volumes[0].store;		/*Content addressed store for extracted files */
+RECORD_CACHE *recCache = &volumes[0].recCache;		/*Last seen version of each MFT record */
+USN_JOURNAL *usnJournal = &volumes[0].journal;		/*Change journal, and where each MFT record is */
+VOLUME_BITMAP *volBitmap = &volumes[0].bitmap;		/*Allocated clusters, from $Bitmap */
+pthread_mutex_t volumeLock = PTHREAD_MUTEX_INITIALIZER;	/*Held while a volume is selected and in use */
+pthread_t consumer_tid;
+bool consumerRunning = false;
+bool consumerStop = false;			/*Asks the consumer to drain the queue and exit */
+pthread_mutex_t consumerLock = PTHREAD_MUTEX_INITIALIZER;	/*Serialises starting and stopping the consumer */
+COALESCER coalescer;				/*Merges repeated guest writes before they are read */
+TRACE writeTrace;					/*Recording of received writes, if NTFS_TRACE_FILE is set */
 
 int main(int argc, char* argv[]) {
+	configDefaults(&config, UDS_SOCKET_NAME, METRICS_SOCKET_NAME, CONTROL_SOCKET_NAME, EXTFILESDIR);
+	if(configParseArgs(&config, argc, argv) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	logInit(config.logLevel, config.logFile[0] ? config.logFile : NULL);
+	maxExtractSize = config.maxExtractSize;
+	maxFileModifyAge = config.maxModifyAge*NTFS_TICKS_PER_SEC;
+	socket_path = config.socketName;
+	metrics_socket_path = config.metricsSocketName;
+	control_socket_path = config.controlSocketName;
+	coalesceWindowMs = config.coalesceWindow;
 	QInit();
+	coalesceInit(&coalescer, coalesceWindowMs);
+	if(clusterCacheInit(&clusterCache, config.cacheSize*1024*1024) == EXIT_FAILURE) {
+		printf("Failed to allocate a %" PRIu64 " MiB cluster cache.\n", config.cacheSize);
+		return EXIT_FAILURE;
+	}
+	uint16_t v;
+
+	/*SIGTERM and SIGINT stop a daemon, blocked here so every thread inherits the mask */
+	sigset_t stopSignals;
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGTERM);
+	sigaddset(&stopSignals, SIGINT);
+	if(config.daemon) {
+		pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+	} else {
+		system("clear"); /*Clear terminal window */
+	}
+	printf("Launching raw NTFS extraction engine for %u volume%s\n", config.nVolumes, config.nVolumes > 1 ? "s" : "");
+
+	/*Copy the $MFT of each volume, index it and open its extraction store */
+	for(v = 0; v < config.nVolumes; v++) {
+		if(volumeOpen(&volumes[v], &config.volumes[v]) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+	nVolumes = config.nVolumes;
+	udsVolumeCount = nVolumes;
+
+	/*Writes left unconsumed at the last shutdown are consumed first */
+	const char *volumeNames[CFG_MAX_VOLUMES];
+	for(v = 0; v < nVolumes; v++) {
+		volumeNames[v] = config.volumes[v].name;
+	}
+	int nReloaded = QLoad(config.queueFile, volumeNames, nVolumes);
+	if(nReloaded > 0) {
+		printf("Reloaded %d writes queued at the last shutdown.\n", nReloaded);
+	}
+
+	/*Record received writes for tracereplay */
+	const char *tracePath = config.traceFile[0] ? config.traceFile : NULL;
+	if(tracePath && traceOpenWrite(&writeTrace, tracePath) == EXIT_SUCCESS) {
+		udsTrace = &writeTrace;
+		printf("Recording writes to %s.\n", tracePath);
+	}
+
+	/*-------------------------------- Launch UDS Server Thread --------------------------------*/
+	pthread_t uds_tid;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr); /*Default thread attributes */
+	if(udsServerInit() == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	pthread_create(&uds_tid, &attr, udsServerThreadFn, socket_path); /* Launch UDS thread */
+	printf("UDS server thread started.\n");
+
+	/*------------------------------ Launch metrics endpoint thread -----------------------------*/
+	pthread_t metrics_tid;
+	metricsGauge("ntfs_queue_depth", "Writes waiting for the consumer", QDepth);
+	metricsGauge("ntfs_queue_dropped_total", "Writes dropped because the queue was full", QDropped);
+	metricsGauge("ntfs_cluster_cache_hits_total", "Blocks read from the cluster cache", clusterCacheHits);
+	metricsGauge("ntfs_cluster_cache_misses_total", "Blocks read from the device past the cluster cache", clusterCacheMisses);
+	metricsGauge("ntfs_cluster_cache_invalidated_total", "Cached blocks dropped by guest writes", clusterCacheInvalidated);
+	pthread_create(&metrics_tid, &attr, metricsServerThreadFn, metrics_socket_path);
+	pthread_detach(metrics_tid);
+	printf("Metrics endpoint thread started.\n\n");
+
+	/*------------------------------ Launch control socket thread -------------------------------*/
+	pthread_t control_tid;
+	controlHandler = runCommand;
+	pthread_create(&control_tid, &attr, controlServerThreadFn, control_socket_path);
+	pthread_detach(control_tid);
+	printf("Control socket thread started.\n\n");
+
+	if(config.daemon) {
+		/*------------------------- Consume writes until told to stop --------------------------*/
+		int sig;
+		cmdServerStart(stdout);
+		sigwait(&stopSignals, &sig);
+		printf("Received %s, stopping.\n", strsignal(sig));
+	} else {
+		/*---------------------------- User interface to the program ---------------------------*/
+		char cmd[CMD_BUFF];
+		int8_t pRet = -1;
+		uint16_t volume = 0;		/*Volume searched and extracted from */
+		char *searchTerm;
+		do {
+			printf("What do you want to do? \n");
+			if(fgets(cmd, CMD_BUFF-1, stdin) == NULL) break;
+			switch(pRet = parseUserInput(cmd)) {
+			case PRINT_HELP : ;
+				printf(HELP);
+				break;
+			case PRINT_FILES : ;	/* Print list of files stored in offline MFT copy */
+				cmdPrintFiles(stdout, volume);
+				break;
+			case FREE_SPACE : ;		/* Print allocated and free clusters from $Bitmap */
+				cmdFreeSpace(stdout, volume);
+				break;
+			case SRCH_FOR_MFTN : ;	/* Search offline MFT records using record number */
+			case SRCH_FOR_MFTC : ;	/* Search offline MFT records using record file name */
+			case SRCH_FOR_MFTO : ;	/* Search offline MFT records using record sector offset */
+			case SRCH_FOR_TIME : ;	/* Search offline MFT records for times in a range */
+			case EXT_MFTN: ;		/* Extract file using MFT record number( offline directory ) */
+			case EXT_MFTCO: ;		/* Extract file using QEMU write offset */
+			case USE_VOLUME: ;
+			case EXPORT_FILES: ;	/* Write the list of files out as CSV, NDJSON or Arrow */
+			case SRCH_DELETED: ;	/* Search deleted files by name, scored against $Bitmap */
+			case RECOVER_FILES: ;	/* Recover deleted files to the extraction store */
+				while( strcmp((searchTerm = getSearchTerm()), EXIT_CMD) != 0 ) {
+					runTermCommand(stdout, pRet, searchTerm, &volume);
+					free(searchTerm);
+				}
+				free(searchTerm);
+				break;
+			case BATCH_MFTN: ;		/* Search offline MFT records for many terms at once */
+			case BATCH_MFTC: ;
+			case BATCH_MFTO: ;
+				printf("Enter the search terms, one per line, then a blank line:\n");
+				cmdBatchSearch(stdin, stdout, volume, pRet == BATCH_MFTN ? SRCH_NUM :
+													  pRet == BATCH_MFTC ? SRCH_NAME : SRCH_CROFFS);
+				break;
+			case UDSSTART: ;
+				cmdServerStart(stdout);
+				break;
+			case UDSSTOP: ;
+				cmdServerStop(stdout);
+				break;
+			case UNKNOWN :
+				printf("Command not recognised, try \'help\'\n");
+				break;
+			}
+		} while( pRet != EXIT );
+	}
+
+	/*--------------------------------------- Tidy up ---------------------------------------*/
+	controlServerStop();		/*No command may start the consumer or use a volume past here */
+	printf("Control sessions finished.\n");
+	if(MFT_offline_copy != NULL) {		/*Make sure the offline MFT copy is closed */
+		fclose(MFT_offline_copy);
+	}
+	udsServerStop();
+	pthread_join(uds_tid,NULL); /* Wait for it to queue what it holds and exit */
+	printf("UDS Server thread finished.\n");
+	if(udsTrace) {
+		printf("Recorded %" PRIu64 " writes to %s.\n", writeTrace.count, tracePath);
+		traceClose(udsTrace);
+		udsTrace = NULL;
+	}
+
+	pthread_mutex_lock(&consumerLock);
+	bool running = consumerRunning;
+	pthread_mutex_unlock(&consumerLock);
+	if(running) {
+		cmdServerStop(stdout);
+		printf("Extraction server finished.\n");
+	}
+	int nSaved = QSave(config.queueFile, volumeNames, nVolumes);
+	if(nSaved > 0) {
+		printf("Saved %d unconsumed writes to %s.\n", nSaved, config.queueFile);
+	}
+	printf("Coalescing: %" PRIu64 " writes in %" PRIu64 " reads, ratio %.2f.\n",
+			coalescer.countIn, coalescer.countOut, coalesceRatio(&coalescer));
+	printf("Cluster cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " blocks dropped by writes.\n",
+			clusterCacheHits(), clusterCacheMisses(), clusterCacheInvalidated());
+	for(v = 0; v < nVolumes; v++) {
+		volumeClose(&volumes[v]);		/*Remove offline file directory from memory, close the device */
+	}
+	clusterCacheFree(&clusterCache);
+	logClose();
+
+	return EXIT_SUCCESS;
+} //end of main method.
+
+/**
+ * Prints every named file in the volume's index.
+ */
+void cmdPrintFiles(FILE *out, uint16_t volume) {
+	printAllFiles(out, volumes[volume].files);
+}
+
+/**
+ * Searches the volume's index by record number, name or offset (srchType).
+ * Names are matched ignoring case and may use '*' and '?' wildcards, or be a
+ * full path, "\dir\file". A file found by record number is listed with every
+ * path it has, if it has hard links.
+ */
+int cmdSearch(FILE *out, uint16_t volume, uint8_t srchType, char *searchTerm) {
+	VOLUME *vol = &volumes[volume];
+	uint32_t nMatched, nLinks, l;
+	HARD_LINK *link;
+	File *found = srchType != SRCH_NAME ? searchFiles(out, vol->files, srchType, searchTerm) :
+				  searchTerm[0] == '\\' ? nameIndexSearchPath(out, &vol->names, searchTerm, &nMatched)
+										: nameIndexSearch(out, &vol->names, searchTerm, &nMatched);
+	if(found && srchType == SRCH_NUM && (nLinks = linkRecordLinks(&vol->links, found->recordNumber, &link)) > 1) {
+		char *fullPath = malloc( PATH_FULL_MAX );
+		for(l = 0; l < nLinks; l++) {
+			pathResolve(&vol->dirs, link[l].parent, linkName(&vol->links, &link[l]), fullPath, PATH_FULL_MAX);
+			fprintf(out, "\tLink %" PRIu32 " of %" PRIu32 ": %s\n", l + 1, nLinks, fullPath);
+		}
+		free(fullPath);
+	}
+	if(found) {
+		freeFilesList(found);
+	} else {
+		fprintf(out, "No files found for that query.\n");
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Lists the files with a time in a range, in time order. The term is the time,
+ * created, modified, changed or read, the start of the range and optionally its
+ * end, which is otherwise open: "modified -30m", "created 2015-03-01 2015-04-01".
+ */
+int cmdSearchTime(FILE *out, uint16_t volume, char *searchTerm) {
+	char fieldName[16], fromStr[32], toStr[32], when[32];
+	int64_t now = linuxTimetoNTFStime(), from, to = INT64_MAX;
+	TIME_KEY *key;
+	uint32_t nFound, i;
+
+	int nTerms = sscanf(searchTerm, "%15s %31s %31s", fieldName, fromStr, toStr);
+	int field = nTerms >= 2 ? timeField(fieldName) : -1;
+	if(field == -1 || timeParse(fromStr, now, &from) == EXIT_FAILURE ||
+	   (nTerms == 3 && timeParse(toStr, now, &to) == EXIT_FAILURE)) {
+		fprintf(out, "Give created, modified, changed or read, then the times from and to, "
+					 "as now, -30m, -2h, -7d or 2015-03-10T14:30:00.\n");
+		return EXIT_FAILURE;
+	}
+	nFound = timeIndexRange(&volumes[volume].times, field, from, to, &key);
+	for(i = 0; i < nFound; i++, key++) {
+		timeFormat(when, sizeof(when), key->time);
+		fprintf(out, "%s | ", when);
+		printFile(out, key->file);
+	}
+	fprintf(out, "%" PRIu32 " files %s in that range.\n", nFound, timeFieldNames[field]);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Reads search terms from in, one per line up to a blank line or the end of
+ * input, and looks them all up in one pass over the volume's index, or names in
+ * its name index, ignoring case. Each match is printed after its term, in the
+ * order the terms were given.
+ */
+int cmdBatchSearch(FILE *in, FILE *out, uint16_t volume, uint8_t srchType) {
+	char line[CMD_BUFF];
+	char **terms = NULL;
+	uint32_t nTerms = 0, maxTerms = 0, nMatched, i;
+	File *file;
+
+	while(fgets(line, sizeof(line), in)) {
+		line[ strcspn(line, "\r\n") ] = 0;
+		if(line[0] == '\0') break;
+		if(nTerms == maxTerms) {
+			maxTerms = maxTerms ? maxTerms*2 : 64;
+			terms = realloc(terms, maxTerms*sizeof(char *));
+		}
+		terms[nTerms++] = strdup(line);
+	}
+
+	FILE_QUERY *queries = malloc( (nTerms + 1)*sizeof(FILE_QUERY) );
+	for(i = 0; i < nTerms; i++) {
+		fileQueryInit(&queries[i], srchType, terms[i]);
+	}
+	nMatched = srchType == SRCH_NAME ? nameIndexBatch(&volumes[volume].names, queries, nTerms)
+									 : searchFilesBatch(volumes[volume].files, srchType, queries, nTerms);
+
+	for(i = 0; i < nTerms; i++) {
+		if(!queries[i].valid) {
+			fprintf(out, "%s | invalid\n", terms[i]);
+		} else if(queries[i].found == NULL) {
+			fprintf(out, "%s | not found\n", terms[i]);
+		}
+		for(file = queries[i].found; file; file = file->p_next) {
+			fprintf(out, "%s | ", terms[i]);
+			printFile(out, file);
+		}
+		freeFilesList(queries[i].found);
+		free(terms[i]);
+	}
+	fprintf(out, "%" PRIu32 " of %" PRIu32 " terms matched.\n", nMatched, nTerms);
+
+	free(queries);
+	free(terms);
+	return EXIT_SUCCESS;
+}
+
+/* Columns of an export of the index */
+static const EXPORT_COLUMN exportColumns[] = {
+	{ "record", EXPORT_U64 }, { "parent", EXPORT_U64 }, { "path", EXPORT_STR }, { "name", EXPORT_STR },
+	{ "size", EXPORT_U64 }, { "sector_offset", EXPORT_I64 }, { "cluster_offset", EXPORT_I64 },
+	{ "created", EXPORT_TIME }, { "modified", EXPORT_TIME }, { "changed", EXPORT_TIME }, { "read", EXPORT_TIME },
+	{ "fn_created", EXPORT_TIME }, { "fn_modified", EXPORT_TIME }, { "fn_changed", EXPORT_TIME },
+	{ "fn_read", EXPORT_TIME }, { "flags", EXPORT_U64 }, { "sequence", EXPORT_U64 }, { "lsn", EXPORT_I64 },
+	{ "stream", EXPORT_STR }, { "links", EXPORT_U64 }
+};
+
+/**
+ * Exports every named file in the volume's index with its full path. The term
+ * is the format, csv, ndjson or arrow, then the file to write, "-" for out.
+ */
+int cmdExport(FILE *out, uint16_t volume, char *searchTerm) {
+	VOLUME *vol = &volumes[volume];
+	char format[16], *path, *fullPath = malloc( PATH_FULL_MAX );
+	EXPORT_VALUE row[sizeof(exportColumns)/sizeof(exportColumns[0])];
+	EXPORTER exp;
+	File *file;
+	HARD_LINK *link;
+	int retVal = EXIT_SUCCESS, pathStart = 0, t;
+
+	sscanf(searchTerm, "%15s %n", format, &pathStart);
+	path = searchTerm + pathStart;		/*The rest of the line, which may hold spaces */
+	if(pathStart == 0 || *path == '\0' || exportFormat(format) == -1) {
+		fprintf(out, "Give the format, csv, ndjson or arrow, and the file to write.\n");
+		free(fullPath);
+		return EXIT_FAILURE;
+	}
+	uint64_t startNs = monotonicNs();
+	if(exportOpen(&exp, path, out, exportFormat(format), exportColumns,
+			sizeof(exportColumns)/sizeof(exportColumns[0])) == EXIT_FAILURE) {
+		fprintf(out, "Failed to open %s.\n", path);
+		free(fullPath);
+		return EXIT_FAILURE;
+	}
+	for(file = vol->files; file && retVal == EXIT_SUCCESS; file = file->p_next) {
+		if(file->fileName == NULL) continue;
+		pathResolve(&vol->dirs, file->parentRecord, file->fileName, fullPath, PATH_FULL_MAX);
+		row[0].u = file->recordNumber;
+		row[1].u = file->parentRecord;
+		row[2].s = fullPath;
+		row[3].s = file->fileName;
+		row[4].u = file->length;
+		row[5].i = file->sec_offset;
+		row[6].i = file->cl_offset;
+		for(t = 0; t < FTIME_FIELDS; t++) {
+			row[7 + t].i = ntfsTimeToUnixUs(file->meta.siTime[t]);
+			row[7 + FTIME_FIELDS + t].i = ntfsTimeToUnixUs(file->meta.fnTime[t]);
+		}
+		row[15].u = file->meta.flags;
+		row[16].u = file->meta.sequence;
+		row[17].i = file->meta.lsn;
+		row[18].s = file->streamName ? file->streamName : "";
+		row[19].u = linkRecordLinks(&vol->links, file->recordNumber, &link);
+		retVal = exportRow(&exp, row);
+	}
+	uint64_t nRows = exp.nRows;
+	if(exportClose(&exp) == EXIT_FAILURE || retVal == EXIT_FAILURE) {
+		int errsv = errno;
+		fprintf(out, "Failed to write %s: %s.\n", path, strerror(errsv));
+		retVal = EXIT_FAILURE;
+	} else if(strcmp(path, "-") != 0) {
+		fprintf(out, "Exported %" PRIu64 " files to %s in %.3f s.\n", nRows, path, (monotonicNs() - startNs)/1e9);
+	}
+	free(fullPath);
+	return retVal;
+}
+
+/**
+ * Prints the volume's allocated and free clusters, as $Bitmap has them now, and
+ * its largest runs of free clusters.
+ */
+int cmdFreeSpace(FILE *out, uint16_t volume) {
+	uint64_t largest[FREE_SPACE_RUNS][2], runLength, lcn, nRuns = 0;
+	uint32_t nLargest = 0, i;
+
+	pthread_mutex_lock(&volumeLock);
+	volumeSelect(&volumes[volume]);
+	if(volBitmap->bits == NULL) {
+		pthread_mutex_unlock(&volumeLock);
+		fprintf(out, "This volume's $Bitmap was not loaded.\n");
+		return EXIT_FAILURE;
+	}
+	for(lcn = bitmapNextFree(volBitmap, 0, &runLength); lcn < volBitmap->nClusters;
+		lcn = bitmapNextFree(volBitmap, lcn + runLength, &runLength)) {
+		nRuns++;
+		for(i = nLargest; i > 0 && largest[i - 1][1] < runLength; i--) {	/*Insert, longest first */
+			if(i < FREE_SPACE_RUNS) memcpy(largest[i], largest[i - 1], sizeof(largest[i]));
+		}
+		if(i < FREE_SPACE_RUNS) {
+			largest[i][0] = lcn;
+			largest[i][1] = runLength;
+			if(nLargest < FREE_SPACE_RUNS) nLargest++;
+		}
+	}
+	uint64_t nFree = volBitmap->nClusters - volBitmap->nAllocated;
+	fprintf(out, "%" PRIu64 " clusters of %" PRIu32 " bytes, %" PRIu64 " allocated, %" PRIu64 " free (%.1f%%, %.1f MiB) in %" PRIu64 " runs.\n",
+			volBitmap->nClusters, dwBytesPerCluster, volBitmap->nAllocated, nFree,
+			volBitmap->nClusters ? 100.0*nFree/volBitmap->nClusters : 0.0, nFree*(double)dwBytesPerCluster/(1 << 20), nRuns);
+	for(i = 0; i < nLargest; i++) {
+		fprintf(out, "\tFree from cluster %" PRIu64 ", %" PRIu64 " clusters (sector %" PRIu64 ").\n", largest[i][0], largest[i][1],
+				(relativePartSector + largest[i][0]*dwBytesPerCluster)/SECTOR_SIZE);
+	}
+	pthread_mutex_unlock(&volumeLock);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Lists the deleted files whose names match a pattern, as name search does, with
+ * how much of each is still on the volume: the % of its clusters $Bitmap has
+ * free now.
+ */
+int cmdSearchDeleted(FILE *out, uint16_t volume, char *searchTerm) {
+	VOLUME *vol = &volumes[volume];
+	char pattern[NAME_FOLD_MAX], folded[NAME_FOLD_MAX], when[32], *fullPath = malloc( PATH_FULL_MAX );
+	uint32_t i, nFound = 0, nWhole = 0;
+
+	nameFold(vol->names.upcase, searchTerm, pattern, sizeof(pattern));
+	pthread_mutex_lock(&volumeLock);
+	volumeSelect(vol);
+	for(i = 0; i < vol->deleted.count; i++) {
+		DELETED_FILE *file = &vol->deleted.files[i];
+		nameFold(vol->names.upcase, file->fileName, folded, sizeof(folded));
+		if(!nameGlobMatch(pattern, folded)) continue;
+		uint32_t score = recoveryScore(file, volBitmap);
+		pathResolve(&vol->dirs, file->parentRecord, file->fileName, fullPath, PATH_FULL_MAX);
+		timeFormat(when, sizeof(when), file->meta.siTime[FTIME_CHANGED]);
+		fprintf(out, "%8" PRIu32 " | %12" PRId64 " | %10" PRIu64 " | %3" PRIu32 "%% | %s | %s\n",
+				file->recordNumber, file->sec_offset, file->size, score, when, fullPath);
+		nFound++;
+		if(score == 100) nWhole++;
+	}
+	fprintf(out, "%" PRIu32 " deleted files match, %" PRIu32 " with none of their clusters %s.\n",
+			nFound, nWhole, volBitmap->bits ? "reused" : "known to be reused");
+	pthread_mutex_unlock(&volumeLock);
+	free(fullPath);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Recovers deleted files into the extraction store: one by its record number,
+ * or those whose names match a pattern and which have at least a given % of
+ * their clusters still free, RECOVER_MIN_SCORE unless the pattern is preceded
+ * by it, "50 *.doc". The files are read by config.recoverThreads threads.
+ */
+int cmdRecover(FILE *out, uint16_t volume, char *searchTerm) {
+	VOLUME *vol = &volumes[volume];
+	char pattern[NAME_FOLD_MAX], folded[NAME_FOLD_MAX], *end;
+	const char *namePattern = searchTerm;
+	pthread_t readers[CFG_MAX_RECOVER];
+	RECOVER_JOB job;
+	uint32_t minScore = RECOVER_MIN_SCORE, nThreads = 0, nTooLarge = 0, i;
+
+	memset(&job, 0, sizeof(RECOVER_JOB));
+	unsigned long n = strtoul(searchTerm, &end, 10);
+	bool byRecord = end != searchTerm && *end == '\0';
+	if(!byRecord && end != searchTerm && n <= 100 && (*end == '%' || *end == ' ')) {
+		if(*end == '%') end++;
+		if(*end == ' ') {
+			minScore = n;
+			namePattern = end + strspn(end, " ");
+		}
+	}
+	nameFold(vol->names.upcase, namePattern, pattern, sizeof(pattern));
+	if((job.files = malloc( (vol->deleted.count + 1)*sizeof(DELETED_FILE *) )) == NULL) {
+		fprintf(out, "Failed to allocate the recovery list.\n");
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&volumeLock);
+	volumeSelect(vol);
+	if(byRecord) {
+		DELETED_FILE *file = recoveryFind(&vol->deleted, (uint32_t)n);
+		if(file && file->size <= maxExtractSize) {
+			job.files[job.nFiles++] = file;		/*Whatever its score, reused clusters read as zeros */
+		} else if(file) {
+			nTooLarge++;
+		}
+	} else {
+		for(i = 0; i < vol->deleted.count; i++) {
+			DELETED_FILE *file = &vol->deleted.files[i];
+			nameFold(vol->names.upcase, file->fileName, folded, sizeof(folded));
+			if(!nameGlobMatch(pattern, folded) || recoveryScore(file, volBitmap) < minScore) continue;
+			if(file->size > maxExtractSize) {
+				nTooLarge++;
+				continue;
+			}
+			job.files[job.nFiles++] = file;
+		}
+	}
+
+	job.fd = blkDevDescriptor;		/*Pinned, the lock is not held while the files are read */
+	job.dwBytesPerCluster = dwBytesPerCluster;
+	job.relativePartSector = relativePartSector;
+	job.bitmap = volBitmap;
+	job.store = extStore;
+	pthread_mutex_unlock(&volumeLock);
+
+	uint64_t startNs = monotonicNs();
+	while(nThreads < config.recoverThreads && nThreads < job.nFiles &&
+		  pthread_create(&readers[nThreads], NULL, recoverThreadFn, &job) == 0) {
+		nThreads++;
+	}
+	if(nThreads == 0) {
+		recoverThreadFn(&job);
+	}
+	for(i = 0; i < nThreads; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	if(job.nFiles == 0 && nTooLarge == 0) {
+		fprintf(out, "No deleted files %s.\n", byRecord ? "with that record number" : "match that query");
+	} else {
+		fprintf(out, "Recovered %" PRIu32 " deleted files, %" PRIu64 " bytes, in %.3f s with %" PRIu32 " readers.\n",
+				job.countRecovered, job.bytes, (monotonicNs() - startNs)/1e9, nThreads ? nThreads : 1);
+		if(job.countFailed) fprintf(out, "%" PRIu32 " could not be read.\n", job.countFailed);
+		if(nTooLarge) fprintf(out, "%" PRIu32 " larger than %" PRIu64 " bytes were skipped.\n", nTooLarge, maxExtractSize);
+	}
+	free(job.files);
+	return job.countFailed || job.nFiles == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Extracts a $DATA stream of the record indexed under an MFT record number,
+ * reading the record from the device. The term is the record number for the
+ * file's own data, "number:stream" for a named stream, or "number:*" for all.
+ */
+int cmdExtractRecord(FILE *out, uint16_t volume, char *searchTerm) {
+	VOLUME *vol = &volumes[volume];
+	char *mftBuffer = malloc( MFT_RECORD_MAX ); /*Buffer an entire MFT Record here*/
+	char *stream = strchr(searchTerm, ':');
+	int retVal = EXIT_SUCCESS;
+	uint32_t nExtracted = 0;
+
+	if(stream) {
+		*stream++ = '\0';
+	}
+	File *found = searchFiles(out, vol->files, SRCH_NUM, searchTerm);
+	if(!found) {
+		fprintf(out, "No records match that query.\n");
+		free(mftBuffer);
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&volumeLock);
+	volumeSelect(vol);
+	int64_t sOffsBytes = found->sec_offset*SECTOR_SIZE;	/*Every entry of the record has its offset */
+	off_t offs_restore = blk_offset; 			/*Backup current read position */
+
+	/* Read the MFT entry, from disk unless its cluster is cached */
+	if(clusterCacheRead(&clusterCache, volume, blkDevDescriptor, mftBuffer, dwMFTRecordLength, sOffsBytes) != dwMFTRecordLength) {
+		int errsv = errno;
+		fprintf(out, "Failed to read MFT at offset: %" PRIu64 ", with error %s.\n",
+				sOffsBytes, strerror(errsv));
+		retVal = EXIT_FAILURE;
+	} else {
+		NTFS_MFT_FILE_ENTRY_HEADER mftRecHeader;
+		NTFS_ATTRIBUTE *mftRecAttr;
+		ATTR_ITER it;
+		memcpy(&mftRecHeader, mftBuffer, sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
+
+		if(!recordFixup(mftBuffer, dwMFTRecordLength)) {
+			fprintf(out, "Record was torn, or its update sequence is bad, reading it as it is.\n");
+		}
+		attrIterInit(&it, mftBuffer, dwMFTRecordLength);
+		while((mftRecAttr = attrNext(&it))) {
+			if(mftRecAttr->dwType == DATA) {
+				char *streamName = getAttrName(mftRecAttr, mftBuffer+it.offs);
+				bool wanted = stream == NULL ? streamName == NULL :
+							  strcmp(stream, "*") == 0 || (streamName && strcmp(stream, streamName) == 0);
+				if(wanted) {
+					LOG_DEBUG("\tData size: %" PRIu64 " Bytes.\n", mftRecAttr->uchNonResFlag ?
+							  (uint64_t)(mftRecAttr->Attr).NonResident.n64RealSize : (mftRecAttr->Attr.Resident).dwLength);
+					if(extractDataAttr(&mftRecHeader, mftRecAttr, found->fileName) == EXIT_SUCCESS) {
+						fprintf(out, "Extracted %s%s%s.\n", found->fileName, streamName ? ":" : "", streamName ? streamName : "");
+						nExtracted++;
+					}
+				}
+				free(streamName);
+			}
+		}
+		if(it.bad) {
+			/*- NOTE: Some attributes(deleted files?) have impossible record lengths -*/
+			fprintf(out, "Bad record attribute at offset %u.\n", it.next);
+		}
+		if(nExtracted == 0) {
+			fprintf(out, "No %s data was extracted from that record.\n", stream ? "such stream's" : "unnamed stream");
+			retVal = EXIT_FAILURE;
+		}
+	}
+	lseekAbs(blkDevDescriptor, offs_restore);		   /*Restore read position */
+	pthread_mutex_unlock(&volumeLock);
+
+	freeFilesList(found);
+	free(mftBuffer);
+	return retVal;
+}
+
+/**
+ * Reads the cluster at a QEMU write offset (in sectors) and extracts the resident
+ * data of the MFT records in it. Sector offsets rounded to the nearest cluster
+ * may contain up to 4 MFT records; they are read online.
+ */
+int cmdExtractOffset(FILE *out, uint16_t volume, char *searchTerm) {
+	char *buff = malloc( BUFFSIZE );
+	int retVal = EXIT_SUCCESS;
+	int64_t d64SearchTerm = strtoull(searchTerm, NULL, 0);
+
+	pthread_mutex_lock(&volumeLock);
+	volumeSelect(&volumes[volume]);
+	if(d64SearchTerm >= 0) {
+		int64_t sOffsBytes = d64SearchTerm*SECTOR_SIZE;
+		off_t offs_restore = blk_offset; 			/*Backup current read position */
+		uint32_t readLen = dwBytesPerCluster > dwMFTRecordLength ? dwBytesPerCluster : dwMFTRecordLength;
+		char *cBuff = malloc( readLen );
+
+		/* Read the cluster, or the record if it is larger, from disk unless it is cached */
+		if(clusterCacheRead(&clusterCache, volume, blkDevDescriptor, cBuff, readLen, sOffsBytes) == -1) {
+			int errsv = errno;
+			fprintf(out, "Failed to read cluster at offset: %" PRIu64 ", with error %s.\n",
+					sOffsBytes, strerror(errsv));
+			pthread_mutex_unlock(&volumeLock);
+			free(cBuff);
+			free(buff);
+			return EXIT_FAILURE;
+		}
+
+		/* Try to read MFT records from the cluster memory*/
+		uint32_t recN = 0;
+		char *mftBuff = malloc( dwMFTRecordLength );
+		NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) );
+		NTFS_ATTRIBUTE *mftRecAttr;
+		ATTR_ITER it;
+
+		for(; recN < readLen/dwMFTRecordLength; recN++) {
+			memcpy(mftBuff, cBuff+(recN*dwMFTRecordLength), dwMFTRecordLength);
+			/* Copy MFT record header*/
+			memcpy(mftRecHeader, mftBuff, sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
+			/* Check if this memory contains an MFT record, they all start 'FILE0' */
+			if(strcmp("FILE0", mftRecHeader->fileSignature) == 0) {
+				char * fName = NULL;
+				if(!recordFixup(mftBuff, dwMFTRecordLength)) {
+					fprintf(out, "Record %u was torn, or its update sequence is bad.\n", recN);
+				}
+				attrIterInit(&it, mftBuff, dwMFTRecordLength);
+				while((mftRecAttr = attrNext(&it))) {
+					if(mftRecAttr->dwType == STANDARD_INFORMATION) { /*Contains create/modify stamps */
+						STD_INFORMATION stdInfo;		   /*STANDARD_INFORMATION is always resident */
+						attrResidentCopy(mftRecAttr, &stdInfo, sizeof(STD_INFORMATION));
+						uint64_t altTime = stdInfo.fileAltTime;
+						fprintf(out, "\tFile alt time: %" PRIu64 "\n", altTime);
+					}
+
+					else if(mftRecAttr->dwType == FILE_NAME) { /* Get file name */
+						char *linkName = getFileName(mftRecAttr, mftBuff, it.offs);
+						if(linkName == NULL) continue;
+						fprintf(out, "\t%s\n", linkName);
+						if(fName == NULL || getFileNameSpace(mftRecAttr, mftBuff, it.offs) != FILE_NAME_DOS) {
+							free(fName);	/*Extracted under the last name, an 8.3 name only if there is no other */
+							fName = linkName;
+						} else {
+							free(linkName);
+						}
+					}
+
+					else if(mftRecAttr->dwType == DATA) {
+						char *streamName = getAttrName(mftRecAttr, mftBuff+it.offs);
+						fprintf(out, "Has data%s%s\n", streamName ? " in stream " : "", streamName ? streamName : "");
+						free(streamName);
+						if(mftRecAttr->uchNonResFlag == false) { /*$DATA is resident */
+							uint32_t attrDataSize = (mftRecAttr->Attr.Resident).dwLength;
+							fprintf(out, "\tData size: %d Bytes.\n", attrDataSize);
+
+							/* Extract the file, or stream, to disk */
+							extractDataAttr(mftRecHeader, mftRecAttr, fName ? fName : "");
+						}
+					}
+				}
+				/*- NOTE: Some attributes have impossible lengths, longer than the record -*/
+				if(it.bad) {
+					LOG_DEBUG("Bad record attribute at offset %u.\n", it.next);
+					countBadAttr++;
+				}
+				free(fName);
+			}
+
+		}
+
+		lseekAbs(blkDevDescriptor, offs_restore);		   /*Restore read position */
+
+		free(mftBuff);
+		free(mftRecHeader);
+		free(cBuff);
+	}
+	pthread_mutex_unlock(&volumeLock);
+	free(buff);
+	return retVal;
+}
+
+/**
+ * Selects the volume later commands work on, by name or index.
+ */
+int cmdUseVolume(FILE *out, char *searchTerm, uint16_t *volume) {
+	char *end = NULL;
+	unsigned long index = strtoul(searchTerm, &end, 10);
+	bool isIndex = end != searchTerm && *end == '\0';
+	uint16_t v;
+	for(v = 0; v < nVolumes; v++) {
+		if((isIndex && index == v) || strcmp(searchTerm, volumes[v].cfg->name) == 0) {
+			*volume = v;
+			fprintf(out, "Using volume %u, %s on %s.\n", v, volumes[v].cfg->name, volumes[v].cfg->device);
+			return EXIT_SUCCESS;
+		}
+	}
+	fprintf(out, "No volume %s.\n", searchTerm);
+	return EXIT_FAILURE;
+}
+
+/**
+ * Starts the consumer thread extracting files from the writes guests report.
+ */
+int cmdServerStart(FILE *out) {
+	int retVal = EXIT_SUCCESS;
+	pthread_mutex_lock(&consumerLock);
+	fprintf(out, "starting...\n");
+	if(!consumerRunning) {
+		if(pthread_create(&consumer_tid, NULL, consumerThreadFn, NULL) == 0) {
+			consumerRunning = true;
+			fprintf(out, "Server started.\n");
+		} else {
+			fprintf(out, "Failed to start the consumer thread.\n");
+			retVal = EXIT_FAILURE;
+		}
+	} else {
+		fprintf(out, "Server already running.\n");
+	}
+	pthread_mutex_unlock(&consumerLock);
+	return retVal;
+}
+
+/**
+ * Stops the consumer thread once it has drained the queue, or after
+ * DRAIN_TIMEOUT_MS, and consumed the writes held for coalescing.
+ */
+int cmdServerStop(FILE *out) {
+	pthread_mutex_lock(&consumerLock);
+	fprintf(out, "Stopping...\n");
+	if(consumerRunning) {
+		__atomic_store_n(&consumerStop, true, __ATOMIC_RELEASE);
+		pthread_join(consumer_tid, NULL); /* Wait for thread to exit */
+		consumerStop = false;
+		consumerRunning = false;
+		if(QDepth() > 0) {
+			fprintf(out, "%" PRIu64 " queued writes not consumed.\n", QDepth());
+		}
+		fprintf(out, "Server stopped.\n");
+	} else {
+		fprintf(out, "Server not running.\n");
+	}
+	pthread_mutex_unlock(&consumerLock);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Runs one of the commands taking a search term.
+ */
+int runTermCommand(FILE *out, int8_t cmd, char *searchTerm, uint16_t *volume) {
+	switch(cmd) {
+	case SRCH_FOR_MFTN:	return cmdSearch(out, *volume, SRCH_NUM, searchTerm);
+	case SRCH_FOR_MFTC:	return cmdSearch(out, *volume, SRCH_NAME, searchTerm);
+	case SRCH_FOR_MFTO:	return cmdSearch(out, *volume, SRCH_CROFFS, searchTerm);
+	case SRCH_FOR_TIME:	return cmdSearchTime(out, *volume, searchTerm);
+	case EXT_MFTN:		return cmdExtractRecord(out, *volume, searchTerm);
+	case EXT_MFTCO:		return cmdExtractOffset(out, *volume, searchTerm);
+	case USE_VOLUME:	return cmdUseVolume(out, searchTerm, volume);
+	case EXPORT_FILES:	return cmdExport(out, *volume, searchTerm);
+	case SRCH_DELETED:	return cmdSearchDeleted(out, *volume, searchTerm);
+	case RECOVER_FILES:	return cmdRecover(out, *volume, searchTerm);
+	}
+	return EXIT_FAILURE;
+}
+
+/**
+ * Runs a control socket request: a command with any search term on the same line.
+ *
+ * Returns EXIT_SUCCESS, EXIT_FAILURE, or CTL_CLOSE to end the session.
+ */
+int runCommand(FILE *in, FILE *out, char *line, uint16_t *volume) {
+	char *searchTerm;
+	int8_t cmd = parseCommandLine(line, &searchTerm);
+	switch(cmd) {
+	case PRINT_HELP:
+		fprintf(out, HELP);
+		fprintf(out, "Give the search term on the same line. " SHUTDOWN_CMD " stops a daemon.\n");
+		return EXIT_SUCCESS;
+	case PRINT_FILES:
+		cmdPrintFiles(out, *volume);
+		return EXIT_SUCCESS;
+	case FREE_SPACE:
+		return cmdFreeSpace(out, *volume);
+	case BATCH_MFTN:
+		return cmdBatchSearch(in, out, *volume, SRCH_NUM);
+	case BATCH_MFTC:
+		return cmdBatchSearch(in, out, *volume, SRCH_NAME);
+	case BATCH_MFTO:
+		return cmdBatchSearch(in, out, *volume, SRCH_CROFFS);
+	case UDSSTART:
+		return cmdServerStart(out);
+	case UDSSTOP:
+		return cmdServerStop(out);
+	case SHUTDOWN:
+		if(!config.daemon) {
+			fprintf(out, "Only a daemon can be shut down from here.\n");
+			return EXIT_FAILURE;
+		}
+		fprintf(out, "Shutting down.\n");
+		kill(getpid(), SIGTERM);	/*Taken by sigwait in main */
+		return EXIT_SUCCESS;
+	case EXIT:
+		return CTL_CLOSE;
+	case UNKNOWN:
+		fprintf(out, "Command not recognised, try \'help\'\n");
+		return EXIT_FAILURE;
+	}
+	if(*searchTerm == '\0') {
+		fprintf(out, "%s needs a search term.\n", line);
+		return EXIT_FAILURE;
+	}
+	return runTermCommand(out, cmd, searchTerm, volume);
+}
+
+/**
+ * Opens the block device (or image file) and, for each NTFS partition in its MBR,
+ * copies the $MFT to a local file, with a FRAG record ahead of each fragment giving
+ * the offset it was read from. The geometry of the last partition is left in the
+ * volume globals and mftCopyName names its $MFT copy. A device holding an NTFS
+ * volume without a partition table, such as a loop device over one partition, is
+ * taken as a single partition at offset 0.
+ */
+int mountVolume(const char *device) {
 	ssize_t readStatus;
 	int workingPartition = -1;
 	uint64_t u64bytesAbsoluteMFT = -1;
 	char* buff = malloc( BUFFSIZE );	/*Used for getPartitionInfo(...), getBootSectinfo(...) et al*/
-	char* mftBuffer = malloc( MFT_RECORD_LENGTH ); /*Buffer an entire MFT Record here*/
-
-	system("clear"); /*Clear terminal window */
-	printf("Launching raw NTFS extraction engine for %s\n", BLOCK_DEVICE);
+	char* mftBuffer = malloc( MFT_RECORD_MAX ); /*Buffer an entire MFT Record here*/
 
 	/*Open block device in read-only mode */
-	if((blkDevDescriptor = open(BLOCK_DEVICE, O_RDONLY)) == -1 ) {
+	if((blkDevDescriptor = open(device, O_RDONLY)) == -1 ) {
 		int errsv = errno;
-		printf("Failed to open block device %s with error: %s.\n", BLOCK_DEVICE, strerror(errsv));
+		printf("Failed to open block device %s with error: %s.\n", device, strerror(errsv));
 		return EXIT_FAILURE;
 	}
 
 	if((endOfDev = lseek(blkDevDescriptor, 0, SEEK_END)) == -1) {
 		int errsv = errno;
-		printf("Failed to locate end of block device %s with error: %s.\n", BLOCK_DEVICE, strerror(errsv));
+		printf("Failed to locate end of block device %s with error: %s.\n", device, strerror(errsv));
 		return EXIT_FAILURE;
 	}
-	if(DEBUG) printf("end of block device: %" PRIu64 "\n", endOfDev);
-
+	LOG_DEBUG("end of block device: %" PRIu64 "\n", endOfDev);
 
-	/*Seek partition table  */
-	lseekAbs(blkDevDescriptor, P_OFFSET);
 
-	/*--------------------- Read in primary partitions from MBR ---------------------*/
-	printf("Reading primary partition data: ");
 	PARTITION *priParts;
 	PARTITION *nTFSParts[P_PARTITIONS];
 	int i, nNTFS = 0;
+	bool unpartitioned = false;
 	priParts = malloc( sizeof(PARTITION) );
 
+	/*An unpartitioned volume starts with its NTFS boot sector */
+	NTFS_BOOT_SECTOR *sector0 = malloc( sizeof(NTFS_BOOT_SECTOR) );
+	lseekAbs(blkDevDescriptor, 0);
+	if(read(blkDevDescriptor, sector0, sizeof(NTFS_BOOT_SECTOR)) == sizeof(NTFS_BOOT_SECTOR) &&
+	   memcmp(sector0->chOemID, "NTFS", sizeof(sector0->chOemID)) == 0) {
+		nTFSParts[nNTFS] = calloc(1, sizeof(PARTITION));
+		nTFSParts[nNTFS++]->chType = NTFS_TYPE;
+		unpartitioned = true;
+		printf("Unpartitioned NTFS volume.\n");
+	}
+	free(sector0);
+
+	/*Seek partition table  */
+	lseekAbs(blkDevDescriptor, P_OFFSET);
+
+	/*--------------------- Read in primary partitions from MBR ---------------------*/
+	if(!unpartitioned) printf("Reading primary partition data: ");
+
 	/*Iterate the primary partitions in MBR to look for NTFS partitions, if found copy */
-	for(i = 0; i < P_PARTITIONS; i++) {
+	for(i = 0; i < P_PARTITIONS && !unpartitioned; i++) {
 		if((readStatus = read( blkDevDescriptor, priParts, sizeof(PARTITION))) == -1){
 			int errsv = errno;
 			printf("Failed to open partition table with error: %s.\n", strerror(errsv));
@@ -121,7 +1094,8 @@ int main(int argc, char* argv[]) {
 				memcpy(nTFSParts[nNTFS++], priParts, sizeof(PARTITION)); /*Copy to NTFS Partition array */
 				if(DEBUG) {
 					getPartitionInfo(buff, priParts);
-					printf("\nPartition %d:\n%s\n",i, buff);
+					LOG_DEBUG("Partition %d:\n", i);
+					logText(LOG_LVL_DEBUG, buff);
 				}
 			}
 		}
@@ -140,38 +1114,62 @@ int main(int argc, char* argv[]) {
 	/*-------------- Follow relative sector offset of NTFS partitions ---------------*/
 	for(workingPartition = 0; workingPartition < nNTFS; workingPartition++) {
 		NTFS_BOOT_SECTOR *nTFS_Boot = malloc( sizeof(NTFS_BOOT_SECTOR) );
-		relativePartSector = nTFSParts[workingPartition]->dwRelativeSector*SECTOR_SIZE;
-
-		/*Set offset pointer to partition table */
-		lseekAbs(blkDevDescriptor, relativePartSector);
-
-		if((readStatus = read(blkDevDescriptor, nTFS_Boot, sizeof(NTFS_BOOT_SECTOR))) == -1) {
-			int errsv = errno;
-			printf("Failed to open NTFS Boot sector for partition %d with error: %s.\n",i , strerror(errsv));
-		} else {
-			printf("\nExtracting MFT from partition %d\n", workingPartition);
+		uint32_t diskSecSize;
+
+		/*The partition table counts the disk's own sectors, 4096 bytes on a 4K native
+		  disk, so take the sector size which finds the boot sector */
+		for(diskSecSize = SECTOR_SIZE; diskSecSize <= DISK_SECTOR_MAX; diskSecSize *= 8) {
+			relativePartSector = (uint64_t)nTFSParts[workingPartition]->dwRelativeSector*diskSecSize;
+			lseekAbs(blkDevDescriptor, relativePartSector);
+			if((readStatus = read(blkDevDescriptor, nTFS_Boot, sizeof(NTFS_BOOT_SECTOR))) == -1) {
+				int errsv = errno;
+				printf("Failed to open NTFS Boot sector for partition %d with error: %s.\n", workingPartition, strerror(errsv));
+				return EXIT_FAILURE;
+			}
+			if(readStatus == sizeof(NTFS_BOOT_SECTOR) &&
+			   memcmp(nTFS_Boot->chOemID, "NTFS", sizeof(nTFS_Boot->chOemID)) == 0) {
+				break;
+			}
+		}
+		if(diskSecSize > DISK_SECTOR_MAX) {
+			printf("No NTFS boot sector found for partition %d.\n", workingPartition);
+			return EXIT_FAILURE;
 		}
+		printf("\nExtracting MFT from partition %d\n", workingPartition);
 		if(nTFSParts[workingPartition]->chBootInd == 0x08) { /*If this is a Bootable NTFS partition -0x80*/
 			printf("\tThis is the boot partition.\n");
 		}
 
 		/*------ If NTFS boot sector found then use it to find Master File Table -----*/
-		if (DEBUG) {
+		if(DEBUG) {
 			getBootSectInfo(buff, nTFS_Boot);
-			printf("\nNTFS boot sector data\n%s\n", buff);
+			LOG_DEBUG("NTFS boot sector data\n");
+			logText(LOG_LVL_DEBUG, buff);
+		}
+		/*Geometry of the volume, the bytes per sector, cluster and MFT record */
+		uint16_t wBytesPerSec = nTFS_Boot->bpb.wBytesPerSec;
+		dwBytesPerCluster = getBytesPerCluster(nTFS_Boot);
+		dwMFTRecordLength = getMFTRecordLength(nTFS_Boot);
+		if(wBytesPerSec < SECTOR_SIZE || wBytesPerSec > DISK_SECTOR_MAX || (wBytesPerSec & (wBytesPerSec - 1)) ||
+		   dwBytesPerCluster < wBytesPerSec || dwMFTRecordLength < MFT_RECORD_LENGTH ||
+		   dwMFTRecordLength > MFT_RECORD_MAX || (dwMFTRecordLength & (dwMFTRecordLength - 1))) {
+			printf("Unsupported volume geometry on partition %d: %u byte sectors, %u byte clusters, %u byte MFT records.\n",
+				   workingPartition, wBytesPerSec, dwBytesPerCluster, dwMFTRecordLength);
+			return EXIT_FAILURE;
 		}
-		/*Calculate the number of bytes per sector = sectors per cluster * bytes per sector */
-		dwBytesPerCluster = (nTFS_Boot->bpb.uchSecPerClust) * (nTFS_Boot->bpb.wBytesPerSec);
-		if (DEBUG) printf("Filesystem Bytes Per Cluster: %d\n", dwBytesPerCluster);
+		volBitmap->nClusters = (uint64_t)nTFS_Boot->bpb.n64TotalSec*wBytesPerSec/dwBytesPerCluster;
+		/*No record numbers past those of an $MFT filling the rest of the device are kept */
+		recCacheLimit(recCache, endOfDev > relativePartSector ? (endOfDev - relativePartSector)/dwMFTRecordLength : 0);
+		printf("\t%u byte sectors, %u byte clusters, %u byte MFT records.\n", wBytesPerSec, dwBytesPerCluster, dwMFTRecordLength);
 		/*Calculate the number of bytes by which the boot sector is offset on disk */
-		uint64_t u64bytesAbsoluteSector = (nTFS_Boot->bpb.wBytesPerSec) * (nTFSParts[workingPartition]->dwRelativeSector);
-		if (DEBUG) printf("Bootsector offset in bytes: %" PRIu64 "\n", u64bytesAbsoluteSector );
+		uint64_t u64bytesAbsoluteSector = relativePartSector;
+		LOG_DEBUG("Bootsector offset in bytes: %" PRIu64 "\n", u64bytesAbsoluteSector );
 		/*Calculate the relative bytes location of the MFT on the partition */
 		uint64_t u64bytesRelativeMFT = dwBytesPerCluster * (nTFS_Boot->bpb.n64MFTLogicalClustNum);
-		if (DEBUG) printf("Relative bytes location of MFT: %" PRIu64 "\n", u64bytesRelativeMFT);
+		LOG_DEBUG("Relative bytes location of MFT: %" PRIu64 "\n", u64bytesRelativeMFT);
 		/*Absolute MFT offset in bytes*/
 		u64bytesAbsoluteMFT = u64bytesAbsoluteSector + u64bytesRelativeMFT;
-		if (DEBUG) printf("Absolute MFT location in bytes: %" PRIu64 "\n", u64bytesAbsoluteMFT);
+		LOG_DEBUG("Absolute MFT location in bytes: %" PRIu64 "\n", u64bytesAbsoluteMFT);
 
 		/*Find the root directory metafile entry in the MFT, and extract its index allocation attributes */
 		/*$MFT is always the first MFT record, and it's mirror the second */
@@ -188,7 +1186,7 @@ int main(int argc, char* argv[]) {
 		char * utf8FileName = NULL;
 		mftMetaMFT = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) ); /*Allocate for the file header */
 		/* Read the MFT entry */
-		if((readStatus = read( blkDevDescriptor, mftBuffer, MFT_RECORD_LENGTH)) == -1) { /*Read the next record */
+		if((readStatus = read( blkDevDescriptor, mftBuffer, dwMFTRecordLength)) == -1) { /*Read the next record */
 			int errsv = errno;
 			printf("Failed to read MFT at offset: %" PRIu64 ", with error %s.\n",
 					u64bytesAbsoluteMFT, strerror(errsv));
@@ -196,168 +1194,125 @@ int main(int argc, char* argv[]) {
 		}
 		/* Copy MFT record header*/
 		memcpy(mftMetaMFT, mftBuffer, sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
-		if(DEBUG) printf("\nRead MFT record %d into buffer.\n", i);
+		LOG_DEBUG("Read MFT record %d into buffer.\n", i);
+		if(!recordFixup(mftBuffer, dwMFTRecordLength)) {
+			printf("\tThe $MFT record's update sequence is bad, reading it as it is.\n");
+		}
 
 		/*------------------------- Get MFT Record attributes ------------------------*/
 		if(DEBUG) {
 			getFILE0Attrib(buff, mftMetaMFT);
-			printf("%s\n", buff);
+			logText(LOG_LVL_DEBUG, buff);
 		}
 
-		NTFS_ATTRIBUTE *mftRecAttrib, *mftRecAttribTemp = malloc( sizeof(NTFS_ATTRIBUTE) );
-		//mftRecAttrib = malloc(MFT_RECORD_LENGTH);
-		uint16_t attribOffset = mftMetaMFT->wAttribOffset; /*Offset to attributes */
+		NTFS_ATTRIBUTE *mftRecAttrib;
+		ATTR_ITER it;
 
 		/*---------------------- Follow attribute(s) offset position(s) ---------------------*/
-		do {
-			memcpy(mftRecAttribTemp, mftBuffer+attribOffset, sizeof(NTFS_ATTRIBUTE));
-			/*Determine actual attribute length and use to copy full attribute */
-			mftRecAttrib = malloc(mftRecAttribTemp->dwFullLength);
-			memcpy(mftRecAttrib, mftBuffer+attribOffset, mftRecAttribTemp->dwFullLength);
-			if (VERBOSE & DEBUG) {
+		attrIterInit(&it, mftBuffer, dwMFTRecordLength);
+		while((mftRecAttrib = attrNext(&it))) {
+			uint16_t attribOffset = it.offs;
+			if(VERBOSE) {
 				getFileAttribMembers(buff, mftRecAttrib);
-				printf("%s\n", buff);
+				logText(LOG_LVL_TRACE, buff);
 			}
 
-			if(DEBUG && mftRecAttrib->dwType == STANDARD_INFORMATION) { /*if is STANDATRD_INFORMATION attribute */
-				printf("STANDARD_INFORMATION attribute\n");
+			if(mftRecAttrib->dwType == STANDARD_INFORMATION) { /*if is STANDATRD_INFORMATION attribute */
+				LOG_DEBUG("STANDARD_INFORMATION attribute\n");
 			}
-			else if(DEBUG && mftRecAttrib->dwType == ATTRIBUTE_LIST) {
-				printf("ATTRIBUTE_LIST attribute\n");
+			else if(mftRecAttrib->dwType == ATTRIBUTE_LIST) {
+				LOG_DEBUG("ATTRIBUTE_LIST attribute\n");
 			}
 			else if(mftRecAttrib->dwType == FILE_NAME) { /*If is FILE_NAME attribute */
+				free(utf8FileName);
 				utf8FileName = getFileName(mftRecAttrib, mftBuffer, attribOffset);
 				/* Check if fileName == $MFT, set toggle */
-				if( strcmp(utf8FileName, "$MFT" ) == 0 ) {
+				if( utf8FileName && strcmp(utf8FileName, "$MFT" ) == 0 ) {
 					isMFTFile = true;
 				} else {
 					isMFTFile = false;
 				}
-			} else if(DEBUG && mftRecAttrib->dwType == OBJECT_ID ) {
-				printf("OBJECT_ID attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == SECURITY_DESCRIPTOR) {
-				printf("SECURITY_DESCRIPTOR attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == VOLUME_NAME) {
+			} else if(mftRecAttrib->dwType == OBJECT_ID ) {
+				LOG_DEBUG("OBJECT_ID attribute\n");
+			} else if(mftRecAttrib->dwType == SECURITY_DESCRIPTOR) {
+				LOG_DEBUG("SECURITY_DESCRIPTOR attribute\n");
+			} else if(mftRecAttrib->dwType == VOLUME_NAME) {
 				/*This attribute simply contains the name of the volume. (In UNICODE!) */
-				printf("VOLUME_NAME attribute\n");
-				VOLUME_NAME_ATTR *vNameAttr = malloc( mftRecAttrib->Attr.Resident.dwLength + 1);
-				memcpy(vNameAttr, mftBuffer + attribOffset + (mftRecAttrib->Attr).Resident.wAttrOffset,
-						(mftRecAttrib->Attr).Resident.dwLength);
-				printf("\tVolume Name: %s\n", vNameAttr->arrUnicodeVolumeName);
-				free(vNameAttr);
-			} else if(DEBUG && mftRecAttrib->dwType == VOLUME_INFORMATION) {
-				printf("VOLUME_INFORMATION attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == DATA) {
-				printf("DATA attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == INDEX_ROOT) {
+				LOG_DEBUG("VOLUME_NAME attribute\n");
+				if(DEBUG) {
+					uint16_t unicodeName[128];
+					char volumeName[3*128 + 1];
+					uint32_t len = attrResidentCopy(mftRecAttrib, unicodeName, sizeof(unicodeName));
+					utf16ToUtf8(volumeName, unicodeName, len/sizeof(uint16_t));
+					LOG_DEBUG("\tVolume Name: %s\n", volumeName);
+				}
+			} else if(mftRecAttrib->dwType == VOLUME_INFORMATION) {
+				LOG_DEBUG("VOLUME_INFORMATION attribute\n");
+			} else if(mftRecAttrib->dwType == DATA) {
+				LOG_DEBUG("DATA attribute\n");
+			} else if(mftRecAttrib->dwType == INDEX_ROOT) {
 				/*This is the root node of the B+ tree that implements an index (e.g. a directory).
 			  This file attribute is always resident. */
-				printf("INDEX_ROOT attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == INDEX_ALLOCATION) {
-				printf("INDEX_ALLOCATION attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == BITMAP) {
+				LOG_DEBUG("INDEX_ROOT attribute\n");
+			} else if(mftRecAttrib->dwType == INDEX_ALLOCATION) {
+				LOG_DEBUG("INDEX_ALLOCATION attribute\n");
+			} else if(mftRecAttrib->dwType == BITMAP) {
 				/*This file attribute is a sequence of bits, each of which represents the status of an entity. */
-				printf("BITMAP attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == REPARSE_POINT) {
-				printf("REPARSE_POINT attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == EA_INFORMATION) {
-				printf("EA_INFORMATION attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == EA) {
-				printf("EA attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == LOGGED_UTILITY_STREAM) {
-				printf("LOGGED_UTILITY_STREAM attribute\n");
+				LOG_DEBUG("BITMAP attribute\n");
+			} else if(mftRecAttrib->dwType == REPARSE_POINT) {
+				LOG_DEBUG("REPARSE_POINT attribute\n");
+			} else if(mftRecAttrib->dwType == EA_INFORMATION) {
+				LOG_DEBUG("EA_INFORMATION attribute\n");
+			} else if(mftRecAttrib->dwType == EA) {
+				LOG_DEBUG("EA attribute\n");
+			} else if(mftRecAttrib->dwType == LOGGED_UTILITY_STREAM) {
+				LOG_DEBUG("LOGGED_UTILITY_STREAM attribute\n");
 			} else {
-				if(DEBUG) printf("Unknown attribute of type: %d.\n", mftRecAttrib->dwType);
+				LOG_DEBUG("Unknown attribute of type: %d.\n", mftRecAttrib->dwType);
 			}
 			/* Is attribute resident? */
-			if(DEBUG) printf("\t%s ", mftRecAttrib->uchNonResFlag==true?"Non-Resident.":"Resident.");
+			LOG_DEBUG("\t%s ", mftRecAttrib->uchNonResFlag==true?"Non-Resident.":"Resident.");
 
 			if(mftRecAttrib->uchNonResFlag==false) { /*Is resident */
 				uint32_t attribDataSize = (mftRecAttrib->Attr.Resident).dwLength;
-				if(DEBUG && VERBOSE) {
-					printf("\tData size: %d Bytes.\n", attribDataSize);
-					size_t attribDataOffset = (mftRecAttrib->Attr.Resident).wAttrOffset;
-					uint16_t * residentData = malloc( attribDataSize );
-					/* Dump raw resident-attribute data for debugging purposes. */
-					memcpy(residentData, mftBuffer+attribOffset+attribDataOffset, attribDataSize);
-					int  k = 0;
-					printf("\tSize of data: %lu Raw attribute data: ", attribDataSize/sizeof(uint16_t));
-					for(; k<attribDataSize/sizeof(uint16_t); k++) {
-						printf("%04x: ", residentData[k]);
-						printf("%c ", residentData[k]&0xFF);
-					}
-					printf("\n");
-					free(residentData);
+				LOG_TRACE("\tData size: %u Bytes.\n", attribDataSize);
+				if(VERBOSE) { /* Dump raw resident-attribute data */
+					logHex(LOG_LVL_TRACE, mftBuffer+attribOffset+(mftRecAttrib->Attr.Resident).wAttrOffset, attribDataSize);
 				}
 			}
 			/*--------- If the attribute data is non-resident then... ---------*/
 			else if(mftRecAttrib->uchNonResFlag==true) {
-				uint8_t countRuns = 0;
-				OFFS_LEN_BITFIELD *offs_len_bitField = malloc( sizeof(OFFS_LEN_BITFIELD) );
+				uint32_t countRuns = 0;
+				bool badRuns;
 				uint64_t realSize = (mftRecAttrib->Attr).NonResident.n64RealSize;
 
 				/*Offset to data runs */
 				uint16_t dataRunOffset = (mftRecAttrib->Attr).NonResident.wDatarunOffset;
-				if(DEBUG) {
-					printf("\tReal file size: %" PRId64 " bytes.\n", realSize);
-					printf("\tData run offset in attribute header: %u out of %u\n", dataRunOffset, mftRecAttrib->dwFullLength);
-					printf("\tProcessing run list...\n");
-				}
-				uint64_t *runLen = malloc( sizeof(uint64_t) ); /*The length and offset data run fields are always 8 or less bytes */
-				int64_t *runOffs = malloc( sizeof(int64_t) ); /* Offset is signed */
-				DataRun *runListP = NULL; /*Allocate for runlist */
-				do {
-					/*Follow offset to data runs, read first data run. */
-					/*First read it's offset and length nibbles using the bitfield */
-					/*Top four bits represent a length, and the last four bits represent an offset. */
-					if(countRuns == 0) {
-						memcpy(offs_len_bitField, mftBuffer+attribOffset+dataRunOffset, sizeof(OFFS_LEN_BITFIELD));
-					}
-					if(DEBUG && VERBOSE) {
-						printf("\tlength of length field of datarun: %u ", offs_len_bitField->bitfield.lengthSize);
-						printf("\tlength of offset field of datarun: %u\n", offs_len_bitField->bitfield.offsetSize);
-					}
-
-					*runLen = 0; /*Initialise to zero since values may be less than 8 bytes long */
-					*runOffs = 0;
-					dataRunOffset++; /*Move offset past offset_length_union */
-
-					/*Copy length field from run list */
-					memcpy(runLen, mftBuffer+attribOffset+dataRunOffset, offs_len_bitField->bitfield.lengthSize);
-					dataRunOffset+=offs_len_bitField->bitfield.lengthSize; /*Move offset past length field */
-
-					/*Copy offset field from run list */
-					memcpy(runOffs, mftBuffer+attribOffset+dataRunOffset, offs_len_bitField->bitfield.offsetSize);
-					dataRunOffset+=offs_len_bitField->bitfield.offsetSize; /*Move offset past offset field */
-
-					runListP = addRun(runListP, *runLen, *runOffs);
-					if(DEBUG && VERBOSE) {
-						printf("\tLength of datarun: %" PRIu64 " clusters\t", *runLen);
-						printf("\tVCN offset to datarun: %" PRId64 " clusters\n", *runOffs);
-					}
+				LOG_DEBUG("\tReal file size: %" PRId64 " bytes.\n", realSize);
+				LOG_DEBUG("\tData run offset in attribute header: %u out of %u\n", dataRunOffset, mftRecAttrib->dwFullLength);
+				LOG_DEBUG("\tProcessing run list...\n");
+				/*Top four bits of each run's header give the size of its offset, the last four its length */
+				DataRun *runListP = decodeRunList((uint8_t *)mftBuffer+attribOffset+dataRunOffset,
+												  (uint8_t *)mftBuffer+attribOffset+mftRecAttrib->dwFullLength, &badRuns), *run;
+				for(run = runListP; run; run = run->p_next) {
 					countRuns++;
-
-					/*Copy next bitfield header, check if == 0 for loop termination */
-					memcpy(offs_len_bitField, mftBuffer+attribOffset+dataRunOffset, sizeof(OFFS_LEN_BITFIELD));
-				} while(offs_len_bitField->val != 0);
-				free(runLen);
-				free(runOffs);
-
-				runListP = reverseList(runListP);
+				}
+				if(badRuns) {
+					printf("\tRun list is malformed, using its first %u runs.\n", countRuns);
+				}
 				if(DEBUG) {
 					printRuns(buff, runListP);
-					printf("%s", buff);
-					printf("\tFinished processing %u data runs from runlist\n", countRuns);
+					logText(LOG_LVL_DEBUG, buff);
 				}
+				LOG_DEBUG("\tFinished processing %u data runs from runlist\n", countRuns);
 
 				/*Now.. I need the DATA attribute from the MFT, so check */
 				/*If this is it, then extract it to a local file*/
-				if(isMFTFile && (mftRecAttrib->dwType == DATA)) {
+				if(isMFTFile && (mftRecAttrib->dwType == DATA) && runListP) {
 					printf("\t$MFT meta file found.\n");
-					uint8_t fileNameLen = snprintf(NULL, 0, "%s%d", utf8FileName , workingPartition) + 1; // \0 terminated
-					char * mFTfileName = malloc( fileNameLen );
+					char mFTfileName[FILENAME_MAX];
 
-					snprintf(mFTfileName, fileNameLen, "%s%d.data", utf8FileName, workingPartition);
+					snprintf(mFTfileName, sizeof(mFTfileName), "%s%s%d", mftCopyPrefix, utf8FileName, workingPartition);
 					if((MFT_offline_copy = fopen(mFTfileName, "w+")) == NULL) {/*Open/create file, r/w pointer at start */
 						int errsv = errno;
 						printf("Failed to create local file for storing %s: %s.\n", utf8FileName, strerror(errsv));
@@ -367,7 +1322,7 @@ int main(int argc, char* argv[]) {
 						printf("\t%s is fragmented on disk, located %u fragments.\n", utf8FileName, countRuns);
 					}
 					printf("\tWriting DATA attribute to local %s file\n", mFTfileName);
-					free(mFTfileName);
+					snprintf(mftCopyName, sizeof(mftCopyName), "%s", mFTfileName);
 
 					off_t offset_restore = blk_offset; /*Backup the current read offset */
 
@@ -379,14 +1334,12 @@ int main(int argc, char* argv[]) {
 					uint64_t sizeofMFT = 0;
 					while (p_current_item) {
 						off_t nonResReadFrom =  dwBytesPerCluster*(p_current_item->offset);
-						if(DEBUG) {
-							printf("\t%" PRIu64 "\t%" PRId64 "\n", p_current_item->offset, p_current_item->length);
-							printf("\tnonResReadFrom: %" PRId64 "\n", nonResReadFrom);
-						}
+						LOG_DEBUG("\t%" PRIu64 "\t%" PRId64 "\n", p_current_item->offset, p_current_item->length);
+						LOG_DEBUG("\tnonResReadFrom: %" PRId64 "\n", nonResReadFrom);
 
 						/* Move file pointer to the cluster */
 						lseekRel(blkDevDescriptor, nonResReadFrom);
-						if(DEBUG && VERBOSE) printf("\tblk_offset = %" PRId64 "\n", blk_offset);
+						LOG_TRACE("\tblk_offset = %" PRId64 "\n", blk_offset);
 
 						size_t readLength = dwBytesPerCluster*p_current_item->length;
 						char * dataRun = malloc( readLength );
@@ -411,6 +1364,11 @@ int main(int argc, char* argv[]) {
 							}
 							sizeofMFT += readLength;
 							free(frag);
+							/*Only the $MFT's clusters are kept in the cluster cache */
+							if(clusterCacheRegion(&clusterCache, curVolume ? curVolume - volumes : 0,
+												  blk_offset, readLength) == EXIT_FAILURE) {
+								printf("Failed to add the $MFT fragment to the cluster cache.\n");
+							}
 						}
 						free(dataRun);
 
@@ -426,15 +1384,14 @@ int main(int argc, char* argv[]) {
 				}// end of if(isMFTFile && (mftRecAttrib->dwType == DATA))
 
 				freeRunList(runListP);
-				free(offs_len_bitField);
 				//free(p_head); Can't free this yet.
 			}
-			if(DEBUG && VERBOSE) printf("attribOffset: %u", attribOffset);
-			attribOffset += mftRecAttrib->dwFullLength; /*Increment the offset by the length of this attribute */
-			free(mftRecAttrib);
-		} while( attribOffset+MFT_FILE_ATTR_PAD < mftMetaMFT->dwRecLength ); /*While there are attributes left to inspect */
+			LOG_TRACE("attribOffset: %u", attribOffset);
+		}
+		if(it.bad) {
+			printf("\tBad attribute in the $MFT record at offset %u.\n", it.next);
+		}
 
-		free(mftRecAttribTemp);
 		if(utf8FileName != NULL) {
 			free(utf8FileName);
 		}
@@ -447,13 +1404,31 @@ int main(int argc, char* argv[]) {
 		}
 	} //for(workingPartition = 0; workingPartition < nNTFS; workingPartition++) {
 
+	for(i=0; i < nNTFS; i++) {
+		free(nTFSParts[i]); /*Free the memory allocated for NTFS partition structures */
+	}
+	free(buff);
+	free(mftBuffer);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Builds the list of files, and seeds the record cache, from the local $MFT copy
+ * written by mountVolume.
+ */
+int buildFileIndex(const char *mftCopyPath, File **files) {
+	ssize_t readStatus;
+	char* buff = malloc( BUFFSIZE );
+	char* mftBuffer = malloc( MFT_RECORD_MAX ); /*Buffer an entire MFT Record here*/
+
 	/*------------------- Process FILE records from extracted MFT  ------------------*/
 	printf("\nProcessing MFT...\n");
 	int countRecords = 0;
 	int32_t secPerClus = dwBytesPerCluster/SECTOR_SIZE;
+	int64_t secPerRec = dwMFTRecordLength/SECTOR_SIZE;
 
 	/*Open file, r pointer at start */
-	if((MFT_offline_copy = fopen("$MFT1", "r+")) == NULL) {
+	if((MFT_offline_copy = fopen(mftCopyPath, "r+")) == NULL) {
 		int errsv = errno;
 		printf("Failed to open file: %s.\n", strerror(errsv));
 		return EXIT_FAILURE;
@@ -467,26 +1442,29 @@ int main(int argc, char* argv[]) {
 	}
 
 	NTFS_MFT_FILE_ENTRY_HEADER *mftFileH = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) ); /*Allocate for the FILE0 header */
-	NTFS_ATTRIBUTE *mftRecAttrTmp = malloc( sizeof(NTFS_ATTRIBUTE) ); /*Attribute header size */
-	NTFS_ATTRIBUTE *mftRecAttr = malloc( MFT_RECORD_LENGTH ); /*Attribute size << record size */
+	NTFS_ATTRIBUTE *mftRecAttr;		/*Points into the record buffer */
+	ATTR_ITER it;
 
 	int countFiles = 0, countDelEntity = 0, countDir = 0, countOther = 0;
-	int countBadAttr = 0;
 	int countFileNames = 0;
+	int countLinks = 0;
+	int countStreams = 0;
 	int countFrags = 0;
+	int countTorn = 0;
 	int relRecN = 0; /*Relative record number, needed for calculating offset to record on disk */
 
 	File *offl_files = NULL; /* Init the list of files to be constructed */
+	*files = NULL;
 	uint64_t u64bytesAbsMFTOffset = 0;
 	int64_t d64segAbsMFTOffset = 0;
 
-	while((readStatus = fread(mftBuffer, MFT_RECORD_LENGTH, 1, MFT_offline_copy)) != 0) {
+	while((readStatus = fread(mftBuffer, dwMFTRecordLength, 1, MFT_offline_copy)) != 0) {
 		/*Read in one whole MFT record to mftBuffer, each time loop iterates */
 		/*Extract MFT header */
 		memcpy(mftFileH, mftBuffer, sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
-		if(VERBOSE && DEBUG) {
+		if(VERBOSE) {
 			getFILE0Attrib(buff, mftFileH);
-			printf("%s\n", buff);
+			logText(LOG_LVL_TRACE, buff);
 		}
 		/*Fragment records keep track of the MFT fragment from which records originated */
 		/*Each fragment record starts with signature 'FRAG', check this */
@@ -503,54 +1481,79 @@ int main(int argc, char* argv[]) {
 			free(frag);
 			countFrags++;
 			relRecN = 0; /*Reset for each fragment's records */
+			/*Fragment records are shorter than larger MFT records, step back to the first record */
+			if(dwMFTRecordLength > sizeof(FRAG) &&
+			   fseek(MFT_offline_copy, (long)sizeof(FRAG) - (long)dwMFTRecordLength, SEEK_CUR) != 0) {
+				int errsv = errno;
+				printf("Error handing local MFT file copy: %s.\n", strerror(errsv));
+				return EXIT_FAILURE;
+			}
 		}
 
 		/*Each subsequent file record should  start with signature 'FILE0', check this. */
 		else if(strcmp(mftFileH->fileSignature, "FILE0") == 0) {
 
 			char * aFileName = NULL;	/*Set for files which have this attribute */
+			uint32_t parentRecord = 0;	/*Directory aFileName is in */
+			bool isDosName = false;		/*aFileName is only an 8.3 name, until another is found */
+			char *linkNames[MFT_MAX_LINKS];	/*Hard links, the names other than aFileName */
+			uint32_t linkParents[MFT_MAX_LINKS];
+			uint32_t nLinks = 0, l;
+			FILE_META meta;				/*Times, flags and version of the record */
 			bool hasDataAttr = false;	/*Set for files which have $DATA */
 			BYTE uchNonResFlag;			/*If hasDataAttr then set */
 			// size_t resDataOffset = 0;	/*Offset to non-resident data attribute in record */
 			uint32_t resDataSize = 0;
+			uint64_t dataSize = 0, dataFingerprint = 0; /*Version of $DATA, seeds the record cache */
+			const BYTE *resData = NULL;	/*Resident $DATA in mftBuffer, kept if the file is deleted */
 			DataRun *runList = NULL; 	/*Allocate for non-resident $DATA runlist */
+			char *streamNames[MFT_MAX_STREAMS];	/*Alternate data streams, named $DATA */
+			uint64_t streamSizes[MFT_MAX_STREAMS];
+			uint32_t nStreams = 0, s;
+
+			if(!recordFixup(mftBuffer, dwMFTRecordLength)) {
+				countTorn++;	/*Torn on disk, read as it is */
+			}
+			memset(&meta, 0, sizeof(FILE_META));
+			meta.lsn = mftFileH->n64LogSeqNumber;
+			meta.sequence = mftFileH->wSequence;
 
 			/*---------------------------- Get MFT Record attributes ---------------------------*/
-			uint16_t attrOffset = mftFileH->wAttribOffset; 	 	    /*Offset to first attribute */
-			do {
-				/*------- Attribute size if unknown, so get header first which contains size -------*/
-				memcpy(mftRecAttrTmp, mftBuffer+attrOffset, sizeof(NTFS_ATTRIBUTE));
-
-				/*- NOTE: Some attributes have impossible record lengths > 1024, this breaks things -*/
-				if(mftRecAttrTmp->dwFullLength > MFT_RECORD_LENGTH-attrOffset) {
-					if(DEBUG) {
-						printf("Bad record attribute:\n");
-						getFileAttribMembers(buff,mftRecAttrTmp);
-						printf("%s\n", buff);
-					}
-					countBadAttr++;
-					break;
-				}
-				/*-------- Determine actual attribute length and use to copy full attribute --------*/
-				memcpy(mftRecAttr, mftBuffer+attrOffset, mftRecAttrTmp->dwFullLength);
+			attrIterInit(&it, mftBuffer, dwMFTRecordLength);
+			while((mftRecAttr = attrNext(&it))) {
+				uint16_t attrOffset = it.offs;
 
 				if(mftRecAttr->dwType == STANDARD_INFORMATION) {
-					if(DEBUG) {
-						STD_INFORMATION *stdInfo = malloc( sizeof(STANDARD_INFORMATION) );
-						uint32_t fileP = getFilePermissions(stdInfo);
-						printf("%" PRIu32 " ", fileP);
-						free(stdInfo);
-					}
+					STD_INFORMATION stdInfo;	/*Shorter before NTFS 3.0, the rest left zero */
+					attrResidentCopy(mftRecAttr, &stdInfo, sizeof(stdInfo));
+					meta.siTime[FTIME_CREATED] = stdInfo.fileCreateTime;
+					meta.siTime[FTIME_MODIFIED] = stdInfo.fileAltTime;
+					meta.siTime[FTIME_CHANGED] = stdInfo.mftChangeTime;
+					meta.siTime[FTIME_READ] = stdInfo.fileReadTime;
+					meta.flags = getFilePermissions(&stdInfo);
+					LOG_DEBUG("\tFlags: %" PRIu32 "\n", meta.flags);
 				}
 
 				/*---------------------------- Get file name from record ---------------------------*/
 				/*------------------ Generally have more than one per actual file ------------------*/
 				else if(mftRecAttr->dwType == FILE_NAME) { 					/*If is FILE_NAME attribute */
-					if(aFileName) {	/*Trickery here is to prevent memory leaks and only keep one FileName */
+					bool isDos = getFileNameSpace(mftRecAttr, mftBuffer, attrOffset) == FILE_NAME_DOS;
+					int64_t fnHead[1 + FTIME_FIELDS];	/*Parent reference and times, the start of FILE_NAME_ATTR */
+					char *fnName = getFileName(mftRecAttr, mftBuffer, attrOffset);
+					attrResidentCopy(mftRecAttr, fnHead, sizeof(fnHead));
+					if(fnName == NULL) {
+						countBadAttr++;		/*Too short to hold a name */
+					} else if(aFileName == NULL || (isDosName && !isDos)) {	/*The first name, an 8.3 name only if there is no other */
 						free(aFileName);
-						aFileName = getFileName(mftRecAttr, mftBuffer, attrOffset);
+						aFileName = fnName;
+						isDosName = isDos;
+						parentRecord = (uint32_t)(fnHead[0] & PATH_REF_MASK);
+						memcpy(meta.fnTime, fnHead + 1, sizeof(meta.fnTime));
+					} else if(!isDos && nLinks < MFT_MAX_LINKS) {	/*Another hard link */
+						linkNames[nLinks] = fnName;
+						linkParents[nLinks++] = (uint32_t)(fnHead[0] & PATH_REF_MASK);
 					} else {
-						aFileName = getFileName(mftRecAttr, mftBuffer, attrOffset);
+						free(fnName);
 					}
 					countFileNames++;
 				}
@@ -566,61 +1569,92 @@ int main(int argc, char* argv[]) {
 				}
 
 				else if(mftRecAttr->dwType == DATA) {
-					hasDataAttr = true;
-					uchNonResFlag = mftRecAttr->uchNonResFlag;
-					if(uchNonResFlag==true) { /*non-resident $DATA attribute  */
-
-						uint8_t countRuns = 0;
-						OFFS_LEN_BITFIELD *offs_len_bitField = malloc( sizeof(OFFS_LEN_BITFIELD) );
-						uint16_t dataRunOffset = (mftRecAttr->Attr).NonResident.wDatarunOffset;
-						do {
-							uint64_t length = 0;  /*The length and offset data run fields are always 8 or less bytes */
-							int64_t offset = 0;   /* Offset is signed */
-							/*Follow offset to data runs, read first data run. */
-							/*First read it's offset and length nibbles using the bitfield */
-							/*Top four bits represent a length, and the last four bits represent an offset. */
-							if(countRuns == 0) {
-								memcpy(offs_len_bitField, mftBuffer+attrOffset+dataRunOffset, sizeof(OFFS_LEN_BITFIELD));
+					uint64_t streamSize;
+					uint64_t streamPrint = dataAttrFingerprint(mftRecAttr, mftBuffer+attrOffset, &streamSize);
+					char *streamName = getAttrName(mftRecAttr, mftBuffer+attrOffset);
+					dataFingerprint = streamFingerprint(dataFingerprint, streamName, streamPrint);
+					if(streamName) {	/*An alternate data stream, indexed apart from the file's own data */
+						if(nStreams < MFT_MAX_STREAMS) {
+							streamNames[nStreams] = streamName;
+							streamSizes[nStreams++] = streamSize;
+						} else {
+							free(streamName);
+						}
+					} else if(!hasDataAttr) {
+						dataSize = streamSize;
+						if(!mftRecAttr->uchNonResFlag) {	/*Within the attribute, attrNext checked */
+							resData = (BYTE *)mftBuffer+attrOffset+(mftRecAttr->Attr).Resident.wAttrOffset;
+						}
+						hasDataAttr = true;
+						uchNonResFlag = mftRecAttr->uchNonResFlag;
+						if(uchNonResFlag==true) { /*non-resident $DATA attribute  */
+							bool badRuns;
+							runList = decodeRunList((uint8_t *)mftBuffer+attrOffset+(mftRecAttr->Attr).NonResident.wDatarunOffset,
+													(uint8_t *)mftBuffer+attrOffset+mftRecAttr->dwFullLength, &badRuns);
+							if(badRuns) {
+								countBadAttr++;		/*Its runs up to the bad one are kept */
 							}
 
-							dataRunOffset++; /*Move offset past offset_length_union */
-
-							/*Copy length field from run list */
-							memcpy(&length, mftBuffer+attrOffset+dataRunOffset, offs_len_bitField->bitfield.lengthSize);
-							dataRunOffset+=offs_len_bitField->bitfield.lengthSize; /*Move offset past length field */
-							/*Copy offset field from run list */
-							memcpy(&offset, mftBuffer+attrOffset+dataRunOffset, offs_len_bitField->bitfield.offsetSize);
-							dataRunOffset+=offs_len_bitField->bitfield.offsetSize; /*Move offset past offset field */
-
-							runList = addRun(runList, length, offset); /*Add extracted run to runlist */
-							countRuns++;
-
-							/*Copy next bitfield header, check if == 0 for loop termination */
-							memcpy(offs_len_bitField, mftBuffer+attrOffset+dataRunOffset, sizeof(OFFS_LEN_BITFIELD));
-						} while(offs_len_bitField->val != 0);
-						free(offs_len_bitField);
-						runList = reverseList(runList);	/*Put the data runs in disk order */
-
-					} else if(uchNonResFlag == false) { /* Non-resident file Data */
-						resDataSize = (mftRecAttr->Attr.Resident).dwLength;
+						} else if(uchNonResFlag == false) { /* Non-resident file Data */
+							resDataSize = (mftRecAttr->Attr.Resident).dwLength;
+						}
 					}
 				}
-
-				attrOffset += mftRecAttr->dwFullLength;    /*Increment the offset by the length of this attribute */
-			} while(attrOffset+MFT_FILE_ATTR_PAD < mftFileH->dwRecLength); /*While there are attributes left to inspect */
+			}
+			/*- NOTE: Some attributes have impossible lengths, longer than the record, the rest are skipped -*/
+			if(it.bad) {
+				LOG_DEBUG("Bad record attribute in record %u at offset %u.\n", mftFileH->dwMFTRecNumber, it.next);
+				countBadAttr++;
+			}
 
 			countRecords++;
+			if(recCacheHolds(recCache, mftFileH->dwMFTRecNumber)) {
+				recCacheUpdate(recCache, mftFileH, dataSize, dataFingerprint);
+				if(usnRecordSector(usnJournal, mftFileH->dwMFTRecNumber,	/*For re-reading it on journal changes */
+								   d64segAbsMFTOffset + relRecN*secPerRec) == EXIT_FAILURE) {
+					printf("Failed to keep the sector of record %u for the change journal.\n", mftFileH->dwMFTRecNumber);
+				}
+			}
+			if(parentRecord == USN_EXTEND_RECORD && aFileName && strcmp(aFileName, USN_JOURNAL_NAME) == 0) {
+				usnJournalMap(usnJournal, (BYTE *)mftBuffer, dwMFTRecordLength);
+			}
 			//if(countRecords > 48) break; /*Debug break out */
 
 			/* At this point we have all of the attributes and need to do something with them */
 			/*Check file flags on record, determine record type */
 			uint16_t mftFlags = mftFileH->wFlags;
 
+			/*Every link of a record in use, to find it by any of its names or paths */
+			if(aFileName && (mftFlags & IN_USE)) {
+				linkTableAdd(&linkTable, mftFileH->dwMFTRecNumber, parentRecord, aFileName);
+				for(l = 0; l < nLinks; l++) {
+					linkTableAdd(&linkTable, mftFileH->dwMFTRecNumber, linkParents[l], linkNames[l]);
+				}
+				countLinks += nLinks;
+			}
+			for(l = 0; l < nLinks; l++) {
+				free(linkNames[l]);
+			}
+
+			/*Named streams of files and directories in use are entries of their own */
+			int64_t d64RecSector = d64segAbsMFTOffset + relRecN*secPerRec;
+			for(s = 0; s < nStreams; s++) {
+				if(aFileName && (mftFlags & IN_USE)) {
+					offl_files = addFile(offl_files, strdup(aFileName), d64RecSector,
+							roundToNearestCluster(d64RecSector, secPerClus), (uint32_t)streamSizes[s],
+							mftFileH->dwMFTRecNumber, parentRecord, &meta);
+					offl_files->streamName = streamNames[s];
+					countStreams++;
+				} else {
+					free(streamNames[s]);
+				}
+			}
+
 			if(mftFlags==IN_USE) {	/*This is a file record */
 				if(hasDataAttr) {	/*And it has $DATA */
 					countFiles++;
 					int64_t d64DataOffset = d64segAbsMFTOffset;
-					int64_t relSecN = relRecN*(MFT_RECORD_LENGTH/SECTOR_SIZE);
+					int64_t relSecN = relRecN*secPerRec;
 					/* Need to round this value to the cluster which contains it */
 
 					if(uchNonResFlag == false) {/*$DATA is resident */
@@ -636,7 +1670,9 @@ int main(int argc, char* argv[]) {
 								d64DataOffset+relSecN, /*Sector offset, specifies the actual record */
 								roundToNearestCluster(d64DataOffset+relSecN, secPerClus),
 								resDataSize,
-								mftFileH->dwMFTRecNumber);
+								mftFileH->dwMFTRecNumber,
+								parentRecord,
+								&meta);
 
 					} else if (uchNonResFlag) {/*DATA is non-resident,  Iterate through the runlist and extract data*/
 						uint32_t totalNonResSize = 0;
@@ -654,7 +1690,9 @@ int main(int argc, char* argv[]) {
 								d64DataOffset+relSecN,
 								roundToNearestCluster(d64DataOffset+relSecN, secPerClus),
 								totalNonResSize,
-								mftFileH->dwMFTRecNumber);
+								mftFileH->dwMFTRecNumber,
+								parentRecord,
+								&meta);
 					} else {
 						if(DEBUG )printf("Corrupted NonResFlag\n");
 						if(aFileName) {
@@ -665,14 +1703,21 @@ int main(int argc, char* argv[]) {
 				}
 
 			} else if (mftFlags==!IN_USE) {
+				if(aFileName && hasDataAttr && (uchNonResFlag == true || resData)) {	/*Kept for recovery */
+					if(recoveryAdd(&delIndex, aFileName, mftFileH->dwMFTRecNumber, parentRecord,
+							d64segAbsMFTOffset + relRecN*secPerRec, &meta, dataSize,
+							uchNonResFlag == true ? NULL : resData, uchNonResFlag == true ? runList : NULL) == EXIT_SUCCESS) {
+						aFileName = NULL;
+					}
+				}
 				if(aFileName) {
 					free(aFileName);
 					aFileName = NULL;
 				}
 				countDelEntity++;
 			} else if (mftFlags==(IN_USE|DIRECTORY)) { /*This is a directory */
-				if(aFileName) {
-					free(aFileName);
+				if(aFileName) {	/*Kept to build the paths of the files in it */
+					pathTableAdd(&dirTable, mftFileH->dwMFTRecNumber, parentRecord, aFileName);
 					aFileName = NULL;
 				}
 				countDir++;
@@ -682,7 +1727,12 @@ int main(int argc, char* argv[]) {
 					aFileName = NULL;
 				}
 				countOther++;
-				if(DEBUG)printf("%u\t", mftFlags);
+				LOG_DEBUG("%u\t", mftFlags);
+			}
+			if(mftFileH->dwMFTRecNumber == UPCASE_RECORD && hasDataAttr && uchNonResFlag == true) {
+				loadUpcase(runList);	/*Names fold ASCII only without it */
+			} else if(mftFileH->dwMFTRecNumber == BITMAP_RECORD && hasDataAttr && uchNonResFlag == true) {
+				loadBitmap(runList, dataSize);
 			}
 			freeRunList(runList);
 			if((!hasDataAttr) && (aFileName!=NULL)) {
@@ -695,7 +1745,7 @@ int main(int argc, char* argv[]) {
 			return EXIT_FAILURE;
 		}
 
-	} //while((readStatus = fread(mftBuffer, MFT_RECORD_LENGTH, 1, MFT_file_copy)) != 0) {
+	} //while((readStatus = fread(mftBuffer, dwMFTRecordLength, 1, MFT_file_copy)) != 0) {
 
 
 	printf("\n%d MFT fragments\n", countFrags);
@@ -704,300 +1754,148 @@ int main(int argc, char* argv[]) {
 			countFiles, countDir,
 			countDelEntity, countOther);
 	printf("Bad record attributes: %d\n", countBadAttr);
+	printf("Records with bad fixups: %d\n", countTorn);
 	printf("File names: %d\n", countFileNames);
+	printf("Alternate data streams: %d\n", countStreams);
+	printf("Hard links: %d, to %" PRIu32 " records\n", countLinks, linkTable.nLinked);
 	printf("%d FILE records processed and stored offline.\n", countRecords);
 
-	/*-------------------------------- Launch UDS Server Thread --------------------------------*/
-	pthread_t uds_tid;
-	pthread_attr_t attr;
-	pthread_attr_init(&attr); /*Default thread attributes */
-	pthread_create(&uds_tid, &attr, udsServerThreadFn, socket_path); /* Launch UDS thread */
-	printf("UDS server thread started.\n\n");
-
-	/*--------------------------- Consumer loop thread for QEMU writes --------------------------*/
-	pthread_t consumer_tid;
-	int consumer_running = false;
-
-	/*------------------------------ User interface to the program ------------------------------*/
-	char cmd[CMD_BUFF];
-	int8_t pRet = -1;
-	char *searchTerm;
-	do {
-		printf("What do you want to do? \n");
-		fgets(cmd, CMD_BUFF-1, stdin);
-		switch(pRet = parseUserInput(cmd)) {
-		case PRINT_HELP : ;
-			printf(HELP);
-			break;
-		case PRINT_FILES : ;	/* Print list of files stored in offline MFT copy */
-			printAllFiles(offl_files);
-			break;
-		case SRCH_FOR_MFTN : ;	/* Search offline MFT records using record number */
-			while( strcmp((searchTerm = getSearchTerm()), EXIT_CMD) != 0 ) {
-				File * found = searchFiles(offl_files, SRCH_NUM, searchTerm);
-				if(found) {
-					freeFilesList(found);
-				} else {
-					printf("No files found for that query.\n");
-				}
-				free(searchTerm);
-			}
-			break;
-		case SRCH_FOR_MFTC : ;	/* Search offline MFT records using record file name */
-			while( strcmp((searchTerm = getSearchTerm()), EXIT_CMD) != 0 ) {
-				File * found = searchFiles(offl_files, SRCH_NAME, searchTerm);
-				if(found) {
-					freeFilesList(found);
-				} else {
-					printf("No files found for that query.\n");
-				}
-				free(searchTerm);
-			}
-			break;
-		case SRCH_FOR_MFTO : ;	/* Search offline MFT records using record sector offset */
-			while( strcmp((searchTerm = getSearchTerm()), EXIT_CMD) != 0 ) {
-				File * found = searchFiles(offl_files, SRCH_CROFFS, searchTerm);
-				if(found) {
-					freeFilesList(found);
-				} else {
-					printf("No files found for that query.\n");
-				}
-				free(searchTerm);
-			}
-			break;
-		case EXT_MFTN: ; /* Extract file using MFT record number( offline directory ) */
-			while( strcmp((searchTerm = getSearchTerm()), EXIT_CMD) != 0 ) {
-
-				File *found = searchFiles(offl_files, SRCH_NUM, searchTerm);
-				if(!found) printf("No records match that query.\n");
-				while(found) {
-					int64_t sOffsBytes = found->sec_offset*SECTOR_SIZE;
-					off_t offs_restore = blk_offset; 			/*Backup current read position */
-					lseekAbs(blkDevDescriptor, sOffsBytes);		/*Move to file record sector offset */
-
-					/* Read the MFT entry from disk */
-					if((readStatus = read(blkDevDescriptor, mftBuffer, MFT_RECORD_LENGTH)) == -1) { /*Read the next record */
-						int errsv = errno;
-						printf("Failed to read MFT at offset: %" PRIu64 ", with error %s.\n",
-								sOffsBytes, strerror(errsv));
-						return EXIT_FAILURE;
-					}
-
-					/* Copy MFT record header*/
-					NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) );
-					memcpy(mftRecHeader, mftBuffer, sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
-
-					/* Determine offset to record attributes from header */
-					NTFS_ATTRIBUTE *mftRecAttr, *mftRecAttrTmp = malloc( sizeof(NTFS_ATTRIBUTE) );
-					uint16_t attrOffset = mftRecHeader->wAttribOffset; /*Offset to attributes */
-
-					do {
-						/*----- Attribute size is unknown, so get header first which contains full size -----*/
-						memcpy(mftRecAttrTmp, mftBuffer+attrOffset, sizeof(NTFS_ATTRIBUTE));
-
-						/*- NOTE: Some attributes(deleted files?) have impossible record lengths, this breaks things -*/
-						if(mftRecAttrTmp->dwFullLength > MFT_RECORD_LENGTH-attrOffset) {
-							printf("Bad record attribute:\n");
-							getFileAttribMembers(buff,mftRecAttrTmp);
-							printf("%s\n", buff);
-							break;
-						}
-
-						/*-------- Determine actual attribute length and use to copy full attribute --------*/
-						mftRecAttr = malloc(mftRecAttrTmp->dwFullLength);
-						memcpy(mftRecAttr, mftBuffer+attrOffset, mftRecAttrTmp->dwFullLength);
-
-						if(mftRecAttr->dwType == DATA) {
-							if(mftRecAttr->uchNonResFlag==false) { /*Is resident $DATA */
-								uint32_t attrDataSize = (mftRecAttr->Attr.Resident).dwLength;
-								size_t attbDataOffs = (mftRecAttr->Attr.Resident).wAttrOffset;
-								if(DEBUG) printf("\tData size: %d Bytes.\n", attrDataSize);
-
-								/* Extract the file to disk */
-								extractResFile(found->fileName, mftBuffer+attrOffset+attbDataOffs, attrDataSize);
-
-							} else if(mftRecAttr->uchNonResFlag==true) { /*non-resident $DATA attribute */
-								printf("This record contains non-resident data.\n");
-								printf("Operation not currently supported.\n");
-							}
-						}
-
-						attrOffset += mftRecAttr->dwFullLength;    /*Increment the offset by the length of this attribute */
-						free(mftRecAttr);
-					} while(attrOffset+MFT_FILE_ATTR_PAD < mftRecHeader->dwRecLength); /*While there are attributes left to inspect */
-
-					lseekAbs(blkDevDescriptor, offs_restore);		   /*Restore read position */
-					free(mftRecHeader);
-					found = found->p_next; /*If there is more than one file found, go through them */
-				}
-				freeFilesList(found);
-				free(searchTerm);
-			}
-			break;
-		case EXT_MFTCO: ; /* Extract file using QEMU write offset */
-			/*Sector offsets rounded to the nearest cluster may contain up to 4 MFT records */
-			/*Retrieve any records at the offset - do this online*/
-			while( strcmp((searchTerm = getSearchTerm()), EXIT_CMD) != 0 ) {
-
-				int64_t d64SearchTerm = strtoull(searchTerm, NULL, 0);
-				if(d64SearchTerm >= 0) {
-					int64_t sOffsBytes = d64SearchTerm*SECTOR_SIZE;
-					off_t offs_restore = blk_offset; 			/*Backup current read position */
-					lseekAbs(blkDevDescriptor, sOffsBytes);		/*Move to first file record sector offset */
-					char *cBuff = malloc( dwBytesPerCluster );
-
-					/* Read the cluster */
-					if((readStatus = read(blkDevDescriptor, cBuff, dwBytesPerCluster)) == -1) {
-						int errsv = errno;
-						printf("Failed to read cluster at offset: %" PRIu64 ", with error %s.\n",
-								sOffsBytes, strerror(errsv));
-						break; //return EXIT_FAILURE;
-					}
-
-					/* Try to read MFT records from the cluster memory*/
-					//FILE *found = NULL;
-					uint8_t recN = 0;
-					char *mftBuff = malloc( MFT_RECORD_LENGTH );
-					NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) );
-					NTFS_ATTRIBUTE *mftRecAttrTmp = malloc( sizeof(NTFS_ATTRIBUTE) ); /*Attribute header size */
-					NTFS_ATTRIBUTE *mftRecAttr = malloc( MFT_RECORD_LENGTH ); /*Attribute size << record size */
-
-					for(; recN < dwBytesPerCluster/MFT_RECORD_LENGTH; recN++) {
-						memcpy(mftBuff, cBuff+(recN*MFT_RECORD_LENGTH), MFT_RECORD_LENGTH);
-						/* Copy MFT record header*/
-						memcpy(mftRecHeader, mftBuff, sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
-						/* Check if this memory contains an MFT record, they all start 'FILE0' */
-						if(strcmp("FILE0", mftRecHeader->fileSignature) == 0) {
-							uint16_t attrOffs = mftRecHeader->wAttribOffset; 	 	    /*Offset to first attribute */
-							char * fName = malloc( BUFFSIZE );
-							do {
-								/*------- Attribute size is unknown, so get header first which contains size -------*/
-								memcpy(mftRecAttrTmp, mftBuff+attrOffs, sizeof(NTFS_ATTRIBUTE));
-
-								/*- NOTE: Some attributes have impossible record lengths > 1024, this breaks things -*/
-								if(mftRecAttrTmp->dwFullLength > MFT_RECORD_LENGTH-attrOffs) {
-									if(DEBUG) {
-										printf("Bad record attribute:\n");
-										getFileAttribMembers(buff,mftRecAttrTmp);
-										printf("%s\n", buff);
-									}
-									countBadAttr++;
-									break;
-								}
-
-								/*-------- Determine actual attribute length and use to copy full attribute --------*/
-								memcpy(mftRecAttr, mftBuff+attrOffs, mftRecAttrTmp->dwFullLength);
-
-								if(mftRecAttr->dwType == STANDARD_INFORMATION) { /*Contains create/modify stamps */
-									STD_INFORMATION *stdInfo = malloc( sizeof(STD_INFORMATION) );
-									memcpy(stdInfo,					   /*STANDARD_INFORMATION is always resident */
-											mftBuff+attrOffs+(mftRecAttr->Attr).Resident.wAttrOffset,
-											sizeof(STD_INFORMATION) );
-									uint64_t altTime = stdInfo->fileAltTime;
-									printf("\tFile alt time: %" PRIu64 "\n", altTime);
-									free(stdInfo);
-								}
-
-								else if(mftRecAttr->dwType == FILE_NAME) { /* Get file name */
-									fName = getFileName(mftRecAttr, mftBuff, attrOffs);
-									printf("\t%s\n", fName);
-								}
-
-								else if(mftRecAttr->dwType == DATA) {
-									printf("Has data\n");
-									if(mftRecAttr->uchNonResFlag == false) { /*$DATA is resident */
-										uint32_t attrDataSize = (mftRecAttr->Attr.Resident).dwLength;
-										size_t attrDataOffs = (mftRecAttr->Attr.Resident).wAttrOffset;
-										printf("\tData size: %d Bytes.\n", attrDataSize);
-
-										/* Extract the file to disk */
-										extractResFile(fName, mftBuff+attrOffs+attrDataOffs, attrDataSize);
-									}
-								}
-
-								attrOffs += mftRecAttr->dwFullLength;    /*Increment the offset by the length of this attribute */
-							} while(attrOffs+8 < mftRecHeader->dwRecLength); /*While there are attributes left to inspect */
-							free(fName);
-						}
-
-					}
-
-					lseekAbs(blkDevDescriptor, offs_restore);		   /*Restore read position */
-
-					/*Check the modified time to help eliminate some records*/
-					free(mftBuff);
-					free(mftRecHeader);
-					free(mftRecAttrTmp);
-					free(mftRecAttr);
-					free(cBuff);
-				}
-				free(searchTerm);
-			}
-			break;
-		case UDSSTART: ;
-			printf("starting...\n");
-			if(!consumer_running) {
-				pthread_create(&consumer_tid, &attr, consumerThreadFn, NULL); /* Launch UDS thread */
-				consumer_running = true;
-				printf("Server started.\n");
-			} else {
-				printf("Server already running.\n");
-			}
-			break;
-		case UDSSTOP: ;
-			printf("Stopping...\n");
-			if(consumer_running) {
-				/* Wait for the list to be empty first...*/
-				pthread_cancel(consumer_tid);	/* This is improper(possibly), but will do for now */
-				pthread_join(consumer_tid, NULL); /* Wait for thread to exit */
-				consumer_running = false;
-				printf("Server stopped.\n");
-			} else {
-				printf("Server not running.\n");
-			}
-
-			break;
-		case UNKNOWN :
-			printf("Command not recognised, try \'help\'\n");
-			break;
-		}
-	} while( pRet != EXIT );
-
-	/*--------------------------------------- Tidy up ---------------------------------------*/
-	for(i=0; i < nNTFS; i++) {
-		free(nTFSParts[i]); /*Free the memory allocated for NTFS partition structures */
-	}
-
-	free(buff); 			/*Used for buffering various texts */
-	free(mftBuffer);		/*Used for buffering one MFT record, 1kb*/
 	free(mftFileH);
-	free(mftRecAttr);
-	free(mftRecAttrTmp);
+	fclose(MFT_offline_copy);
+	MFT_offline_copy = NULL;
+	free(buff);
+	free(mftBuffer);
+	*files = offl_files;
+	return EXIT_SUCCESS;
+}
 
-	if(MFT_offline_copy != NULL) {		/*Make sure the offline MFT copy is closed */
-		fclose(MFT_offline_copy);
+/**
+ * Makes vol the volume the device globals describe, saving those of the volume
+ * selected before, and points the extraction store, record cache, journal and
+ * bitmap globals at its own. Callers other than main's setup hold volumeLock.
+ */
+void volumeSelect(VOLUME *vol) {
+	if(vol == curVolume) return;
+	if(curVolume) {
+		curVolume->fd = blkDevDescriptor;
+		curVolume->offset = blk_offset;
+		curVolume->endOfDev = endOfDev;
+		curVolume->dwBytesPerCluster = dwBytesPerCluster;
+		curVolume->dwMFTRecordLength = dwMFTRecordLength;
+		curVolume->relativePartSector = relativePartSector;
+		snprintf(curVolume->mftCopyName, sizeof(curVolume->mftCopyName), "%s", mftCopyName);
 	}
-	freeFilesList(offl_files);			/*Remove offline file directory from memory */
+	blkDevDescriptor = vol->fd;
+	blk_offset = vol->offset;
+	endOfDev = vol->endOfDev;
+	dwBytesPerCluster = vol->dwBytesPerCluster;
+	dwMFTRecordLength = vol->dwMFTRecordLength;
+	relativePartSector = vol->relativePartSector;
+	snprintf(mftCopyName, sizeof(mftCopyName), "%s", vol->mftCopyName);
+	extStore = &vol->store;
+	recCache = &vol->recCache;
+	usnJournal = &vol->journal;
+	volBitmap = &vol->bitmap;
+	curVolume = vol;
+}
 
-	if((close(blkDevDescriptor)) == -1) { /*close block device and check if failed */
-		int errsv = errno;
-		printf("Failed to close block device %s with error: %s.\n", BLOCK_DEVICE, strerror(errsv));
+/**
+ * Copies and indexes the $MFT of the device configured and opens the volume's
+ * extraction store. With several volumes each has its own store subdirectory
+ * and its name in its $MFT copy's name.
+ */
+int volumeOpen(VOLUME *vol, VOLUME_CFG *cfg) {
+	char storeDir[FILENAME_MAX];
+	bool several = config.nVolumes > 1;
+
+	printf("Opening volume %s on %s\n", cfg->name, cfg->device);
+	memset(vol, 0, sizeof(VOLUME));
+	vol->cfg = cfg;
+	volumeSelect(vol);
+	recCacheInit(recCache);
+	usnJournalInit(usnJournal);
+	snprintf(mftCopyPrefix, sizeof(mftCopyPrefix), "%s/%s%s", config.mftCopyDir,
+			 several ? cfg->name : "", several ? "." : "");
+
+	if(mountVolume(cfg->device) == EXIT_FAILURE ||
+	   buildFileIndex(mftCopyName, &vol->files) == EXIT_FAILURE) {
+		printf("Failed to open volume %s.\n", cfg->name);
 		return EXIT_FAILURE;
 	}
-
-	pthread_cancel(uds_tid);
-	pthread_join(uds_tid,NULL); /* Wait for thread to exit */
-	printf("UDS Server thread finished.\n");
-
-	if(consumer_running) {
-		pthread_cancel(consumer_tid);
-		pthread_join(uds_tid,NULL); /* Wait for thread to exit */
-		consumer_running = false;
-		printf("Extraction server finished.\n");
+	vol->links = linkTable;	/*Moved, as dirTable below */
+	memset(&linkTable, 0, sizeof(LINK_TABLE));
+	linkTableSort(&vol->links);
+	nameIndexBuild(&vol->names, vol->files, upcaseTable, &vol->links);	/*Takes the $UpCase table */
+	printf("Name index: %" PRIu32 " names, %" PRIu32 " trigrams, %s.\n", vol->names.nFiles,
+			vol->names.nTrigrams, upcaseTable ? "folded with $UpCase" : "ASCII folding only");
+	upcaseTable = NULL;
+	vol->dirs = dirTable;	/*Moved, buildFileIndex starts the next volume's afresh */
+	memset(&dirTable, 0, sizeof(PATH_TABLE));
+	vol->deleted = delIndex;
+	memset(&delIndex, 0, sizeof(RECOVERY_INDEX));
+	if(timeIndexBuild(&vol->times, vol->files) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
 	}
-
+	tailJournal();
+	if(volBitmap->bits) {
+		printf("Cluster bitmap: %" PRIu64 " of %" PRIu64 " clusters allocated.\n", volBitmap->nAllocated, volBitmap->nClusters);
+	} else {
+		printf("No cluster bitmap, writes to free clusters are read too.\n");
+	}
+	uint32_t i, nWhole = 0;
+	for(i = 0; i < vol->deleted.count; i++) {
+		if(recoveryScore(&vol->deleted.files[i], volBitmap) == 100) nWhole++;
+	}
+	printf("Deleted files: %" PRIu32 " kept for recovery, %" PRIu32 " with none of their clusters %s.\n",
+			vol->deleted.count, nWhole, volBitmap->bits ? "reused" : "known to be reused");
+
+	/*Open the content addressed store which extracted files are written to */
+	snprintf(storeDir, sizeof(storeDir), "%s%s%s", config.storeDir, several ? cfg->name : "", several ? "/" : "");
+	if((several && storeMkdir(config.storeDir) == EXIT_FAILURE) ||
+	   storeInit(extStore, storeDir) == EXIT_FAILURE) {
+		printf("Failed to open extraction store at %s.\n", storeDir);
+		return EXIT_FAILURE;
+	}
+	vol->open = true;
 	return EXIT_SUCCESS;
-} //end of main method.
+}
+
+/**
+ * Prints the volume's store and record cache counters, then releases its index,
+ * store, cache and device.
+ */
+void volumeClose(VOLUME *vol) {
+	if(!vol->open) return;
+	volumeSelect(vol);
+	printf("Volume %s extraction store: %" PRIu64 " new blobs, %" PRIu64 " deduplicated, %" PRIu64 " unchanged.\n",
+			vol->cfg->name, extStore->countNewBlob, extStore->countNewRef, extStore->countUnchanged);
+	printf("Volume %s record cache: %" PRIu64 " header hits, %" PRIu64 " data hits, %" PRIu64 " changed.\n",
+			vol->cfg->name, recCache->countHeaderHits, recCache->countDataHits, recCache->countMisses);
+	if(volBitmap->bits) {
+		printf("Volume %s cluster bitmap: %" PRIu64 " updates, %" PRIu64 " writes to free clusters dropped.\n",
+				vol->cfg->name, volBitmap->countUpdates, volBitmap->countDropped);
+	}
+	if(usnJournal->record) {
+		printf("Volume %s change journal: %" PRIu64 " records read, %" PRIu64 " MFT records re-read.\n",
+				vol->cfg->name, usnJournal->countRecords, usnJournal->countRereads);
+	}
+	storeClose(extStore);
+	recCacheFree(recCache);
+	usnJournalFree(usnJournal);
+	bitmapFree(volBitmap);
+	nameIndexFree(&vol->names);
+	pathTableFree(&vol->dirs);
+	linkTableFree(&vol->links);
+	timeIndexFree(&vol->times);
+	recoveryFree(&vol->deleted);
+	freeFilesList(vol->files);
+	vol->files = NULL;
+	if((close(blkDevDescriptor)) == -1) { /*close block device and check if failed */
+		int errsv = errno;
+		printf("Failed to close block device %s with error: %s.\n", vol->cfg->device, strerror(errsv));
+	}
+	vol->open = false;
+}
 
 /**
  * Calls lseek(.. with error checking, absolute position mode.
@@ -1038,282 +1936,820 @@ int64_t roundToNearestCluster(int64_t sec_offs, int32_t secPerClus) {
 }
 
 /**
- * Given a pointer to the memory containing data, the length of the data
- * and the name of the file to be written, writes the data to disk.
+ * Given a pointer to the memory containing resident data, the length of the data,
+ * the record header and the name of the file, adds the data to the extraction store.
+ */
+int extractResFile(NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader, char *fileName, void *dataAttr, uint32_t len) {
+
+	char *residentData = (char *)dataAttr;
+	if(VERBOSE) { /* Dump file data as hex/text to the log */
+		logHex(LOG_LVL_TRACE, residentData, len);
+	} else {
+		LOG_DEBUG("\t%.*s", (int)len, residentData);
+	}
+
+	uint64_t startNs = monotonicNs();
+	int stored = storePut(extStore, mftRecHeader->dwMFTRecNumber, mftRecHeader->wSequence,
+						  mftRecHeader->n64LogSeqNumber, fileName, dataAttr, len);
+	metricsTime(MET_STAGE_WRITE, monotonicNs() - startNs);
+	if(stored != -1 && stored != STORE_UNCHANGED) {
+		metricsAdd(MET_FILES_EXTRACTED, 1);
+	}
+	if(stored == -1) {
+		printf("Error extracting file: %s.\n", fileName);
+		return EXIT_FAILURE;
+	}
+	LOG_DEBUG("\t%s %s\n", fileName, stored == STORE_UNCHANGED ? "unchanged" : "stored");
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Bytes in the clusters of runList.
  */
-int extractResFile(char *fileName, void *dataAttr, uint32_t len) {
+uint64_t runListSize(DataRun *runList) {
+	uint64_t size = 0;
+	DataRun *pCurrentRun;
+	for(pCurrentRun = runList; pCurrentRun; pCurrentRun = pCurrentRun->p_next) {
+		size += pCurrentRun->length*dwBytesPerCluster;
+	}
+	return size;
+}
+
+/**
+ * Reads the clusters described by runList (disk order, relative offsets) from the
+ * volume into data, which holds runListSize(runList) bytes. *filled is set to
+ * the bytes read; fileName is only used in messages.
+ */
+int readRunList(DataRun *runList, BYTE *data, const char *fileName, uint64_t *filled) {
 
 	int retVal = EXIT_SUCCESS;
-	char * extractedFileName = malloc( FNAMEBUFF );
-	strcpy(extractedFileName, RESEXTFILESDIR);
-	strcat(extractedFileName, fileName);
-
-	/* Copy resident file data from disk to memory. */
-	char *residentData = malloc( len );
-	memcpy(residentData, dataAttr, len);
-
-	if(DEBUG) { /* Dump file data as hex/text to stdout */
-		int  k = 0;
-		printf("\t");
-		for(; k<len; k++) {
-			if(VERBOSE) {
-				printf("%04x", residentData[k]);
-			} else {
-				printf("%c", residentData[k]);
+	DataRun *pCurrentRun;
+	*filled = 0;
+
+	uint64_t startNs = monotonicNs();
+	lseekAbs(blkDevDescriptor, relativePartSector);	/* Move to beginning of volume */
+	for(pCurrentRun = runList; pCurrentRun; pCurrentRun = pCurrentRun->p_next) {
+
+		/* Move file pointer to the non-resident data  */
+		if(lseekRel(blkDevDescriptor, (pCurrentRun->offset)*dwBytesPerCluster) == EXIT_FAILURE) {
+			retVal = EXIT_FAILURE;
+			break;
+		}
+		size_t runLength = dwBytesPerCluster*pCurrentRun->length;
+
+		/* Read for length specified in dataRun */
+		ssize_t blkRead;
+		if((blkRead = read(blkDevDescriptor, data+*filled, runLength)) == -1 ){
+			int errsv = errno;
+			printf("Failed to read data from guest disk for %s with error: %s.\n", fileName, strerror(errsv));
+			retVal = EXIT_FAILURE;
+			break;
+		}
+		*filled += runLength;
+
+		/* Rewind the file pointer by the amount read */
+		if(lseekRel(blkDevDescriptor, (-1)*blkRead) == EXIT_FAILURE) {
+			retVal = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	metricsTime(MET_STAGE_READ, monotonicNs() - startNs);
+	metricsAdd(MET_DEV_BYTES_READ, *filled);
+	return retVal;
+}
+
+/**
+ * Reads the $UpCase table from the clusters of its runList into upcaseTable.
+ */
+int loadUpcase(DataRun *runList) {
+	uint64_t size = runListSize(runList), filled = 0;
+	if(size < UPCASE_ENTRIES*sizeof(uint16_t)) {
+		printf("$UpCase is too small, only ASCII names will fold.\n");
+		return EXIT_FAILURE;
+	}
+	BYTE *data = malloc( size );
+	if(data == NULL) return EXIT_FAILURE;
+	if(readRunList(runList, data, "$UpCase", &filled) == EXIT_FAILURE ||
+	   filled < UPCASE_ENTRIES*sizeof(uint16_t)) {
+		free(data);
+		return EXIT_FAILURE;
+	}
+	free(upcaseTable);
+	upcaseTable = realloc(data, UPCASE_ENTRIES*sizeof(uint16_t));
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Reads len bytes of the change journal's $J from offset offs, a cluster at a
+ * time. Sparse clusters, released from the head of the journal, read as zero.
+ */
+int readJournal(int64_t offs, BYTE *data, uint32_t len) {
+	uint32_t filled = 0;
+	uint64_t startNs = monotonicNs();
+	while(filled < len) {
+		int64_t vcn = (offs + filled)/dwBytesPerCluster;
+		uint32_t inClus = (offs + filled)%dwBytesPerCluster;
+		uint32_t chunk = dwBytesPerCluster - inClus;
+		int64_t lcn = usnJournalLcn(usnJournal, vcn);
+		if(chunk > len - filled) chunk = len - filled;
+		if(lcn < 0) {
+			memset(data + filled, 0, chunk);
+		} else {
+			int64_t sOffsBytes = relativePartSector + lcn*dwBytesPerCluster + inClus;
+			lseekAbs(blkDevDescriptor, sOffsBytes);
+			if(read(blkDevDescriptor, data + filled, chunk) != chunk) {
+				int errsv = errno;
+				printf("Failed to read the change journal at offset: %" PRId64 ", with error %s.\n",
+					   sOffsBytes, strerror(errsv));
+				return EXIT_FAILURE;
 			}
+			metricsAdd(MET_DEV_BYTES_READ, chunk);
 		}
-		printf("\n");
+		filled += chunk;
 	}
+	metricsTime(MET_STAGE_READ, monotonicNs() - startNs);
+	return EXIT_SUCCESS;
+}
 
-	/*Create local file to which the NTFS file data is extracted */
-	FILE *fileExtracted;
-	if((fileExtracted = fopen(extractedFileName, "w")) == NULL) {
-		int errsv = errno;
-		printf("Failed to create local file for storing %s: %s.\n", fileName, strerror(errsv));
-		retVal =  EXIT_FAILURE;
+/**
+ * Starts following the change journal from its end: the records already in the
+ * last page are taken as seen, so only changes made from now on are reported.
+ */
+void tailJournal(void) {
+	BYTE *page;
+	if(usnJournal->record == 0) {
+		printf("No change journal, changes are seen from MFT writes only.\n");
+		return;
+	}
+	usnJournal->lastUsn = usnJournal->size - 1;
+	if(usnJournal->size > 0 && (page = malloc( USN_PAGE )) != NULL) {
+		if(readJournal((usnJournal->size - 1) & ~(int64_t)(USN_PAGE - 1), page, USN_PAGE) == EXIT_SUCCESS) {
+			usnParse(usnJournal, page, USN_PAGE, NULL, 0);	/*The MFT copy's size may lag the journal */
+		}
+		free(page);
 	}
+	usnJournal->countRecords = 0;
+	printf("Change journal: record %" PRIu32 ", %" PRIu32 " extents, %" PRId64 " bytes, tailing from USN %" PRId64 ".\n",
+			usnJournal->record, usnJournal->nExtents, usnJournal->size, usnJournal->lastUsn + 1);
+}
 
-	/*Write the file data */
-	if( fwrite( residentData, len, 1, fileExtracted ) != 1) {
-		int errsv = errno;
-		printf("Error extracting file: %s.\n", strerror(errsv));
+/**
+ * Reads $Bitmap, realSize bytes from the clusters of its runList, into volBitmap.
+ */
+int loadBitmap(DataRun *runList, uint64_t realSize) {
+	uint64_t size = runListSize(runList), filled = 0;
+	if(realSize == 0 || realSize > size) {
+		printf("$Bitmap has an impossible size, writes to free clusters will be read too.\n");
+		return EXIT_FAILURE;
+	}
+	BYTE *data = malloc( size );
+	if(data == NULL) return EXIT_FAILURE;
+	if(readRunList(runList, data, "$Bitmap", &filled) == EXIT_FAILURE || filled < realSize) {
+		free(data);
+		return EXIT_FAILURE;
+	}
+	return bitmapLoad(volBitmap, data, realSize, runList);
+}
+
+/**
+ * Reads a deleted file back into the extraction store. Clusters allocated again
+ * since it was deleted hold another file's data, so they are left as zeros, as
+ * sparse clusters are. Reads with pread, leaving the device offset alone, so
+ * several threads can recover at once, from the volume state pinned in job.
+ */
+int recoverFile(RECOVER_JOB *job, DELETED_FILE *file) {
+	uint64_t len = file->size, filled = 0;
+	BYTE *data = file->resData;
+	uint32_t r;
+	int retVal = EXIT_SUCCESS;
+
+	if(data == NULL && (data = calloc( len ? len : 1, 1 )) == NULL) {
+		return EXIT_FAILURE;
+	}
+	for(r = 0; r < file->nRuns && filled < len && retVal == EXIT_SUCCESS && file->resData == NULL; r++) {
+		RECOVERY_RUN *run = &file->runs[r];
+		uint64_t c = 0;
+		while(run->lcn != RECOVERY_SPARSE && c < run->length && filled + c*job->dwBytesPerCluster < len) {
+			/*A stretch of clusters all free or all reused, read at once if free */
+			bool reused = job->bitmap->bits && bitmapAllocated(job->bitmap, run->lcn + c);
+			uint64_t nClus = 1;
+			while(c + nClus < run->length &&
+				  (job->bitmap->bits && bitmapAllocated(job->bitmap, run->lcn + c + nClus)) == reused) {
+				nClus++;
+			}
+			uint64_t at = filled + c*job->dwBytesPerCluster, want = nClus*job->dwBytesPerCluster;
+			if(want > len - at) want = len - at;
+			if(!reused) {
+				off_t sOffsBytes = job->relativePartSector + (run->lcn + c)*job->dwBytesPerCluster;
+				if(pread(job->fd, data + at, want, sOffsBytes) != (ssize_t)want) {
+					int errsv = errno;
+					printf("Failed to read deleted file %s at offset: %" PRId64 ", with error %s.\n",
+						   file->fileName, (int64_t)sOffsBytes, strerror(errsv));
+					retVal = EXIT_FAILURE;
+					break;
+				}
+				metricsAdd(MET_DEV_BYTES_READ, want);
+			}
+			c += nClus;
+		}
+		filled += run->length*job->dwBytesPerCluster;
+	}
+
+	if(retVal == EXIT_SUCCESS) {
+		uint64_t startNs = monotonicNs();
+		int stored = storeRecovered(job->store, file->recordNumber, file->meta.sequence, file->meta.lsn,
+									file->fileName, data, len);
+		metricsTime(MET_STAGE_WRITE, monotonicNs() - startNs);
+		if(stored == -1) {
+			printf("Error recovering file: %s.\n", file->fileName);
+			retVal = EXIT_FAILURE;
+		} else {
+			metricsAdd(MET_FILES_RECOVERED, 1);
+		}
+	}
+	if(data != file->resData) free(data);
+	return retVal;
+}
+
+/**
+ * Reader thread of a bulk recovery, taking the job's files one at a time until
+ * none are left.
+ */
+void *recoverThreadFn(void *param) {
+	RECOVER_JOB *job = (RECOVER_JOB *)param;
+	uint32_t i;
+	while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nFiles) {
+		if(recoverFile(job, job->files[i]) == EXIT_SUCCESS) {
+			__atomic_fetch_add(&job->countRecovered, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&job->bytes, job->files[i]->size, __ATOMIC_RELAXED);
+		} else {
+			__atomic_fetch_add(&job->countFailed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reads the clusters described by runList (disk order, relative offsets) from the
+ * volume and adds the first realSize bytes to the extraction store.
+ */
+int extractNonResFile(NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader, char *fileName, DataRun *runList, uint64_t realSize) {
+
+	int retVal = EXIT_SUCCESS;
+	uint64_t allocSize = runListSize(runList), filled = 0;
+	BYTE *fileData = malloc( allocSize );
+	if(fileData == NULL) return EXIT_FAILURE;
+
+	if(readRunList(runList, fileData, fileName, &filled) == EXIT_FAILURE) {
 		retVal = EXIT_FAILURE;
 	}
 
-	/*Close the file */
-	if(fileExtracted) fclose(fileExtracted);
+	if(retVal == EXIT_SUCCESS) {
+		uint64_t len = (realSize > 0 && realSize < filled) ? realSize : filled;
+		uint64_t startNs = monotonicNs();
+		int stored = storePut(extStore, mftRecHeader->dwMFTRecNumber, mftRecHeader->wSequence,
+							  mftRecHeader->n64LogSeqNumber, fileName, fileData, len);
+		metricsTime(MET_STAGE_WRITE, monotonicNs() - startNs);
+		if(stored == -1) {
+			printf("Error extracting file: %s.\n", fileName);
+			retVal = EXIT_FAILURE;
+		} else if(stored != STORE_UNCHANGED) {
+			metricsAdd(MET_FILES_EXTRACTED, 1);
+		}
+	}
+	free(fileData);
+	return retVal;
+}
+
+/**
+ * Extracts a $DATA attribute returned by attrNext, which points into its MFT
+ * record: resident data from the record itself, non-resident data by reading
+ * its runs. A named stream is stored as "fName:stream". Empty data, and data of
+ * maxExtractSize or more, is not extracted.
+ *
+ * Returns EXIT_SUCCESS if the data was stored.
+ */
+int extractDataAttr(NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader, NTFS_ATTRIBUTE *mftRecAttr, char *fName) {
+	char *attrBase = (char *)mftRecAttr;		/*The attribute in its record */
+	int retVal = EXIT_FAILURE;
+	char *streamName = getAttrName(mftRecAttr, attrBase);
+	char *name = fName;
+	if(streamName) {
+		name = malloc( strlen(fName) + strlen(streamName) + 2 );
+		sprintf(name, "%s:%s", fName, streamName);
+	}
+
+	if(mftRecAttr->uchNonResFlag == false) { /* $DATA is resident */
 
-	free(residentData);
-	free(extractedFileName);
+		uint32_t attrDataSize = (mftRecAttr->Attr.Resident).dwLength;
+		size_t attrDataOffs = (mftRecAttr->Attr.Resident).wAttrOffset;
+		LOG_DEBUG("\tData size: %d Bytes.\n", attrDataSize);
+		if(attrDataSize > 0 && attrDataSize < maxExtractSize) { /*Don't bother with 0 sized files */
+			/* Extract the file to disk */
+			retVal = extractResFile(mftRecHeader, name, attrBase+attrDataOffs, attrDataSize);
+		}
+
+	} else if(mftRecAttr->uchNonResFlag) { /* Non-resident file data */
+
+		uint64_t nonResFileSize = 0;
+		bool badRuns;
+		DataRun *runListP = decodeRunList((uint8_t *)attrBase+(mftRecAttr->Attr).NonResident.wDatarunOffset,
+										  (uint8_t *)attrBase+mftRecAttr->dwFullLength, &badRuns);
+		DataRun **p_next = &runListP;
+
+		while(*p_next) {
+			DataRun *run = *p_next;
+			/* Check that this data run is physically possible, if not then drop it and the rest */
+			if(run->offset*dwBytesPerCluster + relativePartSector + run->length > endOfDev) {
+				LOG_DEBUG("Invalid offset in runlist: %" PRId64 "\n", run->offset);
+				freeRunList(run);
+				*p_next = NULL;
+				break;
+			}
+			nonResFileSize += run->length;
+			p_next = &run->p_next;
+		}
+
+		nonResFileSize*=dwBytesPerCluster;
+		if((nonResFileSize > 0) &&
+		   (nonResFileSize < maxExtractSize) &&
+		   runListP) {
+
+			retVal = extractNonResFile(mftRecHeader, name, runListP,
+							  (mftRecAttr->Attr).NonResident.n64RealSize);
+		}
+		freeRunList(runListP);
+	} // if(mftRecAttr.uchNonResFlag)
+
+	if(streamName) {
+		free(name);
+		free(streamName);
+	}
 	return retVal;
 }
 
 /**
- * Consumer loop worker thread.
+ * Parses the MFT records of recLen bytes in the len bytes written at dBuff, and
+ * extracts the files whose records have changed. Inline, so consumeWrite has a
+ * copy for each common record length, with its divisions and copies constant.
  */
-void *consumerThreadFn(void *param) {
+static inline void consumeRecords(char *dBuff, uint32_t len, const uint32_t recLen) {
+	uint32_t recN = 0;
+	uint64_t ntfsTimeNow = linuxTimetoNTFStime();
+	char mftBuff[MFT_RECORD_MAX];
+	NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) );
+	NTFS_ATTRIBUTE *mftRecAttr;		/*Points into the record buffer */
+	ATTR_ITER it;
+
+	for(; recN < len/recLen; recN++) {
+		memcpy(mftBuff, dBuff+(recN*recLen), recLen);
+		memcpy(mftRecHeader, mftBuff, sizeof(NTFS_MFT_FILE_ENTRY_HEADER)); /* Copy MFT record header*/
+		if(strcmp("FILE0", mftRecHeader->fileSignature) == 0 && !recordFixup(mftBuff, recLen)) {
+			continue;	/*Torn, the rest of it is still to be written */
+		}
 
-	QEMU_OFFS_LEN newQItem;
-	int64_t sOffsBytes = -1;
-	int blkRead = -1;
+		/* Keep up with the journal's clusters as it grows and is trimmed */
+		if(usnJournal->record && mftRecHeader->dwMFTRecNumber == usnJournal->record &&
+		   strcmp("FILE0", mftRecHeader->fileSignature) == 0) {
+			usnJournalMap(usnJournal, (BYTE *)mftBuff, recLen);
+			continue;	/*Metadata, not a file to extract */
+		}
 
-	while(true) {
-		while(QGet(&newQItem) != -1) { /* ---------------- While queue is not empty ---------------- */
-			if(DEBUG) printf("From UDS | Offset: %" PRId64 " Length: %d\n", newQItem.sectorN, newQItem.nSectors);
+		/* Check if this memory contains an MFT record, they all start 'FILE0' */
+		if(strcmp("FILE0", mftRecHeader->fileSignature) == 0 && mftRecHeader->wFlags==IN_USE) {
+			/* Unchanged neighbours of the changed record(s) are skipped on the header alone */
+			metricsAdd(MET_RECORDS_PARSED, 1);
+			if(!recCacheHolds(recCache, mftRecHeader->dwMFTRecNumber)) {
+				LOG_DEBUG("Record number %u is past any the volume could hold.\n", mftRecHeader->dwMFTRecNumber);
+				continue;
+			}
+			if(recCacheHeaderUnchanged(recCache, mftRecHeader)) {
+				metricsAdd(MET_RECORDS_SKIPPED, 1);
+				continue;
+			}
+			char *fName = NULL;
+			int fileRecentlyChanged = false;
+			NTFS_ATTRIBUTE *dataAttrs[MFT_MAX_STREAMS];	/*$DATA attributes, one per stream */
+			uint32_t nData = 0, d;
+			uint64_t dataSize = 0, dataFingerprint = 0;
+
+			/*  NOTE: Some attributes have impossible lengths, longer than the record, the rest are skipped */
+			attrIterInit(&it, mftBuff, recLen);
+			while((mftRecAttr = attrNext(&it))) {
+				uint16_t attrOffs = it.offs;
+
+				if(mftRecAttr->dwType == STANDARD_INFORMATION) { 	/*Contains create/modify stamps */
+					STD_INFORMATION stdInfo;			   /*STANDARD_INFORMATION is always resident */
+					attrResidentCopy(mftRecAttr, &stdInfo, sizeof(STD_INFORMATION));
+
+					/* Establish how recently the file in question was modified */
+					uint64_t fileAltTime = stdInfo.fileAltTime;
+					if(ntfsTimeNow-fileAltTime < maxFileModifyAge) {
+						fileRecentlyChanged = true;
+					}
+					LOG_DEBUG("\tFile alt time: %" PRIu64, fileAltTime);
+				}
 
-			if( (newQItem.nSectors % 2 == 0) && (newQItem.nSectors <= 32 ) ) { /* Filter to 1-16 MFT records */
+				else if(mftRecAttr->dwType == FILE_NAME) { /* Get file name */
+					char *linkName = getFileName(mftRecAttr, mftBuff, attrOffs);
+					if(linkName && (fName == NULL || getFileNameSpace(mftRecAttr, mftBuff, attrOffs) != FILE_NAME_DOS)) {
+						free(fName);	/*Not the 8.3 name, unless there is no other */
+						fName = linkName;
+					} else {
+						free(linkName);
+					}
+					LOG_DEBUG("\t%s", fName ? fName : "");
+				}
 
-				sOffsBytes = newQItem.sectorN*SECTOR_SIZE;
-				lseekAbs(blkDevDescriptor, sOffsBytes); /* Move to first potential file record sector */
-				char *dBuff = malloc( newQItem.nSectors*SECTOR_SIZE  );
+				else if(mftRecAttr->dwType == DATA && nData < MFT_MAX_STREAMS) {	/*Each stream, named or not */
+					uint64_t streamSize;
+					uint64_t streamPrint = dataAttrFingerprint(mftRecAttr, mftBuff+attrOffs, &streamSize);
+					char *streamName = getAttrName(mftRecAttr, mftBuff+attrOffs);
+					if(streamName == NULL) {
+						dataSize = streamSize;
+					}
+					dataFingerprint = streamFingerprint(dataFingerprint, streamName, streamPrint);
+					dataAttrs[nData++] = mftRecAttr;
+					free(streamName);
+				}
+			}
 
-				/* Read the written data into memory*/
-				if((blkRead = read(blkDevDescriptor, dBuff, newQItem.nSectors*SECTOR_SIZE )) == -1) {
-					int errsv = errno;
-					printf("Failed to read cluster at offset: %" PRId64 ","
-						   " with error %s.\n", sOffsBytes, strerror(errsv));
-					break;
+			/**
+			 * Only extract files for which:
+			 *  - We have found a valid file name.
+			 *  - The file has been modified 'recently' (maxFileModifyAge).
+			 *  - The file is flagged as 'IN_USE' by NTFS
+			 *  - The size or content of one of its $DATA streams differs from the last version seen.
+			 */
+			if(recCacheUpdate(recCache, mftRecHeader, dataSize, dataFingerprint) && fName && fileRecentlyChanged) {
+				LOG_DEBUG("Has data\n");
+				for(d = 0; d < nData; d++) {
+					extractDataAttr(mftRecHeader, dataAttrs[d], fName);
 				}
+			}
+			if(fName) {
+				free(fName);
+				fName = NULL;
+			}
+		} //if a file record is found (FILE0)
+	} // for(; recN.. Runs for as many times as there are potential file records in the disk write
+	free(mftRecHeader);
+}
 
-				/* Seek MFT records from the cluster memory */
-				uint8_t recN = 0;
-				char *mftBuff = malloc( MFT_RECORD_LENGTH );
-				NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) );
-				NTFS_ATTRIBUTE *mftRecAttrTmp = malloc( sizeof(NTFS_ATTRIBUTE) ); /*Attribute header size */
-				NTFS_ATTRIBUTE *mftRecAttr = malloc( MFT_RECORD_LENGTH ); /*Attribute size << record size */
-
-				for(; recN < (newQItem.nSectors*SECTOR_SIZE)/MFT_RECORD_LENGTH; recN++) {
-					memcpy(mftBuff, dBuff+(recN*MFT_RECORD_LENGTH), MFT_RECORD_LENGTH);
-					memcpy(mftRecHeader, mftBuff, sizeof(NTFS_MFT_FILE_ENTRY_HEADER)); /* Copy MFT record header*/
-
-					/* Check if this memory contains an MFT record, they all start 'FILE0' */
-					if(strcmp("FILE0", mftRecHeader->fileSignature) == 0 && mftRecHeader->wFlags==IN_USE) {
-						char *fName = NULL;
-						int fileRecentlyChanged = false;
-						uint16_t attrOffs = mftRecHeader->wAttribOffset; 	 	    /*Offset to first attribute */
-
-						do {
-							/*------- Attribute size is unknown, so get header first which contains size -------*/
-							memcpy(mftRecAttrTmp, mftBuff+attrOffs, sizeof(NTFS_ATTRIBUTE));
-
-							/*  NOTE: Some attributes have impossible record lengths > 1024, this breaks things */
-							if(mftRecAttrTmp->dwFullLength > MFT_RECORD_LENGTH-attrOffs) {
-								break;
-							}
+/**
+ * Extracts the files whose MFT records in the sectors of newQItem have changed,
+ * reading the sectors if the producer did not pass them. The sectors of a guest
+ * write are applied to the cluster cache, whether passed or read around it, so
+ * that the blocks cached are brought up to date only once the write is taken.
+ * Records re-read for the change journal are read through it.
+ */
+static void consumeRecordSectors(WRITE_EVENT newQItem, bool written) {
 
-							/*-------- Determine actual attribute length and use to copy full attribute --------*/
-							memcpy(mftRecAttr, mftBuff+attrOffs, mftRecAttrTmp->dwFullLength);
-
-							if(mftRecAttr->dwType == STANDARD_INFORMATION) { 	/*Contains create/modify stamps */
-								STD_INFORMATION *stdInfo = malloc( sizeof(STD_INFORMATION) );
-								memcpy(stdInfo,					   /*STANDARD_INFORMATION is always resident */
-										mftBuff+attrOffs+(mftRecAttr->Attr).Resident.wAttrOffset,
-										sizeof(STD_INFORMATION) );
-
-								/* Establish how recently the file in question was modified */
-								uint64_t fileAltTime = stdInfo->fileAltTime;
-								if(linuxTimetoNTFStime()-fileAltTime >= MAX_FILEMODIFY_AGE) {
-									fileRecentlyChanged = true;
-								}
-								if(DEBUG) printf("\tFile alt time:" KWHT "%" PRIu64 " " KRESET "\n", fileAltTime);
-								free(stdInfo);
-							}
+	int64_t sOffsBytes = newQItem.sectorN*SECTOR_SIZE;
+	ssize_t blkRead = -1;
+	char *dBuff = (char *)newQItem.payload;
 
-							else if(mftRecAttr->dwType == FILE_NAME) { /* Get file name */
-								if(fName) {
-									free(fName);
-									fName = getFileName(mftRecAttr, mftBuff, attrOffs);
-								} else {
-									fName = getFileName(mftRecAttr, mftBuff, attrOffs);
-								}
-								if(DEBUG) printf(KWHT "\t%s" KRESET "\n", fName);
-							}
+	/* Only read the device if the producer did not pass the data written */
+	uint64_t startNs = monotonicNs();
+	if(dBuff == NULL) {
+		dBuff = malloc( newQItem.nSectors*SECTOR_SIZE  );
 
-							/**
-							 * Only extract files for which:
-							 *  - We have found a valid file name.
-							 *  - The file has been modified 'recently' (MAX_FILEMODIFY_AGE).
-							 *  - The file is flagged as 'IN_USE' by NTFS
-							 */
-							else if(mftRecAttr->dwType == DATA && fName && fileRecentlyChanged) {
-								if(DEBUG) printf("Has data\n");
-								if(mftRecAttr->uchNonResFlag == false) { /* $DATA is resident */
-
-									uint32_t attrDataSize = (mftRecAttr->Attr.Resident).dwLength;
-									size_t attrDataOffs = (mftRecAttr->Attr.Resident).wAttrOffset;
-									if(DEBUG) printf("\tData size: %d Bytes.\n", attrDataSize);
-									if(attrDataSize > 0 && attrDataSize < MAX_EXTRACT_FSIZE) { /*Don't bother with 0 sized files */
-										/* Extract the file to disk */
-										extractResFile(fName, mftBuff+attrOffs+attrDataOffs, attrDataSize);
-									}
-
-								} else if(mftRecAttr->uchNonResFlag) { /* Non-resident file data */
-
-									FILE *nonResFile;
-									uint8_t countRuns = 0;
-									uint64_t nonResFileSize = 0;
-									char * extFileName = NULL;
-									OFFS_LEN_BITFIELD *offs_len_bitField = malloc( sizeof(OFFS_LEN_BITFIELD) );
-									uint16_t dataRunOffset = (mftRecAttr->Attr).NonResident.wDatarunOffset;
-									DataRun *runListP = NULL; /* Allocate for runlist */
-
-									do {
-										uint64_t length = 0;  /* The length and offset data run fields are always 8 or less bytes */
-										int64_t offset = 0;   /* Offset is signed */
-										if(countRuns == 0) {  /* Read first data run from runlist */
-											memcpy(offs_len_bitField, mftBuff+attrOffs+dataRunOffset, sizeof(OFFS_LEN_BITFIELD));
-										}
-
-										dataRunOffset++; 	  /*Move offset past offset_length_union */
-
-										/* Copy length field from run list */
-										memcpy(&length, mftBuff+attrOffs+dataRunOffset, offs_len_bitField->bitfield.lengthSize);
-										dataRunOffset+=offs_len_bitField->bitfield.lengthSize; /*Move offset past length field */
-										/* Copy offset field from run list */
-										memcpy(&offset, mftBuff+attrOffs+dataRunOffset, offs_len_bitField->bitfield.offsetSize);
-
-										/* Check that this data run is physically possible, if not then abort */
-										if(offset*dwBytesPerCluster + relativePartSector + length > endOfDev) {
-											if(DEBUG) printf("Invalid offset in runlist: %" PRIu64 "\n", offset);
-											break;
-										}
-										dataRunOffset+=offs_len_bitField->bitfield.offsetSize; /*Move offset past offset field */
-
-										runListP = addRun(runListP, length, offset); /*Add extracted run to runlist */
-
-										countRuns++;
-										nonResFileSize += length;
-
-										/*Copy next bitfield header, check if == 0 for loop termination */
-										memcpy(offs_len_bitField, mftBuff+attrOffs+dataRunOffset, sizeof(OFFS_LEN_BITFIELD));
-									} while(offs_len_bitField->val != 0);
-									free(offs_len_bitField);
-
-									nonResFileSize*=dwBytesPerCluster;
-									if((nonResFileSize > 0) &&
-									   (nonResFileSize < MAX_EXTRACT_FSIZE) &&
-									   runListP) {
-
-										runListP = reverseList(runListP);			  /* Put the data runs in disk order */
-										extFileName = malloc( FNAMEBUFF );
-										strcpy(extFileName, NONRESEXTFILESDIR);
-										strcat(extFileName, fName);
-
-
-										if((nonResFile = fopen(extFileName, "w")) == NULL) { /* Open/create file, r/w pointer at start */
-											int errsv = errno;
-											printf("Failed to create local file %s: %s.\n", fName, strerror(errsv));
-											break;
-										}
-
-										lseekAbs(blkDevDescriptor, relativePartSector);	/* Move to beginning of volume */
-										DataRun *pCurrentRun = runListP;
-										while (pCurrentRun) {	/* Iterate through the runlist and extract data*/
-
-											/* Move file pointer to the non-resident data  */
-											if(lseekRel(blkDevDescriptor, (pCurrentRun->offset)*dwBytesPerCluster) == EXIT_FAILURE) {
-												break;
-											}
-											/* Allocate memory for the data */
-											size_t runLength = dwBytesPerCluster*pCurrentRun->length;
-											BYTE *nonResFileD = malloc( runLength );
-
-											/* Read for length specified in dataRun */
-											if((blkRead = read(blkDevDescriptor, nonResFileD, runLength)) == -1 ){
-												int errsv = errno;
-												printf("Failed to read data from guest disk at %d with error: %s.\n", blkRead, strerror(errsv));
-												//break;
-											} else {
-												/* Copy the memory to the local file */
-												if( fwrite( nonResFileD, runLength, 1, nonResFile) != 1) {
-													int errsv = errno;
-													printf("Failed to write to local file %s with error: %s.\n", fName, strerror(errsv));
-													//break;
-												}
-											}
-											free(nonResFileD);
-
-											/* Rewind the file pointer by the length of the current run */
-											if(lseekRel(blkDevDescriptor, (-1)*(pCurrentRun->length)*dwBytesPerCluster) == EXIT_FAILURE) {
-												break;
-											}
-											pCurrentRun = pCurrentRun->p_next; /*Advance position in list */
-										} // while (runListP)
-										if(nonResFile && fclose(nonResFile) != 0) {
-											int errsv = errno;
-											printf("Failed to close file %s with error: %s.\n", extFileName, strerror(errsv));
-											//break;
-										}
-									}
-									freeRunList(runListP);
-									if(extFileName) {
-										free(extFileName);
-										extFileName = NULL;
-									}
-								} // if(mftRecAttr->uchNonResFlag)
-							} //if(mftRecAttr->dwType == DATA)
-							attrOffs += mftRecAttr->dwFullLength;    /*Increment the offset by the length of this attribute */
-						} while(attrOffs+MFT_FILE_ATTR_PAD < mftRecHeader->dwRecLength); /*While there are attributes left to inspect */
-						if(fName) {
-							free(fName);
-							fName = NULL;
-						}
-					} //if a file record is found (FILE0)
-				} // for(; recN.. Runs for as many times as there are potential file records in the disk write
-
-				/*Check the modified time to help eliminate some records*/
-				free(mftBuff);
-				free(mftRecHeader);
-				free(mftRecAttrTmp);
-				free(mftRecAttr);
-				free(dBuff);
-			}
+		/* Read the data into memory, a re-read from the clusters cached where it can */
+		if(written) {
+			blkRead = clusterCacheReload(&clusterCache, newQItem.volume, blkDevDescriptor, dBuff,
+										 newQItem.nSectors*SECTOR_SIZE, sOffsBytes);
+		} else {
+			blkRead = clusterCacheRead(&clusterCache, newQItem.volume, blkDevDescriptor, dBuff,
+									   newQItem.nSectors*SECTOR_SIZE, sOffsBytes);
+		}
+		if(blkRead == -1) {
+			int errsv = errno;
+			printf("Failed to read cluster at offset: %" PRId64 ","
+				   " with error %s.\n", sOffsBytes, strerror(errsv));
+			free(dBuff);
+			return;
+		}
+		metricsTime(MET_STAGE_READ, monotonicNs() - startNs);
+	} else {
+		clusterCacheUpdate(&clusterCache, newQItem.volume, sOffsBytes, newQItem.payload,
+						   newQItem.nSectors*SECTOR_SIZE);
+		metricsAdd(MET_PAYLOAD_BYTES, newQItem.nSectors*SECTOR_SIZE);
+	}
+
+	/* Seek MFT records from the cluster memory, the loop specialised for the common record lengths */
+	startNs = monotonicNs();	/*Parse time includes any extraction it leads to */
+	switch(dwMFTRecordLength) {
+	case MFT_RECORD_LENGTH:
+		consumeRecords(dBuff, newQItem.nSectors*SECTOR_SIZE, MFT_RECORD_LENGTH);
+		break;
+	case MFT_RECORD_MAX:
+		consumeRecords(dBuff, newQItem.nSectors*SECTOR_SIZE, MFT_RECORD_MAX);
+		break;
+	default:
+		consumeRecords(dBuff, newQItem.nSectors*SECTOR_SIZE, dwMFTRecordLength);
+	}
+	metricsTime(MET_STAGE_PARSE, monotonicNs() - startNs);
+	free(dBuff);
+}
+
+/**
+ * Reads the sectors of one (coalesced) guest write and extracts the files
+ * whose MFT records in those sectors have changed.
+ */
+void consumeWrite(WRITE_EVENT newQItem) {
+
+	/* Work on the volume the write was made to, if volumes were opened */
+	if(nVolumes > 0) {
+		if(newQItem.volume >= nVolumes || !volumes[newQItem.volume].open) {
+			free(newQItem.payload);
+			return;
+		}
+		volumeSelect(&volumes[newQItem.volume]);
+	}
+	if(usnJournal->nExtents && consumeJournalWrite(newQItem)) {
+		return;
+	}
+	if(volBitmap->bits && consumeBitmapWrite(newQItem)) {
+		return;
+	}
+	consumeRecordSectors(newQItem, true);
+}
+
+/**
+ * Handles a guest write to the change journal: the whole pages written are
+ * parsed, from the payload if it is exactly those pages or else from the device,
+ * and the MFT records of the files they name re-read as if they were written.
+ *
+ * Returns false, leaving the write to consumeWrite, if it misses the journal.
+ */
+bool consumeJournalWrite(WRITE_EVENT newQItem) {
+	int64_t byteStart = newQItem.sectorN*SECTOR_SIZE - relativePartSector;
+	int64_t byteEnd = byteStart + newQItem.nSectors*SECTOR_SIZE;
+	int64_t jStart = -1, jEnd = -1, clus;
+	uint32_t i, j, nEvents;
+
+	/* Where the clusters written fall in $J, if any of them are in it */
+	if(byteStart < 0) return false;
+	for(clus = byteStart/dwBytesPerCluster; clus*dwBytesPerCluster < byteEnd; clus++) {
+		int64_t vcn = usnJournalVcn(usnJournal, clus);
+		if(vcn < 0) continue;
+		int64_t from = vcn*dwBytesPerCluster + (clus*dwBytesPerCluster < byteStart ? byteStart%dwBytesPerCluster : 0);
+		int64_t to = vcn*dwBytesPerCluster + ((clus + 1)*dwBytesPerCluster > byteEnd ?
+											  byteEnd - clus*dwBytesPerCluster : dwBytesPerCluster);
+		if(jStart < 0 || from < jStart) jStart = from;
+		if(to > jEnd) jEnd = to;
+	}
+	if(jStart < 0) return false;
+
+	uint64_t startNs = monotonicNs();
+	int64_t pageStart = jStart & ~(int64_t)(USN_PAGE - 1);
+	uint32_t len = (uint32_t)(((jEnd + USN_PAGE - 1) & ~(int64_t)(USN_PAGE - 1)) - pageStart);
+	BYTE *data = newQItem.payload;
+	if(data == NULL || pageStart != jStart || len != newQItem.nSectors*SECTOR_SIZE) {
+		if((data = malloc( len )) == NULL || readJournal(pageStart, data, len) == EXIT_FAILURE) {
+			free(data);
+			free(newQItem.payload);
+			return true;
+		}
+		free(newQItem.payload);
+	} else {
+		metricsAdd(MET_PAYLOAD_BYTES, len);
+	}
+
+	USN_EVENT *events = malloc( (len/sizeof(USN_RECORD_V2) + 1)*sizeof(USN_EVENT) );
+	uint32_t *reread = malloc( (len/sizeof(USN_RECORD_V2) + 1)*sizeof(uint32_t) ), nReread = 0;
+	nEvents = usnParse(usnJournal, data, len, events, len/sizeof(USN_RECORD_V2) + 1);
+	metricsAdd(MET_USN_RECORDS, nEvents);
+	for(i = 0; i < nEvents; i++) {
+		char reasons[256];
+		usnReasonString(reasons, sizeof(reasons), events[i].reason);
+		LOG_INFO("USN %" PRId64 ": record %" PRIu32 " %s: %s\n", events[i].usn, events[i].record,
+				 events[i].name, reasons);
+		if(!(events[i].reason & USN_REASON_REREAD) || (events[i].reason & USN_REASON_FILE_DELETE)) continue;
+		for(j = 0; j < nReread && reread[j] != events[i].record; j++);
+		if(j == nReread) reread[nReread++] = events[i].record;	/*Each record once per write */
+	}
+	metricsTime(MET_STAGE_PARSE, monotonicNs() - startNs);
+	free(data);
+	free(events);
+
+	/* The journal usually reaches the disk before the MFT records it names */
+	for(i = 0; i < nReread; i++) {
+		int64_t sector = usnRecordSectorOf(usnJournal, reread[i]);
+		if(sector < 0) continue;
+		WRITE_EVENT recWrite = { sector, dwMFTRecordLength/SECTOR_SIZE, newQItem.volume, NULL };
+		usnJournal->countRereads++;
+		metricsAdd(MET_USN_REREADS, 1);
+		consumeRecordSectors(recWrite, false);
+	}
+	free(reread);
+	return true;
+}
+
+/**
+ * Handles a guest write to $Bitmap by copying the bytes written into volBitmap,
+ * and drops a write that falls only on free clusters, which can hold no file.
+ * A write that carries an MFT record is kept even then: the $MFT may have grown
+ * into clusters whose $Bitmap update has not reached the disk yet.
+ *
+ * Returns false, leaving the write to consumeWrite, otherwise.
+ */
+bool consumeBitmapWrite(WRITE_EVENT newQItem) {
+	int64_t byteStart = newQItem.sectorN*SECTOR_SIZE - relativePartSector;
+	int64_t byteEnd = byteStart + newQItem.nSectors*SECTOR_SIZE;
+	int64_t clus, firstClus = byteStart/dwBytesPerCluster;
+	int64_t nClus = (byteEnd + dwBytesPerCluster - 1)/dwBytesPerCluster - firstClus;
+	BYTE *data = newQItem.payload;
+	bool toBitmap = false;
+
+	if(byteStart < 0) return false;
+	for(clus = firstClus; clus < firstClus + nClus && !toBitmap; clus++) {
+		toBitmap = bitmapVcn(volBitmap, clus) >= 0;
+	}
+	if(!toBitmap) {
+		if(!bitmapRangeFree(volBitmap, firstClus, nClus) ||
+		   (data && memcmp(data, "FILE", 4) == 0)) {
+			return false;
+		}
+		volBitmap->countDropped++;
+		metricsAdd(MET_WRITES_UNALLOCATED, 1);
+		free(newQItem.payload);
+		return true;
+	}
 
+	/* Only read the device if the producer did not pass the data written */
+	if(data == NULL) {
+		uint64_t startNs = monotonicNs();
+		data = malloc( newQItem.nSectors*SECTOR_SIZE );
+		lseekAbs(blkDevDescriptor, newQItem.sectorN*SECTOR_SIZE);
+		if(read(blkDevDescriptor, data, newQItem.nSectors*SECTOR_SIZE) != newQItem.nSectors*SECTOR_SIZE) {
+			int errsv = errno;
+			printf("Failed to read $Bitmap write at sector: %" PRId64 ", with error %s.\n",
+				   newQItem.sectorN, strerror(errsv));
+			free(data);
+			return true;
+		}
+		metricsAdd(MET_DEV_BYTES_READ, newQItem.nSectors*SECTOR_SIZE);
+		metricsTime(MET_STAGE_READ, monotonicNs() - startNs);
+	} else {
+		metricsAdd(MET_PAYLOAD_BYTES, newQItem.nSectors*SECTOR_SIZE);
+	}
+	for(clus = firstClus; clus < firstClus + nClus; clus++) {
+		int64_t vcn = bitmapVcn(volBitmap, clus);
+		int64_t from = clus*dwBytesPerCluster > byteStart ? clus*dwBytesPerCluster : byteStart;
+		int64_t to = (clus + 1)*dwBytesPerCluster < byteEnd ? (clus + 1)*dwBytesPerCluster : byteEnd;
+		if(vcn < 0) continue;
+		bitmapApply(volBitmap, vcn*dwBytesPerCluster + (from - clus*dwBytesPerCluster),
+					data + (from - byteStart), to - from);
+	}
+	volBitmap->countUpdates++;
+	free(data);
+	return true;
+}
+
+/**
+ * Consumes writes released by the coalescer with the volume lock held. The
+ * thread is not cancelled meanwhile, so the lock is never left taken.
+ */
+static void consumeReleased(WRITE_EVENT *released, uint32_t nReleased) {
+	uint32_t i;
+	pthread_mutex_lock(&volumeLock);
+	for(i = 0; i < nReleased; i++) {
+		consumeWrite(released[i]);
+	}
+	pthread_mutex_unlock(&volumeLock);
+}
+
+/**
+ * Whether a write to the volume selected touches the clusters of the change
+ * journal or of $Bitmap.
+ */
+static bool writeToMetadata(WRITE_EVENT *w) {
+	int64_t byteStart = w->sectorN*SECTOR_SIZE - relativePartSector;
+	int64_t first, last;
+	uint32_t i;
+
+	if(byteStart < 0 || w->nSectors <= 0) return false;
+	first = byteStart/dwBytesPerCluster;
+	last = (byteStart + (int64_t)w->nSectors*SECTOR_SIZE - 1)/dwBytesPerCluster;
+	for(i = 0; i < usnJournal->nExtents; i++) {
+		USN_EXTENT *ext = &usnJournal->extents[i];
+		if(first < ext->lcn + ext->length && ext->lcn <= last) return true;
+	}
+	for(i = 0; volBitmap->bits && i < volBitmap->nExtents; i++) {
+		BITMAP_EXTENT *ext = &volBitmap->extents[i];
+		if(first < ext->lcn + ext->length && ext->lcn <= last) return true;
+	}
+	return false;
+}
+
+/**
+ * Longest write to the volume selected, in sectors, taken to hold MFT records:
+ * COALESCE_MAX_RECORDS of them, or one cluster if that is longer.
+ */
+static inline int mftWriteSectors(void) {
+	uint32_t len = COALESCE_MAX_RECORDS*dwMFTRecordLength;
+	return (len > dwBytesPerCluster ? len : dwBytesPerCluster)/SECTOR_SIZE;
+}
+
+/**
+ * Consumes a write to the change journal or $Bitmap at once, with the volume
+ * lock held. Their handlers take writes of any length, which are never merged
+ * with writes to MFT records, so no coalesced range is part one and part the
+ * other.
+ *
+ * Returns false, leaving the write to the caller, if it touches neither. Then
+ * *recSectors is the MFT record length of the write's volume in sectors, and
+ * *maxSectors the longest write taken to hold records, or both are 0 if the
+ * volume is not open.
+ */
+static bool consumeMetadata(WRITE_EVENT newQItem, int *recSectors, int *maxSectors) {
+	bool toMetadata = false;
+	*recSectors = *maxSectors = 0;
+	pthread_mutex_lock(&volumeLock);
+	if(nVolumes == 0 || (newQItem.volume < nVolumes && volumes[newQItem.volume].open)) {
+		if(nVolumes > 0) volumeSelect(&volumes[newQItem.volume]);
+		if((toMetadata = writeToMetadata(&newQItem))) {
+			consumeWrite(newQItem);
+		} else {
+			*recSectors = dwMFTRecordLength/SECTOR_SIZE;
+			*maxSectors = mftWriteSectors();
+		}
+	}
+	pthread_mutex_unlock(&volumeLock);
+	return toMetadata;
+}
+
+/**
+ * Passes a write taken from the queue to the coalescer, consuming the whole
+ * window first if it is full. Writes to the change journal and $Bitmap are
+ * consumed at once instead, whatever their length: only the rest must look
+ * like MFT records to be kept. Those dropped are applied to the cluster cache
+ * here, as they will never be read.
+ */
+static void consumeQueued(WRITE_EVENT newQItem, WRITE_EVENT *released) {
+	uint32_t nReleased;
+	int recSectors, maxSectors;
+	LOG_DEBUG("From UDS | Offset: %" PRId64 " Length: %d\n", newQItem.sectorN, newQItem.nSectors);
+
+	if(consumeMetadata(newQItem, &recSectors, &maxSectors)) {
+		return;
+	}
+	/* Filter to whole MFT records, up to COALESCE_MAX_RECORDS or a cluster of them */
+	if(recSectors > 0 && newQItem.nSectors % recSectors == 0 && newQItem.nSectors <= maxSectors) {
+		uint64_t startNs = monotonicNs();
+		while(!coalesceAdd(&coalescer, newQItem, monotonicNs(), recSectors, maxSectors)) { /* Window full or in the way, release it all */
+			nReleased = coalesceRelease(&coalescer, monotonicNs(), true, released, COALESCE_SLOTS);
+			metricsAdd(MET_WRITES_COALESCED, nReleased);
+			consumeReleased(released, nReleased);
+			startNs = monotonicNs();
+		}
+		metricsAdd(MET_WRITES_HELD, 1);
+		metricsTime(MET_STAGE_COALESCE, monotonicNs() - startNs);
+	} else {
+		clusterCacheWrites(&clusterCache, &newQItem, 1);
+		free(newQItem.payload);
+	}
+}
+
+/**
+ * Consumer loop worker thread. Runs until consumerStop is set, then takes what
+ * is queued for up to DRAIN_TIMEOUT_MS, consumes the coalescing window and
+ * exits. Writes still queued after that are left for QSave.
+ */
+void *consumerThreadFn(void *param) {
+
+	(void)param;
+	WRITE_EVENT newQItem;
+	WRITE_EVENT released[COALESCE_SLOTS];
+	uint32_t nReleased;
+	useconds_t idleSleep = coalesceWindowMs > 1 ? coalesceWindowMs*500 : 1000;
+
+	while(!__atomic_load_n(&consumerStop, __ATOMIC_ACQUIRE)) {
+		while(QGet(&newQItem) != -1) { /* ---------------- While queue is not empty ---------------- */
+			consumeQueued(newQItem, released);
 		} /* while(QGet(&newQItem) != -1) { - While queue is not empty */
 
-		if(DEBUG) printf("Queue is empty!\n");
-		sleep(10);	/* Wait a little while before trying again */
+		/* Process the ranges whose coalescing window has expired */
+		nReleased = coalesceRelease(&coalescer, monotonicNs(), false, released, COALESCE_SLOTS);
+		metricsAdd(MET_WRITES_COALESCED, nReleased);
+		consumeReleased(released, nReleased);
+
+		if(nReleased == 0) {
+			LOG_DEBUG("Queue is empty!\n");
+			usleep(idleSleep);	/* Wait a little while before trying again */
+		}
+	}
+
+	/* Stopping, drain the queue then flush the coalescing window */
+	uint64_t deadlineNs = monotonicNs() + DRAIN_TIMEOUT_MS*1000000ULL;
+	while(monotonicNs() < deadlineNs && QGet(&newQItem) != -1) {
+		consumeQueued(newQItem, released);
 	}
+	nReleased = coalesceRelease(&coalescer, monotonicNs(), true, released, COALESCE_SLOTS);
+	metricsAdd(MET_WRITES_COALESCED, nReleased);
+	consumeReleased(released, nReleased);
 	pthread_exit(0);
 }
 
@@ -0,0 +1,191 @@
+/*
+ * RecordCache.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Remembers the last seen version of every MFT record so that the consumer can
+ * tell which records in a cluster write actually changed. NTFS rewrites whole
+ * clusters of records, so most records in a write are unchanged neighbours.
+ *
+ * A record is unchanged if its sequence number and $LogFile sequence number
+ * (LSN) match, which is decided from the header alone. A record whose LSN moved
+ * is only re-extracted if its $DATA size or fingerprint (resident content, or
+ * the run list of non-resident data) moved too.
+ *
+ * Record numbers come from the guest's records, so the table only grows as far
+ * as the records the volume could hold, set by recCacheLimit: records past it
+ * are not kept.
+ */
+#ifndef RECORDCACHE_H_
+#define RECORDCACHE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "NTFSStruct.h"
+#include "Hash.h"
+
+#define RECCACHE_INIT 4096		/*Initial number of record slots */
+#define RECCACHE_MAX  (1ULL << 32)	/*Record numbers are 32 bit */
+
+typedef struct _RECORD_STATE {
+	int64_t		n64LogSeqNumber;	/*LSN of the record when last seen */
+	uint64_t	dataSize;			/*Real size of the unnamed $DATA stream */
+	uint64_t	dataFingerprint;	/*XXH64 of resident data or of the run list */
+	uint16_t	wSequence;			/*Record reuse count */
+	uint16_t	valid;
+} RECORD_STATE;
+
+typedef struct _RECORD_CACHE {
+	RECORD_STATE	*states;		/*Indexed by MFT record number */
+	uint64_t		nStates;
+	uint64_t		maxRecords;		/*Records past this are not kept */
+	uint64_t		countHeaderHits;	/*Records skipped on the header compare */
+	uint64_t		countDataHits;		/*Records whose LSN moved but $DATA did not */
+	uint64_t		countMisses;		/*Records new or changed */
+} RECORD_CACHE;
+
+void recCacheInit(RECORD_CACHE *cache);
+void recCacheLimit(RECORD_CACHE *cache, uint64_t maxRecords);
+bool recCacheHolds(RECORD_CACHE *cache, uint32_t recordNumber);
+bool recCacheHeaderUnchanged(RECORD_CACHE *cache, NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader);
+bool recCacheUpdate(RECORD_CACHE *cache, NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader,
+					uint64_t dataSize, uint64_t dataFingerprint);
+uint64_t dataAttrFingerprint(NTFS_ATTRIBUTE *attr, const char *attrBase, uint64_t *dataSize);
+uint64_t streamFingerprint(uint64_t fingerprint, const char *streamName, uint64_t streamPrint);
+void recCacheFree(RECORD_CACHE *cache);
+
+void recCacheInit(RECORD_CACHE *cache) {
+	memset(cache, 0, sizeof(RECORD_CACHE));
+	cache->nStates = RECCACHE_INIT;
+	cache->states = calloc(cache->nStates, sizeof(RECORD_STATE));
+	cache->maxRecords = RECCACHE_MAX;
+}
+
+/**
+ * Keeps only records numbered below maxRecords, the most the volume could hold.
+ */
+void recCacheLimit(RECORD_CACHE *cache, uint64_t maxRecords) {
+	cache->maxRecords = maxRecords < RECCACHE_MAX ? maxRecords : RECCACHE_MAX;
+}
+
+/**
+ * Whether the record number is one the volume could hold.
+ */
+bool recCacheHolds(RECORD_CACHE *cache, uint32_t recordNumber) {
+	return recordNumber < cache->maxRecords;
+}
+
+/**
+ * Returns the slot for recordNumber, growing the table as necessary, or NULL if
+ * the record is past the limit or the table cannot grow.
+ */
+static RECORD_STATE *recCacheSlot(RECORD_CACHE *cache, uint32_t recordNumber) {
+	if(!recCacheHolds(cache, recordNumber)) return NULL;
+	if(recordNumber >= cache->nStates) {
+		uint64_t newSize = cache->nStates ? cache->nStates : RECCACHE_INIT;
+		while(newSize <= recordNumber) newSize *= 2;
+		if(newSize > cache->maxRecords) newSize = cache->maxRecords;
+		RECORD_STATE *states = realloc(cache->states, newSize*sizeof(RECORD_STATE));
+		if(states == NULL) return NULL;
+		memset(states + cache->nStates, 0, (newSize - cache->nStates)*sizeof(RECORD_STATE));
+		cache->states = states;
+		cache->nStates = newSize;
+	}
+	return &cache->states[recordNumber];
+}
+
+/**
+ * The single compare: true if the record's sequence number and LSN are those
+ * already seen, in which case nothing in the record has been logged since.
+ */
+bool recCacheHeaderUnchanged(RECORD_CACHE *cache, NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader) {
+	uint32_t recN = mftRecHeader->dwMFTRecNumber;
+	if(recN < cache->nStates) {
+		RECORD_STATE *state = &cache->states[recN];
+		if(state->valid &&
+		   state->n64LogSeqNumber == mftRecHeader->n64LogSeqNumber &&
+		   state->wSequence == mftRecHeader->wSequence) {
+			cache->countHeaderHits++;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Records the new version of a record.
+ *
+ * Returns true if the $DATA content changed (or the record is new or was reused,
+ * or cannot be kept), false if only other metadata moved.
+ */
+bool recCacheUpdate(RECORD_CACHE *cache, NTFS_MFT_FILE_ENTRY_HEADER *mftRecHeader,
+					uint64_t dataSize, uint64_t dataFingerprint) {
+
+	RECORD_STATE *state = recCacheSlot(cache, mftRecHeader->dwMFTRecNumber);
+	if(state == NULL) {
+		cache->countMisses++;
+		return true;
+	}
+	bool changed = !state->valid ||
+				   state->wSequence != mftRecHeader->wSequence ||
+				   state->dataSize != dataSize ||
+				   state->dataFingerprint != dataFingerprint;
+
+	state->n64LogSeqNumber = mftRecHeader->n64LogSeqNumber;
+	state->wSequence = mftRecHeader->wSequence;
+	state->dataSize = dataSize;
+	state->dataFingerprint = dataFingerprint;
+	state->valid = true;
+
+	if(changed) {
+		cache->countMisses++;
+	} else {
+		cache->countDataHits++;
+	}
+	return changed;
+}
+
+/**
+ * Given a $DATA attribute and a pointer to its first byte in the record buffer,
+ * returns the fingerprint of its content and sets *dataSize to the real size.
+ * Resident data is hashed directly, non-resident data via its run list.
+ */
+uint64_t dataAttrFingerprint(NTFS_ATTRIBUTE *attr, const char *attrBase, uint64_t *dataSize) {
+	uint32_t start, len;
+	if(attr->uchNonResFlag) {
+		*dataSize = (attr->Attr).NonResident.n64RealSize;
+		start = (attr->Attr).NonResident.wDatarunOffset;
+		len = start < attr->dwFullLength ? attr->dwFullLength - start : 0;
+	} else {
+		*dataSize = (attr->Attr).Resident.dwLength;
+		start = (attr->Attr).Resident.wAttrOffset;
+		len = (attr->Attr).Resident.dwLength;
+		if(start > attr->dwFullLength) {
+			len = 0;
+		} else if(len > attr->dwFullLength - start) {	/*Never read past the attribute */
+			len = attr->dwFullLength - start;
+		}
+	}
+	return xxh64(attrBase + start, len, *dataSize);
+}
+
+/**
+ * Folds the fingerprint of one $DATA stream into that of the record so far, so
+ * a change to any named stream changes the record's. The unnamed stream's
+ * fingerprint is kept as it is.
+ */
+uint64_t streamFingerprint(uint64_t fingerprint, const char *streamName, uint64_t streamPrint) {
+	if(streamName == NULL) {
+		return fingerprint ^ streamPrint;
+	}
+	return fingerprint ^ xxh64(streamName, strlen(streamName), streamPrint);
+}
+
+void recCacheFree(RECORD_CACHE *cache) {
+	free(cache->states);
+	memset(cache, 0, sizeof(RECORD_CACHE));
+}
+
+#endif /* RECORDCACHE_H_ */
@@ -0,0 +1,149 @@
+/*
+ * Recovery.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Deleted files, kept from the offline pass. An MFT record with the in-use flag
+ * clear still holds the name, times and $DATA of the file it last described,
+ * until NTFS reuses the record. Resident data is copied into the entry; for
+ * non-resident data the clusters its run list named are kept, and scored
+ * against $Bitmap when asked: a cluster allocated again since the file was
+ * deleted now belongs to another file, one still free most likely holds the
+ * deleted file's data.
+ */
+#ifndef RECOVERY_H_
+#define RECOVERY_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "NTFSStruct.h"
+#include "FileList.h"
+#include "RunList.h"
+#include "VolumeBitmap.h"
+
+#define RECOVERY_SPARSE		-1			/*lcn of a sparse run, reads as zero */
+
+/* Run of a deleted file's clusters */
+typedef struct _RECOVERY_RUN {
+	int64_t		lcn;
+	uint64_t	length;
+} RECOVERY_RUN;
+
+typedef struct _DELETED_FILE {
+	char			*fileName;
+	uint32_t		recordNumber;
+	uint32_t		parentRecord;
+	int64_t			sec_offset;			/*Sector of its MFT record */
+	FILE_META		meta;
+	uint64_t		size;				/*Bytes of $DATA */
+	BYTE			*resData;			/*Resident $DATA, NULL if non-resident */
+	RECOVERY_RUN	*runs;				/*Non-resident $DATA, absolute clusters */
+	uint32_t		nRuns;
+	uint64_t		nClusters;			/*Clusters of runs which are not sparse */
+} DELETED_FILE;
+
+typedef struct _RECOVERY_INDEX {
+	DELETED_FILE	*files;				/*In record number order, as the $MFT is read */
+	uint32_t		count;
+	uint32_t		size;				/*Entries allocated */
+} RECOVERY_INDEX;
+
+int      recoveryAdd(RECOVERY_INDEX *idx, char *fileName, uint32_t record, uint32_t parent, int64_t secOffset,
+					 FILE_META *meta, uint64_t size, const BYTE *resData, DataRun *runList);
+uint64_t recoveryReused(DELETED_FILE *file, VOLUME_BITMAP *bm);
+uint32_t recoveryScore(DELETED_FILE *file, VOLUME_BITMAP *bm);
+DELETED_FILE *recoveryFind(RECOVERY_INDEX *idx, uint32_t record);
+void     recoveryFree(RECOVERY_INDEX *idx);
+
+/**
+ * Adds a deleted file, taking ownership of fileName. resData, if not NULL, is
+ * its size bytes of resident data and is copied; otherwise runList (disk order,
+ * relative offsets) gives its clusters.
+ */
+int recoveryAdd(RECOVERY_INDEX *idx, char *fileName, uint32_t record, uint32_t parent, int64_t secOffset,
+				FILE_META *meta, uint64_t size, const BYTE *resData, DataRun *runList) {
+	DELETED_FILE *file;
+	DataRun *run;
+	int64_t lcn = 0;
+	uint32_t nRuns = 0;
+
+	if(idx->count == idx->size) {
+		uint32_t newSize = idx->size ? idx->size*2 : 1024;
+		DELETED_FILE *files = realloc(idx->files, newSize*sizeof(DELETED_FILE));
+		if(files == NULL) return EXIT_FAILURE;
+		idx->files = files;
+		idx->size = newSize;
+	}
+	file = &idx->files[idx->count];
+	memset(file, 0, sizeof(DELETED_FILE));
+	for(run = runList; run; run = run->p_next) nRuns++;
+	if((resData && (file->resData = malloc( size ? size : 1 )) == NULL) ||
+	   (nRuns && (file->runs = malloc( nRuns*sizeof(RECOVERY_RUN) )) == NULL)) {
+		free(file->resData);
+		return EXIT_FAILURE;
+	}
+	if(resData) memcpy(file->resData, resData, size);
+	for(run = runList; run; run = run->p_next) {
+		lcn += run->offset;
+		file->runs[file->nRuns].lcn = run->offset ? lcn : RECOVERY_SPARSE;	/*Sparse runs have no offset */
+		file->runs[file->nRuns++].length = run->length;
+		if(run->offset) file->nClusters += run->length;
+	}
+	file->fileName = fileName;
+	file->recordNumber = record;
+	file->parentRecord = parent;
+	file->sec_offset = secOffset;
+	file->meta = *meta;
+	file->size = size;
+	idx->count++;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Returns how many of the file's clusters $Bitmap has allocated now.
+ */
+uint64_t recoveryReused(DELETED_FILE *file, VOLUME_BITMAP *bm) {
+	uint64_t nReused = 0;
+	uint32_t r;
+	if(bm->bits == NULL) return 0;
+	for(r = 0; r < file->nRuns; r++) {
+		if(file->runs[r].lcn == RECOVERY_SPARSE) continue;
+		nReused += bitmapCountAllocated(bm, file->runs[r].lcn, file->runs[r].length);
+	}
+	return nReused;
+}
+
+/**
+ * Scores how much of a deleted file can be recovered, as the percentage of its
+ * clusters still free. Resident data is always whole.
+ */
+uint32_t recoveryScore(DELETED_FILE *file, VOLUME_BITMAP *bm) {
+	if(file->resData || file->nClusters == 0) return 100;
+	return (uint32_t)(100*(file->nClusters - recoveryReused(file, bm))/file->nClusters);
+}
+
+/**
+ * Returns the deleted file of MFT record record, or NULL if there is none.
+ */
+DELETED_FILE *recoveryFind(RECOVERY_INDEX *idx, uint32_t record) {
+	uint32_t lo = 0, hi = idx->count;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo)/2;
+		if(idx->files[mid].recordNumber < record) lo = mid + 1; else hi = mid;
+	}
+	return lo < idx->count && idx->files[lo].recordNumber == record ? &idx->files[lo] : NULL;
+}
+
+void recoveryFree(RECOVERY_INDEX *idx) {
+	uint32_t i;
+	for(i = 0; i < idx->count; i++) {
+		free(idx->files[i].fileName);
+		free(idx->files[i].resData);
+		free(idx->files[i].runs);
+	}
+	free(idx->files);
+	memset(idx, 0, sizeof(RECOVERY_INDEX));
+}
+
+#endif /* RECOVERY_H_ */
@@ -2,7 +2,11 @@
 #ifndef RUNLIST_H_
 #define RUNLIST_H_
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
 #include "Debug.h"
 
 /*
@@ -22,6 +26,7 @@ typedef struct _DataRun {
 DataRun* addRun(DataRun *p_head, uint64_t length, int64_t offset);
 void printRuns(char * buff, DataRun *p_head);
 DataRun* reverseList(DataRun *p_head);
+DataRun* decodeRunList(const uint8_t *run, const uint8_t *end, bool *bad);
 int freeRunList(DataRun *p_head);
 
 /*
@@ -55,7 +60,7 @@ void printRuns(char * buff, DataRun *p_head) {
  */
 int freeRunList(DataRun *p_head)	{
 
-	if(DEBUG && VERBOSE) printf("\tFreeing RunList: ");
+	LOG_TRACE("\tFreeing RunList: ");
 	DataRun *p_current_item = p_head;
 	int items_freed = 0;
 	while (p_current_item) {
@@ -64,7 +69,7 @@ int freeRunList(DataRun *p_head)	{
 	    p_current_item = p_next;	// Move to the next item
 	    items_freed++;
 	}
-	if(DEBUG && VERBOSE) printf("Freed %d data runs in total\n", items_freed);
+	LOG_TRACE("Freed %d data runs in total\n", items_freed);
 	return items_freed;
 }
 
@@ -82,4 +87,36 @@ DataRun* reverseList(DataRun *p_head) {
   return p_new_head;
 }
 
+/*
+ * Decodes the run list from run up to end, the end of its attribute, into a list in
+ * disk order. Each run is a header byte, the sizes of its length (low nibble) and
+ * offset (high nibble) fields, then the fields, little endian. A sparse run has no
+ * offset and is added with offset 0. Decoding stops at the 0 header which ends the
+ * list; a field past end, or wider than 8 bytes, ends it early and sets *bad.
+ */
+DataRun* decodeRunList(const uint8_t *run, const uint8_t *end, bool *bad) {
+  DataRun *p_head = NULL;
+  *bad = false;
+  while (run < end && *run != 0) {
+    int lenSize = *run & 0x0F, offsSize = *run >> 4;
+    uint64_t length = 0;
+    int64_t offset = 0;
+    if (lenSize == 0 || lenSize > 8 || offsSize > 8 || end - run < 1 + lenSize + offsSize) {
+      *bad = true;
+      break;
+    }
+    memcpy(&length, run + 1, lenSize);
+    if (offsSize > 0) {
+      memcpy(&offset, run + 1 + lenSize, offsSize);
+      if (offsSize < 8 && (run[lenSize + offsSize] & 0x80)) {
+        offset |= -((int64_t)1 << (8*offsSize));	/* Sign extend, runs may go backwards */
+      }
+    }
+    p_head = addRun(p_head, length, offset);
+    run += 1 + lenSize + offsSize;
+  }
+  if (run >= end) *bad = true;	/* No end of list */
+  return reverseList(p_head);
+}
+
 #endif
@@ -0,0 +1,303 @@
+/*
+ * ShmRing.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Single producer, single consumer ring of write notifications in a memfd
+ * shared between a QEMU side tap and the extraction engine. Every slot has a
+ * payload area after the entries, so a producer may pass the data it wrote
+ * (up to UDS_MAX_PAYLOAD bytes) without a copy through the kernel.
+ *
+ * A producer asks for a ring with a UDS_FRAME_SHMREQ frame on the UDS socket
+ * and is handed the memfd and two eventfd doorbells with SCM_RIGHTS. Entries
+ * are then published with a release store of head; no syscall is made unless
+ * the consumer has said it is going to sleep (needWake), or the producer finds
+ * the ring full and has to wait for space (needSpace).
+ */
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "UDSProtocol.h"
+
+#define SHMRING_MAGIC		0x474E4952	/*"RING" little-endian */
+#define SHMRING_ENTRIES		4096		/*Power of two */
+#define SHMRING_HDR_SIZE	4096		/*Entries start on the page after the header */
+#define SHMRING_NFDS		3			/*memfd, data doorbell, space doorbell */
+#define SHMRING_MAP_LEN		(SHMRING_HDR_SIZE + SHMRING_ENTRIES*(sizeof(SHM_RING_ENTRY) + UDS_MAX_PAYLOAD))
+
+typedef struct _SHM_RING_ENTRY {
+	int64_t		sectorN;
+	int32_t		nSectors;
+	uint32_t	payloadLen;		/*Bytes in this slot's payload area, 0 for none */
+} SHM_RING_ENTRY;
+
+typedef struct _SHM_RING_HDR {
+	uint32_t	magic;
+	uint32_t	nEntries;
+	uint64_t	head __attribute__((aligned(64)));		/*Next slot to fill, producer owned */
+	uint64_t	tail __attribute__((aligned(64)));		/*Next slot to drain, consumer owned */
+	uint32_t	needWake __attribute__((aligned(64)));	/*Consumer is waiting on the data doorbell */
+	uint32_t	needSpace;								/*Producer is waiting on the space doorbell */
+} SHM_RING_HDR;
+
+typedef struct _SHM_RING {
+	int				kind;		/*Tag used by the UDS server's epoll loop */
+	int				memFD;
+	int				dataFD;		/*eventfd rung by the producer */
+	int				spaceFD;	/*eventfd rung by the consumer */
+	uint16_t		volume;
+	size_t			mapLen;
+	SHM_RING_HDR	*hdr;
+	SHM_RING_ENTRY	*entries;
+	BYTE			*payloads;	/*UDS_MAX_PAYLOAD bytes per slot */
+} SHM_RING;
+
+int  shmRingCreate(SHM_RING *ring, uint16_t volume);
+int  shmRingMap(SHM_RING *ring, int memFD, int dataFD, int spaceFD);
+int  shmRingPush(SHM_RING *ring, QEMU_OFFS_LEN *rec);
+int  shmRingPushPayload(SHM_RING *ring, QEMU_OFFS_LEN *rec, const void *payload, uint32_t payloadLen);
+int  shmRingDrain(SHM_RING *ring, WRITE_EVENT *out, int maxOut);
+bool shmRingArmWake(SHM_RING *ring);
+int  shmRingConnect(SHM_RING *ring, const char *socketName, uint16_t volume);
+void shmRingClose(SHM_RING *ring);
+
+/**
+ * Maps a ring whose memory and doorbells are already open.
+ */
+int shmRingMap(SHM_RING *ring, int memFD, int dataFD, int spaceFD) {
+	ring->memFD = memFD;
+	ring->dataFD = dataFD;
+	ring->spaceFD = spaceFD;
+	ring->mapLen = SHMRING_MAP_LEN;
+	ring->hdr = mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, memFD, 0);
+	if(ring->hdr == MAP_FAILED) {
+		int errsv = errno;
+		printf("Failed to map shared memory ring: %s.\n", strerror(errsv));
+		ring->hdr = NULL;
+		return EXIT_FAILURE;
+	}
+	ring->entries = (SHM_RING_ENTRY *)((char *)ring->hdr + SHMRING_HDR_SIZE);
+	ring->payloads = (BYTE *)(ring->entries + SHMRING_ENTRIES);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Creates a new, empty ring for a producer writing to volume.
+ */
+int shmRingCreate(SHM_RING *ring, uint16_t volume) {
+
+	memset(ring, 0, sizeof(SHM_RING));
+	ring->volume = volume;
+	int memFD = memfd_create("ntfsWriteRing", MFD_CLOEXEC);
+	int dataFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	int spaceFD = eventfd(0, EFD_CLOEXEC);
+
+	if(memFD == -1 || dataFD == -1 || spaceFD == -1 || ftruncate(memFD, SHMRING_MAP_LEN) == -1) {
+		int errsv = errno;
+		printf("Failed to create shared memory ring: %s.\n", strerror(errsv));
+		if(memFD != -1) close(memFD);
+		if(dataFD != -1) close(dataFD);
+		if(spaceFD != -1) close(spaceFD);
+		return EXIT_FAILURE;
+	}
+	if(shmRingMap(ring, memFD, dataFD, spaceFD) == EXIT_FAILURE) {
+		close(memFD); close(dataFD); close(spaceFD);
+		return EXIT_FAILURE;
+	}
+	ring->hdr->magic = SHMRING_MAGIC;
+	ring->hdr->nEntries = SHMRING_ENTRIES;
+	__atomic_store_n(&ring->hdr->needWake, 1, __ATOMIC_SEQ_CST); /*Consumer starts asleep */
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Producer: publishes one entry, waiting for space if the ring is full.
+ */
+int shmRingPush(SHM_RING *ring, QEMU_OFFS_LEN *rec) {
+	return shmRingPushPayload(ring, rec, NULL, 0);
+}
+
+/**
+ * Producer: publishes one entry together with the data written, which must be
+ * rec->nSectors*UDS_SECTOR_SIZE bytes and no more than UDS_MAX_PAYLOAD.
+ */
+int shmRingPushPayload(SHM_RING *ring, QEMU_OFFS_LEN *rec, const void *payload, uint32_t payloadLen) {
+
+	SHM_RING_HDR *hdr = ring->hdr;
+	uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+
+	while(head - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) >= hdr->nEntries) {
+		uint64_t count;
+		__atomic_store_n(&hdr->needSpace, 1, __ATOMIC_SEQ_CST);
+		if(head - __atomic_load_n(&hdr->tail, __ATOMIC_SEQ_CST) < hdr->nEntries) {
+			break;	/*Consumer drained while we were arming */
+		}
+		if(read(ring->spaceFD, &count, sizeof(count)) == -1 && errno != EINTR) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	uint64_t slot = head & (hdr->nEntries - 1);
+	if(payload == NULL || payloadLen > UDS_MAX_PAYLOAD ||
+	   payloadLen != (uint64_t)rec->nSectors*UDS_SECTOR_SIZE) {
+		payloadLen = 0;	/*Let the engine read the device instead */
+	}
+	ring->entries[slot].sectorN = rec->sectorN;
+	ring->entries[slot].nSectors = rec->nSectors;
+	ring->entries[slot].payloadLen = payloadLen;
+	if(payloadLen) {
+		memcpy(ring->payloads + slot*UDS_MAX_PAYLOAD, payload, payloadLen);
+	}
+	__atomic_store_n(&hdr->head, head + 1, __ATOMIC_SEQ_CST);
+
+	if(__atomic_exchange_n(&hdr->needWake, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if(write(ring->dataFD, &one, sizeof(one)) == -1) return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Consumer: moves up to maxOut entries out of the ring, dropping those of
+ * writes no guest could make.
+ *
+ * Returns the number of entries moved out, 0 once the ring is empty.
+ */
+int shmRingDrain(SHM_RING *ring, WRITE_EVENT *out, int maxOut) {
+
+	SHM_RING_HDR *hdr = ring->hdr;
+	uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+	uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	int n = 0;
+
+	/* The header is the producer's to write, so the ring's size is never taken from it */
+	if(head - tail > SHMRING_ENTRIES) {	/*Producer corrupted the ring, resynchronise */
+		tail = head;
+	}
+	while(tail != head && n < maxOut) {
+		uint64_t slot = tail & (SHMRING_ENTRIES - 1);
+		SHM_RING_ENTRY rec = ring->entries[slot];
+		tail++;
+		if(!udsWriteValid(rec.sectorN, rec.nSectors)) continue;	/*Dropped */
+		out[n].sectorN = rec.sectorN;
+		out[n].nSectors = rec.nSectors;
+		out[n].volume = ring->volume;
+		out[n].payload = NULL;
+		if(rec.payloadLen && rec.payloadLen <= UDS_MAX_PAYLOAD &&
+		   rec.payloadLen == (uint64_t)rec.nSectors*UDS_SECTOR_SIZE &&
+		   (out[n].payload = malloc(rec.payloadLen)) != NULL) {
+			memcpy(out[n].payload, ring->payloads + slot*UDS_MAX_PAYLOAD, rec.payloadLen);
+		}
+		n++;
+	}
+	__atomic_store_n(&hdr->tail, tail, __ATOMIC_SEQ_CST);
+
+	if(n > 0 && __atomic_exchange_n(&hdr->needSpace, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if(write(ring->spaceFD, &one, sizeof(one)) == -1) {
+			int errsv = errno;
+			printf("Failed to ring shared memory space doorbell: %s.\n", strerror(errsv));
+		}
+	}
+	return n;
+}
+
+/**
+ * Consumer: announces it is about to wait on the data doorbell.
+ *
+ * Returns false if entries arrived meanwhile and the ring must be drained again.
+ */
+bool shmRingArmWake(SHM_RING *ring) {
+	__atomic_store_n(&ring->hdr->needWake, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->hdr->head, __ATOMIC_SEQ_CST) !=
+	   __atomic_load_n(&ring->hdr->tail, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&ring->hdr->needWake, 0, __ATOMIC_SEQ_CST);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Producer: connects to the engine's UDS socket and obtains a ring bound to
+ * volume. The socket is kept open, the engine releases the ring when it closes.
+ *
+ * Returns the connected socket, or -1.
+ */
+int shmRingConnect(SHM_RING *ring, const char *socketName, uint16_t volume) {
+
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd == -1) return -1;
+
+	memset(ring, 0, sizeof(SHM_RING));
+	if(connect(fd, (struct sockaddr*)&addr, udsAddress(&addr, socketName)) == -1) {
+		int errsv = errno;
+		printf("Failed to connect to extraction engine: %s.\n", strerror(errsv));
+		close(fd);
+		return -1;
+	}
+
+	UDS_FRAME_HDR req[2] = {
+		{ UDS_FRAME_MAGIC, UDS_FRAME_HELLO, volume, 0 },
+		{ UDS_FRAME_MAGIC, UDS_FRAME_SHMREQ, volume, 0 } };
+	if(write(fd, req, sizeof(req)) != sizeof(req)) {
+		close(fd);
+		return -1;
+	}
+
+	/*The reply is a header carrying the memfd and doorbells as ancillary data */
+	UDS_FRAME_HDR reply;
+	int fds[SHMRING_NFDS];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &reply, sizeof(reply) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr *cmsg;
+	if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(reply) ||
+	   reply.magic != UDS_FRAME_MAGIC || reply.type != UDS_FRAME_SHMREQ ||
+	   (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+	   cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		printf("Extraction engine refused the shared memory ring.\n");
+		close(fd);
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	ring->volume = volume;
+	if(shmRingMap(ring, fds[0], fds[1], fds[2]) == EXIT_FAILURE ||
+	   ring->hdr->magic != SHMRING_MAGIC || ring->hdr->nEntries != SHMRING_ENTRIES) {
+		shmRingClose(ring);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Unmaps the ring and closes its descriptors.
+ */
+void shmRingClose(SHM_RING *ring) {
+	if(ring->hdr) munmap(ring->hdr, ring->mapLen);
+	if(ring->memFD > 0) close(ring->memFD);
+	if(ring->dataFD > 0) close(ring->dataFD);
+	if(ring->spaceFD > 0) close(ring->spaceFD);
+	ring->hdr = NULL;
+	ring->memFD = ring->dataFD = ring->spaceFD = -1;
+}
+
+#endif /* SHMRING_H_ */
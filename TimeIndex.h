@@ -0,0 +1,171 @@
+/*
+ * TimeIndex.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Time range search over the offline index, e.g. files modified in the last 30
+ * minutes. For each $STANDARD_INFORMATION time the named files are kept sorted
+ * by that time, as (time, file) pairs, so a range is found with two binary
+ * searches and is then a run of the array. Times are as of the offline pass.
+ *
+ * Times in queries are "now", a span back from now such as "-30m", "-2h" or
+ * "-7d", or a UTC date "2015-03-10" or date and time "2015-03-10T14:30:00".
+ */
+#ifndef TIMEINDEX_H_
+#define TIMEINDEX_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "NTFSAttributes.h"
+#include "FileList.h"
+
+typedef struct _TIME_KEY {
+	int64_t		time;
+	File		*file;
+} TIME_KEY;
+
+typedef struct _TIME_INDEX {
+	TIME_KEY	*byTime[FTIME_FIELDS];	/*Named files in order of each time */
+	uint32_t	nFiles;
+} TIME_INDEX;
+
+static const char *timeFieldNames[FTIME_FIELDS] = { "created", "modified", "changed", "read" };
+
+int      timeIndexBuild(TIME_INDEX *idx, File *files);
+uint32_t timeIndexRange(TIME_INDEX *idx, int field, int64_t from, int64_t to, TIME_KEY **first);
+void     timeIndexFree(TIME_INDEX *idx);
+int      timeField(const char *name);
+int      timeParse(const char *s, int64_t now, int64_t *ntfsTime);
+size_t   timeFormat(char *out, size_t outLen, int64_t ntfsTime);
+
+static int timeKeyCmp(const void *a, const void *b) {
+	int64_t ta = ((const TIME_KEY *)a)->time, tb = ((const TIME_KEY *)b)->time;
+	return (ta > tb) - (ta < tb);
+}
+
+/**
+ * Sorts the named files in files by each of their $STANDARD_INFORMATION times.
+ */
+int timeIndexBuild(TIME_INDEX *idx, File *files) {
+	uint32_t i, field;
+	File *file;
+
+	memset(idx, 0, sizeof(TIME_INDEX));
+	for(file = files; file; file = file->p_next) {
+		if(file->fileName) idx->nFiles++;
+	}
+	for(field = 0; field < FTIME_FIELDS; field++) {
+		if((idx->byTime[field] = malloc( (idx->nFiles + 1)*sizeof(TIME_KEY) )) == NULL) {
+			printf("Failed to allocate the time index.\n");
+			timeIndexFree(idx);
+			return EXIT_FAILURE;
+		}
+		for(i = 0, file = files; file; file = file->p_next) {
+			if(file->fileName == NULL) continue;
+			idx->byTime[field][i].time = file->meta.siTime[field];
+			idx->byTime[field][i++].file = file;
+		}
+		qsort(idx->byTime[field], idx->nFiles, sizeof(TIME_KEY), timeKeyCmp);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Returns the first key of keys at or after time */
+static uint32_t timeLowerBound(const TIME_KEY *keys, uint32_t n, int64_t time) {
+	uint32_t lo = 0, hi = n;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo)/2;
+		if(keys[mid].time < time) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Finds the files whose time field is in [from, to). *first is set to the
+ * earliest of them, the rest follow it in time order.
+ *
+ * Returns the number of files in the range.
+ */
+uint32_t timeIndexRange(TIME_INDEX *idx, int field, int64_t from, int64_t to, TIME_KEY **first) {
+	TIME_KEY *keys = idx->byTime[field];
+	*first = NULL;
+	if(keys == NULL || from >= to) return 0;
+	uint32_t lo = timeLowerBound(keys, idx->nFiles, from);
+	uint32_t hi = timeLowerBound(keys, idx->nFiles, to);
+	*first = keys + lo;
+	return hi - lo;
+}
+
+void timeIndexFree(TIME_INDEX *idx) {
+	uint32_t field;
+	for(field = 0; field < FTIME_FIELDS; field++) {
+		free(idx->byTime[field]);
+	}
+	memset(idx, 0, sizeof(TIME_INDEX));
+}
+
+/**
+ * Returns the time field called name, created, modified, changed or read, or
+ * -1 if there is none.
+ */
+int timeField(const char *name) {
+	int field;
+	for(field = 0; field < FTIME_FIELDS; field++) {
+		if(strcmp(name, timeFieldNames[field]) == 0) return field;
+	}
+	return -1;
+}
+
+/**
+ * Parses a query time, relative to now if it is a span, to NTFS time.
+ */
+int timeParse(const char *s, int64_t now, int64_t *ntfsTime) {
+	struct tm tm;
+	char unit = 's', *end;
+	const char *rest;
+
+	if(strcmp(s, "now") == 0) {
+		*ntfsTime = now;
+		return EXIT_SUCCESS;
+	}
+	if(s[0] == '-') {
+		long long n = strtoll(s + 1, &end, 10);
+		if(end == s + 1 || n < 0) return EXIT_FAILURE;
+		if(*end) unit = *end++;
+		if(*end) return EXIT_FAILURE;
+		switch(unit) {
+		case 'd': n *= 24;		/* fall through */
+		case 'h': n *= 60;		/* fall through */
+		case 'm': n *= 60;		/* fall through */
+		case 's': break;
+		default: return EXIT_FAILURE;
+		}
+		*ntfsTime = now - (int64_t)n*TIME_NTFSPERLINUX;
+		return EXIT_SUCCESS;
+	}
+	memset(&tm, 0, sizeof(tm));
+	if((rest = strptime(s, "%Y-%m-%d", &tm)) == NULL) return EXIT_FAILURE;
+	if(*rest == 'T' && (rest = strptime(rest + 1, "%H:%M", &tm)) != NULL && *rest == ':') {
+		rest = strptime(rest + 1, "%S", &tm);
+	}
+	if(rest == NULL || *rest) return EXIT_FAILURE;
+	*ntfsTime = (int64_t)timegm(&tm)*TIME_NTFSPERLINUX + TIME_NTFSTOLINUXOFFSET;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Writes an NTFS time as a UTC date and time, "2015-03-10 14:30:00".
+ */
+size_t timeFormat(char *out, size_t outLen, int64_t ntfsTime) {
+	struct tm tm;
+	time_t secs = (time_t)((ntfsTime - (int64_t)TIME_NTFSTOLINUXOFFSET)/TIME_NTFSPERLINUX);
+	if(gmtime_r(&secs, &tm) == NULL) {
+		return snprintf(out, outLen, "?");
+	}
+	return strftime(out, outLen, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+#endif /* TIMEINDEX_H_ */
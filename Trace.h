@@ -0,0 +1,193 @@
+/*
+ * Trace.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Compact binary trace of the guest writes the UDS server receives, for replay
+ * with tools/tracereplay. A TRACE_HDR is followed by one record per write of
+ * four LEB128 varints: nanoseconds since the previous write, the zigzag encoded
+ * difference from the previous write's sector, nSectors and volume. A typical
+ * write takes 6-10 bytes. Payloads are not recorded.
+ */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "UDSProtocol.h"
+#include "Metrics.h"
+
+#define TRACE_MAGIC		"NTFSTRC1"
+#define TRACE_VERSION	1
+#define TRACE_REC_MAX	40			/*Four varints of at most 10 bytes */
+
+#pragma pack(push, 1)
+	typedef struct _TRACE_HDR {
+		char		magic[8];		/*TRACE_MAGIC */
+		uint32_t	version;
+		uint32_t	flags;			/*Reserved, 0 */
+		uint64_t	startTime;		/*CLOCK_REALTIME in ns when recording started */
+	} TRACE_HDR;
+#pragma pack(pop)
+
+typedef struct _TRACE_EVENT {
+	uint64_t	timeNs;			/*Since recording started */
+	int64_t		sectorN;
+	int32_t		nSectors;
+	uint16_t	volume;
+} TRACE_EVENT;
+
+typedef struct _TRACE {
+	FILE			*fp;
+	TRACE_HDR		hdr;
+	uint64_t		startNs;		/*monotonicNs() when recording started */
+	uint64_t		lastNs;			/*Time of the previous record, since start */
+	int64_t			lastSector;
+	uint64_t		count;
+	pthread_mutex_t	lock;
+} TRACE;
+
+int  traceOpenWrite(TRACE *trace, const char *path);
+void traceRecord(TRACE *trace, WRITE_EVENT *events, int nEvents);
+int  traceOpenRead(TRACE *trace, const char *path);
+int  traceNext(TRACE *trace, TRACE_EVENT *event);
+void traceClose(TRACE *trace);
+
+static int traceVarintPut(BYTE *out, uint64_t val) {
+	int n = 0;
+	while(val >= 0x80) {
+		out[n++] = (BYTE)(val | 0x80);
+		val >>= 7;
+	}
+	out[n++] = (BYTE)val;
+	return n;
+}
+
+/**
+ * Reads one varint. Returns false at the end of the file or on a bad varint.
+ */
+static bool traceVarintGet(FILE *fp, uint64_t *val) {
+	int c, shift = 0;
+	*val = 0;
+	do {
+		if((c = fgetc(fp)) == EOF || shift > 63) return false;
+		*val |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while(c & 0x80);
+	return true;
+}
+
+/**
+ * Creates the trace file at path and writes its header.
+ */
+int traceOpenWrite(TRACE *trace, const char *path) {
+	struct timespec ts;
+	memset(trace, 0, sizeof(TRACE));
+	if((trace->fp = fopen(path, "wb")) == NULL) {
+		int errsv = errno;
+		printf("Failed to create trace file %s: %s.\n", path, strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(trace->hdr.magic, TRACE_MAGIC, sizeof(trace->hdr.magic));
+	trace->hdr.version = TRACE_VERSION;
+	trace->hdr.startTime = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+	trace->startNs = monotonicNs();
+	pthread_mutex_init(&trace->lock, NULL);
+	if(fwrite(&trace->hdr, sizeof(TRACE_HDR), 1, trace->fp) != 1) {
+		int errsv = errno;
+		printf("Failed to write trace file %s: %s.\n", path, strerror(errsv));
+		fclose(trace->fp);
+		trace->fp = NULL;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Appends writes received together, all stamped with the current time.
+ */
+void traceRecord(TRACE *trace, WRITE_EVENT *events, int nEvents) {
+	BYTE rec[TRACE_REC_MAX];
+	int i, cancelState;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);	/*fwrite may be a cancellation point */
+	pthread_mutex_lock(&trace->lock);
+	if(trace->fp) {
+		uint64_t now = monotonicNs() - trace->startNs;
+		for(i = 0; i < nEvents; i++) {
+			int64_t dSector = events[i].sectorN - trace->lastSector;
+			int n = traceVarintPut(rec, i == 0 ? now - trace->lastNs : 0);
+			n += traceVarintPut(rec + n, ((uint64_t)dSector << 1) ^ (uint64_t)(dSector >> 63));
+			n += traceVarintPut(rec + n, (uint32_t)events[i].nSectors);
+			n += traceVarintPut(rec + n, events[i].volume);
+			fwrite(rec, n, 1, trace->fp);
+			trace->lastSector = events[i].sectorN;
+		}
+		trace->lastNs = now;
+		trace->count += nEvents;
+	}
+	pthread_mutex_unlock(&trace->lock);
+	pthread_setcancelstate(cancelState, NULL);
+}
+
+/**
+ * Opens a trace for reading and checks its header.
+ */
+int traceOpenRead(TRACE *trace, const char *path) {
+	memset(trace, 0, sizeof(TRACE));
+	if((trace->fp = fopen(path, "rb")) == NULL) {
+		int errsv = errno;
+		printf("Failed to open trace file %s: %s.\n", path, strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	if(fread(&trace->hdr, sizeof(TRACE_HDR), 1, trace->fp) != 1 ||
+	   memcmp(trace->hdr.magic, TRACE_MAGIC, sizeof(trace->hdr.magic)) != 0 ||
+	   trace->hdr.version != TRACE_VERSION) {
+		printf("%s is not a write trace.\n", path);
+		fclose(trace->fp);
+		trace->fp = NULL;
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&trace->lock, NULL);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Reads the next write. Returns 1, 0 at the end of the trace or -1 if it is truncated.
+ */
+int traceNext(TRACE *trace, TRACE_EVENT *event) {
+	uint64_t dt, zz, nSectors, volume;
+	if(!traceVarintGet(trace->fp, &dt)) {
+		return feof(trace->fp) ? 0 : -1;
+	}
+	if(!traceVarintGet(trace->fp, &zz) || !traceVarintGet(trace->fp, &nSectors) ||
+	   !traceVarintGet(trace->fp, &volume)) {
+		return -1;
+	}
+	trace->lastNs += dt;
+	trace->lastSector += (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+	event->timeNs = trace->lastNs;
+	event->sectorN = trace->lastSector;
+	event->nSectors = (int32_t)nSectors;
+	event->volume = (uint16_t)volume;
+	trace->count++;
+	return 1;
+}
+
+void traceClose(TRACE *trace) {
+	pthread_mutex_lock(&trace->lock);
+	if(trace->fp) {
+		fclose(trace->fp);
+		trace->fp = NULL;
+	}
+	pthread_mutex_unlock(&trace->lock);
+	pthread_mutex_destroy(&trace->lock);
+}
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,87 @@
+/*
+ * UDSProtocol.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Wire format shared by the extraction engine and the QEMU side producers.
+ */
+#ifndef UDSPROTOCOL_H_
+#define UDSPROTOCOL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "NTFSStruct.h"
+
+#define UDS_SOCKET_NAME		"\0diskTap"	/*Abstract socket the engine listens on */
+
+/*
+ * Framed protocol. A connection whose first four bytes are UDS_FRAME_MAGIC sends
+ * frames of a UDS_FRAME_HDR followed by count records of the frame's type.
+ * Any other connection is a legacy stream of bare QEMU_OFFS_LEN records.
+ */
+#define UDS_FRAME_MAGIC		0x5346544E	/*"NTFS" little-endian */
+#define UDS_FRAME_HELLO		1			/*Binds the connection to volume, count = 0 */
+#define UDS_FRAME_OFFSLEN	2			/*count QEMU_OFFS_LEN records follow */
+#define UDS_FRAME_SHMREQ	3			/*Requests a shared memory ring, answered with SCM_RIGHTS */
+#define UDS_FRAME_PAYLOAD	4			/*One QEMU_OFFS_LEN then count bytes of the data written */
+
+#define UDS_SECTOR_SIZE		512			/*Sector size QEMU reports writes in */
+#define UDS_MAX_PAYLOAD		16384		/*Largest payload passed through, 16 MFT records */
+#define UDS_MAX_SECTORS		(INT32_MAX >> 9)	/*Longest write taken, QEMU's own request limit */
+
+typedef struct _qemu_offs_len {
+	int64_t sectorN;
+	int nSectors;
+} QEMU_OFFS_LEN;
+
+#pragma pack(push, 1)
+	typedef struct _UDS_FRAME_HDR {
+		uint32_t	magic;		/*UDS_FRAME_MAGIC */
+		uint16_t	type;		/*UDS_FRAME_... */
+		uint16_t	volume;		/*Volume index, UDS_FRAME_HELLO only */
+		uint32_t	count;		/*Number of records (payload bytes) following the header */
+	} UDS_FRAME_HDR;
+#pragma pack(pop)
+
+/*
+ * A guest write as queued for the consumer. If the producer passed the data
+ * written, payload holds nSectors*UDS_SECTOR_SIZE bytes and is owned by the
+ * event; otherwise it is NULL and the consumer reads the device.
+ */
+typedef struct _WRITE_EVENT {
+	int64_t		sectorN;	/*First sector written */
+	int			nSectors;	/*Number of sectors written */
+	uint16_t	volume;		/*Volume the writing guest is bound to */
+	BYTE		*payload;	/*Data written, or NULL */
+} WRITE_EVENT;
+
+/**
+ * Whether a write reported by a producer is one a guest could have made: at a
+ * sector of the disk, of at least one sector and no more than UDS_MAX_SECTORS.
+ * Others are dropped where they are received, before anything sizes a buffer
+ * or a loop by them.
+ */
+static inline bool udsWriteValid(int64_t sectorN, int32_t nSectors) {
+	return sectorN >= 0 && nSectors > 0 && nSectors <= UDS_MAX_SECTORS;
+}
+
+/**
+ * Fills addr for the socket name given and returns the address length to bind
+ * or connect with. Names beginning with a NUL are abstract, "\0name", and only
+ * the bytes of the name are significant; any other name is a path.
+ */
+static inline socklen_t udsAddress(struct sockaddr_un *addr, const char *name) {
+	bool abstract = name[0] == '\0';
+	size_t len = abstract ? strlen(name + 1) + 1 : strlen(name);
+	if(len > sizeof(addr->sun_path) - 1) len = sizeof(addr->sun_path) - 1;
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, name, len);
+	return offsetof(struct sockaddr_un, sun_path) + len + (abstract ? 0 : 1);	/*Paths keep their NUL */
+}
+
+#endif /* UDSPROTOCOL_H_ */
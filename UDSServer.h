@@ -5,95 +5,460 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include "NTFSStruct.h"
+#include "Debug.h"
+#include "UDSProtocol.h"
+#include "ShmRing.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "ClusterCache.h"
 
 #define SOCKET_BUFF	64
-#define Q_ELEMENTS 1000
+#define Q_ELEMENTS 16384
 #define Q_SIZE (Q_ELEMENTS + 1)
 #define QUEUE_FULL -1
 
-typedef struct _qemu_offs_len {
-	int64_t sectorN;
-	int nSectors;
-} QEMU_OFFS_LEN;
+#define UDS_MAX_EVENTS	64			/*epoll events handled per wakeup */
+#define UDS_CONN_BUFF	65536		/*Per connection receive buffer, 4096 records */
+#define UDS_BACKLOG		16
+
+#define UDS_MAX_FRAME_RECS	(UDS_CONN_BUFF/sizeof(QEMU_OFFS_LEN) - 1)
+
+/* Queue file, the writes left unconsumed at shutdown */
+#define QFILE_MAGIC			"NTFSQUE1"
+#define QFILE_NAME_LEN		32			/*Volume names are saved so a restart maps them by name */
+
+/* Connection framing states */
+#define UDS_CONN_UNKNOWN	0
+#define UDS_CONN_LEGACY		1
+#define UDS_CONN_FRAMED		2
+
+/* Kinds of epoll source, the first member of each source structure */
+#define UDS_SRC_CONN		1
+#define UDS_SRC_RING		2
+#define UDS_SRC_STOP		3
+
+/* State for one connected producer */
+typedef struct _UDS_CONN {
+	int			kind;		/*UDS_SRC_CONN */
+	int			fd;
+	int			framing;	/*UDS_CONN_... */
+	uint16_t	volume;
+	SHM_RING	*ring;		/*Shared memory ring handed to this producer, if any */
+	size_t		nBuffered;	/*Bytes of an incomplete frame held in buff */
+	struct _UDS_CONN *next;	/*Open connections, drained when the server stops */
+	BYTE		buff[UDS_CONN_BUFF];
+} UDS_CONN;
+
+#pragma pack(push, 1)
+	typedef struct _QFILE_HDR {
+		char		magic[8];		/*QFILE_MAGIC */
+		uint32_t	nVolumes;		/*Volume names that follow, QFILE_NAME_LEN bytes each */
+		uint32_t	count;			/*Records after the names */
+	} QFILE_HDR;
+
+	typedef struct _QFILE_REC {
+		int64_t		sectorN;
+		int32_t		nSectors;
+		uint16_t	volume;			/*Index into the saved names */
+		uint16_t	hasPayload;		/*nSectors*UDS_SECTOR_SIZE bytes follow if set */
+	} QFILE_REC;
+#pragma pack(pop)
 
 /* Producer-Consumer methods */
 void QInit(void);
-int  QPut(QEMU_OFFS_LEN qItem);
-int  QGet(QEMU_OFFS_LEN *qItem);
+int  QPut(WRITE_EVENT qItem);
+int  QPutBatch(WRITE_EVENT *qItems, int nItems);
+int  QGet(WRITE_EVENT *qItem);
+uint64_t QDepth(void);
+uint64_t QDropped(void);
+int  QSave(const char *path, const char **volumeNames, uint16_t nVolumes);
+int  QLoad(const char *path, const char **volumeNames, uint16_t nVolumes);
 
 /* Producer worker thread for UDS server */
 void *udsServerThreadFn( void *socket_path );
+int  udsServerInit(void);
+void udsServerStop(void);
 
 /*FIFO buffer for QEMU writes */
-QEMU_OFFS_LEN writeQueue[Q_SIZE];
+WRITE_EVENT writeQueue[Q_SIZE];
 int writeQueueIn = 0, writeQueueOut = 0;
+uint64_t writeQueueDropped = 0;		/*Writes lost because the queue was full */
 pthread_mutex_t mutexqueue;
 
-char *socket_path = "\0diskTap";
+char *socket_path = UDS_SOCKET_NAME;
 int udsFD;
+uint16_t udsVolumeCount = 1;		/*Volumes a connection may bind to */
+TRACE *udsTrace = NULL;				/*Received writes are recorded here if set */
+int udsStopFD = -1;					/*eventfd which tells the server thread to stop */
+static int udsStopSource = UDS_SRC_STOP;
+
+static void udsRingDrain(SHM_RING *ring);
+
+/**
+ * Creates the eventfd udsServerStop rings, before the server thread starts.
+ */
+int udsServerInit() {
+	if((udsStopFD = eventfd(0, EFD_CLOEXEC)) == -1) {
+		int errsv = errno;
+		printf("Failed to create the UDS server stop event: %s.\n", strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Tells the server thread to stop. It queues the writes its connections and
+ * rings still hold before closing them and exiting, so join it before QSave.
+ */
+void udsServerStop() {
+	uint64_t one = 1;
+	if(write(udsStopFD, &one, sizeof(one)) != sizeof(one)) {
+		int errsv = errno;
+		printf("Failed to stop the UDS server: %s.\n", strerror(errsv));
+	}
+}
+
+/**
+ * Releases a connection, and the shared memory ring it was given once the
+ * entries still in it have been queued.
+ */
+static void udsConnClose(int epollFD, UDS_CONN **conns, UDS_CONN *conn) {
+	UDS_CONN **p;
+	for(p = conns; *p; p = &(*p)->next) {
+		if(*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	}
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	if(conn->ring) {
+		udsRingDrain(conn->ring);
+		epoll_ctl(epollFD, EPOLL_CTL_DEL, conn->ring->dataFD, NULL);
+		shmRingClose(conn->ring);
+		free(conn->ring);
+	}
+	free(conn);
+}
+
+/**
+ * Queues everything in a ring, then re-arms its doorbell.
+ */
+static void udsRingDrain(SHM_RING *ring) {
+	WRITE_EVENT batch[SHMRING_ENTRIES];
+	uint64_t count;
+	int n;
+	if(read(ring->dataFD, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		int errsv = errno;
+		printf("Shared memory doorbell error: %s\n", strerror(errsv));
+	}
+	do {
+		while((n = shmRingDrain(ring, batch, SHMRING_ENTRIES)) > 0) {
+			uint64_t startNs = monotonicNs();
+			metricsAdd(MET_WRITES_RECEIVED, n);
+			if(udsTrace) traceRecord(udsTrace, batch, n);
+			QPutBatch(batch, n);
+			metricsTime(MET_STAGE_RECEIVE, monotonicNs() - startNs);
+		}
+	} while(!shmRingArmWake(ring));
+}
+
+/**
+ * Answers a UDS_FRAME_SHMREQ: creates a ring for the connection's volume, passes
+ * the memfd and doorbells back with SCM_RIGHTS and starts watching the ring.
+ */
+static int udsConnGiveRing(int epollFD, UDS_CONN *conn) {
+
+	if(conn->ring) {
+		printf("UDS client already has a shared memory ring.\n");
+		return -1;
+	}
+	SHM_RING *ring = malloc(sizeof(SHM_RING));
+	if(shmRingCreate(ring, conn->volume) == EXIT_FAILURE) {
+		free(ring);
+		return -1;
+	}
+	ring->kind = UDS_SRC_RING;
+
+	int fds[SHMRING_NFDS] = { ring->memFD, ring->dataFD, ring->spaceFD };
+	UDS_FRAME_HDR reply = { UDS_FRAME_MAGIC, UDS_FRAME_SHMREQ, conn->volume, SHMRING_ENTRIES };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &reply, sizeof(reply) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if(sendmsg(conn->fd, &msg, MSG_NOSIGNAL) != sizeof(reply)) {
+		int errsv = errno;
+		printf("Failed to pass shared memory ring to UDS client: %s\n", strerror(errsv));
+		shmRingClose(ring);
+		free(ring);
+		return -1;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = ring;
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, ring->dataFD, &ev);
+	conn->ring = ring;
+	printf("Shared memory ring started for volume %u.\n", conn->volume);
+	return 0;
+}
+
+/**
+ * Consumes the complete records held in a connection's buffer, queueing the
+ * writes they describe. Incomplete trailing data is kept for the next read.
+ *
+ * Returns -1 if the stream is malformed and the connection should be closed.
+ */
+static int udsConnParse(int epollFD, UDS_CONN *conn) {
+
+	WRITE_EVENT batch[UDS_CONN_BUFF/sizeof(QEMU_OFFS_LEN)];
+	int nBatch = 0;
+	size_t pos = 0;
+
+	if(conn->framing == UDS_CONN_UNKNOWN) {	/*Decide framing from the first word */
+		if(conn->nBuffered < sizeof(uint32_t)) return 0;
+		uint32_t magic;
+		memcpy(&magic, conn->buff, sizeof(magic));
+		conn->framing = magic == UDS_FRAME_MAGIC ? UDS_CONN_FRAMED : UDS_CONN_LEGACY;
+	}
+
+	while(true) {
+		size_t avail = conn->nBuffered - pos;
+		QEMU_OFFS_LEN *recs;
+		uint32_t nRecs;
+
+		if(conn->framing == UDS_CONN_LEGACY) {
+			nRecs = avail/sizeof(QEMU_OFFS_LEN);
+			if(nRecs == 0) break;
+			recs = (QEMU_OFFS_LEN *)(conn->buff + pos);
+			pos += nRecs*sizeof(QEMU_OFFS_LEN);
+		} else {
+			UDS_FRAME_HDR hdr;
+			if(avail < sizeof(UDS_FRAME_HDR)) break;
+			memcpy(&hdr, conn->buff + pos, sizeof(UDS_FRAME_HDR));
+			if(hdr.magic != UDS_FRAME_MAGIC ||	/*Payload counts are bytes, checked below */
+			   (hdr.type != UDS_FRAME_PAYLOAD && hdr.count > UDS_MAX_FRAME_RECS)) {
+				printf("Malformed frame from UDS client, disconnecting.\n");
+				return -1;
+			}
+			if(hdr.type == UDS_FRAME_HELLO) {
+				if(hdr.volume >= udsVolumeCount) {
+					printf("UDS client requested unknown volume %u.\n", hdr.volume);
+					return -1;
+				}
+				conn->volume = hdr.volume;
+				pos += sizeof(UDS_FRAME_HDR);
+				continue;
+			}
+			if(hdr.type == UDS_FRAME_SHMREQ) {
+				pos += sizeof(UDS_FRAME_HDR);
+				if(udsConnGiveRing(epollFD, conn) == -1) return -1;
+				continue;
+			}
+			if(hdr.type == UDS_FRAME_PAYLOAD) {	/*A single write carrying its data */
+				QEMU_OFFS_LEN rec;
+				size_t frameLen = sizeof(UDS_FRAME_HDR) + sizeof(QEMU_OFFS_LEN) + hdr.count;
+				if(hdr.count > UDS_MAX_PAYLOAD) {
+					printf("Oversized payload from UDS client, disconnecting.\n");
+					return -1;
+				}
+				if(avail < frameLen) break;
+				memcpy(&rec, conn->buff + pos + sizeof(UDS_FRAME_HDR), sizeof(QEMU_OFFS_LEN));
+				if(!udsWriteValid(rec.sectorN, rec.nSectors)) {	/*Dropped */
+					pos += frameLen;
+					continue;
+				}
+				if((uint64_t)rec.nSectors*UDS_SECTOR_SIZE != hdr.count) {
+					printf("Payload length does not match write from UDS client, disconnecting.\n");
+					return -1;
+				}
+				batch[nBatch].sectorN = rec.sectorN;
+				batch[nBatch].nSectors = rec.nSectors;
+				batch[nBatch].volume = conn->volume;
+				batch[nBatch].payload = malloc(hdr.count);
+				memcpy(batch[nBatch].payload, conn->buff + pos + sizeof(UDS_FRAME_HDR) + sizeof(QEMU_OFFS_LEN), hdr.count);
+				nBatch++;
+				pos += frameLen;
+				continue;
+			}
+			if(hdr.type != UDS_FRAME_OFFSLEN) {
+				printf("Unknown frame type %u from UDS client, disconnecting.\n", hdr.type);
+				return -1;
+			}
+			if(avail < sizeof(UDS_FRAME_HDR) + hdr.count*sizeof(QEMU_OFFS_LEN)) break;
+			recs = (QEMU_OFFS_LEN *)(conn->buff + pos + sizeof(UDS_FRAME_HDR));
+			nRecs = hdr.count;
+			pos += sizeof(UDS_FRAME_HDR) + hdr.count*sizeof(QEMU_OFFS_LEN);
+		}
+
+		uint32_t i;
+		for(i = 0; i < nRecs; i++) {
+			QEMU_OFFS_LEN rec;
+			memcpy(&rec, &recs[i], sizeof(QEMU_OFFS_LEN));
+			if(!udsWriteValid(rec.sectorN, rec.nSectors)) continue;	/*Dropped */
+			batch[nBatch].sectorN = rec.sectorN;
+			batch[nBatch].nSectors = rec.nSectors;
+			batch[nBatch].volume = conn->volume;
+			batch[nBatch].payload = NULL;
+			nBatch++;
+		}
+	}
+
+	if(nBatch > 0) {
+		metricsAdd(MET_WRITES_RECEIVED, nBatch);
+		if(udsTrace) traceRecord(udsTrace, batch, nBatch);
+		int nQueued = QPutBatch(batch, nBatch);
+		LOG_DEBUG("Queued %d of %d writes from UDS client.\n", nQueued, nBatch);
+	}
+
+	/*Keep the incomplete tail for the next recv */
+	conn->nBuffered -= pos;
+	memmove(conn->buff, conn->buff + pos, conn->nBuffered);
+	return 0;
+}
+
+/**
+ * Reads everything available on a connection.
+ *
+ * Returns -1 when the client has gone or the connection failed.
+ */
+static int udsConnRead(int epollFD, UDS_CONN *conn) {
+	while(true) {
+		ssize_t n = recv(conn->fd, conn->buff + conn->nBuffered, UDS_CONN_BUFF - conn->nBuffered, 0);
+		if(n > 0) {
+			uint64_t startNs = monotonicNs();
+			conn->nBuffered += n;
+			if(udsConnParse(epollFD, conn) == -1) return -1;
+			metricsTime(MET_STAGE_RECEIVE, monotonicNs() - startNs);
+		} else if(n == 0) {
+			printf("Client disconnected.\n");
+			return -1;
+		} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else if(errno != EINTR) {
+			int errsv = errno;
+			printf("Read from UDS socket error: %s\n", strerror(errsv));
+			return -1;
+		}
+	}
+}
 
 /*
- * Creates a UDS socket at the path specified and prints received messages to stdout.
+ * Creates a UDS socket at the path specified and queues the writes that any
+ * number of connected QEMU instances report, over the socket itself or over
+ * shared memory rings requested through it, until udsServerStop is called.
  * Producer thread
  */
 void *udsServerThreadFn(void *socket_path) {
 
 	struct sockaddr_un addr;
-	BYTE buffer[SOCKET_BUFF];
-	QEMU_OFFS_LEN buff;
-	int socketDescriptor, udsReadStatus;
+	struct epoll_event ev, events[UDS_MAX_EVENTS];
+	int epollFD, nEvents, i;
+	UDS_CONN *conns = NULL;		/*Open connections */
+	bool stopping = false;
 
-	if ( (udsFD = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+	if ( (udsFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
 		perror("socket error");
 		pthread_exit(NULL);
 	}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, ((char *)socket_path), sizeof(addr.sun_path)-1);
-	unlink(((char *)socket_path));
+	socklen_t addrLen = udsAddress(&addr, (char *)socket_path);
+	if(addr.sun_path[0] != '\0') {
+		unlink(((char *)socket_path));	/*Left over from a previous run */
+	}
 
-	if (bind(udsFD, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+	if (bind(udsFD, (struct sockaddr*)&addr, addrLen) == -1) {
 		perror("bind error");
 		pthread_exit(NULL);
 	}
 
-	if (listen(udsFD, 5) == -1) {
+	if (listen(udsFD, UDS_BACKLOG) == -1) {
 		perror("listen error");
 		pthread_exit(NULL);
 	}
 
-	while (true) {
-		if ( (socketDescriptor = accept(udsFD, NULL, NULL)) == -1) {
-			int errsv = errno;
-			printf("Accept error: %s\n", strerror(errsv));
+	if ((epollFD = epoll_create1(0)) == -1) {
+		perror("epoll error");
+		pthread_exit(NULL);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;		/*NULL marks the listening socket */
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, udsFD, &ev);
+	ev.data.ptr = &udsStopSource;
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, udsStopFD, &ev);
+
+	while (!stopping) {
+		if ((nEvents = epoll_wait(epollFD, events, UDS_MAX_EVENTS, -1)) == -1) {
+			if(errno != EINTR) {
+				int errsv = errno;
+				printf("UDS epoll error: %s\n", strerror(errsv));
+			}
 			continue;
 		}
 
-		/* Read the received data */
-		while ( (udsReadStatus=read(socketDescriptor, &buff, sizeof(QEMU_OFFS_LEN))) > 0 ) {
-			if(DEBUG) printf("read %u bytes: %s\n", udsReadStatus, buffer);
-			QPut(buff); /*Put received data in the FIFO */
-		}
+		for(i = 0; i < nEvents; i++) {
+			UDS_CONN *conn = events[i].data.ptr;
 
-		if (udsReadStatus == -1) { /*Error reading socket */
-			int errsv = errno;
-			printf("Read from UDS socket error: %s\n", strerror(errsv));
-			pthread_exit(NULL);
-		}
+			if(conn == NULL) {	/*Accept every pending client */
+				int socketDescriptor;
+				while ( (socketDescriptor = accept4(udsFD, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+					conn = calloc(1, sizeof(UDS_CONN));
+					conn->kind = UDS_SRC_CONN;
+					conn->fd = socketDescriptor;
+					conn->next = conns;
+					conns = conn;
+					ev.events = EPOLLIN | EPOLLRDHUP;
+					ev.data.ptr = conn;
+					epoll_ctl(epollFD, EPOLL_CTL_ADD, socketDescriptor, &ev);
+					printf("Client connected.\n");
+				}
+				if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					int errsv = errno;
+					printf("Accept error: %s\n", strerror(errsv));
+				}
+				continue;
+			}
 
-		else if (udsReadStatus == 0) {
-			printf("Client disconnected.\n");
-			close(socketDescriptor);
+			if(conn->kind == UDS_SRC_STOP) {	/*Finish this batch of events, then stop */
+				stopping = true;
+			} else if(conn->kind == UDS_SRC_RING) {	/*Doorbell of a shared memory ring */
+				udsRingDrain((SHM_RING *)conn);
+			} else if(udsConnRead(epollFD, conn) == -1) {
+				udsConnClose(epollFD, &conns, conn);
+			}
 		}
 	}
 
-    pthread_exit(0);
+	/*Queue what the connections and their rings still hold, then close them */
+	while(conns) {
+		udsConnRead(epollFD, conns);
+		udsConnClose(epollFD, &conns, conns);
+	}
+	close(epollFD);
+	close(udsFD);
+	pthread_exit(0);
 }
 
 /**
@@ -109,24 +474,43 @@ void QInit()
 /**
  * Put a new item in the queue
  */
-int QPut(QEMU_OFFS_LEN qItem)
+int QPut(WRITE_EVENT qItem)
+{
+	return QPutBatch(&qItem, 1) == 1 ? 0 : -1;
+}
+
+/**
+ * Put up to nItems in the queue under a single lock. The queue takes ownership
+ * of each item's payload. The consumer applies the writes queued to the cluster
+ * cache as it takes them, those dropped are applied here, as they never will be.
+ *
+ * Returns the number queued, the remainder are dropped if the queue fills.
+ */
+int QPutBatch(WRITE_EVENT *qItems, int nItems)
 {
+	int i;
 	pthread_mutex_lock (&mutexqueue);
-	if(writeQueueIn == (( writeQueueOut - 1 + Q_SIZE) % Q_SIZE)) {
-		pthread_mutex_unlock (&mutexqueue);
-		return -1;	/* Queue Full*/
-	} else {
-		writeQueue[writeQueueIn] = qItem;
+	for(i = 0; i < nItems; i++) {
+		if(writeQueueIn == (( writeQueueOut - 1 + Q_SIZE) % Q_SIZE)) {
+			break;	/* Queue Full*/
+		}
+		writeQueue[writeQueueIn] = qItems[i];
 		writeQueueIn = (writeQueueIn + 1) % Q_SIZE;
-		pthread_mutex_unlock (&mutexqueue);
-		return 0;
 	}
+	writeQueueDropped += nItems - i;
+	pthread_mutex_unlock (&mutexqueue);
+	int nQueued = i;
+	clusterCacheWrites(&clusterCache, qItems + nQueued, nItems - nQueued);
+	for(; i < nItems; i++) {	/*Dropped writes release their data */
+		free(qItems[i].payload);
+	}
+	return nQueued;
 }
 
 /**
  * Remove the earliest item from the queue (FIFO)
  */
-int QGet(QEMU_OFFS_LEN *qItem)
+int QGet(WRITE_EVENT *qItem)
 {
 	pthread_mutex_lock (&mutexqueue);
     if(writeQueueIn == writeQueueOut) {
@@ -140,4 +524,148 @@ int QGet(QEMU_OFFS_LEN *qItem)
     }
 }
 
+/**
+ * Number of writes waiting in the queue.
+ */
+uint64_t QDepth()
+{
+	pthread_mutex_lock (&mutexqueue);
+	uint64_t depth = (writeQueueIn - writeQueueOut + Q_SIZE) % Q_SIZE;
+	pthread_mutex_unlock (&mutexqueue);
+	return depth;
+}
+
+/**
+ * Number of writes lost because the queue was full.
+ */
+uint64_t QDropped()
+{
+	pthread_mutex_lock (&mutexqueue);
+	uint64_t dropped = writeQueueDropped;
+	pthread_mutex_unlock (&mutexqueue);
+	return dropped;
+}
+
+/**
+ * Empties the queue into a file, for QLoad to put back after a restart. Call
+ * once the producer and consumer have stopped. Nothing is written if the queue
+ * is empty.
+ *
+ * Returns the number of writes saved, or -1 on error.
+ */
+int QSave(const char *path, const char **volumeNames, uint16_t nVolumes)
+{
+	char tmpPath[FILENAME_MAX+8];
+	char name[QFILE_NAME_LEN];
+	QFILE_HDR hdr = { QFILE_MAGIC, nVolumes, (uint32_t)QDepth() };
+	WRITE_EVENT qItem;
+	bool ok = true;
+	uint16_t v;
+
+	if(hdr.count == 0) {
+		return 0;
+	}
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	FILE *fp = fopen(tmpPath, "wb");
+	if(fp == NULL) {
+		int errsv = errno;
+		printf("Failed to create queue file %s: %s.\n", tmpPath, strerror(errsv));
+		return -1;
+	}
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	for(v = 0; v < nVolumes && ok; v++) {
+		memset(name, 0, sizeof(name));
+		strncpy(name, volumeNames[v], sizeof(name) - 1);
+		ok = fwrite(name, sizeof(name), 1, fp) == 1;
+	}
+	while(QGet(&qItem) != -1) {		/*Always empty the queue, to free the payloads */
+		QFILE_REC rec = { qItem.sectorN, qItem.nSectors, qItem.volume, qItem.payload != NULL };
+		ok = ok && fwrite(&rec, sizeof(rec), 1, fp) == 1;
+		if(ok && qItem.payload) {
+			ok = fwrite(qItem.payload, (size_t)qItem.nSectors*UDS_SECTOR_SIZE, 1, fp) == 1;
+		}
+		free(qItem.payload);
+	}
+	if(fclose(fp) != 0 || !ok || rename(tmpPath, path) != 0) {
+		int errsv = errno;
+		printf("Failed to write queue file %s: %s.\n", path, strerror(errsv));
+		unlink(tmpPath);
+		return -1;
+	}
+	return (int)hdr.count;
+}
+
+/**
+ * Queues the writes saved by QSave and removes the file. Saved volumes are
+ * matched to the current ones by name, writes for volumes no longer served
+ * are dropped.
+ *
+ * Returns the number of writes queued, 0 if there is no file, or -1 on error.
+ */
+int QLoad(const char *path, const char **volumeNames, uint16_t nVolumes)
+{
+	char name[QFILE_NAME_LEN];
+	int32_t *volumeMap;
+	QFILE_HDR hdr;
+	QFILE_REC rec;
+	uint32_t i;
+	uint16_t v;
+	int nQueued = 0;
+
+	FILE *fp = fopen(path, "rb");
+	if(fp == NULL) {
+		if(errno == ENOENT) return 0;
+		int errsv = errno;
+		printf("Failed to open queue file %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, QFILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	   hdr.nVolumes > UINT16_MAX + 1) {
+		printf("%s is not a queue file.\n", path);
+		fclose(fp);
+		return -1;
+	}
+	volumeMap = calloc(hdr.nVolumes ? hdr.nVolumes : 1, sizeof(int32_t));
+	for(i = 0; i < hdr.nVolumes; i++) {
+		volumeMap[i] = -1;
+	}
+	for(i = 0; i < hdr.nVolumes; i++) {
+		if(fread(name, sizeof(name), 1, fp) != 1) {
+			printf("Queue file %s is truncated in its volume names.\n", path);
+			free(volumeMap);
+			fclose(fp);
+			return -1;
+		}
+		name[sizeof(name) - 1] = '\0';
+		for(v = 0; v < nVolumes; v++) {
+			if(strcmp(name, volumeNames[v]) == 0) volumeMap[i] = v;
+		}
+	}
+	for(i = 0; i < hdr.count && fread(&rec, sizeof(rec), 1, fp) == 1; i++) {
+		WRITE_EVENT qItem = { rec.sectorN, rec.nSectors, 0, NULL };
+		if(!udsWriteValid(rec.sectorN, rec.nSectors)) break;
+		if(rec.hasPayload) {
+			if((uint64_t)rec.nSectors*UDS_SECTOR_SIZE > UDS_MAX_PAYLOAD) break;
+			qItem.payload = malloc((size_t)rec.nSectors*UDS_SECTOR_SIZE);
+			if(fread(qItem.payload, (size_t)rec.nSectors*UDS_SECTOR_SIZE, 1, fp) != 1) {
+				free(qItem.payload);
+				break;
+			}
+		}
+		if(rec.volume >= hdr.nVolumes || volumeMap[rec.volume] == -1) {
+			free(qItem.payload);	/*Volume no longer served */
+			continue;
+		}
+		qItem.volume = (uint16_t)volumeMap[rec.volume];
+		nQueued += QPut(qItem) == 0;
+	}
+	if(i < hdr.count) {
+		printf("Queue file %s is truncated after %u writes.\n", path, i);
+	}
+	free(volumeMap);
+	fclose(fp);
+	unlink(path);		/*Queued now, so they are not taken twice */
+	return nQueued;
+}
+
 #endif
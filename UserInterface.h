@@ -36,6 +36,16 @@
 #define EXT_MFTCO		8
 #define UDSSTART		9
 #define UDSSTOP			10
+#define USE_VOLUME		11
+#define SHUTDOWN		12
+#define BATCH_MFTN		13
+#define BATCH_MFTC		14
+#define BATCH_MFTO		15
+#define EXPORT_FILES	16
+#define SRCH_FOR_TIME	17
+#define FREE_SPACE		18
+#define SRCH_DELETED	19
+#define RECOVER_FILES	20
 #define EXIT			127
 #define UNKNOWN			-1
 
@@ -51,10 +61,20 @@
 #define SRCH_MFTN_CMD		"search using record number"
 #define SRCH_MFTC_CMD		"search using record name"
 #define SRCH_MFTO_CMD		"search using record offset"
+#define SRCH_TIME_CMD		"search using time"
+#define BATCH_MFTN_CMD		"batch search using record number"
+#define BATCH_MFTC_CMD		"batch search using record name"
+#define BATCH_MFTO_CMD		"batch search using record offset"
+#define EXPORT_CMD			"export"
+#define FREE_SPACE_CMD		"free space"
+#define SRCH_DELETED_CMD	"search deleted"
+#define RECOVER_CMD			"recover deleted"
 #define EXT_MFTN_CMD		"extract using record number"
 #define EXT_MFTCO_CMD		"extract using qemu offset"
 #define UDSSTART_CMD		"start server"
 #define UDSSTOP_CMD			"stop server"
+#define USE_VOLUME_CMD		"use volume"
+#define SHUTDOWN_CMD		"shutdown"
 #define EXIT_CMD			"exit"
 
 
@@ -63,22 +83,36 @@
 \t" KWHT "%s" KRESET " - Display this menu.\n\
 \t" KWHT "%s" KRESET " - Print out a list of all file names found on volume.\n\
 \t" KWHT "%s" KRESET " - Search (offline) for a file using it's MFT record number.\n\
-\t" KWHT "%s" KRESET " - Search (offline) for a file using it's file name.\n\
+\t" KWHT "%s" KRESET " - Search (offline) for a file using any of it's names, any case, * and ? wildcards, or it's path, \\dir\\file.\n\
 \t" KWHT "%s" KRESET " - Search (offline) for a file using it's sector number offset.\n\
-\t" KWHT "%s" KRESET " - Extract a file using it's (offline) MFT record number.\n\
+\t" KWHT "%s" KRESET " - Search (offline) for files by time, " KWHT "created|modified|changed|read from [to]" KRESET ", e.g. modified -30m.\n\
+\t" KWHT "%s" KRESET ", " KWHT "name" KRESET ", " KWHT "offset" KRESET " - Search for many terms at once, one per line, ending with a blank line.\n\
+\t" KWHT "%s" KRESET " - Write the list of files to a file, as " KWHT "csv|ndjson|arrow path" KRESET ", - for here.\n\
+\t" KWHT "%s" KRESET " - Show allocated and free clusters, and the largest free runs, from $Bitmap.\n\
+\t" KWHT "%s" KRESET " - List deleted files by name, * and ? wildcards, with the %% of their clusters still free.\n\
+\t" KWHT "%s" KRESET " - Recover a deleted file by record number, or many as " KWHT "[min%%] name" KRESET ", e.g. 100 *.doc.\n\
+\t" KWHT "%s" KRESET " - Extract a file using it's (offline) MFT record number, " KWHT "number:stream" KRESET " for an alternate data stream, " KWHT "number:*" KRESET " for all.\n\
 \t" KWHT "%s" KRESET " - Extract a file, using it's QEMU write offset.\n\
 \t" KWHT "%s" KRESET " - Listen to UDS for Guest VM write offsets & extract (live).\n\
 \t" KWHT "%s" KRESET " - Stop listening to UDS.\n\
+\t" KWHT "%s" KRESET " - Choose the volume searched and extracted from, by name or index.\n\
 \t" KWHT "%s" KRESET " - Close this program.\n", \
 HELP_CMD, \
 PRINT_FILES_CMD, \
 SRCH_MFTN_CMD, \
 SRCH_MFTC_CMD, \
 SRCH_MFTO_CMD, \
+SRCH_TIME_CMD, \
+BATCH_MFTN_CMD, \
+EXPORT_CMD, \
+FREE_SPACE_CMD, \
+SRCH_DELETED_CMD, \
+RECOVER_CMD, \
 EXT_MFTN_CMD, \
 EXT_MFTCO_CMD, \
 UDSSTART_CMD, \
 UDSSTOP_CMD, \
+USE_VOLUME_CMD, \
 EXIT_CMD
 
 #define SEARCHTERM "Enter the search term: "
@@ -95,15 +129,54 @@ int8_t parseUserInput(char * userInput) {
 	else if ( ENTERED(SRCH_MFTN_CMD) )	 { return SRCH_FOR_MFTN; }
 	else if ( ENTERED(SRCH_MFTC_CMD) )	 { return SRCH_FOR_MFTC; }
 	else if ( ENTERED(SRCH_MFTO_CMD) )	 { return SRCH_FOR_MFTO; }
+	else if ( ENTERED(SRCH_TIME_CMD) )	 { return SRCH_FOR_TIME; }
+	else if ( ENTERED(BATCH_MFTN_CMD) )	 { return BATCH_MFTN; }
+	else if ( ENTERED(BATCH_MFTC_CMD) )	 { return BATCH_MFTC; }
+	else if ( ENTERED(BATCH_MFTO_CMD) )	 { return BATCH_MFTO; }
+	else if ( ENTERED(EXPORT_CMD) )		 { return EXPORT_FILES; }
+	else if ( ENTERED(FREE_SPACE_CMD) )	 { return FREE_SPACE; }
+	else if ( ENTERED(SRCH_DELETED_CMD) ) { return SRCH_DELETED; }
+	else if ( ENTERED(RECOVER_CMD) )	 { return RECOVER_FILES; }
 	else if ( ENTERED(EXT_MFTN_CMD) )	 { return EXT_MFTN; }
 	else if ( ENTERED(EXT_MFTCO_CMD) )	 { return EXT_MFTCO; }
 	else if ( ENTERED(UDSSTART_CMD) )	 { return UDSSTART; }
 	else if ( ENTERED(UDSSTOP_CMD) )	 { return UDSSTOP; }
+	else if ( ENTERED(USE_VOLUME_CMD) )	 { return USE_VOLUME; }
 	else if ( ENTERED(EXIT_CMD) ) 		 { return EXIT;	}
 	else 								 { return UNKNOWN; }
 
 }
 
+/* Commands which take their search term on the same line, control socket only */
+static const struct {
+	const char	*cmd;
+	int8_t		code;
+} lineCommands[] = {
+	{ SRCH_MFTN_CMD, SRCH_FOR_MFTN }, { SRCH_MFTC_CMD, SRCH_FOR_MFTC }, { SRCH_MFTO_CMD, SRCH_FOR_MFTO },
+	{ SRCH_TIME_CMD, SRCH_FOR_TIME },	{ EXT_MFTN_CMD, EXT_MFTN }, { EXT_MFTCO_CMD, EXT_MFTCO }, { USE_VOLUME_CMD, USE_VOLUME },
+	{ EXPORT_CMD, EXPORT_FILES }, { SRCH_DELETED_CMD, SRCH_DELETED }, { RECOVER_CMD, RECOVER_FILES },
+	{ SHUTDOWN_CMD, SHUTDOWN }
+};
+
+/**
+ * Determines the action for a command given on one line, as the control socket
+ * takes them: the command, then for searches and extraction its search term.
+ * *arg is left pointing at the search term, or at an empty string.
+ */
+int8_t parseCommandLine(char *line, char **arg) {
+	size_t i, len;
+	line[ strcspn(line, "\r\n") ] = 0;
+	*arg = line + strlen(line);
+	for(i = 0; i < sizeof(lineCommands)/sizeof(lineCommands[0]); i++) {
+		len = strlen(lineCommands[i].cmd);
+		if(strncmp(line, lineCommands[i].cmd, len) == 0 && (line[len] == ' ' || line[len] == '\0')) {
+			for(*arg = line + len; **arg == ' '; (*arg)++);
+			return lineCommands[i].code;
+		}
+	}
+	return parseUserInput(line);
+}
+
 /**
  * Gets the search input string from user
  *
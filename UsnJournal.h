@@ -0,0 +1,351 @@
+/*
+ * UsnJournal.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * Tails the NTFS change journal, the $J stream of $Extend\$UsnJrnl, as a second
+ * source of changes. Windows appends a USN record to the journal for each change
+ * to a file, naming its MFT record and why it changed, so one journal cluster
+ * written by the guest covers changes to dozens of files. The records named are
+ * then re-read from the $MFT, instead of waiting for their own cluster writes.
+ *
+ * The journal's clusters are mapped from its $J run list when the volume is
+ * indexed, and again whenever its MFT record is written. $J is sparse: clusters
+ * before the oldest record kept are released and new ones appended, so only
+ * allocated runs are mapped. USN records are 8 byte aligned and never cross a
+ * USN_PAGE boundary; the rest of a page after its last record is zero.
+ *
+ * A record's USN is its offset in $J. Only records with a USN above the highest
+ * seen are new; the journal is tailed from its end when the volume is opened.
+ */
+#ifndef USNJOURNAL_H_
+#define USNJOURNAL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "AttrIter.h"
+#include "RunList.h"
+
+#define USN_EXTEND_RECORD	11			/*MFT record number of $Extend */
+#define USN_JOURNAL_NAME	"$UsnJrnl"
+#define USN_PAGE			4096		/*USN records never cross one of these */
+#define USN_NAME_MAX		(3*255+1)	/*Longest file name in UTF-8 */
+#define USN_REF_MASK		0x0000FFFFFFFFFFFFULL	/*Record number part of a file reference */
+
+/* Reasons a USN record was written, as the Windows USN_REASON_ flags */
+#define USN_REASON_DATA_OVERWRITE			0x00000001
+#define USN_REASON_DATA_EXTEND				0x00000002
+#define USN_REASON_DATA_TRUNCATION			0x00000004
+#define USN_REASON_NAMED_DATA_OVERWRITE		0x00000010
+#define USN_REASON_NAMED_DATA_EXTEND		0x00000020
+#define USN_REASON_NAMED_DATA_TRUNCATION	0x00000040
+#define USN_REASON_FILE_CREATE				0x00000100
+#define USN_REASON_FILE_DELETE				0x00000200
+#define USN_REASON_EA_CHANGE				0x00000400
+#define USN_REASON_SECURITY_CHANGE			0x00000800
+#define USN_REASON_RENAME_OLD_NAME			0x00001000
+#define USN_REASON_RENAME_NEW_NAME			0x00002000
+#define USN_REASON_INDEXABLE_CHANGE			0x00004000
+#define USN_REASON_BASIC_INFO_CHANGE		0x00008000
+#define USN_REASON_HARD_LINK_CHANGE			0x00010000
+#define USN_REASON_COMPRESSION_CHANGE		0x00020000
+#define USN_REASON_ENCRYPTION_CHANGE		0x00040000
+#define USN_REASON_OBJECT_ID_CHANGE			0x00080000
+#define USN_REASON_REPARSE_POINT_CHANGE		0x00100000
+#define USN_REASON_STREAM_CHANGE			0x00200000
+#define USN_REASON_CLOSE					0x80000000
+
+/* Reasons after which the file's record is worth re-reading, unless it was deleted */
+#define USN_REASON_REREAD	(USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND | USN_REASON_DATA_TRUNCATION | \
+							 USN_REASON_NAMED_DATA_OVERWRITE | USN_REASON_NAMED_DATA_EXTEND | \
+							 USN_REASON_NAMED_DATA_TRUNCATION | USN_REASON_FILE_CREATE | \
+							 USN_REASON_RENAME_NEW_NAME | USN_REASON_STREAM_CHANGE | USN_REASON_CLOSE)
+
+#pragma pack(push, 1)
+
+	/* Fixed part of a USN_RECORD_V2, followed by the file name in UTF-16 */
+	typedef struct _USN_RECORD_V2 {
+		uint32_t	dwRecordLength;
+		uint16_t	wMajorVersion;
+		uint16_t	wMinorVersion;
+		uint64_t	n64FileReference;
+		uint64_t	n64ParentReference;
+		int64_t		n64Usn;
+		int64_t		n64TimeStamp;
+		uint32_t	dwReason;
+		uint32_t	dwSourceInfo;
+		uint32_t	dwSecurityId;
+		uint32_t	dwFileAttributes;
+		uint16_t	wFileNameLength;		/*In bytes */
+		uint16_t	wFileNameOffset;
+	} USN_RECORD_V2;
+
+	/* USN_RECORD_V3, with 128 bit file references; on NTFS the top half is zero */
+	typedef struct _USN_RECORD_V3 {
+		uint32_t	dwRecordLength;
+		uint16_t	wMajorVersion;
+		uint16_t	wMinorVersion;
+		uint64_t	n64FileReference[2];
+		uint64_t	n64ParentReference[2];
+		int64_t		n64Usn;
+		int64_t		n64TimeStamp;
+		uint32_t	dwReason;
+		uint32_t	dwSourceInfo;
+		uint32_t	dwSecurityId;
+		uint32_t	dwFileAttributes;
+		uint16_t	wFileNameLength;
+		uint16_t	wFileNameOffset;
+	} USN_RECORD_V3;
+
+#pragma pack(pop)
+
+/* A change read from the journal */
+typedef struct _USN_EVENT {
+	int64_t		usn;
+	int64_t		timeStamp;			/*NTFS time */
+	uint32_t	record;				/*MFT record number of the file */
+	uint32_t	parent;
+	uint32_t	reason;				/*USN_REASON_ flags */
+	char		name[USN_NAME_MAX];
+} USN_EVENT;
+
+/* Allocated run of $J, in clusters */
+typedef struct _USN_EXTENT {
+	int64_t		vcn;
+	int64_t		lcn;
+	int64_t		length;
+} USN_EXTENT;
+
+typedef struct _USN_JOURNAL {
+	uint32_t	record;				/*MFT record of $UsnJrnl, 0 if there is none */
+	USN_EXTENT	*extents;
+	uint32_t	nExtents;
+	int64_t		size;				/*Bytes of $J, the next USN written */
+	int64_t		lastUsn;			/*Highest USN seen, -1 before any */
+	int64_t		*recordSectors;		/*Sector of each MFT record, -1 if unknown */
+	uint64_t	nRecords;
+	uint64_t	countRecords;		/*USN records read since opening */
+	uint64_t	countRereads;		/*MFT records re-read for them */
+} USN_JOURNAL;
+
+void    usnJournalInit(USN_JOURNAL *journal);
+int     usnJournalMap(USN_JOURNAL *journal, const BYTE *record, uint32_t recLen);
+int64_t usnJournalVcn(USN_JOURNAL *journal, int64_t lcn);
+int64_t usnJournalLcn(USN_JOURNAL *journal, int64_t vcn);
+int64_t usnJournalEnd(USN_JOURNAL *journal);
+uint32_t usnParse(USN_JOURNAL *journal, const BYTE *data, uint32_t len, USN_EVENT *events, uint32_t maxEvents);
+int     usnRecordSector(USN_JOURNAL *journal, uint32_t record, int64_t sector);
+int64_t usnRecordSectorOf(USN_JOURNAL *journal, uint32_t record);
+size_t  usnReasonString(char *out, size_t outLen, uint32_t reason);
+void    usnJournalFree(USN_JOURNAL *journal);
+
+void usnJournalInit(USN_JOURNAL *journal) {
+	memset(journal, 0, sizeof(USN_JOURNAL));
+	journal->lastUsn = -1;
+}
+
+/**
+ * Maps the clusters of the $J stream from the $UsnJrnl MFT record in record,
+ * replacing any earlier mapping.
+ *
+ * Returns EXIT_FAILURE if the record has no non-resident $J.
+ */
+int usnJournalMap(USN_JOURNAL *journal, const BYTE *record, uint32_t recLen) {
+	NTFS_MFT_FILE_ENTRY_HEADER *hdr = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	NTFS_ATTRIBUTE *attr;
+	ATTR_ITER it;
+
+	attrIterInit(&it, (char *)record, recLen);
+	while((attr = attrNext(&it))) {
+		if(attr->dwType != DATA || !attr->uchNonResFlag || attr->uchNameLength != 2) continue;
+		const BYTE *name = record + it.offs + attr->wNameOffset;
+		if(name[0] != '$' || name[1] != 0 || name[2] != 'J' || name[3] != 0) continue;
+
+		/*Decode the run list, skipping sparse runs, which have no offset */
+		bool badRuns;
+		DataRun *runList = decodeRunList(record + it.offs + attr->Attr.NonResident.wDatarunOffset,
+										 record + it.offs + attr->dwFullLength, &badRuns), *run;
+		int64_t vcn = attr->Attr.NonResident.n64StartVCN, lcn = 0;
+		uint32_t maxExtents = 16;
+		USN_EXTENT *extents = malloc( maxExtents*sizeof(USN_EXTENT) );
+		uint32_t nExtents = 0;
+		for(run = runList; run; run = run->p_next) {
+			if(run->offset != 0) {
+				lcn += run->offset;
+				if(nExtents == maxExtents) {
+					maxExtents *= 2;
+					extents = realloc(extents, maxExtents*sizeof(USN_EXTENT));
+				}
+				extents[nExtents].vcn = vcn;
+				extents[nExtents].lcn = lcn;
+				extents[nExtents++].length = (int64_t)run->length;
+			}
+			vcn += run->length;
+		}
+		freeRunList(runList);
+		free(journal->extents);
+		journal->extents = extents;
+		journal->nExtents = nExtents;
+		journal->size = attr->Attr.NonResident.n64RealSize;
+		journal->record = hdr->dwMFTRecNumber;
+		return EXIT_SUCCESS;
+	}
+	return EXIT_FAILURE;
+}
+
+/**
+ * Returns the journal cluster (VCN) held in volume cluster lcn, or -1 if lcn
+ * is not part of the journal.
+ */
+int64_t usnJournalVcn(USN_JOURNAL *journal, int64_t lcn) {
+	uint32_t i;
+	for(i = 0; i < journal->nExtents; i++) {
+		USN_EXTENT *ext = &journal->extents[i];
+		if(lcn >= ext->lcn && lcn < ext->lcn + ext->length) return ext->vcn + (lcn - ext->lcn);
+	}
+	return -1;
+}
+
+/**
+ * Returns the volume cluster holding journal cluster vcn, or -1 if it is sparse.
+ */
+int64_t usnJournalLcn(USN_JOURNAL *journal, int64_t vcn) {
+	uint32_t i;
+	for(i = 0; i < journal->nExtents; i++) {
+		USN_EXTENT *ext = &journal->extents[i];
+		if(vcn >= ext->vcn && vcn < ext->vcn + ext->length) return ext->lcn + (vcn - ext->vcn);
+	}
+	return -1;
+}
+
+/**
+ * Returns the journal cluster after the last allocated one.
+ */
+int64_t usnJournalEnd(USN_JOURNAL *journal) {
+	return journal->nExtents ? journal->extents[journal->nExtents - 1].vcn +
+							   journal->extents[journal->nExtents - 1].length : 0;
+}
+
+/**
+ * Parses the USN records in data, len bytes of the journal starting on a page
+ * boundary. Records newer than the last seen are returned in events, up to
+ * maxEvents of them; events may be NULL to only move the last USN seen on.
+ *
+ * Returns the number of new records.
+ */
+uint32_t usnParse(USN_JOURNAL *journal, const BYTE *data, uint32_t len, USN_EVENT *events, uint32_t maxEvents) {
+	uint32_t offs = 0, nNew = 0;
+	int64_t lastUsn = journal->lastUsn;
+
+	while(offs + sizeof(USN_RECORD_V2) <= len) {
+		USN_RECORD_V3 v3;
+		USN_RECORD_V2 v2;
+		uint32_t pageLeft = USN_PAGE - offs % USN_PAGE;
+		memcpy(&v2, data + offs, sizeof(v2));
+
+		/*The rest of a page after its last record is zero, as is anything damaged */
+		bool isV3 = v2.wMajorVersion == 3;
+		uint32_t fixedLen = isV3 ? sizeof(USN_RECORD_V3) : sizeof(USN_RECORD_V2);
+		if(v2.dwRecordLength == 0 || v2.dwRecordLength % 8 || v2.dwRecordLength > pageLeft ||
+		   offs + v2.dwRecordLength > len || (v2.wMajorVersion != 2 && !isV3) || v2.dwRecordLength < fixedLen) {
+			offs += pageLeft;
+			continue;
+		}
+		int64_t usn = v2.n64Usn, timeStamp = v2.n64TimeStamp;
+		uint64_t fileRef = v2.n64FileReference, parentRef = v2.n64ParentReference;
+		uint32_t reason = v2.dwReason;
+		uint16_t nameLen = v2.wFileNameLength, nameOffs = v2.wFileNameOffset;
+		if(isV3) {
+			memcpy(&v3, data + offs, sizeof(v3));
+			usn = v3.n64Usn;
+			timeStamp = v3.n64TimeStamp;
+			fileRef = v3.n64FileReference[0];
+			parentRef = v3.n64ParentReference[0];
+			reason = v3.dwReason;
+			nameLen = v3.wFileNameLength;
+			nameOffs = v3.wFileNameOffset;
+		}
+		if(usn > journal->lastUsn) {
+			journal->countRecords++;
+			if(usn > lastUsn) lastUsn = usn;
+			if(events && nNew < maxEvents) {
+				USN_EVENT *ev = &events[nNew];
+				uint16_t name[255];
+				if(nameOffs + nameLen > v2.dwRecordLength || nameLen > sizeof(name)) nameLen = 0;
+				memcpy(name, data + offs + nameOffs, nameLen);
+				ev->usn = usn;
+				ev->timeStamp = timeStamp;
+				ev->record = (uint32_t)(fileRef & USN_REF_MASK);
+				ev->parent = (uint32_t)(parentRef & USN_REF_MASK);
+				ev->reason = reason;
+				utf16ToUtf8(ev->name, name, nameLen/2);
+			}
+			nNew++;
+		}
+		offs += v2.dwRecordLength;
+	}
+	journal->lastUsn = lastUsn;
+	return nNew < maxEvents || events == NULL ? nNew : maxEvents;
+}
+
+/**
+ * Remembers the sector of an MFT record, for re-reading it. Callers keep record
+ * to those the volume could hold, as the table grows to it.
+ *
+ * Returns EXIT_FAILURE, forgetting nothing, if the table cannot grow.
+ */
+int usnRecordSector(USN_JOURNAL *journal, uint32_t record, int64_t sector) {
+	if(record >= journal->nRecords) {
+		uint64_t newSize = journal->nRecords ? journal->nRecords : 4096, i;
+		while(newSize <= record) newSize *= 2;
+		int64_t *recordSectors = realloc(journal->recordSectors, newSize*sizeof(int64_t));
+		if(recordSectors == NULL) return EXIT_FAILURE;
+		for(i = journal->nRecords; i < newSize; i++) recordSectors[i] = -1;
+		journal->recordSectors = recordSectors;
+		journal->nRecords = newSize;
+	}
+	journal->recordSectors[record] = sector;
+	return EXIT_SUCCESS;
+}
+
+int64_t usnRecordSectorOf(USN_JOURNAL *journal, uint32_t record) {
+	return record < journal->nRecords ? journal->recordSectors[record] : -1;
+}
+
+/**
+ * Writes the names of the reasons set, e.g. "data_extend|close".
+ */
+size_t usnReasonString(char *out, size_t outLen, uint32_t reason) {
+	static const char *names[32] = {
+		"data_overwrite", "data_extend", "data_truncation", NULL, "named_data_overwrite",
+		"named_data_extend", "named_data_truncation", NULL, "file_create", "file_delete",
+		"ea_change", "security_change", "rename_old_name", "rename_new_name", "indexable_change",
+		"basic_info_change", "hard_link_change", "compression_change", "encryption_change",
+		"object_id_change", "reparse_point_change", "stream_change", "transacted_change",
+		"integrity_change", NULL, NULL, NULL, NULL, NULL, NULL, NULL, "close" };
+	size_t len = 0;
+	int bit;
+	out[0] = '\0';
+	for(bit = 0; bit < 32 && len + 1 < outLen; bit++) {
+		if(!(reason & (1U << bit))) continue;
+		if(names[bit]) {
+			len += snprintf(out + len, outLen - len, "%s%s", len ? "|" : "", names[bit]);
+		} else {
+			len += snprintf(out + len, outLen - len, "%s0x%x", len ? "|" : "", 1U << bit);
+		}
+	}
+	return len < outLen ? len : outLen - 1;
+}
+
+void usnJournalFree(USN_JOURNAL *journal) {
+	free(journal->extents);
+	free(journal->recordSectors);
+	usnJournalInit(journal);
+}
+
+#endif /* USNJOURNAL_H_ */
@@ -0,0 +1,200 @@
+/*
+ * VolumeBitmap.h
+ *
+ *      Author: Christopher Hicks
+ *
+ * The volume's cluster allocation bitmap, the $DATA of $Bitmap (MFT record 6):
+ * bit n is set if cluster n is in use. It is read once in the offline pass and
+ * then kept current from the guest's writes to $Bitmap's own clusters, so a
+ * write can be tested against it without touching the device. Bits are held in
+ * 64 bit words, least significant bit first, as they are on disk.
+ *
+ * Counts of allocated clusters are kept as words change, and runs of free
+ * clusters are found a word at a time, for free space queries.
+ */
+#ifndef VOLUMEBITMAP_H_
+#define VOLUMEBITMAP_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "RunList.h"
+
+#define BITMAP_RECORD	6		/*MFT record number of $Bitmap */
+
+/* Run of $Bitmap's own clusters */
+typedef struct _BITMAP_EXTENT {
+	int64_t		vcn;
+	int64_t		lcn;
+	int64_t		length;
+} BITMAP_EXTENT;
+
+typedef struct _VOLUME_BITMAP {
+	uint64_t		*bits;				/*NULL until $Bitmap is loaded */
+	uint64_t		nWords;
+	uint64_t		nClusters;			/*Clusters in the volume, from its boot sector */
+	uint64_t		nAllocated;
+	BITMAP_EXTENT	*extents;			/*Where $Bitmap is, to see writes to it */
+	uint32_t		nExtents;
+	uint64_t		countUpdates;		/*Writes to $Bitmap applied */
+	uint64_t		countDropped;		/*Writes to free clusters dropped */
+} VOLUME_BITMAP;
+
+int     bitmapLoad(VOLUME_BITMAP *bm, BYTE *data, uint64_t len, DataRun *runList);
+bool    bitmapAllocated(VOLUME_BITMAP *bm, uint64_t lcn);
+bool    bitmapRangeFree(VOLUME_BITMAP *bm, uint64_t lcn, uint64_t n);
+uint64_t bitmapCountAllocated(VOLUME_BITMAP *bm, uint64_t lcn, uint64_t n);
+int64_t bitmapVcn(VOLUME_BITMAP *bm, int64_t lcn);
+void    bitmapApply(VOLUME_BITMAP *bm, uint64_t offs, const BYTE *data, uint64_t len);
+uint64_t bitmapNextFree(VOLUME_BITMAP *bm, uint64_t lcn, uint64_t *runLength);
+void    bitmapFree(VOLUME_BITMAP *bm);
+
+/**
+ * Takes the $Bitmap data read from runList, len bytes of it, as the volume's
+ * bitmap. Bits past the last cluster are ignored. data must have been malloc'd.
+ */
+int bitmapLoad(VOLUME_BITMAP *bm, BYTE *data, uint64_t len, DataRun *runList) {
+	uint64_t nClusters = bm->nClusters && bm->nClusters < len*8 ? bm->nClusters : len*8;
+	uint64_t nWords = (nClusters + 63)/64, w;
+	DataRun *run;
+	int64_t vcn = 0, lcn = 0;
+
+	uint64_t *bits = realloc(data, nWords*sizeof(uint64_t) > len ? nWords*sizeof(uint64_t) : len);
+	if(bits == NULL) {
+		free(data);
+		return EXIT_FAILURE;
+	}
+	memset((BYTE *)bits + len, 0, nWords*sizeof(uint64_t) > len ? nWords*sizeof(uint64_t) - len : 0);
+	if(nClusters % 64) bits[nWords - 1] &= (1ULL << (nClusters % 64)) - 1;
+
+	bitmapFree(bm);
+	bm->bits = bits;
+	bm->nWords = nWords;
+	bm->nClusters = nClusters;
+	for(w = 0; w < nWords; w++) {
+		bm->nAllocated += __builtin_popcountll(bits[w]);
+	}
+	for(run = runList; run; run = run->p_next) {
+		bm->extents = realloc(bm->extents, (bm->nExtents + 1)*sizeof(BITMAP_EXTENT));
+		lcn += run->offset;
+		bm->extents[bm->nExtents].vcn = vcn;
+		bm->extents[bm->nExtents].lcn = lcn;
+		bm->extents[bm->nExtents++].length = run->length;
+		vcn += run->length;
+	}
+	return EXIT_SUCCESS;
+}
+
+bool bitmapAllocated(VOLUME_BITMAP *bm, uint64_t lcn) {
+	return lcn >= bm->nClusters || (bm->bits[lcn/64] >> (lcn % 64)) & 1;
+}
+
+/**
+ * Returns true if none of the n clusters from lcn are allocated. Clusters past
+ * the end of the volume count as allocated.
+ */
+bool bitmapRangeFree(VOLUME_BITMAP *bm, uint64_t lcn, uint64_t n) {
+	uint64_t end = lcn + n;
+	if(end > bm->nClusters || end < lcn) return false;
+	while(lcn < end) {
+		uint64_t bit = lcn % 64, span = 64 - bit < end - lcn ? 64 - bit : end - lcn;
+		uint64_t mask = (span == 64 ? ~0ULL : ((1ULL << span) - 1)) << bit;
+		if(bm->bits[lcn/64] & mask) return false;
+		lcn += span;
+	}
+	return true;
+}
+
+/**
+ * Counts the allocated clusters among the n from lcn. Clusters past the end of
+ * the volume count as allocated.
+ */
+uint64_t bitmapCountAllocated(VOLUME_BITMAP *bm, uint64_t lcn, uint64_t n) {
+	uint64_t end = lcn + n, count = 0;
+	if(end > bm->nClusters || end < lcn) {
+		if(lcn >= bm->nClusters) return n;
+		count = end < lcn ? n - (bm->nClusters - lcn) : end - bm->nClusters;
+		end = bm->nClusters;
+	}
+	while(lcn < end) {
+		uint64_t bit = lcn % 64, span = 64 - bit < end - lcn ? 64 - bit : end - lcn;
+		uint64_t mask = (span == 64 ? ~0ULL : ((1ULL << span) - 1)) << bit;
+		count += __builtin_popcountll(bm->bits[lcn/64] & mask);
+		lcn += span;
+	}
+	return count;
+}
+
+/**
+ * Returns the cluster of $Bitmap held in volume cluster lcn, or -1 if lcn is
+ * not part of $Bitmap.
+ */
+int64_t bitmapVcn(VOLUME_BITMAP *bm, int64_t lcn) {
+	uint32_t i;
+	for(i = 0; i < bm->nExtents; i++) {
+		BITMAP_EXTENT *ext = &bm->extents[i];
+		if(lcn >= ext->lcn && lcn < ext->lcn + ext->length) return ext->vcn + (lcn - ext->lcn);
+	}
+	return -1;
+}
+
+/**
+ * Copies len bytes written to $Bitmap at offset offs into the bitmap, keeping
+ * the count of allocated clusters.
+ */
+void bitmapApply(VOLUME_BITMAP *bm, uint64_t offs, const BYTE *data, uint64_t len) {
+	uint64_t nBytes = (bm->nClusters + 7)/8, w;
+	if(offs >= nBytes) return;
+	if(len > nBytes - offs) len = nBytes - offs;
+	uint64_t firstWord = offs/8, lastWord = (offs + len - 1)/8;
+	for(w = firstWord; w <= lastWord; w++) {
+		bm->nAllocated -= __builtin_popcountll(bm->bits[w]);
+	}
+	memcpy((BYTE *)bm->bits + offs, data, len);
+	if(lastWord == bm->nWords - 1 && bm->nClusters % 64) {
+		bm->bits[lastWord] &= (1ULL << (bm->nClusters % 64)) - 1;
+	}
+	for(w = firstWord; w <= lastWord; w++) {
+		bm->nAllocated += __builtin_popcountll(bm->bits[w]);
+	}
+}
+
+/**
+ * Finds the first free cluster at or after lcn and the length of the free run
+ * it starts.
+ *
+ * Returns the cluster, or nClusters if there are no free clusters after lcn.
+ */
+uint64_t bitmapNextFree(VOLUME_BITMAP *bm, uint64_t lcn, uint64_t *runLength) {
+	uint64_t w, start, end;
+	*runLength = 0;
+	if(lcn >= bm->nClusters) return bm->nClusters;
+
+	/*Skip allocated words, then find the first clear bit */
+	w = lcn/64;
+	uint64_t clear = ~bm->bits[w] & (~0ULL << (lcn % 64));
+	while(clear == 0 && ++w < bm->nWords) clear = ~bm->bits[w];
+	if(w >= bm->nWords) return bm->nClusters;
+	start = w*64 + __builtin_ctzll(clear);
+	if(start >= bm->nClusters) return bm->nClusters;
+
+	/*Then the first set bit after it */
+	uint64_t used = bm->bits[w] & (~0ULL << (start % 64));
+	while(used == 0 && ++w < bm->nWords) used = bm->bits[w];
+	end = w >= bm->nWords ? bm->nClusters : w*64 + __builtin_ctzll(used);
+	if(end > bm->nClusters) end = bm->nClusters;
+	*runLength = end - start;
+	return start;
+}
+
+void bitmapFree(VOLUME_BITMAP *bm) {
+	uint64_t nClusters = bm->nClusters;
+	free(bm->bits);
+	free(bm->extents);
+	memset(bm, 0, sizeof(VOLUME_BITMAP));
+	bm->nClusters = nClusters;		/*From the boot sector, not $Bitmap */
+}
+
+#endif /* VOLUMEBITMAP_H_ */
@@ -0,0 +1,274 @@
+/*
+ * enginetest.c
+ *
+ *      Author: Christopher Hicks
+ *
+ * Tests of the engine's parts which need no image, run by ctest:
+ *  - coalesce, the write coalescer: writes which repeat, overlap, abut and
+ *    bridge pending ranges, and the bytes and order of what is released.
+ *  - store, the extraction store's check for content unchanged since a
+ *    record's stream was last stored, across streams, reused records and
+ *    recovery.
+ *  - cluster_cache, the hits and misses of reads in and out of the regions
+ *    cached, over a memory backed device, and of reads after guest writes
+ *    are applied to it.
+ *
+ * The engine is compiled in whole, its own main renamed, as in ntfsbench.
+ *
+ * Usage: enginetest coalesce|store|cluster_cache
+ */
+#define main extractionEngineMain
+#include "../RawNTFSExtraction.c"
+#undef main
+
+#define TEST_MAX_SECTORS	32		/*16 records of 1024 bytes */
+#define TEST_CACHE_BLOCKS	32		/*Blocks of the cluster cache test's device, the first half cached */
+#define TEST_BLOCK_SECTORS	(CCACHE_BLOCK/UDS_SECTOR_SIZE)
+
+static int testFailures = 0;
+
+#define TEST_CHECK(cond) do { \
+	if(!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		testFailures++; \
+	} \
+} while(0)
+
+/**
+ * Returns a write of nSectors at sectorN whose payload is every byte fill.
+ */
+static WRITE_EVENT testWrite(int64_t sectorN, int nSectors, BYTE fill) {
+	WRITE_EVENT w = { sectorN, nSectors, 0, malloc( (size_t)nSectors*UDS_SECTOR_SIZE ) };
+	memset(w.payload, fill, (size_t)nSectors*UDS_SECTOR_SIZE);
+	return w;
+}
+
+/**
+ * Whether every byte of sectors [from, to) of a released write is fill.
+ */
+static bool testSectors(WRITE_EVENT *w, int64_t from, int64_t to, BYTE fill) {
+	int64_t k;
+	if(w->payload == NULL || from < w->sectorN || to > w->sectorN + w->nSectors) return false;
+	for(k = (from - w->sectorN)*UDS_SECTOR_SIZE; k < (to - w->sectorN)*UDS_SECTOR_SIZE; k++) {
+		if(w->payload[k] != fill) return false;
+	}
+	return true;
+}
+
+static void testCoalesce(void) {
+	COALESCER c;
+	WRITE_EVENT out[COALESCE_SLOTS];
+	uint32_t n;
+
+	/* A third write bridging the first two joins them, its bytes over theirs */
+	coalesceInit(&c, 100);
+	TEST_CHECK(coalesceAdd(&c, testWrite(0, 4, 'a'), 1, 2, TEST_MAX_SECTORS));
+	TEST_CHECK(coalesceAdd(&c, testWrite(8, 4, 'b'), 2, 2, TEST_MAX_SECTORS));
+	TEST_CHECK(c.nPending == 2);
+	TEST_CHECK(coalesceAdd(&c, testWrite(2, 8, 'c'), 3, 2, TEST_MAX_SECTORS));
+	TEST_CHECK(c.nPending == 1);
+	n = coalesceRelease(&c, 4, true, out, COALESCE_SLOTS);
+	TEST_CHECK(n == 1);
+	if(n == 1) {
+		TEST_CHECK(out[0].sectorN == 0 && out[0].nSectors == 12);
+		TEST_CHECK(testSectors(&out[0], 0, 2, 'a'));
+		TEST_CHECK(testSectors(&out[0], 2, 10, 'c'));
+		TEST_CHECK(testSectors(&out[0], 10, 12, 'b'));
+		free(out[0].payload);
+	}
+	TEST_CHECK(coalesceRatio(&c) == 3.0);
+
+	/* Repeats of one range keep the last bytes written */
+	coalesceInit(&c, 100);
+	TEST_CHECK(coalesceAdd(&c, testWrite(100, 2, 'a'), 1, 2, TEST_MAX_SECTORS));
+	TEST_CHECK(coalesceAdd(&c, testWrite(100, 2, 'b'), 2, 2, TEST_MAX_SECTORS));
+	n = coalesceRelease(&c, 3, true, out, COALESCE_SLOTS);
+	TEST_CHECK(n == 1 && testSectors(&out[0], 100, 102, 'b'));
+	if(n == 1) free(out[0].payload);
+
+	/* A write overlapping a range it cannot be merged with waits for the release */
+	coalesceInit(&c, 100);
+	TEST_CHECK(coalesceAdd(&c, testWrite(0, TEST_MAX_SECTORS, 'a'), 1, 2, TEST_MAX_SECTORS));
+	WRITE_EVENT over = testWrite(TEST_MAX_SECTORS - 2, 4, 'b');
+	TEST_CHECK(!coalesceAdd(&c, over, 2, 2, TEST_MAX_SECTORS));
+	n = coalesceRelease(&c, 3, true, out, COALESCE_SLOTS);
+	TEST_CHECK(n == 1 && testSectors(&out[0], 0, TEST_MAX_SECTORS, 'a'));
+	if(n == 1) free(out[0].payload);
+	TEST_CHECK(coalesceAdd(&c, over, 4, 2, TEST_MAX_SECTORS));
+	n = coalesceRelease(&c, 5, true, out, COALESCE_SLOTS);
+	TEST_CHECK(n == 1 && testSectors(&out[0], TEST_MAX_SECTORS - 2, TEST_MAX_SECTORS + 2, 'b'));
+	if(n == 1) free(out[0].payload);
+
+	/* One only abutting a full range is kept apart, and released after it */
+	coalesceInit(&c, 100);
+	TEST_CHECK(coalesceAdd(&c, testWrite(0, TEST_MAX_SECTORS, 'a'), 1, 2, TEST_MAX_SECTORS));
+	TEST_CHECK(coalesceAdd(&c, testWrite(TEST_MAX_SECTORS, 2, 'b'), 2, 2, TEST_MAX_SECTORS));
+	n = coalesceRelease(&c, 3, true, out, COALESCE_SLOTS);
+	TEST_CHECK(n == 2);
+	if(n == 2) {
+		TEST_CHECK(out[0].sectorN == 0 && out[1].sectorN == TEST_MAX_SECTORS);
+		free(out[0].payload);
+		free(out[1].payload);
+	}
+
+	/* With 4096 byte records, ranges are merged up to the cap for them */
+	coalesceInit(&c, 100);
+	TEST_CHECK(coalesceAdd(&c, testWrite(0, 8, 'a'), 1, 8, 16*8));
+	TEST_CHECK(coalesceAdd(&c, testWrite(8, 8, 'b'), 2, 8, 16*8));
+	TEST_CHECK(coalesceAdd(&c, testWrite(16, 16*8, 'c'), 3, 8, 16*8));
+	n = coalesceRelease(&c, 4, true, out, COALESCE_SLOTS);
+	TEST_CHECK(n == 2 && out[0].nSectors == 16 && out[1].nSectors == 16*8);
+	for(; n > 0; n--) free(out[n - 1].payload);
+
+	/* A write without its payload leaves the union to be read from the device */
+	coalesceInit(&c, 100);
+	TEST_CHECK(coalesceAdd(&c, testWrite(0, 2, 'a'), 1, 2, TEST_MAX_SECTORS));
+	WRITE_EVENT bare = { 2, 2, 0, NULL };
+	TEST_CHECK(coalesceAdd(&c, bare, 2, 2, TEST_MAX_SECTORS));
+	n = coalesceRelease(&c, 3, true, out, COALESCE_SLOTS);
+	TEST_CHECK(n == 1 && out[0].nSectors == 4 && out[0].payload == NULL);
+}
+
+static void testStore(void) {
+	EXTRACT_STORE store;
+	const char a[] = "first content", b[] = "second content";
+
+	storeInit(&store, NULL);	/*Digests only, nothing written */
+	TEST_CHECK(storePut(&store, 40, 1, 0, "f.txt", a, sizeof(a)) == STORE_NEWBLOB);
+	TEST_CHECK(storePut(&store, 40, 1, 0, "f.txt", a, sizeof(a)) == STORE_UNCHANGED);
+
+	/* Streams of one record are each compared with their own last content */
+	TEST_CHECK(storePut(&store, 40, 1, 0, "f.txt:ads", b, sizeof(b)) == STORE_NEWBLOB);
+	TEST_CHECK(storePut(&store, 40, 1, 0, "f.txt", a, sizeof(a)) == STORE_UNCHANGED);
+	TEST_CHECK(storePut(&store, 40, 1, 0, "f.txt:ads", b, sizeof(b)) == STORE_UNCHANGED);
+	TEST_CHECK(storePut(&store, 40, 1, 0, "f.txt:other", b, sizeof(b)) == STORE_NEWREF);
+
+	/* Record numbers far apart, and more streams than the set first holds */
+	TEST_CHECK(storePut(&store, UINT32_MAX, 1, 0, "g", a, sizeof(a)) == STORE_NEWREF);
+	uint32_t r;
+	for(r = 0; r < 2*STORE_SET_INIT; r++) {
+		storePut(&store, r, 1, 0, "h", b, sizeof(b));
+	}
+	TEST_CHECK(storePut(&store, UINT32_MAX, 1, 0, "g", a, sizeof(a)) == STORE_UNCHANGED);
+	TEST_CHECK(storePut(&store, 40, 1, 0, "f.txt:ads", b, sizeof(b)) == STORE_UNCHANGED);
+	TEST_CHECK(storePut(&store, 40, 1, 0, "f.txt", a, sizeof(a)) == STORE_NEWREF);
+	TEST_CHECK(store.countNewBlob == 2);
+
+	/* A record reused for another file is stored though its content is the same */
+	TEST_CHECK(storePut(&store, 40, 2, 0, "f.txt", a, sizeof(a)) == STORE_NEWREF);
+	TEST_CHECK(storePut(&store, 40, 2, 0, "f.txt", a, sizeof(a)) == STORE_UNCHANGED);
+
+	/* Recovering the deleted file of a record leaves its live content the last */
+	TEST_CHECK(storeRecovered(&store, 50, 3, 0, "d.txt", b, sizeof(b)) == STORE_NEWREF);
+	TEST_CHECK(storePut(&store, 50, 3, 0, "d.txt", b, sizeof(b)) == STORE_NEWREF);
+	TEST_CHECK(storeRecovered(&store, 40, 2, 0, "f.txt", b, sizeof(b)) == STORE_NEWREF);
+	TEST_CHECK(storePut(&store, 40, 2, 0, "f.txt", a, sizeof(a)) == STORE_UNCHANGED);
+	storeClose(&store);
+}
+
+/**
+ * Whether the cluster cache has counted hits hits and misses misses in all.
+ */
+static bool testCacheCounts(uint64_t hits, uint64_t misses) {
+	return clusterCacheHits() == hits && clusterCacheMisses() == misses;
+}
+
+static void testClusterCache(void) {
+	BYTE buff[3*CCACHE_BLOCK];
+	uint32_t b;
+	int dev = memfd_create("cachedev", 0);
+
+	/* Each block of the device is filled with its number */
+	TEST_CHECK(dev != -1);
+	TEST_CHECK(clusterCacheInit(&clusterCache, CCACHE_SHARDS*4*CCACHE_BLOCK) == EXIT_SUCCESS);
+	for(b = 0; b < TEST_CACHE_BLOCKS; b++) {
+		memset(buff, b, CCACHE_BLOCK);
+		TEST_CHECK(pwrite(dev, buff, CCACHE_BLOCK, (off_t)b*CCACHE_BLOCK) == CCACHE_BLOCK);
+	}
+	TEST_CHECK(clusterCacheRegion(&clusterCache, 0, 0, TEST_CACHE_BLOCKS/2*CCACHE_BLOCK) == EXIT_SUCCESS);
+
+	/* A block in the region misses once, then hits */
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, 1024, 2*CCACHE_BLOCK + 512) == 1024 && buff[0] == 2);
+	TEST_CHECK(testCacheCounts(0, 1));
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, 1024, 2*CCACHE_BLOCK + 512) == 1024 && buff[0] == 2);
+	TEST_CHECK(testCacheCounts(1, 1));
+
+	/* Blocks outside it, or of another volume, are read around the cache */
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, CCACHE_BLOCK, 20*CCACHE_BLOCK) == CCACHE_BLOCK && buff[0] == 20);
+	TEST_CHECK(clusterCacheRead(&clusterCache, 1, dev, buff, CCACHE_BLOCK, 2*CCACHE_BLOCK) == CCACHE_BLOCK && buff[0] == 2);
+	TEST_CHECK(testCacheCounts(1, 1));
+
+	/* A read across the region's end caches only the blocks in it */
+	for(b = 0; b < 2; b++) {
+		TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, sizeof(buff), 14*CCACHE_BLOCK) == sizeof(buff));
+		TEST_CHECK(buff[0] == 14 && buff[CCACHE_BLOCK] == 15 && buff[2*CCACHE_BLOCK] == 16);
+	}
+	TEST_CHECK(testCacheCounts(3, 3));
+
+	/* A write's payload is copied into the blocks cached, and caches those written whole */
+	WRITE_EVENT w = testWrite(2*TEST_BLOCK_SECTORS + 1, 2, 'p');
+	clusterCacheWrites(&clusterCache, &w, 1);
+	free(w.payload);
+	w = testWrite(5*TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, 'q');
+	clusterCacheWrites(&clusterCache, &w, 1);
+	free(w.payload);
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, CCACHE_BLOCK, 2*CCACHE_BLOCK) == CCACHE_BLOCK);
+	TEST_CHECK(buff[511] == 2 && buff[512] == 'p' && buff[1535] == 'p' && buff[1536] == 2);
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, CCACHE_BLOCK, 5*CCACHE_BLOCK) == CCACHE_BLOCK);
+	TEST_CHECK(buff[0] == 'q' && buff[CCACHE_BLOCK - 1] == 'q');
+	TEST_CHECK(testCacheCounts(5, 3));
+
+	/* One without, read by the consumer past the cache, updates the blocks cached with what it read */
+	memset(buff, 'n', CCACHE_BLOCK);
+	TEST_CHECK(pwrite(dev, buff, 1024, 2*CCACHE_BLOCK + 2048) == 1024);
+	TEST_CHECK(clusterCacheReload(&clusterCache, 0, dev, buff, 1024, 2*CCACHE_BLOCK + 2048) == 1024);
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, CCACHE_BLOCK, 2*CCACHE_BLOCK) == CCACHE_BLOCK);
+	TEST_CHECK(buff[512] == 'p' && buff[2047] == 2 && buff[2048] == 'n' && buff[3071] == 'n' && buff[3072] == 2);
+	TEST_CHECK(testCacheCounts(6, 3));
+
+	/* One never consumed without its payload drops the blocks it wrote, to be read again */
+	memset(buff, 'd', CCACHE_BLOCK);
+	TEST_CHECK(pwrite(dev, buff, CCACHE_BLOCK, 2*CCACHE_BLOCK) == CCACHE_BLOCK);
+	WRITE_EVENT bare = { 2*TEST_BLOCK_SECTORS, 1, 0, NULL };
+	clusterCacheWrites(&clusterCache, &bare, 1);
+	TEST_CHECK(clusterCacheInvalidated() == 1);
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, CCACHE_BLOCK, 2*CCACHE_BLOCK) == CCACHE_BLOCK && buff[0] == 'd');
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, CCACHE_BLOCK, 2*CCACHE_BLOCK) == CCACHE_BLOCK && buff[0] == 'd');
+	TEST_CHECK(testCacheCounts(7, 4));
+
+	/* Malformed writes are skipped, not walked block by block */
+	WRITE_EVENT bad[2] = { { 1, -1, 0, NULL }, { -TEST_BLOCK_SECTORS, 1, 0, NULL } };
+	clusterCacheWrites(&clusterCache, bad, 2);
+	TEST_CHECK(clusterCacheInvalidated() == 1);
+
+	/* Nor are writes outside the region cached */
+	w = testWrite(20*TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, 'r');
+	clusterCacheWrites(&clusterCache, &w, 1);
+	free(w.payload);
+	TEST_CHECK(clusterCacheRead(&clusterCache, 0, dev, buff, CCACHE_BLOCK, 20*CCACHE_BLOCK) == CCACHE_BLOCK && buff[0] == 20);
+	TEST_CHECK(testCacheCounts(7, 4));
+
+	clusterCacheFree(&clusterCache);
+	close(dev);
+}
+
+int main(int argc, char* argv[]) {
+	if(argc != 2) {
+		printf("Usage: enginetest coalesce|store|cluster_cache\n");
+		return EXIT_FAILURE;
+	}
+	logInit(LOG_LVL_ERROR, NULL);
+	if(strcmp(argv[1], "coalesce") == 0) {
+		testCoalesce();
+	} else if(strcmp(argv[1], "store") == 0) {
+		testStore();
+	} else if(strcmp(argv[1], "cluster_cache") == 0) {
+		testClusterCache();
+	} else {
+		printf("Unknown test %s.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	logClose();
+	printf("%s: %d failed checks.\n", argv[1], testFailures);
+	return testFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
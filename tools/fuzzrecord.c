@@ -0,0 +1,138 @@
+/*
+ * fuzzrecord.c
+ *
+ *      Author: Christopher Hicks
+ *
+ * Fuzzes the MFT record parsers with libFuzzer. Each input is one MFT record,
+ * as a guest may write it: 1024 bytes, or 4096 if it is longer than 1024, cut
+ * or zero padded to that length:
+ *  - its update sequence fixups are applied, unless torn, its attributes are
+ *    walked with attrNext, and each is handed to the parser for its type:
+ *    $STANDARD_INFORMATION and $FILE_NAME contents, attribute names, $DATA
+ *    fingerprints and run lists,
+ *  - each $DATA attribute is extracted by extractDataAttr, its runs read from
+ *    an in-memory device into a store which keeps only digests,
+ *  - the record is mapped as the $UsnJrnl record,
+ *  - and the record is passed to consumeWrite as the payload of a guest write,
+ *    extracting its files whatever their modify times.
+ *
+ * The engine is compiled in whole, its own main renamed, as in ntfsbench.
+ *
+ * Built with -DFUZZ=ON. With clang, libFuzzer supplies main:
+ *   fuzzrecord corpus/
+ * Other compilers build a driver which runs each input file named once, under
+ * the address and undefined behaviour sanitizers, to replay a corpus or crash:
+ *   fuzzrecord crash-1234 more-inputs...
+ */
+#define main extractionEngineMain
+#include "../RawNTFSExtraction.c"
+#undef main
+
+#define FUZZ_CLUSTER	4096
+#define FUZZ_DEV_SIZE	(64*FUZZ_CLUSTER)	/*Device the run lists are read from */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	char record[MFT_RECORD_MAX];
+	NTFS_MFT_FILE_ENTRY_HEADER header;
+	NTFS_ATTRIBUTE *attr;
+	ATTR_ITER it;
+	USN_JOURNAL journal;
+
+	dwMFTRecordLength = size > MFT_RECORD_LENGTH ? MFT_RECORD_MAX : MFT_RECORD_LENGTH;
+	memset(record, 0, sizeof(record));
+	memcpy(record, data, size < dwMFTRecordLength ? size : dwMFTRecordLength);
+	WRITE_EVENT write = { 0, dwMFTRecordLength/SECTOR_SIZE, 0, malloc( dwMFTRecordLength ) };
+	memcpy(write.payload, record, dwMFTRecordLength);	/*As written, before the fixups */
+	recordFixup(record, dwMFTRecordLength);
+	memcpy(&header, record, sizeof(header));
+
+	attrIterInit(&it, record, dwMFTRecordLength);
+	while((attr = attrNext(&it))) {
+		char *attrBase = record + it.offs;
+		char *name = getAttrName(attr, attrBase);
+		free(name);
+		if(attr->dwType == STANDARD_INFORMATION) {
+			STD_INFORMATION stdInfo;
+			attrResidentCopy(attr, &stdInfo, sizeof(stdInfo));
+		} else if(attr->dwType == FILE_NAME) {
+			int64_t fnHead[1 + FTIME_FIELDS];
+			attrResidentCopy(attr, fnHead, sizeof(fnHead));
+			free(getFileName(attr, record, it.offs));
+			getFileNameSpace(attr, record, it.offs);
+		} else if(attr->dwType == DATA) {
+			uint64_t dataSize;
+			dataAttrFingerprint(attr, attrBase, &dataSize);
+			if(attr->uchNonResFlag) {
+				bool bad;
+				freeRunList(decodeRunList((uint8_t *)attrBase + (attr->Attr).NonResident.wDatarunOffset,
+										  (uint8_t *)attrBase + attr->dwFullLength, &bad));
+			}
+			extractDataAttr(&header, attr, "fuzz");
+		}
+	}
+
+	memset(&journal, 0, sizeof(journal));
+	usnJournalMap(&journal, (BYTE *)record, dwMFTRecordLength);
+	free(journal.extents);
+
+	consumeWrite(write);	/*Takes the payload */
+	return 0;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+	BYTE cluster[FUZZ_CLUSTER];
+	uint32_t c;
+
+	logLevel = LOG_LVL_ERROR;
+	maxFileModifyAge = UINT64_MAX;		/*Every file is recent enough to extract */
+	maxExtractSize = FUZZ_DEV_SIZE;
+	recCacheInit(recCache);
+	recCacheLimit(recCache, FUZZ_DEV_SIZE/MFT_RECORD_LENGTH);	/*As mountVolume limits it to the device */
+	storeInit(extStore, NULL);
+
+	/*The device: clusters each filled with their own number */
+	int dev = memfd_create("fuzzdev", 0);
+	if(dev == -1) {
+		int errsv = errno;
+		printf("Failed to create the fuzz device: %s.\n", strerror(errsv));
+		exit(EXIT_FAILURE);
+	}
+	for(c = 0; c < FUZZ_DEV_SIZE/FUZZ_CLUSTER; c++) {
+		memset(cluster, (int)c, sizeof(cluster));
+		if(write(dev, cluster, sizeof(cluster)) != sizeof(cluster)) {
+			printf("Failed to fill the fuzz device.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	blkDevDescriptor = dev;
+	dwBytesPerCluster = FUZZ_CLUSTER;
+	relativePartSector = 0;
+	endOfDev = FUZZ_DEV_SIZE;
+	return 0;
+}
+
+#ifdef FUZZ_REPLAY
+/**
+ * Runs each input file once, for builds without libFuzzer.
+ */
+int main(int argc, char **argv) {
+	uint8_t *data = malloc( MFT_RECORD_MAX );
+	int i;
+
+	LLVMFuzzerInitialize(&argc, &argv);
+	for(i = 1; i < argc; i++) {
+		FILE *in = fopen(argv[i], "rb");
+		if(in == NULL) {
+			int errsv = errno;
+			printf("Failed to open %s: %s.\n", argv[i], strerror(errsv));
+			continue;
+		}
+		size_t size = fread(data, 1, MFT_RECORD_MAX, in);
+		fclose(in);
+		LLVMFuzzerTestOneInput(data, size);
+	}
+	printf("Ran %d inputs.\n", argc - 1);
+	free(data);
+	return EXIT_SUCCESS;
+}
+#endif
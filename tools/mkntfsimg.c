@@ -0,0 +1,712 @@
+/*
+ * mkntfsimg.c
+ *
+ *      Author: Christopher Hicks
+ *
+ * Writes a synthetic NTFS disk image for benchmarking: an MBR with one NTFS
+ * partition, its boot sector and an $MFT of FILE records with $STANDARD_INFORMATION,
+ * $FILE_NAME and resident or non-resident $DATA. Only the structures the
+ * extraction engine reads are written; the only other metadata files are $UpCase,
+ * folding ASCII and Latin-1 letters, $Bitmap, marking the clusters allocated,
+ * and the change journal $Extend\$UsnJrnl, whose sparse $J stream holds a few
+ * USN records followed by free clusters. Entries are placed in the root directory
+ * or in a directory made before them, giving a tree of paths. Deleted records
+ * keep their $DATA, with its clusters free in $Bitmap unless reused since.
+ * Some files also have an 8.3 short name, or hard links in other directories.
+ * The same seed always gives the same image.
+ *
+ * The disk has 512 byte sectors and 1024 byte MFT records unless -S 4096 gives
+ * it 4K native sectors, counted in 4096 bytes by the MBR and boot sector, or
+ * -R 4096 gives it 4096 byte records. Clusters are 4096 bytes either way.
+ *
+ * Optionally writes a trace of guest writes to MFT records, one "sector nSectors"
+ * pair per line, for replay through shmtap or ntfsbench. Trace sectors are 512
+ * bytes, whatever the disk's own.
+ *
+ * Usage: mkntfsimg -o image [-n records] [-r resident%] [-d deleted%] [-D directory%]
+ *                  [-c maxClusters] [-f fileFragments] [-m mftFragments]
+ *                  [-p partition] [-s seed] [-S sectorSize] [-R recordSize]
+ *                  [-w trace -W writes]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../NTFSStruct.h"
+#include "../NTFSAttributes.h"
+#include "../UsnJournal.h"
+
+#define IMG_SECTOR_SIZE		512			/*Unit of trace sectors and of the update sequence stride */
+#define IMG_SEC_PER_CLUS	8
+#define IMG_CLUSTER_SIZE	(IMG_SECTOR_SIZE*IMG_SEC_PER_CLUS)
+#define IMG_RECORD_SIZE		1024		/*Default MFT record length */
+#define IMG_RECORD_MAX		4096
+#define IMG_RECS_PER_CLUS	(IMG_CLUSTER_SIZE/recordSize)
+#define IMG_PART_START		2048		/*Partition starts 1MiB into the disk, in 512 byte sectors */
+#define IMG_MFT_LCN			16			/*First cluster of the $MFT */
+#define IMG_FRAG_GAP		8			/*Clusters left free between fragments */
+#define IMG_MAX_RESIDENT	600			/*Largest resident $DATA written */
+#define IMG_MAX_FRAGS		64
+#define IMG_ATTR_RES_HDR	24			/*Resident attribute header length */
+#define IMG_ATTR_NONRES_HDR	64			/*Non-resident attribute header length */
+#define IMG_USN				1			/*Update sequence number in the fixups */
+#define IMG_IN_USE			0x01		/*MFT FILE0 record flags */
+#define IMG_DIRECTORY		0x02
+#define IMG_BITMAP_REC		6			/*MFT record number of $Bitmap */
+#define IMG_UPCASE_REC		10			/*MFT record number of $UpCase */
+#define IMG_ROOT_REC		5			/*MFT record number of the root directory */
+#define IMG_MAX_DIRS		4096		/*Directories files are placed in */
+#define IMG_MAX_AGE			(365*86400)	/*Files were created up to a year ago, in seconds */
+#define IMG_UPCASE_SIZE		(65536*2)	/*One UTF-16 unit per UTF-16 unit */
+#define IMG_EXTEND_REC		11			/*MFT record number of $Extend */
+#define IMG_USNJRNL_REC		12			/*MFT record of $UsnJrnl, in $Extend */
+#define IMG_USN_SPARSE		16			/*Released clusters at the head of $J */
+#define IMG_ZONE_STREAM		"Zone.Identifier"	/*Alternate data stream given to some files */
+#define IMG_ZONE_DATA		"[ZoneTransfer]\r\nZoneId=3\r\n"
+#define IMG_USN_CLUSTERS	16			/*Allocated clusters after them */
+#define IMG_MAX_LINKS		2			/*Hard links given to a file, besides its own name */
+#define IMG_USN_RECORDS		8			/*USN records already in $J */
+
+typedef struct _IMG_RUN {
+	int64_t		lcn;
+	int64_t		length;
+} IMG_RUN;
+
+typedef struct _IMG_OPTS {
+	const char	*imagePath;
+	const char	*tracePath;
+	uint32_t	nRecords;
+	uint32_t	residentPct;
+	uint32_t	deletedPct;
+	uint32_t	directoryPct;
+	uint32_t	maxClusters;
+	uint32_t	fileFrags;
+	uint32_t	mftFrags;
+	uint32_t	partition;
+	uint32_t	seed;
+	uint32_t	nWrites;
+} IMG_OPTS;
+
+static IMG_RUN mftRuns[IMG_MAX_FRAGS];
+static uint32_t nMftRuns = 0;
+static int64_t nextFreeLcn = 0;
+static uint64_t nextLsn = 0x100000;
+static BYTE *clusterBitmap = NULL;		/*Clusters allocated so far, for $Bitmap */
+static int64_t clusterBitmapLen = 0;
+static uint32_t diskSecSize = IMG_SECTOR_SIZE;	/*Bytes per sector of the disk, -S */
+static uint32_t recordSize = IMG_RECORD_SIZE;	/*Bytes per MFT record, -R */
+
+/**
+ * Returns the number of bytes needed to store val as a little-endian signed value.
+ */
+static int runFieldSize(int64_t val, bool isSigned) {
+	int n = 1;
+	while(n < 8) {
+		int64_t lo = isSigned ? -((int64_t)1 << (8*n - 1)) : 0;
+		int64_t hi = isSigned ? ((int64_t)1 << (8*n - 1)) - 1 : ((int64_t)1 << (8*n)) - 1;
+		if(val >= lo && val <= hi) break;
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Encodes runs as an NTFS run list with relative offsets. Runs with an lcn of -1
+ * are sparse and have no offset. Returns its length, including the terminating zero.
+ */
+static uint32_t encodeRunList(BYTE *out, IMG_RUN *runs, uint32_t nRuns) {
+	uint32_t len = 0, i;
+	int64_t prevLcn = 0;
+	for(i = 0; i < nRuns; i++) {
+		int64_t delta = runs[i].lcn - prevLcn;
+		int lenSize = runFieldSize(runs[i].length, false);
+		int offsSize = runs[i].lcn < 0 ? 0 : runFieldSize(delta, true);
+		out[len++] = (BYTE)((offsSize << 4) | lenSize);
+		memcpy(out + len, &runs[i].length, lenSize);
+		len += lenSize;
+		memcpy(out + len, &delta, offsSize);
+		len += offsSize;
+		if(runs[i].lcn >= 0) prevLcn = runs[i].lcn;
+	}
+	out[len++] = 0;
+	return len;
+}
+
+/**
+ * Marks len clusters from lcn allocated in clusterBitmap.
+ */
+static void markAllocated(int64_t lcn, int64_t len) {
+	int64_t c;
+	if((lcn + len + 7)/8 > clusterBitmapLen) {
+		int64_t newLen = clusterBitmapLen ? clusterBitmapLen : 4096;
+		while(newLen < (lcn + len + 7)/8) newLen *= 2;
+		clusterBitmap = realloc(clusterBitmap, newLen);
+		memset(clusterBitmap + clusterBitmapLen, 0, newLen - clusterBitmapLen);
+		clusterBitmapLen = newLen;
+	}
+	for(c = lcn; c < lcn + len; c++) {
+		clusterBitmap[c/8] |= 1 << (c % 8);
+	}
+}
+
+/**
+ * Marks len clusters from lcn free again, as deleting a file does.
+ */
+static void markFree(int64_t lcn, int64_t len) {
+	int64_t c;
+	for(c = lcn; c < lcn + len && (c + 8)/8 <= clusterBitmapLen; c++) {
+		clusterBitmap[c/8] &= ~(1 << (c % 8));
+	}
+}
+
+/**
+ * Allocates nClusters split into up to nFrags runs, each after a gap.
+ */
+static uint32_t allocRuns(IMG_RUN *runs, int64_t nClusters, uint32_t nFrags) {
+	uint32_t i, n = 0;
+	if(nFrags > nClusters) nFrags = (uint32_t)nClusters;
+	if(nFrags > IMG_MAX_FRAGS) nFrags = IMG_MAX_FRAGS;
+	for(i = 0; i < nFrags; i++) {
+		int64_t len = nClusters/nFrags + (i < nClusters % nFrags ? 1 : 0);
+		runs[n].lcn = nextFreeLcn;
+		runs[n].length = len;
+		markAllocated(nextFreeLcn, len);
+		nextFreeLcn += len + (i + 1 < nFrags ? IMG_FRAG_GAP : 1);
+		n++;
+	}
+	return n;
+}
+
+static uint32_t align8(uint32_t n) {
+	return (n + 7) & ~7U;
+}
+
+/**
+ * Writes an attribute's name, if it has one, after its header of hdrLen bytes.
+ * Returns the offset its content or run list starts at.
+ */
+static uint32_t attrName(NTFS_ATTRIBUTE *attr, uint32_t hdrLen, const char *name) {
+	uint32_t k, len = name ? strlen(name) : 0;
+	uint16_t *unicodeName = (uint16_t *)((BYTE *)attr + hdrLen);
+	for(k = 0; k < len; k++) {
+		unicodeName[k] = (uint16_t)name[k];
+	}
+	attr->uchNameLength = len;
+	attr->wNameOffset = len ? hdrLen : 0;
+	return align8(hdrLen + 2*len);
+}
+
+/**
+ * Appends a resident attribute holding len bytes of content, called name or
+ * unnamed if name is NULL. Returns its length.
+ */
+static uint32_t addResidentAttr(BYTE *rec, uint32_t offs, uint32_t type, uint16_t id, const char *name,
+								const void *content, uint32_t len) {
+	NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(rec + offs);
+	uint32_t contentOffs = align8(IMG_ATTR_RES_HDR + 2*(name ? strlen(name) : 0));
+	uint32_t fullLen = align8(contentOffs + len);
+	memset(attr, 0, fullLen);
+	attr->dwType = type;
+	attr->dwFullLength = fullLen;
+	attr->uchNonResFlag = false;
+	attr->wID = id;
+	attr->Attr.Resident.dwLength = len;
+	attr->Attr.Resident.wAttrOffset = attrName(attr, IMG_ATTR_RES_HDR, name);
+	memcpy(rec + offs + contentOffs, content, len);
+	return fullLen;
+}
+
+/**
+ * Appends a non-resident $DATA attribute for runs, called name or unnamed if
+ * name is NULL. Returns its length.
+ */
+static uint32_t addNonResidentData(BYTE *rec, uint32_t offs, uint16_t id, const char *name,
+								   IMG_RUN *runs, uint32_t nRuns, uint64_t realSize) {
+	NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(rec + offs);
+	BYTE runList[IMG_MAX_FRAGS*17 + 1];
+	uint32_t runLen = encodeRunList(runList, runs, nRuns);
+	uint32_t runOffs = align8(IMG_ATTR_NONRES_HDR + 2*(name ? strlen(name) : 0));
+	uint32_t fullLen = align8(runOffs + runLen);
+	int64_t nClusters = 0;
+	uint32_t i;
+	for(i = 0; i < nRuns; i++) nClusters += runs[i].length;
+
+	memset(attr, 0, fullLen);
+	attr->dwType = DATA;
+	attr->dwFullLength = fullLen;
+	attr->uchNonResFlag = true;
+	attr->wID = id;
+	attr->Attr.NonResident.n64StartVCN = 0;
+	attr->Attr.NonResident.n64EndVCN = nClusters - 1;
+	attr->Attr.NonResident.wDatarunOffset = attrName(attr, IMG_ATTR_NONRES_HDR, name);
+	attr->Attr.NonResident.n64AllocSize = nClusters*IMG_CLUSTER_SIZE;
+	attr->Attr.NonResident.n64RealSize = realSize;
+	attr->Attr.NonResident.n64StreamSize = realSize;
+	memcpy(rec + offs + runOffs, runList, runLen);
+	return fullLen;
+}
+
+/**
+ * Fills in the record header, the end marker and the update sequence fixups.
+ */
+static void finishRecord(BYTE *rec, uint32_t recN, uint16_t flags, uint32_t usedLen, uint16_t nextAttrId,
+						 uint16_t nLinks) {
+	NTFS_MFT_FILE_ENTRY_HEADER *hdr = (NTFS_MFT_FILE_ENTRY_HEADER *)rec;
+	uint16_t *fixups = (uint16_t *)(rec + sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
+	uint32_t s;
+
+	memset(rec + usedLen, 0xFF, 4);		/*End of attributes marker */
+	usedLen += 8;
+
+	memcpy(hdr->fileSignature, "FILE", 4);
+	hdr->wFixupOffset = sizeof(NTFS_MFT_FILE_ENTRY_HEADER);
+	hdr->wFixupSize = 1 + recordSize/IMG_SECTOR_SIZE;
+	hdr->n64LogSeqNumber = nextLsn;
+	nextLsn += 0x40 + rand() % 0x1000;
+	hdr->wSequence = 1 + rand() % 4;
+	hdr->wHardLinks = nLinks;
+	hdr->wAttribOffset = align8(sizeof(NTFS_MFT_FILE_ENTRY_HEADER) + 2*hdr->wFixupSize);
+	hdr->wFlags = flags;
+	hdr->dwRecLength = usedLen;
+	hdr->dwAllLength = recordSize;
+	hdr->n64BaseMftRec = 0;
+	hdr->wNextAttrID = nextAttrId;
+	hdr->dwMFTRecNumber = recN;
+
+	fixups[0] = IMG_USN;
+	for(s = 0; s < recordSize/IMG_SECTOR_SIZE; s++) {
+		uint16_t *sectorEnd = (uint16_t *)(rec + (s + 1)*IMG_SECTOR_SIZE - 2);
+		fixups[1 + s] = *sectorEnd;
+		*sectorEnd = IMG_USN;
+	}
+}
+
+/**
+ * Builds a $FILE_NAME attribute's content for name in namespace nameSpace.
+ * Returns its length.
+ */
+static uint32_t fileNameContent(FILE_NAME_ATTR *fn, const char *name, uint32_t parent, uint64_t ntfsTime,
+								uint64_t size, bool isDir, BYTE nameSpace) {
+	uint32_t k, len = strlen(name);
+	memset(fn, 0, sizeof(FILE_NAME_ATTR));
+	fn->n64ParentDirReference = parent | ((int64_t)parent << 48);	/*Sequence number is the record number */
+	fn->n64FileCreationTime = ntfsTime;
+	fn->n64FileAlterationTime = ntfsTime;
+	fn->n64MFTChangedTime = ntfsTime;
+	fn->n64ReadTime = ntfsTime;
+	fn->n64AllocatedFileSize = (size + IMG_CLUSTER_SIZE - 1)/IMG_CLUSTER_SIZE*IMG_CLUSTER_SIZE;
+	fn->n64RealFileSize = size;
+	fn->dwFlags = isDir ? 0x10000000 : NORMAL;
+	fn->bFileNameLength = len;
+	fn->bFilenameNamespace = nameSpace;
+	for(k = 0; k < len; k++) {
+		fn->arrUnicodeFileName[k] = (uint16_t)name[k];
+	}
+	return offsetof(FILE_NAME_ATTR, arrUnicodeFileName) + 2*len;
+}
+
+/**
+ * Writes IMG_USN_RECORDS version 2 USN records to out, as if the first files
+ * were created, their USNs counting from usn. Returns their length.
+ */
+static uint32_t usnRecords(BYTE *out, int64_t usn, uint64_t ntfsTime) {
+	uint32_t len = 0, i, k;
+	for(i = 0; i < IMG_USN_RECORDS; i++) {
+		char name[32];
+		uint32_t recN = 16 + i, nameLen = snprintf(name, sizeof(name), "file%06u.txt", recN);
+		uint32_t recLen = align8(sizeof(USN_RECORD_V2) + 2*nameLen);
+		USN_RECORD_V2 *usnRec = (USN_RECORD_V2 *)(out + len);
+		uint16_t *unicodeName = (uint16_t *)(out + len + sizeof(USN_RECORD_V2));
+		memset(usnRec, 0, recLen);
+		usnRec->dwRecordLength = recLen;
+		usnRec->wMajorVersion = 2;
+		usnRec->n64FileReference = recN | ((uint64_t)recN << 48);	/*Sequence number is the record number */
+		usnRec->n64ParentReference = IMG_ROOT_REC | ((uint64_t)IMG_ROOT_REC << 48);
+		usnRec->n64Usn = usn + len;
+		usnRec->n64TimeStamp = ntfsTime;
+		usnRec->dwReason = USN_REASON_FILE_CREATE | USN_REASON_CLOSE;
+		usnRec->wFileNameLength = 2*nameLen;
+		usnRec->wFileNameOffset = sizeof(USN_RECORD_V2);
+		for(k = 0; k < nameLen; k++) {
+			unicodeName[k] = (uint16_t)name[k];
+		}
+		len += recLen;
+	}
+	return len;
+}
+
+static int writeAt(int fd, const void *buf, size_t len, off_t offs) {
+	if(pwrite(fd, buf, len, offs) != (ssize_t)len) {
+		int errsv = errno;
+		printf("Failed to write image at offset %" PRId64 ": %s.\n", (int64_t)offs, strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Absolute byte offset of cluster lcn.
+ */
+static off_t clusterOffset(int64_t lcn) {
+	return (off_t)IMG_PART_START*IMG_SECTOR_SIZE + lcn*IMG_CLUSTER_SIZE;
+}
+
+/**
+ * Absolute sector of MFT record recN, following the $MFT runs.
+ */
+static int64_t recordSector(uint32_t recN) {
+	int64_t cluster = recN/IMG_RECS_PER_CLUS;
+	uint32_t i;
+	for(i = 0; i < nMftRuns; i++) {
+		if(cluster < mftRuns[i].length) {
+			return clusterOffset(mftRuns[i].lcn + cluster)/IMG_SECTOR_SIZE +
+				   (recN % IMG_RECS_PER_CLUS)*(recordSize/IMG_SECTOR_SIZE);
+		}
+		cluster -= mftRuns[i].length;
+	}
+	return -1;
+}
+
+static void usage() {
+	printf("Usage: mkntfsimg -o image [-n records] [-r resident%%] [-d deleted%%] [-D directory%%]\n"
+		   "                 [-c maxClusters] [-f fileFragments] [-m mftFragments]\n"
+		   "                 [-p partition] [-s seed] [-S sectorSize] [-R recordSize]\n"
+		   "                 [-w trace -W writes]\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	IMG_OPTS opts = { NULL, NULL, 10000, 50, 0, 0, 4, 1, 1, 0, 1, 0 };
+	int opt;
+	while((opt = getopt(argc, argv, "o:n:r:d:D:c:f:m:p:s:S:R:w:W:h")) != -1) {
+		switch(opt) {
+		case 'o': opts.imagePath = optarg; break;
+		case 'w': opts.tracePath = optarg; break;
+		case 'n': opts.nRecords = strtoul(optarg, NULL, 10); break;
+		case 'r': opts.residentPct = strtoul(optarg, NULL, 10); break;
+		case 'd': opts.deletedPct = strtoul(optarg, NULL, 10); break;
+		case 'D': opts.directoryPct = strtoul(optarg, NULL, 10); break;
+		case 'c': opts.maxClusters = strtoul(optarg, NULL, 10); break;
+		case 'f': opts.fileFrags = strtoul(optarg, NULL, 10); break;
+		case 'm': opts.mftFrags = strtoul(optarg, NULL, 10); break;
+		case 'p': opts.partition = strtoul(optarg, NULL, 10); break;
+		case 's': opts.seed = strtoul(optarg, NULL, 10); break;
+		case 'W': opts.nWrites = strtoul(optarg, NULL, 10); break;
+		case 'S': diskSecSize = strtoul(optarg, NULL, 10); break;
+		case 'R': recordSize = strtoul(optarg, NULL, 10); break;
+		default: usage(); return EXIT_FAILURE;
+		}
+	}
+	if(opts.imagePath == NULL || opts.nRecords < 2 || opts.partition > 3 ||
+	   opts.maxClusters < 1 || opts.fileFrags < 1 || opts.mftFrags < 1 ||
+	   (diskSecSize != IMG_SECTOR_SIZE && diskSecSize != IMG_CLUSTER_SIZE) ||
+	   (recordSize != IMG_RECORD_SIZE && recordSize != IMG_RECORD_MAX)) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	srand(opts.seed);
+
+	int fd;
+	if((fd = open(opts.imagePath, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		int errsv = errno;
+		printf("Failed to create image %s: %s.\n", opts.imagePath, strerror(errsv));
+		return EXIT_FAILURE;
+	}
+
+	/*------------------------------- Lay out the $MFT ------------------------------*/
+	int64_t mftClusters = (opts.nRecords + IMG_RECS_PER_CLUS - 1)/IMG_RECS_PER_CLUS;
+	nextFreeLcn = IMG_MFT_LCN;
+	markAllocated(0, IMG_MFT_LCN);		/*Boot sector and $MFTMirr */
+	nMftRuns = allocRuns(mftRuns, mftClusters, opts.mftFrags);
+	uint32_t nRecords = mftClusters*IMG_RECS_PER_CLUS;	/*Fill the last cluster */
+	uint64_t ntfsNow = linuxTimetoNTFStime();
+
+	/*------------------------------- Write the records -----------------------------*/
+	BYTE rec[IMG_RECORD_MAX];
+	BYTE content[IMG_RECORD_MAX];
+	BYTE cluster[IMG_CLUSTER_SIZE];
+	uint32_t recN, countRes = 0, countNonRes = 0, countDel = 0, countDir = 0, countStreams = 0;
+	uint32_t countShort = 0, countLinks = 0;
+	bool *inUse = calloc(nRecords, sizeof(bool));
+	uint32_t dirs[IMG_MAX_DIRS], nDirs = 0;		/*Three in four entries go in a directory made earlier */
+
+	for(recN = 0; recN < nRecords; recN++) {
+		char name[64];
+		uint32_t offs, attrLen;
+		uint16_t attrId = 0, flags = IMG_IN_USE;
+		bool isDir = false;
+		uint64_t fileSize = 0;
+		uint32_t parent = (recN < 16 || nDirs == 0 || rand() % 4 == 0) ? IMG_ROOT_REC : dirs[rand() % nDirs];
+		IMG_RUN runs[IMG_MAX_FRAGS];
+		uint32_t nRuns = 0, resLen = 0;
+		uint32_t linkParents[IMG_MAX_LINKS], nLinks = 0, l;
+		bool hasShortName = false;
+
+		if(recN == IMG_BITMAP_REC) {	/*Written last, once every cluster is allocated */
+			inUse[recN] = true;
+			continue;
+		}
+		memset(rec, 0, sizeof(rec));
+		offs = align8(sizeof(NTFS_MFT_FILE_ENTRY_HEADER) + 2*(1 + recordSize/IMG_SECTOR_SIZE));
+
+		if(recN == 0) {
+			snprintf(name, sizeof(name), "$MFT");
+			fileSize = (uint64_t)nRecords*recordSize;
+		} else if(recN == IMG_UPCASE_REC) {
+			snprintf(name, sizeof(name), "$UpCase");
+			fileSize = IMG_UPCASE_SIZE;
+			nRuns = allocRuns(runs, IMG_UPCASE_SIZE/IMG_CLUSTER_SIZE, 1);
+		} else if(recN == IMG_EXTEND_REC) {
+			snprintf(name, sizeof(name), "$Extend");
+			flags = IMG_IN_USE | IMG_DIRECTORY;
+			isDir = true;
+		} else if(recN == IMG_USNJRNL_REC) {
+			snprintf(name, sizeof(name), "$UsnJrnl");
+			parent = IMG_EXTEND_REC;
+			runs[0].lcn = -1;
+			runs[0].length = IMG_USN_SPARSE;
+			nRuns = 1 + allocRuns(runs + 1, IMG_USN_CLUSTERS, 1);
+		} else if(recN >= opts.nRecords) {		/*Never used */
+			snprintf(name, sizeof(name), "deleted%06u.tmp", recN);
+			flags = 0;
+			countDel++;
+		} else if((uint32_t)(rand() % 100) < opts.deletedPct) {	/*Keeps its data, freed below */
+			flags = 0;
+			countDel++;
+			if((uint32_t)(rand() % 100) < opts.residentPct) {
+				snprintf(name, sizeof(name), "deleted%06u.txt", recN);
+				resLen = 1 + rand() % IMG_MAX_RESIDENT;
+				fileSize = resLen;
+			} else {
+				snprintf(name, sizeof(name), "deleted%06u.dat", recN);
+				int64_t nClusters = 1 + rand() % opts.maxClusters;
+				nRuns = allocRuns(runs, nClusters, opts.fileFrags);
+				fileSize = (nClusters - 1)*IMG_CLUSTER_SIZE + 1 + rand() % IMG_CLUSTER_SIZE;
+			}
+		} else if((uint32_t)(rand() % 100) < opts.directoryPct) {
+			snprintf(name, sizeof(name), "dir%06u", recN);
+			flags = IMG_IN_USE | IMG_DIRECTORY;
+			isDir = true;
+			countDir++;
+			if(nDirs < IMG_MAX_DIRS) dirs[nDirs++] = recN;
+		} else if((uint32_t)(rand() % 100) < opts.residentPct) {
+			snprintf(name, sizeof(name), "file%06u.txt", recN);
+			resLen = 1 + rand() % IMG_MAX_RESIDENT;
+			fileSize = resLen;
+			countRes++;
+		} else {
+			snprintf(name, sizeof(name), "file%06u.dat", recN);
+			int64_t nClusters = 1 + rand() % opts.maxClusters;
+			nRuns = allocRuns(runs, nClusters, opts.fileFrags);
+			fileSize = (nClusters - 1)*IMG_CLUSTER_SIZE + 1 + rand() % IMG_CLUSTER_SIZE;
+			countNonRes++;
+		}
+		inUse[recN] = (flags == IMG_IN_USE);
+		if(flags == IMG_IN_USE && recN >= 16 && nRuns) {	/*Resident data leaves no room for more names */
+			if(rand() % 10 == 0) {		/*Its long name has an 8.3 short form */
+				hasShortName = true;
+				countShort++;
+			}
+			if(nDirs > 1 && rand() % 10 == 0) {	/*Linked into other directories, as in WinSxS */
+				nLinks = 1 + rand() % IMG_MAX_LINKS;
+				for(l = 0; l < nLinks; l++) {
+					do {
+						linkParents[l] = dirs[rand() % nDirs];
+					} while(linkParents[l] == parent);
+				}
+				countLinks += nLinks;
+			}
+		}
+
+		/*$STANDARD_INFORMATION */
+		STD_INFORMATION stdInfo;
+		memset(&stdInfo, 0, sizeof(stdInfo));
+		uint64_t created = ntfsNow - (uint64_t)(rand() % IMG_MAX_AGE)*TIME_NTFSPERLINUX;
+		stdInfo.fileCreateTime = created;
+		stdInfo.fileAltTime = ntfsNow;		/*Recent, so that writes to the records are extracted */
+		stdInfo.mftChangeTime = ntfsNow;
+		stdInfo.fileReadTime = created + (ntfsNow - created)/2;
+		stdInfo.filePermissions = recN < 16 ? (HIDDEN | SYSTEM) : ARCHIVE;
+		offs += addResidentAttr(rec, offs, STANDARD_INFORMATION, attrId++, NULL, &stdInfo, sizeof(stdInfo));
+
+		/*$FILE_NAME, the short name first as Windows writes it, then any hard links */
+		if(hasShortName) {
+			char shortName[16];
+			snprintf(shortName, sizeof(shortName), "FI%04u~1.%s", recN % 10000, resLen ? "TXT" : "DAT");
+			attrLen = fileNameContent((FILE_NAME_ATTR *)content, shortName, parent, created, fileSize, isDir, FILE_NAME_DOS);
+			offs += addResidentAttr(rec, offs, FILE_NAME, attrId++, NULL, content, attrLen);
+		}
+		attrLen = fileNameContent((FILE_NAME_ATTR *)content, name, parent, created, fileSize, isDir,
+								  hasShortName ? FILE_NAME_WIN32 : FILE_NAME_WIN32_DOS);
+		offs += addResidentAttr(rec, offs, FILE_NAME, attrId++, NULL, content, attrLen);
+		for(l = 0; l < nLinks; l++) {
+			attrLen = fileNameContent((FILE_NAME_ATTR *)content, name, linkParents[l], created, fileSize, isDir, FILE_NAME_WIN32);
+			offs += addResidentAttr(rec, offs, FILE_NAME, attrId++, NULL, content, attrLen);
+		}
+
+		/*$DATA */
+		if(recN == 0) {
+			offs += addNonResidentData(rec, offs, attrId++, NULL, mftRuns, nMftRuns, fileSize);
+		} else if(resLen) {
+			uint32_t k;
+			for(k = 0; k < resLen; k++) {
+				content[k] = 'a' + (recN + k) % 26;
+			}
+			offs += addResidentAttr(rec, offs, DATA, attrId++, NULL, content, resLen);
+		} else if(recN == IMG_USNJRNL_REC) {
+			uint64_t maxSize[4] = { 32 << 20, 8 << 20, 0, 0 };	/*$Max: maximum and allocation delta */
+			uint32_t usnLen = usnRecords(cluster, (int64_t)IMG_USN_SPARSE*IMG_CLUSTER_SIZE, ntfsNow);
+			offs += addResidentAttr(rec, offs, DATA, attrId++, "$Max", maxSize, sizeof(maxSize));
+			offs += addNonResidentData(rec, offs, attrId++, "$J", runs, nRuns,
+									   (uint64_t)IMG_USN_SPARSE*IMG_CLUSTER_SIZE + usnLen);
+			memset(cluster + usnLen, 0, sizeof(cluster) - usnLen);
+			if(writeAt(fd, cluster, IMG_CLUSTER_SIZE, clusterOffset(runs[1].lcn)) == EXIT_FAILURE) {
+				return EXIT_FAILURE;
+			}
+		} else if(recN == IMG_UPCASE_REC) {
+			uint16_t *upcase = malloc(IMG_UPCASE_SIZE);
+			uint32_t u;
+			for(u = 0; u < IMG_UPCASE_SIZE/2; u++) {
+				upcase[u] = (u >= 'a' && u <= 'z') || (u >= 0xE0 && u <= 0xFE && u != 0xF7) ? u - 0x20 :
+							u == 0xFF ? 0x178 : u;
+			}
+			offs += addNonResidentData(rec, offs, attrId++, NULL, runs, nRuns, fileSize);
+			if(writeAt(fd, upcase, IMG_UPCASE_SIZE, clusterOffset(runs[0].lcn)) == EXIT_FAILURE) {
+				return EXIT_FAILURE;
+			}
+			free(upcase);
+		} else if(nRuns) {
+			uint32_t r;
+			int64_t c;
+			offs += addNonResidentData(rec, offs, attrId++, NULL, runs, nRuns, fileSize);
+			if(flags == IMG_IN_USE && rand() % 10 == 0) {	/*Downloaded, so marked with the zone it came from */
+				offs += addResidentAttr(rec, offs, DATA, attrId++, IMG_ZONE_STREAM, IMG_ZONE_DATA, sizeof(IMG_ZONE_DATA) - 1);
+				countStreams++;
+			}
+			memset(cluster, 0, sizeof(cluster));
+			for(r = 0; r < nRuns; r++) {	/*Stamp each cluster so no two files share content */
+				for(c = 0; c < runs[r].length; c++) {
+					snprintf((char *)cluster, sizeof(cluster), "%s cluster %" PRId64 "\n", name, runs[r].lcn + c);
+					if(writeAt(fd, cluster, IMG_CLUSTER_SIZE, clusterOffset(runs[r].lcn + c)) == EXIT_FAILURE) {
+						return EXIT_FAILURE;
+					}
+				}
+			}
+		}
+
+		if(flags == 0 && nRuns) {	/*A deleted file's clusters are free, or one in four reused since */
+			uint32_t r;
+			for(r = rand() % 4 == 0 ? 1 : 0; r < nRuns; r++) {
+				markFree(runs[r].lcn, runs[r].length);
+			}
+		}
+
+		finishRecord(rec, recN, flags, offs, attrId, 1 + nLinks);
+		if(writeAt(fd, rec, recordSize, recordSector(recN)*IMG_SECTOR_SIZE) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	/*----------------------------------- $Bitmap ----------------------------------*/
+	IMG_RUN bitmapRun;
+	allocRuns(&bitmapRun, (nextFreeLcn + IMG_FRAG_GAP)/(8*IMG_CLUSTER_SIZE) + 2, 1);	/*Room for its own clusters */
+	int64_t partSectors = (nextFreeLcn + IMG_FRAG_GAP)*IMG_SEC_PER_CLUS;
+	int64_t nClusters = (partSectors - 1)/IMG_SEC_PER_CLUS;
+	uint64_t bitmapSize = ((nClusters + 63)/64)*8;		/*Whole 64 bit words, as NTFS keeps it */
+	markAllocated(bitmapSize*8, 0);						/*Sized to the whole of $Bitmap */
+	if(writeAt(fd, clusterBitmap, bitmapSize, clusterOffset(bitmapRun.lcn)) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	if(nRecords > IMG_BITMAP_REC) {
+		STD_INFORMATION stdInfo;
+		uint32_t offs = align8(sizeof(NTFS_MFT_FILE_ENTRY_HEADER) + 2*(1 + recordSize/IMG_SECTOR_SIZE));
+		uint16_t attrId = 0;
+		memset(rec, 0, sizeof(rec));
+		memset(&stdInfo, 0, sizeof(stdInfo));
+		stdInfo.fileCreateTime = stdInfo.fileAltTime = stdInfo.mftChangeTime = stdInfo.fileReadTime = ntfsNow;
+		stdInfo.filePermissions = HIDDEN | SYSTEM;
+		offs += addResidentAttr(rec, offs, STANDARD_INFORMATION, attrId++, NULL, &stdInfo, sizeof(stdInfo));
+		uint32_t attrLen = fileNameContent((FILE_NAME_ATTR *)content, "$Bitmap", IMG_ROOT_REC, ntfsNow, bitmapSize, false,
+										   FILE_NAME_WIN32_DOS);
+		offs += addResidentAttr(rec, offs, FILE_NAME, attrId++, NULL, content, attrLen);
+		offs += addNonResidentData(rec, offs, attrId++, NULL, &bitmapRun, 1, bitmapSize);
+		finishRecord(rec, IMG_BITMAP_REC, IMG_IN_USE, offs, attrId, 1);
+		if(writeAt(fd, rec, recordSize, recordSector(IMG_BITMAP_REC)*IMG_SECTOR_SIZE) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	/*------------------------------ Boot sector and MBR ----------------------------*/
+	NTFS_BOOT_SECTOR boot;
+	memset(&boot, 0, sizeof(boot));
+	memcpy(boot.chJumpInstruction, "\xEB\x52\x90", 3);
+	memcpy(boot.chOemID, "NTFS", 4);
+	memcpy(boot.chDummy, "    ", 4);
+	boot.bpb.wBytesPerSec = diskSecSize;
+	boot.bpb.uchSecPerClust = IMG_CLUSTER_SIZE/diskSecSize;
+	boot.bpb.uchMediaDescriptor = 0xF8;
+	boot.bpb.wSecPerTrack = 63;
+	boot.bpb.wNumberOfHeads = 255;
+	boot.bpb.dwHiddenSec = IMG_PART_START/(diskSecSize/IMG_SECTOR_SIZE);
+	boot.bpb.n64TotalSec = partSectors/(diskSecSize/IMG_SECTOR_SIZE) - 1;
+	boot.bpb.n64MFTLogicalClustNum = mftRuns[0].lcn;
+	boot.bpb.n64MFTMirrLoficalClustNum = 2;
+	boot.bpb.nClustPerMFTRecord = 256 - __builtin_ctz(recordSize);	/*2^-n bytes per record, 0xF6 for 1024 */
+	boot.bpb.nClustPerIndexRecord = 1;
+	boot.bpb.n64VolumeSerialNum = ((int64_t)opts.seed << 32) | 0x4E544653;
+	boot.wSecMark = 0xAA55;
+
+	BYTE mbr[IMG_SECTOR_SIZE];
+	PARTITION part;
+	memset(mbr, 0, sizeof(mbr));
+	memset(&part, 0, sizeof(part));
+	part.chType = NTFS_TYPE;
+	part.dwRelativeSector = IMG_PART_START/(diskSecSize/IMG_SECTOR_SIZE);	/*In the disk's own sectors */
+	part.dwNumberSector = partSectors/(diskSecSize/IMG_SECTOR_SIZE);
+	memcpy(mbr + 0x1BE + opts.partition*sizeof(PARTITION), &part, sizeof(PARTITION));
+	mbr[510] = 0x55;
+	mbr[511] = 0xAA;
+
+	if(writeAt(fd, mbr, sizeof(mbr), 0) == EXIT_FAILURE ||
+	   writeAt(fd, &boot, sizeof(boot), (off_t)IMG_PART_START*IMG_SECTOR_SIZE) == EXIT_FAILURE ||
+	   ftruncate(fd, (off_t)(IMG_PART_START + partSectors)*IMG_SECTOR_SIZE) == -1) {
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	printf("%s: %u records (%u resident, %u non-resident, %u directories, %u free or deleted), "
+		   "%u alternate data streams, %u short names, %u hard links, %u $MFT fragments, %" PRId64 " clusters.\n",
+		   opts.imagePath, nRecords, countRes, countNonRes, countDir, countDel, countStreams, countShort, countLinks,
+		   nMftRuns, nextFreeLcn);
+
+	/*------------------------------- Guest write trace -----------------------------*/
+	if(opts.tracePath && opts.nWrites) {
+		FILE *trace;
+		uint32_t w;
+		if((trace = fopen(opts.tracePath, "w")) == NULL) {
+			int errsv = errno;
+			printf("Failed to create trace %s: %s.\n", opts.tracePath, strerror(errsv));
+			return EXIT_FAILURE;
+		}
+		for(w = 0; w < opts.nWrites; w++) {
+			do {
+				recN = 1 + rand() % (nRecords - 1);
+			} while(!inUse[recN]);
+			if(rand() % 2) {	/*A single record, or the whole cluster holding it */
+				fprintf(trace, "%" PRId64 " %d\n", recordSector(recN), recordSize/IMG_SECTOR_SIZE);
+			} else {
+				fprintf(trace, "%" PRId64 " %d\n", recordSector(recN - recN % IMG_RECS_PER_CLUS), IMG_SEC_PER_CLUS);
+			}
+		}
+		fclose(trace);
+		printf("%s: %u guest writes.\n", opts.tracePath, opts.nWrites);
+	}
+	free(inUse);
+	free(clusterBitmap);
+	return EXIT_SUCCESS;
+}
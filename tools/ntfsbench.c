@@ -0,0 +1,418 @@
+/*
+ * ntfsbench.c
+ *
+ *      Author: Christopher Hicks
+ *
+ * Benchmarks the extraction engine against an image from mkntfsimg:
+ *  - index build, the $MFT copy and the offline pass over it,
+ *  - search latency, by record number and by name, one term at a time and as
+ *    one batch of all the queries,
+ *  - name index search latency, case-insensitive names, suffix globs such as
+ *    "*123.txt" (trigram lookups) and "*.dat" (many matches),
+ *  - time range search latency, files created in a random day of the last year,
+ *  - export of the whole index with paths, as CSV, NDJSON and Arrow, to /dev/null,
+ *  - live extraction throughput, replaying a write trace through the coalescer
+ *    and consumer, cold (every record new) and warm (record cache seeded),
+ *  - change journal throughput, pages of USN records naming random files
+ *    written to $J with their data, each named record then re-read,
+ *  - for both, the cluster cache's hits and misses, each write applied to the
+ *    blocks cached as the consumer takes it.
+ *
+ * The engine is compiled in whole, its own main renamed. Engine output is sent
+ * to /dev/null while timing; results are printed as "name value unit" lines.
+ * Files are only extracted if their modify time is recent, so run it soon
+ * after generating the image.
+ *
+ * Usage: ntfsbench -i image [-t trace] [-q queries] [-o storeDir] [-K cacheMiB]
+ */
+#define main extractionEngineMain
+#include "../RawNTFSExtraction.c"
+#undef main
+
+#define BENCH_QUERIES	1000
+#define BENCH_STOREDIR	"bench_store/"
+#define BENCH_JOURNAL_PAGES	256		/*Journal page writes replayed */
+
+static int savedStdout = -1;
+
+/**
+ * Sends stdout to /dev/null while quiet, so the engine's output is not timed.
+ */
+static void benchQuiet(bool quiet) {
+	fflush(stdout);
+	if(quiet && savedStdout == -1) {
+		int nullFD = open("/dev/null", O_WRONLY);
+		savedStdout = dup(STDOUT_FILENO);
+		dup2(nullFD, STDOUT_FILENO);
+		close(nullFD);
+	} else if(!quiet && savedStdout != -1) {
+		dup2(savedStdout, STDOUT_FILENO);
+		close(savedStdout);
+		savedStdout = -1;
+	}
+}
+
+/**
+ * Prints the cluster cache hits and misses since hits and misses were read.
+ */
+static void benchClusterCache(const char *name, uint64_t hits, uint64_t misses) {
+	hits = clusterCacheHits() - hits;
+	misses = clusterCacheMisses() - misses;
+	printf("%s.cluster_cache %" PRIu64 " hits, %" PRIu64 " misses, hit ratio %.2f\n", name, hits, misses,
+		   hits + misses ? (double)hits/(hits + misses) : 0.0);
+}
+
+static int cmpU64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Prints the mean, median and 99th percentile of n latencies, which are sorted.
+ */
+static void benchLatency(const char *name, uint64_t *ns, uint32_t n) {
+	uint64_t total = 0;
+	uint32_t i;
+	if(n == 0) return;
+	qsort(ns, n, sizeof(uint64_t), cmpU64);
+	for(i = 0; i < n; i++) total += ns[i];
+	printf("%s.mean %.3f us\n", name, total/1e3/n);
+	printf("%s.p50 %.3f us\n", name, ns[n/2]/1e3);
+	printf("%s.p99 %.3f us\n", name, ns[(uint64_t)n*99/100]/1e3);
+}
+
+/**
+ * Replays writes through the coalescer and consumer as fast as they go.
+ */
+static void benchLive(const char *name, WRITE_EVENT *writes, uint32_t nWrites) {
+	WRITE_EVENT released[COALESCE_SLOTS];
+	uint64_t bytes = 0, extractedBefore = extStore->countNewBlob + extStore->countNewRef;
+	uint64_t hits = clusterCacheHits(), misses = clusterCacheMisses();
+	uint32_t i, r, nReleased;
+
+	coalesceInit(&coalescer, coalesceWindowMs);
+	benchQuiet(true);
+	uint64_t startNs = monotonicNs();
+	for(i = 0; i < nWrites; i++) {
+		while(!coalesceAdd(&coalescer, writes[i], monotonicNs(),
+						   dwMFTRecordLength/SECTOR_SIZE, mftWriteSectors())) {
+			nReleased = coalesceRelease(&coalescer, monotonicNs(), true, released, COALESCE_SLOTS);
+			for(r = 0; r < nReleased; r++) {
+				bytes += released[r].nSectors*SECTOR_SIZE;
+				consumeWrite(released[r]);
+			}
+		}
+	}
+	nReleased = coalesceRelease(&coalescer, monotonicNs(), true, released, COALESCE_SLOTS);
+	for(r = 0; r < nReleased; r++) {
+		bytes += released[r].nSectors*SECTOR_SIZE;
+		consumeWrite(released[r]);
+	}
+	uint64_t elapsedNs = monotonicNs() - startNs;
+	benchQuiet(false);
+
+	printf("%s.writes_per_s %.0f writes/s\n", name, nWrites/(elapsedNs/1e9));
+	printf("%s.read_mb_per_s %.2f MB/s\n", name, bytes/1e6/(elapsedNs/1e9));
+	printf("%s.coalescing_ratio %.2f\n", name, coalesceRatio(&coalescer));
+	printf("%s.files_extracted %" PRIu64 " files\n", name,
+		   extStore->countNewBlob + extStore->countNewRef - extractedBefore);
+	benchClusterCache(name, hits, misses);
+}
+
+/**
+ * Writes pages of USN records to the journal's free clusters after its end and
+ * consumes them, as the guest appending to $J would. Each record names a random
+ * file, so nearly every one leads to an MFT record re-read.
+ */
+static void benchJournal(File **fileArr, uint32_t nFiles) {
+	int64_t firstPage = (usnJournal->size + USN_PAGE - 1)/USN_PAGE;
+	int64_t nPages = usnJournalEnd(usnJournal)*dwBytesPerCluster/USN_PAGE - firstPage;
+	uint64_t recordsBefore = usnJournal->countRecords, rereadsBefore = usnJournal->countRereads;
+	uint64_t hits = clusterCacheHits(), misses = clusterCacheMisses();
+	int64_t usn = firstPage*USN_PAGE;
+	uint32_t i, nRecords = 0;
+	if(nPages <= 0 || nFiles == 0) {
+		printf("live.journal no change journal clusters free\n");
+		return;
+	}
+
+	WRITE_EVENT *writes = malloc(BENCH_JOURNAL_PAGES*sizeof(WRITE_EVENT));
+	for(i = 0; i < BENCH_JOURNAL_PAGES; i++) {	/*The free pages in turn, USNs always rising */
+		int64_t offs = (firstPage + i % nPages)*USN_PAGE;
+		uint32_t len = 0;
+		writes[i].sectorN = (relativePartSector + usnJournalLcn(usnJournal, offs/dwBytesPerCluster)*dwBytesPerCluster +
+							 offs % dwBytesPerCluster)/SECTOR_SIZE;
+		writes[i].nSectors = USN_PAGE/SECTOR_SIZE;
+		writes[i].volume = 0;
+		writes[i].payload = calloc(1, USN_PAGE);
+		while(len + sizeof(USN_RECORD_V2) + 8 <= USN_PAGE) {
+			USN_RECORD_V2 *usnRec = (USN_RECORD_V2 *)(writes[i].payload + len);
+			usnRec->dwRecordLength = (sizeof(USN_RECORD_V2) + 8 + 7) & ~7;
+			usnRec->wMajorVersion = 2;
+			usnRec->n64FileReference = fileArr[rand() % nFiles]->recordNumber;
+			usnRec->n64ParentReference = PATH_ROOT_RECORD;
+			usnRec->n64Usn = usn;
+			usnRec->dwReason = USN_REASON_DATA_EXTEND | USN_REASON_CLOSE;
+			usnRec->wFileNameLength = 8;
+			usnRec->wFileNameOffset = sizeof(USN_RECORD_V2);
+			memcpy(usnRec + 1, "b\0e\0n\0c\0", 8);
+			len += usnRec->dwRecordLength;
+			usn += usnRec->dwRecordLength;
+			nRecords++;
+		}
+	}
+
+	benchQuiet(true);
+	uint64_t startNs = monotonicNs();
+	for(i = 0; i < BENCH_JOURNAL_PAGES; i++) {
+		consumeWrite(writes[i]);	/*Frees the payload */
+	}
+	uint64_t elapsedNs = monotonicNs() - startNs;
+	benchQuiet(false);
+
+	printf("live.journal.pages_per_s %.0f pages/s\n", BENCH_JOURNAL_PAGES/(elapsedNs/1e9));
+	printf("live.journal.records_per_s %.0f records/s, %" PRIu64 " of %u read\n",
+		   nRecords/(elapsedNs/1e9), usnJournal->countRecords - recordsBefore, nRecords);
+	printf("live.journal.rereads %" PRIu64 " records\n", usnJournal->countRereads - rereadsBefore);
+	benchClusterCache("live.journal", hits, misses);
+	free(writes);
+}
+
+int main(int argc, char* argv[]) {
+
+	const char *imagePath = NULL, *tracePath = NULL, *storeDir = BENCH_STOREDIR;
+	uint32_t nQueries = BENCH_QUERIES, i;
+	uint64_t cacheSize = CFG_DEFAULT_CACHE;
+	int opt;
+	while((opt = getopt(argc, argv, "i:t:q:o:K:")) != -1) {
+		switch(opt) {
+		case 'i': imagePath = optarg; break;
+		case 't': tracePath = optarg; break;
+		case 'q': nQueries = strtoul(optarg, NULL, 10); break;
+		case 'o': storeDir = optarg; break;
+		case 'K': cacheSize = strtoull(optarg, NULL, 10); break;
+		default: imagePath = NULL; optind = argc; break;
+		}
+	}
+	if(imagePath == NULL) {
+		printf("Usage: ntfsbench -i image [-t trace] [-q queries] [-o storeDir] [-K cacheMiB]\n");
+		return EXIT_FAILURE;
+	}
+	logInit(logLevelFromName(getenv("NTFS_LOG_LEVEL"), LOG_LVL_WARN), getenv("NTFS_LOG_FILE"));
+	QInit();
+	clusterCacheInit(&clusterCache, cacheSize*1024*1024);
+	recCacheInit(recCache);
+	usnJournalInit(usnJournal);
+	srand(1);
+
+	/*-------------------------------- Index build --------------------------------*/
+	File *files = NULL;
+	benchQuiet(true);
+	uint64_t startNs = monotonicNs();
+	int mounted = mountVolume(imagePath);
+	uint64_t mountNs = monotonicNs() - startNs;
+	startNs = monotonicNs();
+	int indexed = mounted == EXIT_SUCCESS ? buildFileIndex(mftCopyName, &files) : EXIT_FAILURE;
+	uint64_t indexNs = monotonicNs() - startNs;
+	NAME_INDEX names;
+	startNs = monotonicNs();
+	if(indexed == EXIT_SUCCESS) {
+		linkTableSort(&linkTable);
+		nameIndexBuild(&names, files, upcaseTable, &linkTable);
+	}
+	uint64_t namesNs = monotonicNs() - startNs;
+	TIME_INDEX times;
+	startNs = monotonicNs();
+	if(indexed == EXIT_SUCCESS) timeIndexBuild(&times, files);
+	uint64_t timesNs = monotonicNs() - startNs;
+	benchQuiet(false);
+	if(indexed == EXIT_FAILURE) {
+		printf("Failed to index %s.\n", imagePath);
+		return EXIT_FAILURE;
+	}
+	tailJournal();
+
+	uint32_t nFiles = 0;
+	File *f;
+	for(f = files; f; f = f->p_next) nFiles++;
+	File **fileArr = malloc(nFiles*sizeof(File *));
+	for(i = 0, f = files; f; f = f->p_next) fileArr[i++] = f;
+
+	printf("image %s\n", imagePath);
+	printf("index.mft_copy %.3f ms\n", mountNs/1e6);
+	printf("index.build %.3f ms\n", indexNs/1e6);
+	printf("index.files %u files\n", nFiles);
+	printf("index.files_per_s %.0f files/s\n", nFiles/(indexNs/1e9));
+	printf("index.names %.3f ms, %u trigrams%s\n", namesNs/1e6, names.nTrigrams,
+		   names.upcase ? "" : ", no $UpCase");
+	printf("index.times %.3f ms\n", timesNs/1e6);
+
+	/*------------------------------- Search latency ------------------------------*/
+	if(nFiles > 0 && nQueries > 0) {
+		uint64_t *latency = malloc(nQueries*sizeof(uint64_t));
+		char term[FILENAME_MAX];
+		int srchTypes[2] = { SRCH_NUM, SRCH_NAME };
+		const char *srchNames[2] = { "search.record", "search.name" };
+		int t;
+		for(t = 0; t < 2; t++) {
+			benchQuiet(true);
+			for(i = 0; i < nQueries; i++) {
+				File *target = fileArr[rand() % nFiles];
+				if(srchTypes[t] == SRCH_NUM) {
+					snprintf(term, sizeof(term), "%" PRIu64, (uint64_t)target->recordNumber);
+				} else {
+					snprintf(term, sizeof(term), "%s", target->fileName);
+				}
+				startNs = monotonicNs();
+				File *found = searchFiles(stdout, files, srchTypes[t], term);
+				latency[i] = monotonicNs() - startNs;
+				freeFilesList(found);
+			}
+			benchQuiet(false);
+			benchLatency(srchNames[t], latency, nQueries);
+		}
+
+		/* The same number of lookups, as one batch per search type */
+		const char *batchNames[2] = { "search.batch_record", "search.batch_name" };
+		char (*terms)[FILENAME_MAX] = malloc(nQueries*sizeof(*terms));
+		FILE_QUERY *queries = malloc(nQueries*sizeof(FILE_QUERY));
+		for(t = 0; t < 2; t++) {
+			for(i = 0; i < nQueries; i++) {
+				File *target = fileArr[rand() % nFiles];
+				if(srchTypes[t] == SRCH_NUM) {
+					snprintf(terms[i], FILENAME_MAX, "%" PRIu64, (uint64_t)target->recordNumber);
+				} else {
+					snprintf(terms[i], FILENAME_MAX, "%s", target->fileName);
+				}
+				fileQueryInit(&queries[i], srchTypes[t], terms[i]);
+			}
+			startNs = monotonicNs();
+			uint32_t nMatched = srchTypes[t] == SRCH_NAME ? nameIndexBatch(&names, queries, nQueries)
+														  : searchFilesBatch(files, srchTypes[t], queries, nQueries);
+			uint64_t batchNs = monotonicNs() - startNs;
+			for(i = 0; i < nQueries; i++) freeFilesList(queries[i].found);
+			printf("%s %.3f ms for %u terms, %u matched\n", batchNames[t], batchNs/1e6, nQueries, nMatched);
+		}
+		free(queries);
+		free(terms);
+
+		/* Name index: the upper cased name, its last 10 characters as a suffix glob, and a broad glob */
+		const char *globNames[3] = { "search.iname", "search.glob_suffix", "search.glob_broad" };
+		uint32_t nMatched, maxMatched[3] = { 0, 0, 0 };
+		for(t = 0; t < 3; t++) {
+			benchQuiet(true);
+			for(i = 0; i < nQueries; i++) {
+				File *target = fileArr[rand() % nFiles];
+				size_t len = strlen(target->fileName), k;
+				if(t == 0) {
+					for(k = 0; k <= len; k++) term[k] = toupper((unsigned char)target->fileName[k]);
+				} else if(t == 1) {
+					snprintf(term, sizeof(term), "*%s", target->fileName + (len > 10 ? len - 10 : 0));
+				} else {
+					snprintf(term, sizeof(term), "*.%s", len > 3 ? target->fileName + len - 3 : "dat");
+				}
+				startNs = monotonicNs();
+				File *found = nameIndexSearch(stdout, &names, term, &nMatched);
+				latency[i] = monotonicNs() - startNs;
+				if(nMatched > maxMatched[t]) maxMatched[t] = nMatched;
+				freeFilesList(found);
+			}
+			benchQuiet(false);
+			benchLatency(globNames[t], latency, nQueries);
+			printf("%s.max_matches %u files\n", globNames[t], maxMatched[t]);
+		}
+
+		/* Time range: files created in a day, anywhere in the last year */
+		int64_t now = linuxTimetoNTFStime(), day = 86400LL*TIME_NTFSPERLINUX;
+		uint64_t totalFound = 0;
+		for(i = 0; i < nQueries; i++) {
+			TIME_KEY *first;
+			int64_t from = now - (rand() % 365)*day;
+			startNs = monotonicNs();
+			totalFound += timeIndexRange(&times, FTIME_CREATED, from, from + day, &first);
+			latency[i] = monotonicNs() - startNs;
+		}
+		benchLatency("search.time_range", latency, nQueries);
+		printf("search.time_range.mean_matches %.1f files\n", (double)totalFound/nQueries);
+		free(latency);
+	}
+
+	/*----------------------------------- Export ----------------------------------*/
+	volumes[0].files = files;
+	volumes[0].dirs = dirTable;
+	volumes[0].links = linkTable;
+	const char *exportTerms[3] = { "csv /dev/null", "ndjson /dev/null", "arrow /dev/null" };
+	for(i = 0; i < 3; i++) {
+		char term[32];
+		snprintf(term, sizeof(term), "%s", exportTerms[i]);
+		benchQuiet(true);
+		startNs = monotonicNs();
+		cmdExport(stdout, 0, term);
+		uint64_t exportNs = monotonicNs() - startNs;
+		benchQuiet(false);
+		printf("export.%.*s %.3f ms, %.0f files/s\n", (int)strcspn(term, " "), term, exportNs/1e6, nFiles/(exportNs/1e9));
+	}
+	volumes[0].files = NULL;	/*Lent, the record cache, journal and bitmap in volumes[0] are in use */
+	memset(&volumes[0].dirs, 0, sizeof(PATH_TABLE));
+	memset(&volumes[0].links, 0, sizeof(LINK_TABLE));
+
+	/*------------------------------ Live extraction ------------------------------*/
+	uint32_t nWrites = 0, maxWrites = 1024;
+	WRITE_EVENT *writes = malloc(maxWrites*sizeof(WRITE_EVENT));
+	if(tracePath) {
+		FILE *trace;
+		WRITE_EVENT w;
+		if((trace = fopen(tracePath, "r")) == NULL) {
+			int errsv = errno;
+			printf("Failed to open trace %s: %s.\n", tracePath, strerror(errsv));
+			return EXIT_FAILURE;
+		}
+		memset(&w, 0, sizeof(w));
+		while(fscanf(trace, "%" SCNd64 " %d", &w.sectorN, &w.nSectors) == 2) {
+			if(nWrites == maxWrites) {
+				maxWrites *= 2;
+				writes = realloc(writes, maxWrites*sizeof(WRITE_EVENT));
+			}
+			writes[nWrites++] = w;
+		}
+		fclose(trace);
+	} else {	/*One write per indexed file record */
+		writes = realloc(writes, (nFiles + 1)*sizeof(WRITE_EVENT));
+		for(i = 0; i < nFiles; i++) {
+			memset(&writes[nWrites], 0, sizeof(WRITE_EVENT));
+			writes[nWrites].sectorN = fileArr[i]->sec_offset;
+			writes[nWrites].nSectors = dwMFTRecordLength/SECTOR_SIZE;
+			nWrites++;
+		}
+	}
+
+	if(nWrites > 0) {
+		if(storeInit(extStore, storeDir) == EXIT_FAILURE) {
+			printf("Failed to open extraction store at %s.\n", storeDir);
+			return EXIT_FAILURE;
+		}
+		printf("live.writes %u writes\n", nWrites);
+		benchLive("live.warm", writes, nWrites);	/*Cache seeded by the index build */
+		uint64_t maxRecords = recCache->maxRecords;
+		recCacheFree(recCache);
+		recCacheInit(recCache);
+		recCacheLimit(recCache, maxRecords);
+		benchLive("live.cold", writes, nWrites);
+		benchJournal(fileArr, nFiles);
+		storeClose(extStore);
+	}
+
+	free(writes);
+	free(fileArr);
+	nameIndexFree(&names);
+	pathTableFree(&dirTable);
+	linkTableFree(&linkTable);
+	timeIndexFree(&times);
+	freeFilesList(files);
+	recCacheFree(recCache);
+	usnJournalFree(usnJournal);
+	clusterCacheFree(&clusterCache);
+	close(blkDevDescriptor);
+	logClose();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,41 @@
+/*
+ * shmtap.c
+ *
+ *      Author: Christopher Hicks
+ *
+ * Stand-in for the QEMU side disk tap, using the shared memory ring transport.
+ * Reads "sector nSectors" pairs from stdin and publishes each as a guest write.
+ *
+ * Usage: shmtap [volume]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "../ShmRing.h"
+
+int main(int argc, char* argv[]) {
+
+	SHM_RING ring;
+	uint16_t volume = argc > 1 ? (uint16_t)strtoul(argv[1], NULL, 10) : 0;
+	int sockFD;
+
+	if((sockFD = shmRingConnect(&ring, UDS_SOCKET_NAME, volume)) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	QEMU_OFFS_LEN rec;
+	uint64_t countWrites = 0;
+	while(scanf("%" SCNd64 " %d", &rec.sectorN, &rec.nSectors) == 2) {
+		if(shmRingPush(&ring, &rec) == EXIT_FAILURE) {
+			printf("Failed to publish write to the shared memory ring.\n");
+			break;
+		}
+		countWrites++;
+	}
+	printf("%" PRIu64 " writes published on volume %u.\n", countWrites, volume);
+
+	shmRingClose(&ring);
+	close(sockFD);
+	return EXIT_SUCCESS;
+}
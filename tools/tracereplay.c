@@ -0,0 +1,202 @@
+/*
+ * tracereplay.c
+ *
+ *      Author: Christopher Hicks
+ *
+ * Feeds a write trace recorded by the extraction engine (NTFS_TRACE_FILE) back
+ * to it, over the framed socket protocol or through shared memory rings, one
+ * connection per volume in the trace.
+ *
+ * Writes are sent at the pace they were recorded divided by the speed factor,
+ * so 1 is the original speed, 2 twice as fast and 0 as fast as they can be
+ * sent. Writes that fall due together go in one frame.
+ *
+ * Usage: tracereplay [-m sock|shm] [-s speed] [-S socket] trace
+ *
+ * The socket is the engine's --socket, @name for an abstract one.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include "../ShmRing.h"
+#include "../Trace.h"
+
+#define REPLAY_VOLUMES	64			/*Volumes a trace may use */
+#define REPLAY_BATCH	256			/*Records sent in one frame at most */
+
+#define REPLAY_SOCK		0
+#define REPLAY_SHM		1
+
+/* One connection to the engine, bound to a volume */
+typedef struct _REPLAY_CONN {
+	int				fd;
+	SHM_RING		ring;
+	UDS_FRAME_HDR	hdr;
+	QEMU_OFFS_LEN	batch[REPLAY_BATCH];	/*Same layout as the OFFSLEN frame body */
+	uint32_t		nBatch;
+} REPLAY_CONN;
+
+static REPLAY_CONN *conns[REPLAY_VOLUMES];
+static char socketName[sizeof(((struct sockaddr_un *)0)->sun_path)] = UDS_SOCKET_NAME;
+
+/**
+ * Connects to the engine's socket and binds the connection to volume.
+ */
+static int replayConnectSock(uint16_t volume) {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd == -1) return -1;
+
+	if(connect(fd, (struct sockaddr*)&addr, udsAddress(&addr, socketName)) == -1) {
+		int errsv = errno;
+		printf("Failed to connect to extraction engine: %s.\n", strerror(errsv));
+		close(fd);
+		return -1;
+	}
+	UDS_FRAME_HDR hello = { UDS_FRAME_MAGIC, UDS_FRAME_HELLO, volume, 0 };
+	if(write(fd, &hello, sizeof(hello)) != sizeof(hello)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Returns the connection for volume, opening it on first use.
+ */
+static REPLAY_CONN *replayConn(uint16_t volume, int mode) {
+	if(volume >= REPLAY_VOLUMES) {
+		printf("Volume %u in trace is out of range.\n", volume);
+		return NULL;
+	}
+	if(conns[volume] == NULL) {
+		REPLAY_CONN *conn = calloc(1, sizeof(REPLAY_CONN));
+		conn->fd = mode == REPLAY_SHM ? shmRingConnect(&conn->ring, socketName, volume)
+									  : replayConnectSock(volume);
+		if(conn->fd == -1) {
+			free(conn);
+			return NULL;
+		}
+		conn->hdr.magic = UDS_FRAME_MAGIC;
+		conn->hdr.type = UDS_FRAME_OFFSLEN;
+		conn->hdr.volume = volume;
+		conns[volume] = conn;
+	}
+	return conns[volume];
+}
+
+/**
+ * Sends the writes batched on a socket connection as one frame.
+ */
+static int replayFlush(REPLAY_CONN *conn) {
+	if(conn->nBatch == 0) return EXIT_SUCCESS;
+	conn->hdr.count = conn->nBatch;
+	struct iovec iov[2] = {
+		{ &conn->hdr, sizeof(UDS_FRAME_HDR) },
+		{ conn->batch, conn->nBatch*sizeof(QEMU_OFFS_LEN) } };
+	ssize_t len = iov[0].iov_len + iov[1].iov_len;
+	conn->nBatch = 0;
+	if(writev(conn->fd, iov, 2) != len) {	/*Blocking socket, short only on error */
+		int errsv = errno;
+		printf("Failed to send writes: %s.\n", strerror(errsv));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int replayFlushAll(void) {
+	int v;
+	for(v = 0; v < REPLAY_VOLUMES; v++) {
+		if(conns[v] && replayFlush(conns[v]) == EXIT_FAILURE) return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+
+	int mode = REPLAY_SOCK, opt, rc;
+	double speed = 1.0;
+	while((opt = getopt(argc, argv, "m:s:S:")) != -1) {
+		switch(opt) {
+		case 'm': mode = strcmp(optarg, "shm") == 0 ? REPLAY_SHM : REPLAY_SOCK; break;
+		case 's': speed = strtod(optarg, NULL); break;
+		case 'S':
+			memset(socketName, 0, sizeof(socketName));
+			strncpy(socketName + (optarg[0] == '@'), optarg + (optarg[0] == '@'), sizeof(socketName) - 2);
+			break;
+		default: optind = argc; break;
+		}
+	}
+	if(optind != argc - 1 || speed < 0) {
+		printf("Usage: tracereplay [-m sock|shm] [-s speed] [-S socket] trace\n");
+		return EXIT_FAILURE;
+	}
+
+	TRACE trace;
+	if(traceOpenRead(&trace, argv[optind]) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	TRACE_EVENT event;
+	REPLAY_CONN *conn;
+	uint64_t startNs = monotonicNs(), maxLagNs = 0;
+	while((rc = traceNext(&trace, &event)) == 1) {
+		if(speed > 0) {
+			uint64_t dueNs = startNs + (uint64_t)(event.timeNs/speed), now = monotonicNs();
+			if(dueNs > now) {
+				struct timespec due = { dueNs/1000000000ULL, dueNs%1000000000ULL };
+				if(replayFlushAll() == EXIT_FAILURE) {
+					rc = -1;
+					break;
+				}
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+			} else if(now - dueNs > maxLagNs) {
+				maxLagNs = now - dueNs;
+			}
+		}
+		if((conn = replayConn(event.volume, mode)) == NULL) {
+			rc = -1;
+			break;
+		}
+		QEMU_OFFS_LEN rec = { event.sectorN, event.nSectors };
+		if(mode == REPLAY_SHM) {
+			if(shmRingPush(&conn->ring, &rec) == EXIT_FAILURE) {
+				printf("Failed to publish write to the shared memory ring.\n");
+				rc = -1;
+				break;
+			}
+		} else {
+			conn->batch[conn->nBatch++] = rec;
+			if(conn->nBatch == REPLAY_BATCH && replayFlush(conn) == EXIT_FAILURE) {
+				rc = -1;
+				break;
+			}
+		}
+	}
+	if(rc == -1) {
+		printf("Replay stopped at write %" PRIu64 ".\n", trace.count);
+	}
+	replayFlushAll();
+	uint64_t elapsedNs = monotonicNs() - startNs;
+
+	printf("%" PRIu64 " writes replayed in %.3f s, %.0f writes/s (recorded over %.3f s).\n",
+			trace.count, elapsedNs/1e9, trace.count/(elapsedNs/1e9), trace.lastNs/1e9);
+	if(speed > 0) {
+		printf("Largest lag behind the recorded pace %.3f ms.\n", maxLagNs/1e6);
+	}
+
+	int v;
+	for(v = 0; v < REPLAY_VOLUMES; v++) {
+		if(conns[v] == NULL) continue;
+		if(mode == REPLAY_SHM) shmRingClose(&conns[v]->ring);
+		close(conns[v]->fd);
+		free(conns[v]);
+	}
+	traceClose(&trace);
+	return rc == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}